@@ -1,16 +1,42 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <pthread.h>
-#include <regex>
+#include <queue>
+#include <sstream>
+#include <random>
 #include <stdexcept>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "clip-unicode.h"
 #include "clip.h"
 #include "ggml/ggml.h"
 
@@ -51,11 +77,14 @@ static std::string format(const char * fmt, ...) {
 #define KEY_LAYER_NORM_EPS "clip.%s.attention.layer_norm_epsilon"
 #define KEY_PROJ_DIM "clip.%s.projection_dim"
 #define KEY_TOKENS "tokenizer.ggml.tokens"
+#define KEY_MERGES "tokenizer.ggml.merges"
 #define KEY_N_POSITIONS "clip.text.context_length"
 #define KEY_IMAGE_SIZE "clip.vision.image_size"
 #define KEY_PATCH_SIZE "clip.vision.patch_size"
 #define KEY_IMAGE_MEAN "clip.vision.image_mean"
 #define KEY_IMAGE_STD "clip.vision.image_std"
+#define KEY_QUANT_RECIPE "clip.quantize.recipe"
+#define KEY_IMATRIX_N_ROWS "clip.imatrix.n_rows"
 
 //
 // tensor name constants
@@ -137,6 +166,21 @@ std::string get_ftype(int ftype) {
     case 8:
         return "q8_0";
         break;
+    case 10:
+        return "q2_k";
+        break;
+    case 11:
+        return "q3_k";
+        break;
+    case 12:
+        return "q4_k";
+        break;
+    case 13:
+        return "q5_k";
+        break;
+    case 14:
+        return "q6_k";
+        break;
     default:
         throw std::runtime_error(format("Unrecognized file type: %d\n", ftype));
     }
@@ -146,17 +190,446 @@ std::string get_ftype(int ftype) {
 // Vocab utils
 //
 
+// bounded LRU cache of word -> token ids, so that repeated words skip the BPE merge loop
+struct clip_bpe_cache {
+    using id = clip_vocab_id;
+    using entry = std::pair<std::string, std::vector<id>>;
+
+    size_t capacity = 8192;
+    std::list<entry> lru; // most recently used first
+    std::unordered_map<std::string, std::list<entry>::iterator> index;
+    std::mutex mutex;
+
+    bool get(const std::string & word, std::vector<id> & out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(word);
+        if (it == index.end()) {
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        out.insert(out.end(), it->second->second.begin(), it->second->second.end());
+        return true;
+    }
+
+    void put(const std::string & word, const id * ids, const size_t n) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (capacity == 0 || index.count(word)) {
+            return;
+        }
+        if (lru.size() >= capacity) {
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+        lru.emplace_front(word, std::vector<id>(ids, ids + n));
+        index[word] = lru.begin();
+    }
+};
+
 struct clip_vocab {
     using id = clip_vocab_id;
-    using token = std::string;
 
-    std::map<token, id> token_to_id;
-    std::map<id, token> id_to_token;
+    // all tokens back to back in a single buffer: token i is blob[offsets[i], offsets[i + 1])
+    std::vector<char> blob;
+    std::vector<uint32_t> offsets;
+
+    // open addressing hash table (linear probing) of token ids, -1 marks an empty slot. size is a power of 2
+    std::vector<id> table;
+
     std::vector<std::string> special_tokens;
 
+    // BPE merges in an open addressing table as well, keyed by the ids of the pair (left << 32 | right).
+    // empty for files converted without merges, in which case the tokenizer falls back to greedy matching
+    struct merge {
+        uint64_t pair; // MERGE_EMPTY marks an empty slot
+        int32_t rank;
+        id merged;
+    };
+    static const uint64_t MERGE_EMPTY = UINT64_MAX;
+    std::vector<merge> merges;
+    size_t n_merges = 0;
+
+    // ids of the byte-level unicode symbol of each byte, inside a word and at the end of it ("</w>")
+    id byte_ids[256];
+    id byte_ids_eow[256];
+
+    mutable clip_bpe_cache cache;
+
+    size_t n_tokens() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+    std::string token(const id i) const { return std::string(blob.data() + offsets[i], offsets[i + 1] - offsets[i]); }
+
+    static uint32_t hash(const char * s, const size_t n) {
+        uint32_t h = 2166136261u; // FNV-1a
+        for (size_t i = 0; i < n; i++) {
+            h = (h ^ (uint8_t)s[i]) * 16777619u;
+        }
+        return h;
+    }
+
+    static uint64_t hash_pair(uint64_t x) {
+        x ^= x >> 33; // murmur3 finalizer
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb3fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    // returns -1 when the token is not in the vocab
+    id find(const char * s, const size_t n) const {
+        if (table.empty()) {
+            return -1;
+        }
+        const size_t mask = table.size() - 1;
+        for (size_t slot = hash(s, n) & mask;; slot = (slot + 1) & mask) {
+            const id cur = table[slot];
+            if (cur < 0) {
+                return -1;
+            }
+            if (offsets[cur + 1] - offsets[cur] == n && memcmp(blob.data() + offsets[cur], s, n) == 0) {
+                return cur;
+            }
+        }
+    }
+
+    id find(const std::string & s) const { return find(s.data(), s.size()); }
+
+    const merge * find_merge(const id left, const id right) const {
+        if (merges.empty()) {
+            return nullptr;
+        }
+        const uint64_t pair = ((uint64_t)(uint32_t)left << 32) | (uint32_t)right;
+        const size_t mask = merges.size() - 1;
+        for (size_t slot = hash_pair(pair) & mask;; slot = (slot + 1) & mask) {
+            const merge & m = merges[slot];
+            if (m.pair == pair) {
+                return &m;
+            }
+            if (m.pair == MERGE_EMPTY) {
+                return nullptr;
+            }
+        }
+    }
+
+    // builds the token storage and the lookup table from the GGUF string array, without per-token allocations
+    void load_tokens(const gguf_context * ctx, const int idx_tokens) {
+        const int n = gguf_get_arr_n(ctx, idx_tokens);
+
+        offsets.resize(n + 1);
+        offsets[0] = 0;
+        for (int i = 0; i < n; i++) {
+            offsets[i + 1] = offsets[i] + strlen(gguf_get_arr_str(ctx, idx_tokens, i));
+        }
+
+        blob.resize(offsets[n]);
+        for (int i = 0; i < n; i++) {
+            memcpy(blob.data() + offsets[i], gguf_get_arr_str(ctx, idx_tokens, i), offsets[i + 1] - offsets[i]);
+        }
+
+        size_t size = 1;
+        while (size < 2 * (size_t)n) {
+            size *= 2;
+        }
+        table.assign(size, -1);
+        for (id i = 0; i < n; i++) {
+            const char * s = blob.data() + offsets[i];
+            const size_t len = offsets[i + 1] - offsets[i];
+            size_t slot = hash(s, len) & (size - 1);
+            while (table[slot] >= 0) {
+                slot = (slot + 1) & (size - 1);
+            }
+            table[slot] = i; // on duplicates the first id wins, as find() returns the first match
+        }
+    }
+
+    // merges are "left right" strings in rank order
+    void load_merges(const gguf_context * ctx, const int idx_merges) {
+        const int n = gguf_get_arr_n(ctx, idx_merges);
+
+        size_t size = 1;
+        while (size < 2 * (size_t)n) {
+            size *= 2;
+        }
+        merge empty = {MERGE_EMPTY, 0, -1};
+        merges.assign(size, empty);
+        n_merges = 0;
+
+        std::string merged;
+        for (int rank = 0; rank < n; ++rank) {
+            const char * m = gguf_get_arr_str(ctx, idx_merges, rank);
+            const char * sep = strchr(m, ' ');
+            if (!sep) {
+                continue;
+            }
+            const id left = find(m, sep - m);
+            const id right = find(sep + 1, strlen(sep + 1));
+            merged.assign(m, sep - m);
+            merged.append(sep + 1);
+            const id result = find(merged);
+            if (left < 0 || right < 0 || result < 0) {
+                continue;
+            }
+
+            const uint64_t pair = ((uint64_t)(uint32_t)left << 32) | (uint32_t)right;
+            size_t slot = hash_pair(pair) & (size - 1);
+            while (merges[slot].pair != MERGE_EMPTY && merges[slot].pair != pair) {
+                slot = (slot + 1) & (size - 1);
+            }
+            if (merges[slot].pair == pair) {
+                continue; // keep the lowest rank
+            }
+            merges[slot].pair = pair;
+            merges[slot].rank = rank;
+            merges[slot].merged = result;
+            n_merges++;
+        }
+
+        if (n_merges == 0) {
+            merges.clear();
+        }
+    }
+
     //    void add_special_token(const std::string & token);
 };
 
+// GPT-2 style reversible mapping of bytes to printable unicode code points, as in bytes_to_unicode() of the converter
+static uint32_t byte_to_unicode(const uint8_t b) {
+    if ((b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE)) {
+        return b;
+    }
+
+    // the remaining bytes are mapped to 256, 257, ... in increasing order
+    uint32_t n = 0;
+    for (uint32_t c = 0; c < b; c++) {
+        if (!((c >= '!' && c <= '~') || (c >= 0xA1 && c <= 0xAC) || (c >= 0xAE))) {
+            n++;
+        }
+    }
+    return 256 + n;
+}
+
+//
+// Unicode utils
+//
+
+// decode one code point from s[0..n), n > 0. invalid sequences are consumed one byte at a time and yield U+FFFD
+static uint32_t utf8_decode(const char * s, const size_t n, size_t * len) {
+    const uint8_t c = (uint8_t)s[0];
+    int need = 0;
+    uint32_t cp = 0;
+    if (c < 0x80) {
+        *len = 1;
+        return c;
+    } else if ((c & 0xE0) == 0xC0) {
+        need = 1;
+        cp = c & 0x1F;
+    } else if ((c & 0xF0) == 0xE0) {
+        need = 2;
+        cp = c & 0x0F;
+    } else if ((c & 0xF8) == 0xF0) {
+        need = 3;
+        cp = c & 0x07;
+    } else {
+        *len = 1;
+        return 0xFFFD;
+    }
+
+    if ((size_t)need >= n) {
+        *len = 1;
+        return 0xFFFD;
+    }
+    for (int i = 1; i <= need; i++) {
+        const uint8_t cc = (uint8_t)s[i];
+        if ((cc & 0xC0) != 0x80) {
+            *len = 1;
+            return 0xFFFD;
+        }
+        cp = (cp << 6) | (cc & 0x3F);
+    }
+
+    *len = need + 1;
+    return cp;
+}
+
+static void utf8_append(std::string & out, const uint32_t cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+static bool unicode_in_ranges(const uint32_t cp, const clip_unicode_range * ranges, const size_t n) {
+    size_t lo = 0;
+    size_t hi = n;
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        if (cp < ranges[mid].first) {
+            hi = mid;
+        } else if (cp > ranges[mid].last) {
+            lo = mid + 1;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool unicode_is_letter(const uint32_t cp) {
+    if (cp < 0x80) {
+        return (cp | 0x20) >= 'a' && (cp | 0x20) <= 'z';
+    }
+    return unicode_in_ranges(cp, clip_unicode_letters, sizeof(clip_unicode_letters) / sizeof(clip_unicode_letters[0]));
+}
+
+static bool unicode_is_number(const uint32_t cp) {
+    if (cp < 0x80) {
+        return cp >= '0' && cp <= '9';
+    }
+    return unicode_in_ranges(cp, clip_unicode_numbers, sizeof(clip_unicode_numbers) / sizeof(clip_unicode_numbers[0]));
+}
+
+// same set as Python's str.isspace(), which CLIP uses to clean whitespace
+static bool unicode_is_whitespace(const uint32_t cp) {
+    if (cp < 0x80) {
+        return (cp >= 0x09 && cp <= 0x0D) || (cp >= 0x1C && cp <= 0x20);
+    }
+    return cp == 0x85 || cp == 0xA0 || cp == 0x1680 || (cp >= 0x2000 && cp <= 0x200A) || cp == 0x2028 || cp == 0x2029 ||
+           cp == 0x202F || cp == 0x205F || cp == 0x3000;
+}
+
+static uint32_t unicode_to_lower(const uint32_t cp) {
+    if (cp < 0x80) {
+        return (cp >= 'A' && cp <= 'Z') ? cp + 32 : cp;
+    }
+
+    const size_t n = sizeof(clip_unicode_lower_runs) / sizeof(clip_unicode_lower_runs[0]);
+    size_t lo = 0;
+    size_t hi = n;
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        const clip_unicode_lower_run & run = clip_unicode_lower_runs[mid];
+        if (cp < run.first) {
+            hi = mid;
+        } else if (cp > run.last) {
+            lo = mid + 1;
+        } else {
+            return (cp - run.first) % run.stride == 0 ? cp + run.delta : cp;
+        }
+    }
+    return cp;
+}
+
+static std::string unicode_lowercase(const char * text) {
+    std::string out;
+    const size_t n = strlen(text);
+    out.reserve(n);
+    for (size_t i = 0; i < n;) {
+        size_t len;
+        const uint32_t cp = utf8_decode(text + i, n - i, &len);
+        if (cp < 0x80) {
+            out += (char)unicode_to_lower(cp);
+        } else if (cp == 0xFFFD && len == 1) {
+            out += text[i]; // keep invalid bytes as they are
+        } else {
+            utf8_append(out, unicode_to_lower(cp));
+        }
+        i += len;
+    }
+    return out;
+}
+
+//
+// Pre-tokenizer
+//
+
+// Splits lowercased text into words the same way as CLIP's regex
+//   <|startoftext|>|<|endoftext|>|'s|'t|'re|'ve|'m|'ll|'d|[\p{L}]+|[\p{N}]|[^\s\p{L}\p{N}]+
+// Whitespace only separates words. Words are returned as views into the text, nothing is allocated.
+struct clip_word_scanner {
+    const std::string & text;
+    const std::vector<std::string> & special_tokens;
+    size_t pos = 0;
+
+    clip_word_scanner(const std::string & text, const std::vector<std::string> & special_tokens)
+        : text(text), special_tokens(special_tokens) {}
+
+    // returns false at the end of the text. is_special is set when the word is one of special_tokens
+    bool next(size_t * begin, size_t * len, bool * is_special) {
+        const char * s = text.data();
+        const size_t n = text.size();
+
+        // skip whitespace
+        while (pos < n) {
+            size_t cl;
+            if (!unicode_is_whitespace(utf8_decode(s + pos, n - pos, &cl))) {
+                break;
+            }
+            pos += cl;
+        }
+        if (pos >= n) {
+            return false;
+        }
+
+        *begin = pos;
+        *is_special = false;
+
+        for (const auto & token : special_tokens) {
+            if (text.compare(pos, token.size(), token) == 0) {
+                *is_special = true;
+                pos += token.size();
+                *len = token.size();
+                return true;
+            }
+        }
+
+        if (s[pos] == '\'') {
+            static const char * contractions[] = {"s", "t", "re", "ve", "m", "ll", "d"};
+            for (const char * c : contractions) {
+                const size_t cn = strlen(c);
+                if (text.compare(pos + 1, cn, c) == 0) {
+                    pos += 1 + cn;
+                    *len = 1 + cn;
+                    return true;
+                }
+            }
+        }
+
+        size_t cl;
+        const uint32_t cp = utf8_decode(s + pos, n - pos, &cl);
+        if (unicode_is_letter(cp)) {
+            pos += cl;
+            while (pos < n && unicode_is_letter(utf8_decode(s + pos, n - pos, &cl))) {
+                pos += cl;
+            }
+        } else if (unicode_is_number(cp)) {
+            pos += cl; // digits are split one by one
+        } else {
+            pos += cl;
+            while (pos < n) {
+                const uint32_t c = utf8_decode(s + pos, n - pos, &cl);
+                if (unicode_is_whitespace(c) || unicode_is_letter(c) || unicode_is_number(c)) {
+                    break;
+                }
+                pos += cl;
+            }
+        }
+
+        *len = pos - *begin;
+        return true;
+    }
+};
+
 //
 // clip layers
 //
@@ -237,6 +710,86 @@ struct clip_buffer {
     ~clip_buffer() { delete[] data; }
 };
 
+// opt-in, memory bounded LRU cache of text embeddings keyed by a hash of the token ids.
+// the tokens are stored alongside to rule out hash collisions
+struct clip_text_cache {
+    using id = clip_vocab_id;
+
+    struct entry {
+        uint64_t key;
+        bool normalize;
+        std::vector<id> tokens;
+        std::vector<float> vec;
+    };
+
+    size_t max_bytes = 0; // 0 = disabled
+    size_t size_bytes = 0;
+    std::list<entry> lru; // most recently used first
+    std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+    clip_text_cache_stats stats = {};
+    std::mutex mutex;
+
+    static uint64_t hash(const id * tokens, const size_t n, const bool normalize) {
+        uint64_t h = 14695981039346656037ULL; // FNV-1a
+        const uint8_t * bytes = reinterpret_cast<const uint8_t *>(tokens);
+        for (size_t i = 0; i < n * sizeof(id); i++) {
+            h = (h ^ bytes[i]) * 1099511628211ULL;
+        }
+        return normalize ? ~h : h;
+    }
+
+    static size_t entry_bytes(const entry & e) {
+        return sizeof(entry) + e.tokens.size() * sizeof(id) + e.vec.size() * sizeof(float);
+    }
+
+    bool get(const id * tokens, const size_t n, const bool normalize, float * vec) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (max_bytes == 0) {
+            return false;
+        }
+        auto it = index.find(hash(tokens, n, normalize));
+        if (it == index.end() || it->second->normalize != normalize || it->second->tokens.size() != n ||
+            !std::equal(tokens, tokens + n, it->second->tokens.begin())) {
+            stats.misses++;
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        std::copy(it->second->vec.begin(), it->second->vec.end(), vec);
+        stats.hits++;
+        return true;
+    }
+
+    // must be called with the mutex held
+    void evict(const size_t target_bytes) {
+        while (!lru.empty() && size_bytes > target_bytes) {
+            size_bytes -= entry_bytes(lru.back());
+            index.erase(lru.back().key);
+            lru.pop_back();
+            stats.evictions++;
+        }
+    }
+
+    void put(const id * tokens, const size_t n, const bool normalize, const float * vec, const int dim) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (max_bytes == 0) {
+            return;
+        }
+        const uint64_t key = hash(tokens, n, normalize);
+        auto it = index.find(key);
+        if (it != index.end()) { // same tokens encoded concurrently, or a collision: the newest wins
+            size_bytes -= entry_bytes(*it->second);
+            lru.erase(it->second);
+            index.erase(it);
+        }
+        lru.push_front({key, normalize, std::vector<id>(tokens, tokens + n), std::vector<float>(vec, vec + dim)});
+        index[key] = lru.begin();
+        size_bytes += entry_bytes(lru.front());
+        evict(max_bytes);
+    }
+};
+
+struct clip_imatrix;
+
 struct clip_ctx {
     bool has_text_encoder = false;
     bool has_vision_encoder = false;
@@ -250,6 +803,19 @@ struct clip_ctx {
     struct ggml_context * ctx;
     struct gguf_context * ctx_gguf;
     struct clip_buffer buf_compute;
+    struct clip_buffer buf_scratch;
+    mutable struct clip_buffer buf_panel; // the activations of a multiplication by panels, quantized once for its threads
+    mutable std::mutex compute_mutex;     // held by an encode while it uses buf_compute, buf_scratch and buf_panel
+    mutable struct clip_text_cache text_cache;
+    void * mapping = nullptr; // of the model file with use_mmap
+    size_t mapping_size = 0;
+    // weights repacked into panels, with the memory holding them if it is not that of ctx
+    std::map<const struct ggml_tensor *, std::vector<uint8_t>> packed_weights;
+    struct clip_imatrix * imatrix = nullptr; // collected while not null
+    std::atomic<int> n_refs{0};              // references taken through a clip_model_handle
+    uint64_t fingerprint = 0;                // see clip_model_fingerprint
+    clip_layer_callback layer_callback = nullptr;
+    void * layer_callback_data = nullptr;
 };
 
 //
@@ -258,1443 +824,6279 @@ struct clip_ctx {
 
 // utility function for a workaround until https://github.com/ggerganov/ggml/issues/260 is resolved
 // after that, remove this and use the mechanism implemented in GGML directly
+// the buffers are sized for the towers loaded, not for the tensors of the file: a text-only load of a two-tower model
+// only builds the text graph. when the vision tower is loaded, its graph is the larger one
 size_t get_mem_req_by_size(struct clip_ctx * ctx) {
     size_t mb = 1024 * 1024;
-    const int n_tensors = gguf_get_n_tensors(ctx->ctx_gguf);
-    const auto & vision_hparams = clip_get_vision_hparams(ctx);
-    const int n_positions =
-        ctx->has_vision_encoder ? vision_hparams->image_size * vision_hparams->image_size / vision_hparams->patch_size + 1 : 77;
-    switch (n_tensors) {
-    case 397:                    // base, two-tower
-    case 200:                    // base, vision-only
-        if (n_positions == 50) { // patch size = 32
+    if (ctx->has_vision_encoder) {
+        const auto & vision_hparams = clip_get_vision_hparams(ctx);
+        const int n_positions = vision_hparams->image_size * vision_hparams->image_size / vision_hparams->patch_size + 1;
+        switch (vision_hparams->hidden_size) {
+        case 768:                    // base
+            if (n_positions == 50) { // patch size = 32
+                return 12 * mb;
+            } else { // patch size = 16
+                return 24 * mb;
+            }
+        case 1024:                    // large
+            if (n_positions == 257) { // input image size = 224
+                return 24 * mb;
+            } else { // input image size = 336
+                return 60 * mb;
+            }
+        case 1280: // huge
+            return 232 * mb;
+        }
+    } else if (ctx->has_text_encoder) {
+        switch (ctx->text_model.hparams.hidden_size) {
+        case 512: // base
+        case 768: // large
             return 12 * mb;
-        } else { // patch size = 16
-            return 24 * mb;
-        }
-    case 197: // base or large, text-only
-        return 12 * mb;
-    case 589:                     // large, two-tower
-    case 392:                     // large, vision-only
-        if (n_positions == 257) { // input image size = 224
-            return 24 * mb;
-        } else { // input image size = 336
-            return 60 * mb;
+        case 1024: // huge
+            return 120 * mb;
         }
-    case 909: // huge, two-tower
-    case 520: // huge, vision-only
-        return 232 * mb;
-    case 389: // huge, text-only
-        return 120 * mb;
-    default:
-        fprintf(stderr, "%s: Unrecognized number of tensors: %d. Check if you pass the correct model file\n", __func__,
-                n_tensors);
-        exit(1);
     }
+    fprintf(stderr, "%s: Unrecognized model size. Check if you pass the correct model file\n", __func__);
+    exit(1);
 }
-
 size_t get_scr_buf_req_by_size(struct clip_ctx * ctx) {
     size_t mb = 1024 * 1024;
-
-    const int n_tensors = gguf_get_n_tensors(ctx->ctx_gguf);
-    const auto & vision_hparams = clip_get_vision_hparams(ctx);
-    const int n_positions =
-        ctx->has_vision_encoder ? vision_hparams->image_size * vision_hparams->image_size / vision_hparams->patch_size + 1 : 77;
-
-    switch (n_tensors) {
-    case 397:
-    case 200:
-        if (n_positions <= 50) {
+    if (ctx->has_vision_encoder) {
+        const auto & vision_hparams = clip_get_vision_hparams(ctx);
+        const int n_positions = vision_hparams->image_size * vision_hparams->image_size / vision_hparams->patch_size + 1;
+        switch (vision_hparams->hidden_size) {
+        case 768:
+            if (n_positions <= 50) {
+                return 32 * mb;
+            } else {
+                return 96 * mb;
+            }
+        case 1024:
+            if (n_positions <= 257) {
+                return 96 * mb;
+            } else {
+                return 192 * mb;
+            }
+        case 1280:
+            return 144 * mb;
+        }
+    } else if (ctx->has_text_encoder) {
+        switch (ctx->text_model.hparams.hidden_size) {
+        case 512:
+        case 768:
             return 32 * mb;
-        } else {
-            return 96 * mb;
-        }
-    case 197:
-        return 32 * mb;
-    case 589:
-    case 392:
-        if (n_positions <= 257) {
-            return 96 * mb;
-        } else {
-            return 192 * mb;
+        case 1024:
+            return 60 * mb;
         }
-    case 909:
-    case 520:
-        return 144 * mb;
-    case 389:
-        return 60 * mb;
-    default:
-        fprintf(stderr, "%s: Unrecognized number of tensors: %d. Check if you pass the correct model file\n", __func__,
-                n_tensors);
-        exit(1);
     }
+    fprintf(stderr, "%s: Unrecognized model size. Check if you pass the correct model file\n", __func__);
+    exit(1);
 }
 
-// read and create ggml_context containing the tensors and their data
-struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
-
-    struct ggml_context * meta = NULL;
+//
+// weight conversion, defined with clip_model_quantize_recipe
+//
 
-    struct gguf_init_params params = {
-        /*.no_alloc = */ true,
-        /*.ctx      = */ &meta,
-    };
+// the blocks of the legacy quantization types
+#define QK_LEGACY 32
+
+// presets, from the smallest to the closest to f16 embeddings. projections and embeddings move the embeddings the
+// most when quantized, the MLPs the least
+static const struct {
+    const char * name;
+    const char * recipe;
+} quantize_presets[] = {
+    {"small", "proj=q8_0,token_embd=q5_1,*=q4_0"},
+    {"balanced", "proj=f16,*_embd=q8_0,attn_*=q5_1,ffn_*=q4_1"},
+    {"quality", "proj=f16,*_embd=f16,attn_*=q8_0,ffn_*=q5_1"},
+};
 
-    struct gguf_context * ctx = gguf_init_from_file(fname, params);
+// a rule of a recipe: [tower.]role[@first-last]=type
+struct quantize_rule {
+    std::string tower; // "t", "v" or empty for both
+    std::string role;  // glob over the roles below
+    int layer_min = -1;
+    int layer_max = -1;
+    bool keep = false;
+    int ftype = 0;
+    ggml_type type = GGML_TYPE_F32;
+    ggml_type fallback = GGML_TYPE_F32;
+};
 
-    if (verbosity >= 1) {
-        const int n_tensors = gguf_get_n_tensors(ctx);
-        const int n_kv = gguf_get_n_kv(ctx);
-        const int ftype = get_u32(ctx, KEY_FTYPE);
-        const std::string ftype_str = get_ftype(ftype);
-        const int idx_desc = get_key_idx(ctx, KEY_DESCRIPTION);
-        const std::string description = gguf_get_val_str(ctx, idx_desc);
-        const int idx_name = gguf_find_key(ctx, KEY_NAME);
-        if (idx_name != -1) { // make name optional temporarily as some of the uploaded models missing it due to a bug
-            const std::string name = gguf_get_val_str(ctx, idx_name);
-            printf("%s: model name:   %s\n", __func__, name.c_str());
-        }
-        printf("%s: description:  %s\n", __func__, description.c_str());
-        printf("%s: GGUF version: %d\n", __func__, gguf_get_version(ctx));
-        printf("%s: alignment:    %zu\n", __func__, gguf_get_alignment(ctx));
-        printf("%s: n_tensors:    %d\n", __func__, n_tensors);
-        printf("%s: n_kv:         %d\n", __func__, n_kv);
-        printf("%s: ftype:        %s\n", __func__, ftype_str.c_str());
-        printf("\n");
-    }
+// fn(arg, start, end) over [0, n) split across up to n_threads threads, the calling thread takes the first range
+typedef void (*range_fn)(void * arg, size_t start, size_t end);
 
-    // kv
-    if (verbosity >= 3) {
-        const int n_kv = gguf_get_n_kv(ctx);
+static void parallel_for(const int n_threads, const size_t n, const size_t min_per_thread, range_fn fn, void * arg);
+static bool ends_with(const std::string & str, const std::string & suffix);
+static bool parse_quantize_recipe(const std::string & recipe, std::vector<quantize_rule> & rules);
+static std::string quantize_recipe_text(const std::vector<quantize_rule> & rules);
+static ggml_type quantize_tensor_type(const std::vector<quantize_rule> & rules, const std::string & name,
+                                      const struct ggml_tensor * t);
+static int dominant_ftype(const std::map<ggml_type, int64_t> & n_elements_by_type);
+static void convert_tensor(const int n_threads, const struct ggml_tensor * src, const void * src_data,
+                           struct ggml_tensor * dst);
 
-        for (int i = 0; i < n_kv; ++i) {
-            const char * key = gguf_get_key(ctx, i);
+//
+// packed weights
+//
 
-            printf("%s: kv[%d]: key = %s\n", __func__, i, key);
-        }
-        printf("\n");
-    }
+#if defined(__AVX__)
+static inline float hsum_f32_8(const __m256 v) {
+    __m128 r = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    r = _mm_add_ps(r, _mm_movehl_ps(r, r));
+    r = _mm_add_ss(r, _mm_movehdup_ps(r));
+    return _mm_cvtss_f32(r);
+}
+#endif
 
-    // data
-    size_t ctx_size = 0;
-    {
-        const int n_tensors = gguf_get_n_tensors(ctx);
+#if defined(__AVX2__)
+static inline int32_t hsum_i32_8(const __m256i v) {
+    __m128i r = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    r = _mm_add_epi32(r, _mm_unpackhi_epi64(r, r));
+    r = _mm_add_epi32(r, _mm_shuffle_epi32(r, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(r);
+}
+#endif
 
-        for (int i = 0; i < n_tensors; ++i) {
-            const char * name = gguf_get_tensor_name(ctx, i);
-            const size_t offset = gguf_get_tensor_offset(ctx, i);
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+#define CLIP_DPBUSD _mm256_dpbusd_epi32
+#elif defined(__AVXVNNI__)
+#define CLIP_DPBUSD _mm256_dpbusd_avx_epi32
+#endif
 
-            struct ggml_tensor * cur = ggml_get_tensor(meta, name);
-            ctx_size += sizeof(struct ggml_tensor) + GGML_OBJECT_SIZE;
-            size_t tensor_size = ggml_nbytes(cur);
-            size_t padded_size = ggml_nbytes_pad(cur);
-            ctx_size += padded_size;
-            if (verbosity >= 3) {
-                printf("%s: tensor[%d]: n_dims = %d, name = %s, tensor_size=%zu, padded_size=%zu, offset=%zu\n", __func__, i,
-                       cur->n_dims, cur->name, tensor_size, padded_size, offset);
-            }
-        }
-    }
+// q4_0 and q8_0 weights are repacked into panels of CLIP_PANEL_ROWS rows whose blocks are interleaved: for each column
+// of blocks, the scales of the rows of the panel, then their quants. a panel takes the bytes of the rows it replaces.
+// the kernels compute tiles of a panel and two tokens, so that every load of weights or activations is used at least
+// twice and the scales are converted four at a time
+#define CLIP_PANEL_ROWS 4
 
-    clip_ctx * new_clip = new clip_ctx;
+#if defined(__AVX2__) && defined(__F16C__)
+#define CLIP_PANEL_KERNELS "AVX2"
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define CLIP_PANEL_KERNELS "NEON"
+#endif
 
-    // model size and capabilities
-    {
-        int idx = get_key_idx(ctx, KEY_HAS_TEXT_ENC);
-        new_clip->has_text_encoder = gguf_get_val_bool(ctx, idx);
+// a block of activations quantized on the fly
+typedef struct {
+    float d;
+    int8_t qs[QK_LEGACY];
+} clip_block_q8;
 
-        idx = get_key_idx(ctx, KEY_HAS_VIS_ENC);
-        new_clip->has_vision_encoder = gguf_get_val_bool(ctx, idx);
+static bool is_packable_weight(const struct ggml_tensor * w) {
+    return (w->type == GGML_TYPE_Q4_0 || w->type == GGML_TYPE_Q8_0) && w->n_dims == 2 && w->ne[0] % QK_LEGACY == 0 &&
+           w->ne[1] % CLIP_PANEL_ROWS == 0;
+}
 
-        idx = get_key_idx(ctx, KEY_USE_GELU);
-        new_clip->use_gelu = gguf_get_val_bool(ctx, idx);
+struct RepackArgs {
+    size_t block_size;
+    int64_t n_blocks; // per row
+    const uint8_t * src;
+    uint8_t * dst; // may be src
+};
 
-        if (verbosity >= 1) {
-            printf("%s: text_encoder:   %d\n", __func__, new_clip->has_text_encoder);
-            printf("%s: vision_encoder: %d\n", __func__, new_clip->has_vision_encoder);
-            printf("%s: model size:     %.2f MB\n", __func__, (ctx_size / 1024.0 / 1024.0));
-            printf("%s: metadata size:  %.2f MB\n", __func__, ggml_get_mem_size(meta) / 1024.0 / 1024.0);
+// repacks panels [start, end)
+static void repack_panels(void * arg, size_t start, size_t end) {
+    const RepackArgs * args = static_cast<const RepackArgs *>(arg);
+    const size_t qs_size = args->block_size - sizeof(ggml_fp16_t);
+    const size_t row_size = args->n_blocks * args->block_size;
+
+    std::vector<uint8_t> rows(CLIP_PANEL_ROWS * row_size);
+    for (size_t p = start; p < end; p++) {
+        memcpy(rows.data(), args->src + p * rows.size(), rows.size());
+        uint8_t * out = args->dst + p * rows.size();
+        for (int64_t b = 0; b < args->n_blocks; b++) {
+            for (int r = 0; r < CLIP_PANEL_ROWS; r++) {
+                const uint8_t * block = rows.data() + r * row_size + b * args->block_size;
+                memcpy(out + r * sizeof(ggml_fp16_t), block, sizeof(ggml_fp16_t));
+                memcpy(out + CLIP_PANEL_ROWS * sizeof(ggml_fp16_t) + r * qs_size, block + sizeof(ggml_fp16_t), qs_size);
+            }
+            out += CLIP_PANEL_ROWS * args->block_size;
         }
     }
+}
 
-    // load tensors
-    {
-        struct ggml_init_params params = {
-            .mem_size = ctx_size,
-            .mem_buffer = NULL,
-            .no_alloc = false,
-        };
+// the q4_0 and q8_0 weights of the layers and the projections, repacked when the CPU has kernels for panels. weights
+// in the memory of the model context are repacked in place, mapped ones or those of a buffer into memory of their own
+static void repack_weights(struct clip_ctx * ctx, const clip_model_load_params & params) {
+#if defined(CLIP_PANEL_KERNELS)
+    const int n_threads = params.n_threads > 0 ? params.n_threads : std::max(1, (int)std::thread::hardware_concurrency());
+    const int64_t t_start_us = ggml_time_us();
+
+    std::vector<struct ggml_tensor *> weights;
+    const std::vector<clip_layer> * towers[2] = {
+        ctx->has_text_encoder ? &ctx->text_model.layers : nullptr,
+        ctx->has_vision_encoder ? &ctx->vision_model.layers : nullptr,
+    };
+    for (const auto * layers : towers) {
+        if (!layers) {
+            continue;
+        }
+        for (const auto & layer : *layers) {
+            for (struct ggml_tensor * w : {layer.q_w, layer.k_w, layer.v_w, layer.o_w, layer.ff_i_w, layer.ff_o_w}) {
+                weights.push_back(w);
+            }
+        }
+    }
+    if (ctx->has_text_encoder) {
+        weights.push_back(ctx->text_model.projection);
+    }
+    if (ctx->has_vision_encoder) {
+        weights.push_back(ctx->vision_model.projection);
+    }
 
-        new_clip->ctx = ggml_init(params);
-        if (!new_clip->ctx) {
-            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
-            clip_free(new_clip);
-            return nullptr;
+    const uint8_t * mem = static_cast<const uint8_t *>(ggml_get_mem_buffer(ctx->ctx));
+    const size_t mem_size = ggml_get_mem_size(ctx->ctx);
+    size_t n_packed = 0;
+    size_t size_packed = 0;
+    for (struct ggml_tensor * w : weights) {
+        if (!w || !is_packable_weight(w) || ctx->packed_weights.count(w)) {
+            continue;
         }
 
-        auto fin = std::ifstream(fname, std::ios::binary);
-        if (!fin) {
-            printf("cannot open model file for loading tensors\n");
-            clip_free(new_clip);
-            return nullptr;
+        RepackArgs args = {ggml_type_size(w->type), w->ne[0] / QK_LEGACY, static_cast<const uint8_t *>(w->data),
+                           static_cast<uint8_t *>(w->data)};
+        std::vector<uint8_t> & storage = ctx->packed_weights[w];
+        if (args.src < mem || args.src >= mem + mem_size) {
+            storage.resize(ggml_nbytes(w));
+            args.dst = storage.data();
         }
+        parallel_for(n_threads, w->ne[1] / CLIP_PANEL_ROWS, 16, repack_panels, &args);
+        w->data = args.dst;
 
-        const int n_tensors = gguf_get_n_tensors(ctx);
-        for (int i = 0; i < n_tensors; ++i) {
-            const char * name = gguf_get_tensor_name(ctx, i);
-            struct ggml_tensor * t = ggml_get_tensor(meta, name);
-            struct ggml_tensor * cur = ggml_dup_tensor(new_clip->ctx, t);
-            ggml_set_name(cur, name);
+        n_packed++;
+        size_packed += ggml_nbytes(w);
+    }
 
-            const size_t offset = gguf_get_data_offset(ctx) + gguf_get_tensor_offset(ctx, i);
-            fin.seekg(offset, std::ios::beg);
-            if (!fin) {
-                printf("%s: failed to seek for tensor %s\n", __func__, name);
-                clip_free(new_clip);
-                return nullptr;
+    if (params.verbosity >= 1) {
+        printf("%s: %zu weights of %.2f MB repacked into panels for %s in %.2f ms\n", __func__, n_packed,
+               size_packed / 1024.0 / 1024.0, CLIP_PANEL_KERNELS, (ggml_time_us() - t_start_us) / 1000.0);
+    }
+#else
+    (void)ctx;
+    if (params.verbosity >= 1) {
+        printf("%s: no panel kernels for this CPU, weights are kept as they are\n", __func__);
+    }
+#endif
+}
+
+// x quantized by blocks to [-127, 127]
+static void quantize_row_panel_q8(const float * x, clip_block_q8 * y, const int64_t n_blocks) {
+    for (int64_t b = 0; b < n_blocks; b++) {
+        const float * xb = x + b * QK_LEGACY;
+        float amax = 0.0f;
+        for (int i = 0; i < QK_LEGACY; i++) {
+            amax = std::max(amax, fabsf(xb[i]));
+        }
+        const float d = amax / 127.0f;
+        const float id = d > 0.0f ? 1.0f / d : 0.0f;
+        y[b].d = d;
+        for (int i = 0; i < QK_LEGACY; i++) {
+            y[b].qs[i] = (int8_t)roundf(xb[i] * id);
+        }
+    }
+}
+
+// out[t * CLIP_PANEL_ROWS + r] = row r of a panel of n_blocks columns of blocks . token t, for NT tokens
+template <int NT>
+static void panel_dot(const ggml_type type, const uint8_t * panel, const int64_t n_blocks, const clip_block_q8 * const * x,
+                      float * out) {
+    const size_t qs_size = type == GGML_TYPE_Q8_0 ? QK_LEGACY : QK_LEGACY / 2;
+    const size_t panel_block_size = CLIP_PANEL_ROWS * (sizeof(ggml_fp16_t) + qs_size);
+
+#if defined(__AVX2__) && defined(__F16C__)
+    __m256 acc[NT][CLIP_PANEL_ROWS];
+    for (int t = 0; t < NT; t++) {
+        for (int r = 0; r < CLIP_PANEL_ROWS; r++) {
+            acc[t][r] = _mm256_setzero_ps();
+        }
+    }
+
+    for (int64_t b = 0; b < n_blocks; b++) {
+        const uint8_t * pb = panel + b * panel_block_size;
+        const uint8_t * qs = pb + CLIP_PANEL_ROWS * sizeof(ggml_fp16_t);
+        float d[CLIP_PANEL_ROWS];
+        _mm_storeu_ps(d, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)pb)));
+
+        // |w| and the signs of w, which are moved to x as maddubs takes an unsigned operand
+        __m256i w_abs[CLIP_PANEL_ROWS];
+        __m256i w_sign[CLIP_PANEL_ROWS];
+        for (int r = 0; r < CLIP_PANEL_ROWS; r++) {
+            __m256i w;
+            if (type == GGML_TYPE_Q8_0) {
+                w = _mm256_loadu_si256((const __m256i *)(qs + r * qs_size));
+            } else {
+                const __m128i v = _mm_loadu_si128((const __m128i *)(qs + r * qs_size));
+                const __m128i lo = _mm_and_si128(v, _mm_set1_epi8(0x0F));
+                const __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+                w = _mm256_sub_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), _mm256_set1_epi8(8));
             }
+            w_abs[r] = _mm256_sign_epi8(w, w);
+            w_sign[r] = w;
+        }
 
-            fin.read(reinterpret_cast<char *>(cur->data), ggml_nbytes(t));
+        for (int t = 0; t < NT; t++) {
+            const __m256i xv = _mm256_loadu_si256((const __m256i *)x[t][b].qs);
+            for (int r = 0; r < CLIP_PANEL_ROWS; r++) {
+#if defined(CLIP_DPBUSD)
+                const __m256i dot = CLIP_DPBUSD(_mm256_setzero_si256(), w_abs[r], _mm256_sign_epi8(xv, w_sign[r]));
+#else
+                const __m256i dot = _mm256_madd_epi16(_mm256_maddubs_epi16(w_abs[r], _mm256_sign_epi8(xv, w_sign[r])),
+                                                      _mm256_set1_epi16(1));
+#endif
+                const __m256 scale = _mm256_set1_ps(d[r] * x[t][b].d);
+#if defined(__FMA__)
+                acc[t][r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dot), scale, acc[t][r]);
+#else
+                acc[t][r] = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(dot), scale), acc[t][r]);
+#endif
+            }
         }
+    }
 
-        fin.close();
+    for (int t = 0; t < NT; t++) {
+        for (int r = 0; r < CLIP_PANEL_ROWS; r++) {
+            out[t * CLIP_PANEL_ROWS + r] = hsum_f32_8(acc[t][r]);
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    // a lane per row of the panel
+    float32x4_t acc[NT];
+    for (int t = 0; t < NT; t++) {
+        acc[t] = vdupq_n_f32(0.0f);
     }
 
-    // text model
-    if (new_clip->has_text_encoder) {
-        // load text model
-        auto & text_model = new_clip->text_model;
-        auto & hparams = text_model.hparams;
-        hparams.hidden_size = get_u32(ctx, format(KEY_N_EMBD, "text"));
-        hparams.n_head = get_u32(ctx, format(KEY_N_HEAD, "text"));
-        hparams.n_intermediate = get_u32(ctx, format(KEY_N_FF, "text"));
-        hparams.n_layer = get_u32(ctx, format(KEY_N_BLOCK, "text"));
-        hparams.num_positions = get_u32(ctx, KEY_N_POSITIONS);
-        hparams.projection_dim = get_u32(ctx, format(KEY_PROJ_DIM, "text"));
-        hparams.eps = get_f32(ctx, format(KEY_LAYER_NORM_EPS, "text"));
+    for (int64_t b = 0; b < n_blocks; b++) {
+        const uint8_t * pb = panel + b * panel_block_size;
+        const uint8_t * qs = pb + CLIP_PANEL_ROWS * sizeof(ggml_fp16_t);
+        const float32x4_t d = vcvt_f32_f16(vld1_f16((const __fp16 *)pb));
+
+        int8x16_t w[CLIP_PANEL_ROWS][2];
+        for (int r = 0; r < CLIP_PANEL_ROWS; r++) {
+            if (type == GGML_TYPE_Q8_0) {
+                w[r][0] = vld1q_s8((const int8_t *)(qs + r * qs_size));
+                w[r][1] = vld1q_s8((const int8_t *)(qs + r * qs_size + 16));
+            } else {
+                const uint8x16_t v = vld1q_u8(qs + r * qs_size);
+                w[r][0] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(v, vdupq_n_u8(0x0F))), vdupq_n_s8(8));
+                w[r][1] = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(v, 4)), vdupq_n_s8(8));
+            }
+        }
 
-        const int idx_tokens = get_key_idx(ctx, KEY_TOKENS);
-        hparams.n_vocab = gguf_get_arr_n(ctx, idx_tokens);
-        auto & vocab = new_clip->vocab;
-        for (int id = 0; id < hparams.n_vocab; ++id) {
-            const std::string token = gguf_get_arr_str(ctx, idx_tokens, id);
-            vocab.id_to_token[id] = token;
-            vocab.token_to_id[token] = id;
+        for (int t = 0; t < NT; t++) {
+            const int8x16_t x0 = vld1q_s8(x[t][b].qs);
+            const int8x16_t x1 = vld1q_s8(x[t][b].qs + 16);
+            int32x4_t dot[CLIP_PANEL_ROWS];
+            for (int r = 0; r < CLIP_PANEL_ROWS; r++) {
+                int32x4_t s = vdupq_n_s32(0);
+                s = vpadalq_s16(s, vmull_s8(vget_low_s8(w[r][0]), vget_low_s8(x0)));
+                s = vpadalq_s16(s, vmull_s8(vget_high_s8(w[r][0]), vget_high_s8(x0)));
+                s = vpadalq_s16(s, vmull_s8(vget_low_s8(w[r][1]), vget_low_s8(x1)));
+                s = vpadalq_s16(s, vmull_s8(vget_high_s8(w[r][1]), vget_high_s8(x1)));
+                dot[r] = s;
+            }
+            const int32x4_t sums = vpaddq_s32(vpaddq_s32(dot[0], dot[1]), vpaddq_s32(dot[2], dot[3]));
+            acc[t] = vfmaq_f32(acc[t], vcvtq_f32_s32(sums), vmulq_n_f32(d, x[t][b].d));
         }
+    }
 
-        if (verbosity >= 2) {
-            printf("\n%s: text model hparams\n", __func__);
-            printf("n_vocab            %d\n", hparams.n_vocab);
-            printf("num_positions      %d\n", hparams.num_positions);
-            printf("t_hidden_size      %d\n", hparams.hidden_size);
-            printf("t_n_intermediate   %d\n", hparams.n_intermediate);
-            printf("t_projection_dim   %d\n", hparams.projection_dim);
-            printf("t_n_head           %d\n", hparams.n_head);
-            printf("t_n_layer          %d\n", hparams.n_layer);
+    for (int t = 0; t < NT; t++) {
+        vst1q_f32(out + t * CLIP_PANEL_ROWS, acc[t]);
+    }
+#else
+    for (int i = 0; i < NT * CLIP_PANEL_ROWS; i++) {
+        out[i] = 0.0f;
+    }
+    for (int64_t b = 0; b < n_blocks; b++) {
+        const uint8_t * pb = panel + b * panel_block_size;
+        const ggml_fp16_t * d = reinterpret_cast<const ggml_fp16_t *>(pb);
+        const uint8_t * qs = pb + CLIP_PANEL_ROWS * sizeof(ggml_fp16_t);
+        for (int r = 0; r < CLIP_PANEL_ROWS; r++) {
+            int8_t w[QK_LEGACY];
+            for (int i = 0; i < QK_LEGACY / 2; i++) {
+                if (type == GGML_TYPE_Q8_0) {
+                    w[i] = (int8_t)qs[r * qs_size + i];
+                    w[i + QK_LEGACY / 2] = (int8_t)qs[r * qs_size + i + QK_LEGACY / 2];
+                } else {
+                    w[i] = (int8_t)((qs[r * qs_size + i] & 0x0F) - 8);
+                    w[i + QK_LEGACY / 2] = (int8_t)((qs[r * qs_size + i] >> 4) - 8);
+                }
+            }
+            for (int t = 0; t < NT; t++) {
+                int32_t dot = 0;
+                for (int i = 0; i < QK_LEGACY; i++) {
+                    dot += (int32_t)w[i] * (int32_t)x[t][b].qs[i];
+                }
+                out[t * CLIP_PANEL_ROWS + r] += ggml_fp16_to_fp32(d[r]) * x[t][b].d * dot;
+            }
         }
+    }
+#endif
+}
 
-        text_model.token_embeddings = get_tensor(new_clip->ctx, format(TN_TOKEN_EMBD, "t"));
-        text_model.position_embeddings = get_tensor(new_clip->ctx, format(TN_POS_EMBD, "t"));
-        text_model.post_ln_w = get_tensor(new_clip->ctx, format(TN_LN_POST, "t", "weight"));
-        text_model.post_ln_b = get_tensor(new_clip->ctx, format(TN_LN_POST, "t", "bias"));
-        text_model.projection = get_tensor(new_clip->ctx, TN_TEXT_PROJ);
-        text_model.layers.resize(hparams.n_layer);
-        for (int il = 0; il < hparams.n_layer; ++il) {
-            auto & layer = text_model.layers[il];
-            layer.k_w = get_tensor(new_clip->ctx, format(TN_ATTN_K, "t", il, "weight"));
-            layer.q_w = get_tensor(new_clip->ctx, format(TN_ATTN_Q, "t", il, "weight"));
-            layer.v_w = get_tensor(new_clip->ctx, format(TN_ATTN_V, "t", il, "weight"));
-            layer.o_w = get_tensor(new_clip->ctx, format(TN_ATTN_OUTPUT, "t", il, "weight"));
-            layer.ln_1_w = get_tensor(new_clip->ctx, format(TN_LN_1, "t", il, "weight"));
-            layer.ln_2_w = get_tensor(new_clip->ctx, format(TN_LN_2, "t", il, "weight"));
-            layer.ff_i_w = get_tensor(new_clip->ctx, format(TN_FFN_DOWN, "t", il, "weight"));
-            layer.ff_o_w = get_tensor(new_clip->ctx, format(TN_FFN_UP, "t", il, "weight"));
-            layer.k_b = get_tensor(new_clip->ctx, format(TN_ATTN_K, "t", il, "bias"));
-            layer.q_b = get_tensor(new_clip->ctx, format(TN_ATTN_Q, "t", il, "bias"));
-            layer.v_b = get_tensor(new_clip->ctx, format(TN_ATTN_V, "t", il, "bias"));
-            layer.o_b = get_tensor(new_clip->ctx, format(TN_ATTN_OUTPUT, "t", il, "bias"));
-            layer.ln_1_b = get_tensor(new_clip->ctx, format(TN_LN_1, "t", il, "bias"));
-            layer.ln_2_b = get_tensor(new_clip->ctx, format(TN_LN_2, "t", il, "bias"));
-            layer.ff_i_b = get_tensor(new_clip->ctx, format(TN_FFN_DOWN, "t", il, "bias"));
-            layer.ff_o_b = get_tensor(new_clip->ctx, format(TN_FFN_UP, "t", il, "bias"));
+// quantizes the tokens of x into the clip_buffer userdata for panel_mul_mat, the tokens split across threads. dst is x
+static void panel_quantize(struct ggml_tensor * dst, const struct ggml_tensor * x, int ith, int nth, void * userdata) {
+    (void)dst;
+
+    const int64_t n_blocks = x->ne[0] / QK_LEGACY;
+    const int64_t n_tokens = x->ne[1] * x->ne[2] * x->ne[3];
+    clip_block_q8 * xq = reinterpret_cast<clip_block_q8 *>(static_cast<clip_buffer *>(userdata)->data);
+    for (int64_t t = n_tokens * ith / nth; t < n_tokens * (ith + 1) / nth; t++) {
+        const int64_t i1 = t % x->ne[1];
+        const int64_t i2 = t / x->ne[1] % x->ne[2];
+        const int64_t i3 = t / (x->ne[1] * x->ne[2]);
+        const char * row = static_cast<const char *>(x->data) + i1 * x->nb[1] + i2 * x->nb[2] + i3 * x->nb[3];
+        quantize_row_panel_q8(reinterpret_cast<const float *>(row), xq + t * n_blocks, n_blocks);
+    }
+}
+
+// dst = w x for a weight w repacked into panels, a only giving dst its shape and the clip_buffer userdata holding x as
+// quantized by panel_quantize. the panels are split across threads, each going over its panels for a chunk of tokens at
+// a time, so that a panel stays in cache for all the tokens of a chunk
+static void panel_mul_mat(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * x,
+                          const struct ggml_tensor * w, int ith, int nth, void * userdata) {
+    (void)a;
+
+    const int64_t n_out = w->ne[1];
+    const int64_t n_panels = n_out / CLIP_PANEL_ROWS;
+    const int64_t p0 = n_panels * ith / nth;
+    const int64_t p1 = n_panels * (ith + 1) / nth;
+    if (p0 == p1) {
+        return;
+    }
+
+    const int64_t n_blocks = w->ne[0] / QK_LEGACY;
+    const size_t panel_size = CLIP_PANEL_ROWS * n_blocks * ggml_type_size(w->type);
+    const int64_t n_tokens = x->ne[1] * x->ne[2] * x->ne[3];
+    const int64_t chunk = 64;
+
+    const clip_block_q8 * xq = reinterpret_cast<const clip_block_q8 *>(static_cast<clip_buffer *>(userdata)->data);
+    float * out = static_cast<float *>(dst->data);
+    for (int64_t t0 = 0; t0 < n_tokens; t0 += chunk) {
+        const int64_t t1 = std::min(n_tokens, t0 + chunk);
+        for (int64_t p = p0; p < p1; p++) {
+            const uint8_t * panel = static_cast<const uint8_t *>(w->data) + p * panel_size;
+            float tile[2 * CLIP_PANEL_ROWS];
+            int64_t t = t0;
+            for (; t + 2 <= t1; t += 2) {
+                const clip_block_q8 * xs[2] = {xq + t * n_blocks, xq + (t + 1) * n_blocks};
+                panel_dot<2>(w->type, panel, n_blocks, xs, tile);
+                for (int r = 0; r < CLIP_PANEL_ROWS; r++) {
+                    out[t * n_out + p * CLIP_PANEL_ROWS + r] = tile[r];
+                    out[(t + 1) * n_out + p * CLIP_PANEL_ROWS + r] = tile[CLIP_PANEL_ROWS + r];
+                }
+            }
+            if (t < t1) {
+                const clip_block_q8 * xs[1] = {xq + t * n_blocks};
+                panel_dot<1>(w->type, panel, n_blocks, xs, tile);
+                for (int r = 0; r < CLIP_PANEL_ROWS; r++) {
+                    out[t * n_out + p * CLIP_PANEL_ROWS + r] = tile[r];
+                }
+            }
         }
     }
+}
 
-    // vision model
-    if (new_clip->has_vision_encoder) {
-        // load vision model
-        auto & vision_model = new_clip->vision_model;
-        auto & hparams = vision_model.hparams;
-        hparams.hidden_size = get_u32(ctx, format(KEY_N_EMBD, "vision"));
-        hparams.n_head = get_u32(ctx, format(KEY_N_HEAD, "vision"));
-        hparams.n_intermediate = get_u32(ctx, format(KEY_N_FF, "vision"));
-        hparams.n_layer = get_u32(ctx, format(KEY_N_BLOCK, "vision"));
-        hparams.image_size = get_u32(ctx, KEY_IMAGE_SIZE);
-        hparams.patch_size = get_u32(ctx, KEY_PATCH_SIZE);
-        hparams.projection_dim = get_u32(ctx, format(KEY_PROJ_DIM, "vision"));
-        hparams.eps = get_f32(ctx, format(KEY_LAYER_NORM_EPS, "vision"));
+//
+// model loading
+//
 
-        int idx_mean = get_key_idx(ctx, KEY_IMAGE_MEAN);
-        int idx_std = get_key_idx(ctx, KEY_IMAGE_STD);
-        for (int i = 0; i < 3; ++i) {
-            new_clip->image_mean[i] = ((float *)gguf_get_arr_data(ctx, idx_mean))[i];
-            new_clip->image_std[i] = ((float *)gguf_get_arr_data(ctx, idx_std))[i];
+// the metadata of a model file, without the tensor data
+static struct gguf_context * load_model_meta(const char * fname, struct ggml_context ** meta) {
+    struct gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ meta,
+    };
+
+    struct gguf_context * ctx = gguf_init_from_file(fname, params);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, fname);
+    }
+    return ctx;
+}
+
+// bounds checked reads of a GGUF file in memory
+struct gguf_buffer_reader {
+    const uint8_t * data;
+    size_t size;
+    size_t pos;
+
+    template <typename T> bool read(T & value) {
+        if (size - pos < sizeof(T)) {
+            return false;
         }
+        memcpy(&value, data + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
 
-        if (verbosity >= 2) {
-            printf("\n%s: vision model hparams\n", __func__);
-            printf("image_size         %d\n", hparams.image_size);
-            printf("patch_size         %d\n", hparams.patch_size);
-            printf("v_hidden_size      %d\n", hparams.hidden_size);
-            printf("v_n_intermediate   %d\n", hparams.n_intermediate);
-            printf("v_projection_dim   %d\n", hparams.projection_dim);
-            printf("v_n_head           %d\n", hparams.n_head);
-            printf("v_n_layer          %d\n", hparams.n_layer);
+    bool read(std::string & str) {
+        uint64_t n = 0;
+        if (!read(n) || size - pos < n) {
+            return false;
         }
+        str.assign(reinterpret_cast<const char *>(data + pos), n);
+        pos += n;
+        return true;
+    }
+};
 
-        vision_model.patch_embeddings = get_tensor(new_clip->ctx, TN_PATCH_EMBD);
-        vision_model.class_embedding = get_tensor(new_clip->ctx, TN_CLASS_EMBD);
-        vision_model.position_embeddings = get_tensor(new_clip->ctx, format(TN_POS_EMBD, "v"));
-        vision_model.pre_ln_w = get_tensor(new_clip->ctx, format(TN_LN_PRE, "v", "weight"));
-        vision_model.pre_ln_b = get_tensor(new_clip->ctx, format(TN_LN_PRE, "v", "bias"));
-        vision_model.post_ln_w = get_tensor(new_clip->ctx, format(TN_LN_POST, "v", "weight"));
-        vision_model.post_ln_b = get_tensor(new_clip->ctx, format(TN_LN_POST, "v", "bias"));
-        vision_model.projection = get_tensor(new_clip->ctx, TN_VIS_PROJ);
-        vision_model.layers.resize(hparams.n_layer);
-        for (int il = 0; il < hparams.n_layer; ++il) {
-            auto & layer = vision_model.layers[il];
-            layer.k_w = get_tensor(new_clip->ctx, format(TN_ATTN_K, "v", il, "weight"));
-            layer.q_w = get_tensor(new_clip->ctx, format(TN_ATTN_Q, "v", il, "weight"));
-            layer.v_w = get_tensor(new_clip->ctx, format(TN_ATTN_V, "v", il, "weight"));
-            layer.o_w = get_tensor(new_clip->ctx, format(TN_ATTN_OUTPUT, "v", il, "weight"));
-            layer.ln_1_w = get_tensor(new_clip->ctx, format(TN_LN_1, "v", il, "weight"));
-            layer.ln_2_w = get_tensor(new_clip->ctx, format(TN_LN_2, "v", il, "weight"));
-            layer.ff_i_w = get_tensor(new_clip->ctx, format(TN_FFN_DOWN, "v", il, "weight"));
-            layer.ff_o_w = get_tensor(new_clip->ctx, format(TN_FFN_UP, "v", il, "weight"));
-            layer.k_b = get_tensor(new_clip->ctx, format(TN_ATTN_K, "v", il, "bias"));
-            layer.q_b = get_tensor(new_clip->ctx, format(TN_ATTN_Q, "v", il, "bias"));
-            layer.v_b = get_tensor(new_clip->ctx, format(TN_ATTN_V, "v", il, "bias"));
-            layer.o_b = get_tensor(new_clip->ctx, format(TN_ATTN_OUTPUT, "v", il, "bias"));
-            layer.ln_1_b = get_tensor(new_clip->ctx, format(TN_LN_1, "v", il, "bias"));
-            layer.ln_2_b = get_tensor(new_clip->ctx, format(TN_LN_2, "v", il, "bias"));
-            layer.ff_i_b = get_tensor(new_clip->ctx, format(TN_FFN_DOWN, "v", il, "bias"));
-            layer.ff_o_b = get_tensor(new_clip->ctx, format(TN_FFN_UP, "v", il, "bias"));
+// size of the scalar gguf types, 0 for strings and arrays
+static size_t gguf_scalar_size(const uint32_t type) {
+    switch (type) {
+    case GGUF_TYPE_UINT8:
+    case GGUF_TYPE_INT8:
+    case GGUF_TYPE_BOOL:
+        return 1;
+    case GGUF_TYPE_UINT16:
+    case GGUF_TYPE_INT16:
+        return 2;
+    case GGUF_TYPE_UINT32:
+    case GGUF_TYPE_INT32:
+    case GGUF_TYPE_FLOAT32:
+        return 4;
+    case GGUF_TYPE_UINT64:
+    case GGUF_TYPE_INT64:
+    case GGUF_TYPE_FLOAT64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+// the key-value pairs of a GGUF buffer are copied into a gguf_context, its tensor infos become tensors of meta without
+// data. the offsets of their data from the start of the buffer go to offsets, as gguf_context can't hold them. only
+// versions 2 and 3 of the format are supported
+static struct gguf_context * load_model_meta_from_buffer(const uint8_t * data, const size_t size,
+                                                         struct ggml_context ** meta, std::vector<size_t> & offsets) {
+    gguf_buffer_reader reader = {data, size, 0};
+
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint64_t n_tensors = 0;
+    uint64_t n_kv = 0;
+    if (!reader.read(magic) || memcmp(&magic, "GGUF", 4) != 0 || !reader.read(version) || !reader.read(n_tensors) ||
+        !reader.read(n_kv)) {
+        fprintf(stderr, "%s: not a GGUF buffer\n", __func__);
+        return nullptr;
+    }
+    if (version < 2 || version > 3) {
+        fprintf(stderr, "%s: unsupported GGUF version %u\n", __func__, version);
+        return nullptr;
+    }
+    // every tensor info and key-value pair takes at least a few bytes, this bounds the counts before allocating
+    if (n_tensors > size / 8 || n_kv > size / 8) {
+        fprintf(stderr, "%s: invalid counts of tensors and key-value pairs\n", __func__);
+        return nullptr;
+    }
+
+    struct gguf_context * ctx = gguf_init_empty();
+    size_t alignment = GGUF_DEFAULT_ALIGNMENT;
+    bool ok = true;
+
+    for (uint64_t i = 0; ok && i < n_kv; ++i) {
+        std::string key;
+        uint32_t type = 0;
+        ok = reader.read(key) && reader.read(type);
+        if (!ok) {
+            break;
+        }
+
+        if (type == GGUF_TYPE_STRING) {
+            std::string value;
+            ok = reader.read(value);
+            if (ok) {
+                gguf_set_val_str(ctx, key.c_str(), value.c_str());
+            }
+        } else if (type == GGUF_TYPE_ARRAY) {
+            uint32_t elem_type = 0;
+            uint64_t n = 0;
+            ok = reader.read(elem_type) && reader.read(n) && n <= size;
+            if (ok && elem_type == GGUF_TYPE_STRING) {
+                std::vector<std::string> values(n);
+                std::vector<const char *> ptrs(n);
+                for (uint64_t k = 0; ok && k < n; k++) {
+                    ok = reader.read(values[k]);
+                    ptrs[k] = values[k].c_str();
+                }
+                if (ok) {
+                    gguf_set_arr_str(ctx, key.c_str(), ptrs.data(), n);
+                }
+            } else if (ok) {
+                const size_t elem_size = gguf_scalar_size(elem_type);
+                ok = elem_size > 0 && n <= (reader.size - reader.pos) / elem_size;
+                if (ok) {
+                    gguf_set_arr_data(ctx, key.c_str(), (enum gguf_type)elem_type, data + reader.pos, n);
+                    reader.pos += n * elem_size;
+                }
+            }
+        } else {
+            const size_t value_size = gguf_scalar_size(type);
+            ok = value_size > 0 && reader.size - reader.pos >= value_size;
+            if (!ok) {
+                break;
+            }
+            union {
+                uint8_t u8;
+                int8_t i8;
+                uint16_t u16;
+                int16_t i16;
+                uint32_t u32;
+                int32_t i32;
+                float f32;
+                uint64_t u64;
+                int64_t i64;
+                double f64;
+            } value;
+            memcpy(&value, data + reader.pos, value_size);
+            reader.pos += value_size;
+            switch (type) {
+            case GGUF_TYPE_UINT8:
+                gguf_set_val_u8(ctx, key.c_str(), value.u8);
+                break;
+            case GGUF_TYPE_INT8:
+                gguf_set_val_i8(ctx, key.c_str(), value.i8);
+                break;
+            case GGUF_TYPE_BOOL:
+                gguf_set_val_bool(ctx, key.c_str(), value.u8 != 0);
+                break;
+            case GGUF_TYPE_UINT16:
+                gguf_set_val_u16(ctx, key.c_str(), value.u16);
+                break;
+            case GGUF_TYPE_INT16:
+                gguf_set_val_i16(ctx, key.c_str(), value.i16);
+                break;
+            case GGUF_TYPE_UINT32:
+                gguf_set_val_u32(ctx, key.c_str(), value.u32);
+                break;
+            case GGUF_TYPE_INT32:
+                gguf_set_val_i32(ctx, key.c_str(), value.i32);
+                break;
+            case GGUF_TYPE_FLOAT32:
+                gguf_set_val_f32(ctx, key.c_str(), value.f32);
+                break;
+            case GGUF_TYPE_UINT64:
+                gguf_set_val_u64(ctx, key.c_str(), value.u64);
+                break;
+            case GGUF_TYPE_INT64:
+                gguf_set_val_i64(ctx, key.c_str(), value.i64);
+                break;
+            case GGUF_TYPE_FLOAT64:
+                gguf_set_val_f64(ctx, key.c_str(), value.f64);
+                break;
+            }
+            if (key == "general.alignment" && type == GGUF_TYPE_UINT32) {
+                alignment = value.u32;
+                ok = alignment > 0 && (alignment & (alignment - 1)) == 0;
+            }
         }
     }
 
-    ggml_free(meta);
+    // tensor infos
+    struct tensor_info {
+        std::string name;
+        uint32_t n_dims;
+        int64_t ne[GGML_MAX_DIMS];
+        uint32_t type;
+        uint64_t offset;
+    };
+    std::vector<tensor_info> infos(ok ? n_tensors : 0);
+    for (auto & info : infos) {
+        ok = reader.read(info.name) && info.name.size() < GGML_MAX_NAME && reader.read(info.n_dims) &&
+             info.n_dims >= 1 && info.n_dims <= GGML_MAX_DIMS;
+        // no type takes less than 2 bits per value, which bounds the number of values by the size of the buffer
+        uint64_t n_elements = 1;
+        for (uint32_t d = 0; ok && d < GGML_MAX_DIMS; d++) {
+            uint64_t ne = 1;
+            ok = d >= info.n_dims || (reader.read(ne) && (ne == 0 || n_elements <= size * 4 / ne));
+            n_elements *= ne;
+            info.ne[d] = (int64_t)ne;
+        }
+        ok = ok && reader.read(info.type) && info.type < GGML_TYPE_COUNT && ggml_blck_size((ggml_type)info.type) > 0 &&
+             info.ne[0] % ggml_blck_size((ggml_type)info.type) == 0 && reader.read(info.offset);
+        if (!ok) {
+            break;
+        }
+    }
 
-    new_clip->ctx_gguf = ctx;
+    if (ok) {
+        const size_t data_offset = GGML_PAD(reader.pos, alignment);
+        struct ggml_init_params params = {
+            /*.mem_size   = */ (infos.size() + 1) * ggml_tensor_overhead(),
+            /*.mem_buffer = */ NULL,
+            /*.no_alloc   = */ true,
+        };
+        *meta = ggml_init(params);
+
+        offsets.clear();
+        for (const auto & info : infos) {
+            struct ggml_tensor * t = ggml_new_tensor(*meta, (ggml_type)info.type, info.n_dims, info.ne);
+            ggml_set_name(t, info.name.c_str());
+            const bool in_bounds = data_offset <= size && info.offset <= size - data_offset &&
+                                   ggml_nbytes(t) <= size - data_offset - info.offset;
+            if (!in_bounds || gguf_find_tensor(ctx, info.name.c_str()) != -1) {
+                ok = false;
+                break;
+            }
+            gguf_add_tensor(ctx, t);
+            offsets.push_back(data_offset + info.offset);
+        }
+        if (!ok) {
+            ggml_free(*meta);
+        }
+    }
 
-    const size_t mem_req = get_mem_req_by_size(new_clip);
-    new_clip->buf_compute.resize(mem_req);
-    if (verbosity >= 1) {
-        printf("\n%s: %zu MB of memory allocated\n", __func__, mem_req / 1024 / 1024);
+    if (!ok) {
+        fprintf(stderr, "%s: invalid or truncated GGUF buffer\n", __func__);
+        gguf_free(ctx);
+        return nullptr;
     }
+    return ctx;
+}
 
-    return new_clip;
+// tensors of the text tower are t.* and the text projection, those of the vision tower v.* and the visual projection
+static bool is_tower_tensor_loaded(const char * name, const bool load_text, const bool load_vision) {
+    if (strncmp(name, "t.", 2) == 0 || strcmp(name, TN_TEXT_PROJ) == 0) {
+        return load_text;
+    }
+    if (strncmp(name, "v.", 2) == 0 || strcmp(name, TN_VIS_PROJ) == 0) {
+        return load_vision;
+    }
+    return true;
 }
 
-bool clip_tokenize(const clip_ctx * ctx, const char * text, struct clip_tokens * tokens) {
-    if (!ctx->has_text_encoder) {
-        printf("This GGUF file seems to have no text encoder\n");
+// the towers of the file that the params ask for. fails if that leaves none
+static bool model_towers(const struct gguf_context * ctx, const clip_model_load_params & params, bool & load_text,
+                         bool & load_vision) {
+    load_text = params.text_tower && gguf_get_val_bool(ctx, get_key_idx(ctx, KEY_HAS_TEXT_ENC));
+    load_vision = params.vision_tower && gguf_get_val_bool(ctx, get_key_idx(ctx, KEY_HAS_VIS_ENC));
+    if (!load_text && !load_vision) {
+        fprintf(stderr, "%s: the model has none of the requested towers\n", __func__);
         return false;
     }
+    return true;
+}
 
-    std::vector<std::string> words;
+// the type of every tensor once loaded, GGML_TYPE_COUNT for those of towers that are not. only f32 and f16 tensors
+// can be converted. returns the bytes the loaded tensors take
+static size_t model_tensor_types(const struct gguf_context * ctx, struct ggml_context * meta,
+                                 const std::vector<quantize_rule> & rules, const bool load_text, const bool load_vision,
+                                 std::vector<ggml_type> & types) {
+    const int n_tensors = gguf_get_n_tensors(ctx);
+    types.assign(n_tensors, GGML_TYPE_COUNT);
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
-
-        // Generate the subpattern from the special_tokens vector if it's not empty
-        if (!ctx->vocab.special_tokens.empty()) {
-            std::string special_tokens_subpattern;
-            for (const auto & token : ctx->vocab.special_tokens) {
-                if (!special_tokens_subpattern.empty()) {
-                    special_tokens_subpattern += "|";
-                }
-                special_tokens_subpattern += token;
-            }
+    size_t size = 0;
+    for (int i = 0; i < n_tensors; ++i) {
+        const char * name = gguf_get_tensor_name(ctx, i);
+        if (!is_tower_tensor_loaded(name, load_text, load_vision)) {
+            continue;
+        }
 
-            // Modify the regex pattern with the generated special tokens subpattern
-            pat = special_tokens_subpattern + "|" + pat;
+        const struct ggml_tensor * cur = ggml_get_tensor(meta, name);
+        types[i] = cur->type;
+        if (!rules.empty() && (cur->type == GGML_TYPE_F32 || cur->type == GGML_TYPE_F16)) {
+            types[i] = quantize_tensor_type(rules, name, cur);
         }
+        size += GGML_PAD(ggml_type_size(types[i]) * ggml_nelements(cur) / ggml_blck_size(types[i]), GGML_MEM_ALIGN);
+    }
+    return size;
+}
+
+// a range of the model file read into memory
+struct FileReadJob {
+    size_t offset;
+    size_t size;
+    uint8_t * dst;
+};
+
+struct FileReadArgs {
+    int fd;
+    const std::vector<FileReadJob> * jobs;
+    std::atomic<size_t> next;
+    std::atomic<bool> failed;
+};
+
+#ifndef _WIN32
+// each thread takes the next job until none is left, so that large tensors and small ones balance out
+static void read_file_jobs(void * arg, size_t, size_t) {
+    FileReadArgs * args = static_cast<FileReadArgs *>(arg);
+    const std::vector<FileReadJob> & jobs = *args->jobs;
+    for (size_t i = args->next++; i < jobs.size() && !args->failed; i = args->next++) {
+        const FileReadJob & job = jobs[i];
+        for (size_t done = 0; done < job.size;) {
+            const ssize_t n = pread(args->fd, job.dst + done, job.size - done, job.offset + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                args->failed = true;
+                break;
+            }
+            done += n;
+        }
+    }
+}
+#endif
+
+// reads ranges of a file with up to n_threads reads in flight, ranges over 4 MB split into chunks. the kernel is told
+// about every range up front, so that it can read ahead of the threads
+static bool read_file_ranges(const char * fname, const std::vector<FileReadJob> & ranges, const int n_threads) {
+    const size_t chunk_size = 4 * 1024 * 1024;
+    std::vector<FileReadJob> jobs;
+    for (const auto & range : ranges) {
+        for (size_t done = 0; done < range.size; done += chunk_size) {
+            jobs.push_back({range.offset + done, std::min(chunk_size, range.size - done), range.dst + done});
+        }
+    }
+
+#ifdef _WIN32
+    std::ifstream fin(fname, std::ios::binary);
+    for (const auto & job : jobs) {
+        fin.seekg(job.offset, std::ios::beg);
+        fin.read(reinterpret_cast<char *>(job.dst), job.size);
+    }
+    return fin.good();
+#else
+    const int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (const auto & range : ranges) {
+        posix_fadvise(fd, range.offset, range.size, POSIX_FADV_WILLNEED);
+    }
+#endif
+
+    FileReadArgs args;
+    args.fd = fd;
+    args.jobs = &jobs;
+    args.next = 0;
+    args.failed = false;
+    const int num_threads = std::max(1, std::min(n_threads, (int)jobs.size()));
+    parallel_for(num_threads, num_threads, 1, read_file_jobs, &args);
+    close(fd);
+    return !args.failed;
+#endif
+}
+
+// asks the kernel to read ranges of a file ahead, before they are needed
+static void prefetch_file_ranges(const char * fname, const std::vector<FileReadJob> & ranges) {
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+    const int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    for (const auto & range : ranges) {
+        posix_fadvise(fd, range.offset, range.size, POSIX_FADV_WILLNEED);
+    }
+    close(fd);
+#endif
+}
+
+// where the tensor data of a model is: a file, or a buffer holding a whole file
+struct clip_model_source {
+    const char * fname = nullptr;
+    const uint8_t * buffer = nullptr;
+    size_t buffer_size = 0;
+    std::vector<size_t> offsets; // of the data of every tensor, from the start of the file or buffer
+};
+
+static clip_model_source model_file_source(const char * fname, const struct gguf_context * ctx) {
+    clip_model_source source;
+    source.fname = fname;
+    const int n_tensors = gguf_get_n_tensors(ctx);
+    for (int i = 0; i < n_tensors; ++i) {
+        source.offsets.push_back(gguf_get_data_offset(ctx) + gguf_get_tensor_offset(ctx, i));
+    }
+    return source;
+}
+
+// 64-bit FNV-1a hash of the metadata of a model, the recipe its weights are converted with and the first bytes of the
+// data of every tensor, so that checkpoints with the same architecture differ. the tensors of towers that are not
+// loaded count as well, which gives every load of a file with a recipe the same value. 0 if the file can't be read
+static uint64_t model_fingerprint(const clip_model_source & source, const struct gguf_context * ctx,
+                                  struct ggml_context * meta, const std::string & recipe_text) {
+    const size_t n_sample = 64;
+
+    std::vector<uint8_t> key(gguf_get_meta_size(ctx));
+    gguf_get_meta_data(ctx, key.data());
+    key.insert(key.end(), recipe_text.begin(), recipe_text.end());
+
+    const int n_tensors = gguf_get_n_tensors(ctx);
+    std::vector<uint8_t> samples(n_tensors * n_sample, 0);
+    std::vector<FileReadJob> reads;
+    for (int i = 0; i < n_tensors; ++i) {
+        const struct ggml_tensor * t = ggml_get_tensor(meta, gguf_get_tensor_name(ctx, i));
+        const size_t size = std::min(n_sample, ggml_nbytes(t));
+        if (source.buffer) {
+            memcpy(samples.data() + i * n_sample, source.buffer + source.offsets[i], size);
+        } else {
+            reads.push_back({source.offsets[i], size, samples.data() + i * n_sample});
+        }
+    }
+    if (!reads.empty() && !read_file_ranges(source.fname, reads, 1)) {
+        return 0;
+    }
+    key.insert(key.end(), samples.begin(), samples.end());
+
+    uint64_t h = 14695981039346656037ULL;
+    for (const uint8_t c : key) {
+        h = (h ^ c) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// create ggml_context containing the tensors and their data from the metadata of the model, which it takes. with
+// rules, weights are converted as they are loaded, like clip_model_quantize_recipe would. tensors that are not
+// converted are used in place from a buffer, or from a mapping of the file with use_mmap, if they are aligned
+static struct clip_ctx * clip_model_load_impl(const clip_model_source & source, struct gguf_context * ctx,
+                                              struct ggml_context * meta, const clip_model_load_params & load_params,
+                                              const std::vector<quantize_rule> & rules) {
+    const int verbosity = load_params.verbosity;
+    const int n_threads =
+        load_params.n_threads > 0 ? load_params.n_threads : std::max(1, (int)std::thread::hardware_concurrency());
+
+    if (verbosity >= 1) {
+        const int n_tensors = gguf_get_n_tensors(ctx);
+        const int n_kv = gguf_get_n_kv(ctx);
+        const int ftype = get_u32(ctx, KEY_FTYPE);
+        const std::string ftype_str = get_ftype(ftype);
+        const int idx_desc = get_key_idx(ctx, KEY_DESCRIPTION);
+        const std::string description = gguf_get_val_str(ctx, idx_desc);
+        const int idx_name = gguf_find_key(ctx, KEY_NAME);
+        if (idx_name != -1) { // make name optional temporarily as some of the uploaded models missing it due to a bug
+            const std::string name = gguf_get_val_str(ctx, idx_name);
+            printf("%s: model name:   %s\n", __func__, name.c_str());
+        }
+        printf("%s: description:  %s\n", __func__, description.c_str());
+        printf("%s: GGUF version: %d\n", __func__, gguf_get_version(ctx));
+        printf("%s: alignment:    %zu\n", __func__, gguf_get_alignment(ctx));
+        printf("%s: n_tensors:    %d\n", __func__, n_tensors);
+        printf("%s: n_kv:         %d\n", __func__, n_kv);
+        printf("%s: ftype:        %s\n", __func__, ftype_str.c_str());
+        const int idx_recipe = gguf_find_key(ctx, KEY_QUANT_RECIPE);
+        if (idx_recipe != -1) {
+            printf("%s: recipe:       %s\n", __func__, gguf_get_val_str(ctx, idx_recipe));
+        }
+        printf("\n");
+    }
+
+    // kv
+    if (verbosity >= 3) {
+        const int n_kv = gguf_get_n_kv(ctx);
+
+        for (int i = 0; i < n_kv; ++i) {
+            const char * key = gguf_get_key(ctx, i);
+
+            printf("%s: kv[%d]: key = %s\n", __func__, i, key);
+        }
+        printf("\n");
+    }
+
+    bool load_text = false;
+    bool load_vision = false;
+    if (!model_towers(ctx, load_params, load_text, load_vision)) {
+        ggml_free(meta);
+        gguf_free(ctx);
+        return nullptr;
+    }
+
+    // data, sized by the types the tensors are converted to
+    std::vector<ggml_type> types;
+    const size_t model_size = model_tensor_types(ctx, meta, rules, load_text, load_vision, types);
+    if (verbosity >= 3) {
+        const int n_tensors = gguf_get_n_tensors(ctx);
+        for (int i = 0; i < n_tensors; ++i) {
+            if (types[i] == GGML_TYPE_COUNT) {
+                continue;
+            }
+            const struct ggml_tensor * cur = ggml_get_tensor(meta, gguf_get_tensor_name(ctx, i));
+            const size_t tensor_size = ggml_type_size(types[i]) * ggml_nelements(cur) / ggml_blck_size(types[i]);
+            printf("%s: tensor[%d]: n_dims = %d, name = %s, tensor_size=%zu, padded_size=%zu, offset=%zu\n", __func__, i,
+                   cur->n_dims, cur->name, tensor_size, GGML_PAD(tensor_size, GGML_MEM_ALIGN),
+                   gguf_get_tensor_offset(ctx, i));
+        }
+    }
+
+    clip_ctx * new_clip = new clip_ctx;
+    new_clip->ctx = NULL;
+    new_clip->ctx_gguf = ctx;
+
+    // model size and capabilities
+    {
+        new_clip->has_text_encoder = load_text;
+        new_clip->has_vision_encoder = load_vision;
+
+        int idx = get_key_idx(ctx, KEY_USE_GELU);
+        new_clip->use_gelu = gguf_get_val_bool(ctx, idx);
+
+        if (verbosity >= 1) {
+            printf("%s: text_encoder:   %d\n", __func__, new_clip->has_text_encoder);
+            printf("%s: vision_encoder: %d\n", __func__, new_clip->has_vision_encoder);
+            printf("%s: model size:     %.2f MB\n", __func__, (model_size / 1024.0 / 1024.0));
+            printf("%s: metadata size:  %.2f MB\n", __func__, ggml_get_mem_size(meta) / 1024.0 / 1024.0);
+        }
+    }
+
+    // load tensors
+    {
+        const int n_tensors = gguf_get_n_tensors(ctx);
+        const char * fname = source.fname;
+
+        // the model in memory, if it is
+        const uint8_t * base = source.buffer;
+        size_t base_size = source.buffer_size;
+#ifndef _WIN32
+        if (!base && load_params.use_mmap) {
+            const int fd = open(fname, O_RDONLY);
+            struct stat st;
+            void * addr = fd >= 0 && fstat(fd, &st) == 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (addr != MAP_FAILED) {
+                new_clip->mapping = addr;
+                new_clip->mapping_size = st.st_size;
+                base = static_cast<const uint8_t *>(addr);
+                base_size = st.st_size;
+            } else if (verbosity >= 1) {
+                printf("%s: failed to map '%s', reading it instead\n", __func__, fname);
+            }
+        }
+#endif
+
+        // tensors used in place take no memory in the context
+        std::vector<bool> in_place(n_tensors, false);
+        size_t ctx_size = 0;
+        for (int i = 0; i < n_tensors; ++i) {
+            if (types[i] == GGML_TYPE_COUNT) {
+                continue;
+            }
+            const struct ggml_tensor * t = ggml_get_tensor(meta, gguf_get_tensor_name(ctx, i));
+            if (base && (source.offsets[i] > base_size || ggml_nbytes(t) > base_size - source.offsets[i])) {
+                printf("%s: tensor %s is out of the bounds of the model\n", __func__, ggml_get_name(t));
+                ggml_free(meta);
+                clip_free(new_clip);
+                return nullptr;
+            }
+            in_place[i] = base && types[i] == t->type && (uintptr_t)(base + source.offsets[i]) % GGML_MEM_ALIGN == 0;
+            ctx_size += ggml_tensor_overhead();
+            if (!in_place[i]) {
+                ctx_size += GGML_PAD(ggml_type_size(types[i]) * ggml_nelements(t) / ggml_blck_size(types[i]), GGML_MEM_ALIGN);
+            }
+        }
+
+        struct ggml_init_params params = {
+            .mem_size = ctx_size,
+            .mem_buffer = NULL,
+            .no_alloc = false,
+        };
+
+        new_clip->ctx = ggml_init(params);
+        if (!new_clip->ctx) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            ggml_free(meta);
+            clip_free(new_clip);
+            return nullptr;
+        }
+
+        // tensors kept as they are go straight to their memory, all at once across threads. tensors to convert are
+        // read into a buffer one at a time, the next one prefetched while the current one is converted. in memory,
+        // tensors that can't be used in place are copied or converted from where they are
+        std::vector<FileReadJob> direct_reads;
+        std::vector<std::pair<struct ggml_tensor *, struct ggml_tensor *>> conversions; // file tensor, loaded tensor
+        std::vector<FileReadJob> conversion_reads;
+        size_t n_in_place = 0;
+        size_t size_in_place = 0;
+        size_t size_read = 0;
+        const int64_t t_start_us = ggml_time_us();
+
+        for (int i = 0; i < n_tensors; ++i) {
+            if (types[i] == GGML_TYPE_COUNT) {
+                continue;
+            }
+
+            const char * name = gguf_get_tensor_name(ctx, i);
+            struct ggml_tensor * t = ggml_get_tensor(meta, name);
+            const size_t offset = source.offsets[i];
+
+            ggml_set_no_alloc(new_clip->ctx, in_place[i]);
+            struct ggml_tensor * cur = ggml_new_tensor(new_clip->ctx, types[i], t->n_dims, t->ne);
+            ggml_set_name(cur, name);
+            if (in_place[i]) {
+                cur->data = const_cast<uint8_t *>(base) + offset;
+                n_in_place++;
+                size_in_place += ggml_nbytes(t);
+#ifndef _WIN32
+                if (new_clip->mapping) {
+                    // the pages of the tensor, the first one rounded down to the page size
+                    const size_t page_size = sysconf(_SC_PAGESIZE);
+                    const size_t page_offset = offset / page_size * page_size;
+                    madvise(static_cast<uint8_t *>(new_clip->mapping) + page_offset, offset + ggml_nbytes(t) - page_offset,
+                            MADV_WILLNEED);
+                }
+#endif
+            } else if (base && cur->type == t->type) {
+                memcpy(cur->data, base + offset, ggml_nbytes(t));
+            } else if (base) {
+                conversions.push_back({t, cur});
+                conversion_reads.push_back({offset, ggml_nbytes(t), const_cast<uint8_t *>(base) + offset});
+            } else if (cur->type == t->type) {
+                direct_reads.push_back({offset, ggml_nbytes(t), static_cast<uint8_t *>(cur->data)});
+                size_read += ggml_nbytes(t);
+            } else {
+                conversions.push_back({t, cur});
+                conversion_reads.push_back({offset, ggml_nbytes(t), NULL});
+                size_read += ggml_nbytes(t);
+            }
+        }
+        ggml_set_no_alloc(new_clip->ctx, false);
+
+        if (!base && !conversion_reads.empty()) {
+            prefetch_file_ranges(fname, {conversion_reads[0]});
+        }
+        int64_t t_read_us = ggml_time_us();
+        if (!base && !read_file_ranges(fname, direct_reads, n_threads)) {
+            fprintf(stderr, "%s: failed to read the tensors of '%s'\n", __func__, fname);
+            ggml_free(meta);
+            clip_free(new_clip);
+            return nullptr;
+        }
+
+        t_read_us = ggml_time_us() - t_read_us;
+
+        std::vector<uint8_t> read_buf;
+        size_t size_org = 0;
+        size_t size_new = 0;
+        for (size_t c = 0; c < conversions.size(); c++) {
+            struct ggml_tensor * t = conversions[c].first;
+            struct ggml_tensor * cur = conversions[c].second;
+            if (base) {
+                convert_tensor(n_threads, t, conversion_reads[c].dst, cur);
+                size_org += ggml_nbytes(t);
+                size_new += ggml_nbytes(cur);
+                continue;
+            }
+
+            read_buf.resize(ggml_nbytes(t));
+            conversion_reads[c].dst = read_buf.data();
+            const int64_t t_start_read_us = ggml_time_us();
+            if (!read_file_ranges(fname, {conversion_reads[c]}, n_threads)) {
+                fprintf(stderr, "%s: failed to read tensor %s\n", __func__, ggml_get_name(cur));
+                ggml_free(meta);
+                clip_free(new_clip);
+                return nullptr;
+            }
+            t_read_us += ggml_time_us() - t_start_read_us;
+            if (c + 1 < conversions.size()) {
+                prefetch_file_ranges(fname, {conversion_reads[c + 1]});
+            }
+
+            convert_tensor(n_threads, t, read_buf.data(), cur);
+            size_org += ggml_nbytes(t);
+            size_new += ggml_nbytes(cur);
+            if (verbosity >= 3) {
+                printf("%s: %s converted from %s to %s\n", __func__, ggml_get_name(cur), ggml_type_name(t->type),
+                       ggml_type_name(cur->type));
+            }
+        }
+
+        if (verbosity >= 1) {
+            const double t_read_ms = t_read_us / 1000.0;
+            printf("%s: tensors loaded in %.2f ms", __func__, (ggml_time_us() - t_start_us) / 1000.0);
+            if (!base) {
+                printf(", %.2f MB read in %.2f ms (%.2f MB/s) with %d threads", size_read / 1024.0 / 1024.0, t_read_ms,
+                       size_read / 1024.0 / 1024.0 / std::max(t_read_ms / 1000.0, 1e-6), n_threads);
+            }
+            if (n_in_place > 0) {
+                printf(", %zu tensors of %.2f MB used in place", n_in_place, size_in_place / 1024.0 / 1024.0);
+            }
+            printf("\n");
+        }
+        if (!conversions.empty() && verbosity >= 1) {
+            printf("%s: converted %zu weights from %.2f MB to %.2f MB (%s)\n", __func__, conversions.size(),
+                   size_org / 1024.0 / 1024.0, size_new / 1024.0 / 1024.0, quantize_recipe_text(rules).c_str());
+        }
+    }
+
+    // text model
+    if (new_clip->has_text_encoder) {
+        // load text model
+        auto & text_model = new_clip->text_model;
+        auto & hparams = text_model.hparams;
+        hparams.hidden_size = get_u32(ctx, format(KEY_N_EMBD, "text"));
+        hparams.n_head = get_u32(ctx, format(KEY_N_HEAD, "text"));
+        hparams.n_intermediate = get_u32(ctx, format(KEY_N_FF, "text"));
+        hparams.n_layer = get_u32(ctx, format(KEY_N_BLOCK, "text"));
+        hparams.num_positions = get_u32(ctx, KEY_N_POSITIONS);
+        hparams.projection_dim = get_u32(ctx, format(KEY_PROJ_DIM, "text"));
+        hparams.eps = get_f32(ctx, format(KEY_LAYER_NORM_EPS, "text"));
+
+        const int idx_tokens = get_key_idx(ctx, KEY_TOKENS);
+        hparams.n_vocab = gguf_get_arr_n(ctx, idx_tokens);
+        auto & vocab = new_clip->vocab;
+        vocab.load_tokens(ctx, idx_tokens);
+
+        for (const char * special : {"<|startoftext|>", "<|endoftext|>"}) {
+            if (vocab.find(special, strlen(special)) >= 0) {
+                vocab.special_tokens.push_back(special);
+            }
+        }
+
+        for (int b = 0; b < 256; ++b) {
+            std::string sym;
+            utf8_append(sym, byte_to_unicode((uint8_t)b));
+            vocab.byte_ids[b] = vocab.find(sym);
+            sym += "</w>";
+            vocab.byte_ids_eow[b] = vocab.find(sym);
+        }
+
+        const int idx_merges = gguf_find_key(ctx, KEY_MERGES);
+        if (idx_merges != -1) {
+            vocab.load_merges(ctx, idx_merges);
+        } else if (verbosity >= 1) {
+            printf("%s: no BPE merges in file, falling back to greedy tokenization. re-convert the model for exact "
+                   "tokenization\n",
+                   __func__);
+        }
+
+        if (verbosity >= 2) {
+            printf("\n%s: text model hparams\n", __func__);
+            printf("n_vocab            %d\n", hparams.n_vocab);
+            printf("num_positions      %d\n", hparams.num_positions);
+            printf("t_hidden_size      %d\n", hparams.hidden_size);
+            printf("t_n_intermediate   %d\n", hparams.n_intermediate);
+            printf("t_projection_dim   %d\n", hparams.projection_dim);
+            printf("t_n_head           %d\n", hparams.n_head);
+            printf("t_n_layer          %d\n", hparams.n_layer);
+        }
+
+        text_model.token_embeddings = get_tensor(new_clip->ctx, format(TN_TOKEN_EMBD, "t"));
+        text_model.position_embeddings = get_tensor(new_clip->ctx, format(TN_POS_EMBD, "t"));
+        text_model.post_ln_w = get_tensor(new_clip->ctx, format(TN_LN_POST, "t", "weight"));
+        text_model.post_ln_b = get_tensor(new_clip->ctx, format(TN_LN_POST, "t", "bias"));
+        text_model.projection = get_tensor(new_clip->ctx, TN_TEXT_PROJ);
+        text_model.layers.resize(hparams.n_layer);
+        for (int il = 0; il < hparams.n_layer; ++il) {
+            auto & layer = text_model.layers[il];
+            layer.k_w = get_tensor(new_clip->ctx, format(TN_ATTN_K, "t", il, "weight"));
+            layer.q_w = get_tensor(new_clip->ctx, format(TN_ATTN_Q, "t", il, "weight"));
+            layer.v_w = get_tensor(new_clip->ctx, format(TN_ATTN_V, "t", il, "weight"));
+            layer.o_w = get_tensor(new_clip->ctx, format(TN_ATTN_OUTPUT, "t", il, "weight"));
+            layer.ln_1_w = get_tensor(new_clip->ctx, format(TN_LN_1, "t", il, "weight"));
+            layer.ln_2_w = get_tensor(new_clip->ctx, format(TN_LN_2, "t", il, "weight"));
+            layer.ff_i_w = get_tensor(new_clip->ctx, format(TN_FFN_DOWN, "t", il, "weight"));
+            layer.ff_o_w = get_tensor(new_clip->ctx, format(TN_FFN_UP, "t", il, "weight"));
+            layer.k_b = get_tensor(new_clip->ctx, format(TN_ATTN_K, "t", il, "bias"));
+            layer.q_b = get_tensor(new_clip->ctx, format(TN_ATTN_Q, "t", il, "bias"));
+            layer.v_b = get_tensor(new_clip->ctx, format(TN_ATTN_V, "t", il, "bias"));
+            layer.o_b = get_tensor(new_clip->ctx, format(TN_ATTN_OUTPUT, "t", il, "bias"));
+            layer.ln_1_b = get_tensor(new_clip->ctx, format(TN_LN_1, "t", il, "bias"));
+            layer.ln_2_b = get_tensor(new_clip->ctx, format(TN_LN_2, "t", il, "bias"));
+            layer.ff_i_b = get_tensor(new_clip->ctx, format(TN_FFN_DOWN, "t", il, "bias"));
+            layer.ff_o_b = get_tensor(new_clip->ctx, format(TN_FFN_UP, "t", il, "bias"));
+        }
+    }
+
+    // vision model
+    if (new_clip->has_vision_encoder) {
+        // load vision model
+        auto & vision_model = new_clip->vision_model;
+        auto & hparams = vision_model.hparams;
+        hparams.hidden_size = get_u32(ctx, format(KEY_N_EMBD, "vision"));
+        hparams.n_head = get_u32(ctx, format(KEY_N_HEAD, "vision"));
+        hparams.n_intermediate = get_u32(ctx, format(KEY_N_FF, "vision"));
+        hparams.n_layer = get_u32(ctx, format(KEY_N_BLOCK, "vision"));
+        hparams.image_size = get_u32(ctx, KEY_IMAGE_SIZE);
+        hparams.patch_size = get_u32(ctx, KEY_PATCH_SIZE);
+        hparams.projection_dim = get_u32(ctx, format(KEY_PROJ_DIM, "vision"));
+        hparams.eps = get_f32(ctx, format(KEY_LAYER_NORM_EPS, "vision"));
+
+        int idx_mean = get_key_idx(ctx, KEY_IMAGE_MEAN);
+        int idx_std = get_key_idx(ctx, KEY_IMAGE_STD);
+        for (int i = 0; i < 3; ++i) {
+            new_clip->image_mean[i] = ((float *)gguf_get_arr_data(ctx, idx_mean))[i];
+            new_clip->image_std[i] = ((float *)gguf_get_arr_data(ctx, idx_std))[i];
+        }
+
+        if (verbosity >= 2) {
+            printf("\n%s: vision model hparams\n", __func__);
+            printf("image_size         %d\n", hparams.image_size);
+            printf("patch_size         %d\n", hparams.patch_size);
+            printf("v_hidden_size      %d\n", hparams.hidden_size);
+            printf("v_n_intermediate   %d\n", hparams.n_intermediate);
+            printf("v_projection_dim   %d\n", hparams.projection_dim);
+            printf("v_n_head           %d\n", hparams.n_head);
+            printf("v_n_layer          %d\n", hparams.n_layer);
+        }
+
+        vision_model.patch_embeddings = get_tensor(new_clip->ctx, TN_PATCH_EMBD);
+        vision_model.class_embedding = get_tensor(new_clip->ctx, TN_CLASS_EMBD);
+        vision_model.position_embeddings = get_tensor(new_clip->ctx, format(TN_POS_EMBD, "v"));
+        vision_model.pre_ln_w = get_tensor(new_clip->ctx, format(TN_LN_PRE, "v", "weight"));
+        vision_model.pre_ln_b = get_tensor(new_clip->ctx, format(TN_LN_PRE, "v", "bias"));
+        vision_model.post_ln_w = get_tensor(new_clip->ctx, format(TN_LN_POST, "v", "weight"));
+        vision_model.post_ln_b = get_tensor(new_clip->ctx, format(TN_LN_POST, "v", "bias"));
+        vision_model.projection = get_tensor(new_clip->ctx, TN_VIS_PROJ);
+        vision_model.layers.resize(hparams.n_layer);
+        for (int il = 0; il < hparams.n_layer; ++il) {
+            auto & layer = vision_model.layers[il];
+            layer.k_w = get_tensor(new_clip->ctx, format(TN_ATTN_K, "v", il, "weight"));
+            layer.q_w = get_tensor(new_clip->ctx, format(TN_ATTN_Q, "v", il, "weight"));
+            layer.v_w = get_tensor(new_clip->ctx, format(TN_ATTN_V, "v", il, "weight"));
+            layer.o_w = get_tensor(new_clip->ctx, format(TN_ATTN_OUTPUT, "v", il, "weight"));
+            layer.ln_1_w = get_tensor(new_clip->ctx, format(TN_LN_1, "v", il, "weight"));
+            layer.ln_2_w = get_tensor(new_clip->ctx, format(TN_LN_2, "v", il, "weight"));
+            layer.ff_i_w = get_tensor(new_clip->ctx, format(TN_FFN_DOWN, "v", il, "weight"));
+            layer.ff_o_w = get_tensor(new_clip->ctx, format(TN_FFN_UP, "v", il, "weight"));
+            layer.k_b = get_tensor(new_clip->ctx, format(TN_ATTN_K, "v", il, "bias"));
+            layer.q_b = get_tensor(new_clip->ctx, format(TN_ATTN_Q, "v", il, "bias"));
+            layer.v_b = get_tensor(new_clip->ctx, format(TN_ATTN_V, "v", il, "bias"));
+            layer.o_b = get_tensor(new_clip->ctx, format(TN_ATTN_OUTPUT, "v", il, "bias"));
+            layer.ln_1_b = get_tensor(new_clip->ctx, format(TN_LN_1, "v", il, "bias"));
+            layer.ln_2_b = get_tensor(new_clip->ctx, format(TN_LN_2, "v", il, "bias"));
+            layer.ff_i_b = get_tensor(new_clip->ctx, format(TN_FFN_DOWN, "v", il, "bias"));
+            layer.ff_o_b = get_tensor(new_clip->ctx, format(TN_FFN_UP, "v", il, "bias"));
+        }
+    }
+
+    ggml_free(meta);
+
+    const size_t mem_req = get_mem_req_by_size(new_clip);
+    const size_t scr_req = get_scr_buf_req_by_size(new_clip);
+    new_clip->buf_compute.resize(mem_req);
+    new_clip->buf_scratch.resize(scr_req);
+    if (verbosity >= 1) {
+        printf("\n%s: %zu MB of memory allocated\n", __func__, (mem_req + scr_req) / 1024 / 1024);
+    }
+
+    return new_clip;
+}
+
+struct clip_model_load_params clip_model_load_default_params(void) {
+    struct clip_model_load_params params = {
+        /*.verbosity      = */ 1,
+        /*.text_tower     = */ true,
+        /*.vision_tower   = */ true,
+        /*.use_mmap       = */ false,
+        /*.n_threads      = */ 0,
+        /*.weight_type    = */ NULL,
+        /*.cache_dir      = */ NULL,
+        /*.memory_budget  = */ 0,
+        /*.repack_weights = */ false,
+    };
+    return params;
+}
+
+// <cache_dir>/<model name>-<hash>.gguf, the hash covering the size, modification time and metadata of the source
+// file, the expanded recipe and the towers loaded, so that a changed source or recipe misses the cache
+static bool model_cache_path(const char * fname, const struct gguf_context * ctx, const char * cache_dir,
+                             const std::string & recipe_text, const bool load_text, const bool load_vision,
+                             std::string & path) {
+    struct stat st;
+    if (stat(fname, &st) != 0) {
+        return false;
+    }
+
+    std::vector<uint8_t> key(gguf_get_meta_size(ctx));
+    gguf_get_meta_data(ctx, key.data());
+
+    const int64_t file_info[3] = {(int64_t)st.st_size, (int64_t)st.st_mtime, load_text + 2 * load_vision};
+    key.insert(key.end(), reinterpret_cast<const uint8_t *>(file_info), reinterpret_cast<const uint8_t *>(file_info + 3));
+    key.insert(key.end(), recipe_text.begin(), recipe_text.end());
+
+    uint64_t h = 14695981039346656037ULL; // FNV-1a
+    for (const uint8_t c : key) {
+        h = (h ^ c) * 1099511628211ULL;
+    }
+
+    std::string name = fname;
+    name = name.substr(name.find_last_of('/') + 1);
+    if (ends_with(name, ".gguf")) {
+        name.resize(name.size() - 5);
+    }
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "-%016llx.gguf", (unsigned long long)h);
+    path = std::string(cache_dir) + "/" + name + suffix;
+    return true;
+}
+
+// writes the tensors of a loaded model with the metadata of its source. written to a temporary file renamed into
+// place, so that concurrent loads never see a partial cache file
+static bool model_cache_save(const struct clip_ctx * ctx, const std::string & recipe_text, const std::string & path) {
+    struct gguf_context * ctx_out = gguf_init_empty();
+    gguf_set_kv(ctx_out, ctx->ctx_gguf);
+    gguf_set_val_u32(ctx_out, "general.quantization_version", GGML_QNT_VERSION);
+    gguf_set_val_str(ctx_out, KEY_QUANT_RECIPE, recipe_text.c_str());
+    gguf_set_val_bool(ctx_out, KEY_HAS_TEXT_ENC, ctx->has_text_encoder);
+    gguf_set_val_bool(ctx_out, KEY_HAS_VIS_ENC, ctx->has_vision_encoder);
+
+    std::map<ggml_type, int64_t> n_elements_by_type;
+    const int n_tensors = gguf_get_n_tensors(ctx->ctx_gguf);
+    for (int i = 0; i < n_tensors; ++i) {
+        const char * name = gguf_get_tensor_name(ctx->ctx_gguf, i);
+        struct ggml_tensor * t = ggml_get_tensor(ctx->ctx, name);
+        if (!t) {
+            continue; // a tower that is not loaded
+        }
+        if (ends_with(name, "weight") && t->n_dims == 2) {
+            n_elements_by_type[t->type] += ggml_nelements(t);
+        }
+        gguf_add_tensor(ctx_out, t);
+    }
+    const int ftype = dominant_ftype(n_elements_by_type);
+    if (ftype >= 0) {
+        gguf_set_val_u32(ctx_out, KEY_FTYPE, ftype);
+    }
+
+    char tmp_suffix[32];
+    snprintf(tmp_suffix, sizeof(tmp_suffix), ".tmp.%08x", (unsigned)std::random_device{}());
+    const std::string tmp_path = path + tmp_suffix;
+
+    bool ok = false;
+    FILE * f = fopen(tmp_path.c_str(), "wb");
+    if (f) {
+        fclose(f);
+        gguf_write_to_file(ctx_out, tmp_path.c_str(), false);
+        ok = rename(tmp_path.c_str(), path.c_str()) == 0;
+        if (!ok) {
+            remove(tmp_path.c_str());
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write the model cache '%s'\n", __func__, path.c_str());
+    }
+
+    gguf_free(ctx_out);
+    return ok;
+}
+
+// without a weight type, the types of the file and then smaller and smaller presets are tried until the weights fit the
+// memory budget. fails if none does
+static bool model_fit_budget(const struct gguf_context * ctx, struct ggml_context * meta,
+                             const clip_model_load_params & params, const bool load_text, const bool load_vision,
+                             std::vector<quantize_rule> & rules) {
+    if (params.memory_budget == 0) {
+        return true;
+    }
+
+    std::vector<ggml_type> types;
+    size_t size = model_tensor_types(ctx, meta, rules, load_text, load_vision, types);
+    const int n_presets = sizeof(quantize_presets) / sizeof(quantize_presets[0]);
+    for (int p = n_presets - 1; !params.weight_type && p >= 0 && size > params.memory_budget; p--) {
+        parse_quantize_recipe(quantize_presets[p].name, rules);
+        size = model_tensor_types(ctx, meta, rules, load_text, load_vision, types);
+        if (params.verbosity >= 1) {
+            printf("%s: %.2f MB with the %s preset\n", __func__, size / 1024.0 / 1024.0, quantize_presets[p].name);
+        }
+    }
+    if (size > params.memory_budget) {
+        fprintf(stderr, "%s: the weights take %.2f MB, over the budget of %.2f MB\n", __func__, size / 1024.0 / 1024.0,
+                params.memory_budget / 1024.0 / 1024.0);
+        return false;
+    }
+    return true;
+}
+
+static struct clip_ctx * model_load_file(const char * fname, const struct clip_model_load_params & params) {
+    std::vector<quantize_rule> rules;
+    if (params.weight_type && !parse_quantize_recipe(params.weight_type, rules)) {
+        return nullptr;
+    }
+
+    struct ggml_context * meta = NULL;
+    struct gguf_context * ctx = load_model_meta(fname, &meta);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    bool load_text = false;
+    bool load_vision = false;
+    if (!model_towers(ctx, params, load_text, load_vision) ||
+        !model_fit_budget(ctx, meta, params, load_text, load_vision, rules)) {
+        ggml_free(meta);
+        gguf_free(ctx);
+        return nullptr;
+    }
+
+    std::string cache_path;
+    const std::string recipe_text = quantize_recipe_text(rules);
+    const clip_model_source source = model_file_source(fname, ctx);
+    const uint64_t fingerprint = model_fingerprint(source, ctx, meta, recipe_text);
+    if (!rules.empty() && params.cache_dir &&
+        model_cache_path(fname, ctx, params.cache_dir, recipe_text, load_text, load_vision, cache_path) &&
+        std::ifstream(cache_path).good()) {
+        if (params.verbosity >= 1) {
+            printf("%s: loading converted model from '%s'\n", __func__, cache_path.c_str());
+        }
+
+        struct ggml_context * cache_meta = NULL;
+        struct gguf_context * cache_ctx = load_model_meta(cache_path.c_str(), &cache_meta);
+        if (cache_ctx) {
+            struct clip_model_load_params cache_params = params;
+            cache_params.weight_type = NULL;
+            cache_params.cache_dir = NULL;
+            struct clip_ctx * clip = clip_model_load_impl(model_file_source(cache_path.c_str(), cache_ctx), cache_ctx,
+                                                          cache_meta, cache_params, {});
+            if (clip) {
+                clip->fingerprint = fingerprint;
+                ggml_free(meta);
+                gguf_free(ctx);
+                return clip;
+            }
+        }
+        fprintf(stderr, "%s: failed to load the model cache '%s', converting '%s' again\n", __func__,
+                cache_path.c_str(), fname);
+    }
+
+    struct clip_ctx * clip = clip_model_load_impl(source, ctx, meta, params, rules);
+    if (clip) {
+        clip->fingerprint = fingerprint;
+    }
+    if (clip && !cache_path.empty() && model_cache_save(clip, recipe_text, cache_path) && params.verbosity >= 1) {
+        printf("%s: converted model cached in '%s'\n", __func__, cache_path.c_str());
+    }
+    return clip;
+}
+
+struct clip_ctx * clip_model_load_ex(const char * fname, const struct clip_model_load_params params) {
+    // after the cache is written, which holds the weights as ggml lays them out
+    struct clip_ctx * clip = model_load_file(fname, params);
+    if (clip && params.repack_weights) {
+        repack_weights(clip, params);
+    }
+    return clip;
+}
+
+struct clip_ctx * clip_model_load_from_buffer(const void * data, const size_t size,
+                                              const struct clip_model_load_params params) {
+    std::vector<quantize_rule> rules;
+    if (params.weight_type && !parse_quantize_recipe(params.weight_type, rules)) {
+        return nullptr;
+    }
+
+    clip_model_source source;
+    source.buffer = static_cast<const uint8_t *>(data);
+    source.buffer_size = size;
+
+    struct ggml_context * meta = NULL;
+    struct gguf_context * ctx = load_model_meta_from_buffer(source.buffer, size, &meta, source.offsets);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    bool load_text = false;
+    bool load_vision = false;
+    if (!model_towers(ctx, params, load_text, load_vision) ||
+        !model_fit_budget(ctx, meta, params, load_text, load_vision, rules)) {
+        ggml_free(meta);
+        gguf_free(ctx);
+        return nullptr;
+    }
+
+    const uint64_t fingerprint = model_fingerprint(source, ctx, meta, quantize_recipe_text(rules));
+    struct clip_ctx * clip = clip_model_load_impl(source, ctx, meta, params, rules);
+    if (clip) {
+        clip->fingerprint = fingerprint;
+    }
+    if (clip && params.repack_weights) {
+        repack_weights(clip, params);
+    }
+    return clip;
+}
+
+struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
+    struct clip_model_load_params params = clip_model_load_default_params();
+    params.verbosity = verbosity;
+    return clip_model_load_ex(fname, params);
+}
+
+// rank-based BPE over the byte-level symbols of a word, the last symbol carrying the "</w>" suffix
+static void tokenize_word_bpe(const clip_vocab & vocab, const char * word, const size_t len,
+                              std::vector<clip_vocab::id> & out) {
+    std::vector<clip_vocab::id> symbols;
+    symbols.reserve(len);
+    for (size_t i = 0; i < len; i++) {
+        const uint8_t b = (uint8_t)word[i];
+        const clip_vocab::id sym = i + 1 == len ? vocab.byte_ids_eow[b] : vocab.byte_ids[b];
+        if (sym < 0) {
+            fprintf(stderr, "%s: unknown byte 0x%02x\n", __func__, b);
+            continue;
+        }
+        symbols.push_back(sym);
+    }
+
+    while (symbols.size() > 1) {
+        // find the pair with the lowest merge rank
+        int32_t best_rank = INT32_MAX;
+        uint64_t best_pair = 0;
+        clip_vocab::id best_merged = -1;
+        for (size_t i = 0; i + 1 < symbols.size(); i++) {
+            const clip_vocab::merge * m = vocab.find_merge(symbols[i], symbols[i + 1]);
+            if (m && m->rank < best_rank) {
+                best_rank = m->rank;
+                best_pair = m->pair;
+                best_merged = m->merged;
+            }
+        }
+
+        if (best_merged < 0) {
+            break;
+        }
+
+        // merge all occurrences of the pair, left to right
+        size_t n = 0;
+        for (size_t i = 0; i < symbols.size(); i++) {
+            if (i + 1 < symbols.size() &&
+                (((uint64_t)(uint32_t)symbols[i] << 32) | (uint32_t)symbols[i + 1]) == best_pair) {
+                symbols[n++] = best_merged;
+                i++;
+            } else {
+                symbols[n++] = symbols[i];
+            }
+        }
+        symbols.resize(n);
+    }
+
+    out.insert(out.end(), symbols.begin(), symbols.end());
+}
+
+// fallback for files without merges: greedy longest match against the vocab
+static void tokenize_word_greedy(const clip_vocab & vocab, const std::string & word, std::vector<clip_vocab::id> & out) {
+    // feel lucky? let's try if it's a full word
+    const clip_vocab::id full = vocab.find(word + "</w>");
+    if (full >= 0) {
+        out.push_back(full);
+        return;
+    }
+
+    for (int i = 0; i < word.size();) {
+        for (int j = word.size() - 1; j >= i; j--) {
+            const clip_vocab::id cand = vocab.find(word.data() + i, j - i + 1);
+            if (cand >= 0) { // word.substr(i, j-i+1) in vocab
+                out.push_back(cand);
+                i = j + 1;
+                break;
+            } else if (j == i) { // word.substr(i, 1) has no matching
+                fprintf(stderr, "%s: unknown token '%s'\n", __func__, word.substr(i, 1).data());
+                i++;
+            }
+        }
+    }
+}
+
+// tokenizes text into v_tokens (cleared first), including the startoftext and endoftext tokens
+static void tokenize_text(const clip_ctx * ctx, const char * text, std::vector<clip_vocab::id> & v_tokens) {
+    const auto & vocab = ctx->vocab;
+    const std::string str = unicode_lowercase(text);
+    clip_word_scanner scanner(str, vocab.special_tokens);
+
+    v_tokens.clear();
+    v_tokens.push_back(49406); // startoftext
+
+    size_t begin;
+    size_t len;
+    bool is_special;
+    std::string word;
+    while (scanner.next(&begin, &len, &is_special)) {
+        word.assign(str, begin, len);
+        if (is_special) {
+            v_tokens.push_back(vocab.find(word));
+            continue;
+        }
+
+        if (vocab.n_merges == 0) {
+            tokenize_word_greedy(vocab, word, v_tokens);
+            continue;
+        }
+
+        if (vocab.cache.get(word, v_tokens)) {
+            continue;
+        }
+
+        const size_t n_before = v_tokens.size();
+        tokenize_word_bpe(vocab, word.data(), word.size(), v_tokens);
+        vocab.cache.put(word, v_tokens.data() + n_before, v_tokens.size() - n_before);
+    }
+
+    v_tokens.push_back(49407); // endoftext
+}
+
+bool clip_tokenize(const clip_ctx * ctx, const char * text, struct clip_tokens * tokens) {
+    if (!ctx->has_text_encoder) {
+        printf("This GGUF file seems to have no text encoder\n");
+        return false;
+    }
+
+    std::vector<clip_vocab::id> v_tokens;
+    tokenize_text(ctx, text, v_tokens);
+
+    tokens->size = v_tokens.size();
+
+    tokens->data = new int[v_tokens.size()];
+    std::copy(v_tokens.begin(), v_tokens.end(), tokens->data);
+
+    return true;
+}
+
+void clip_tokens_free(struct clip_tokens * tokens) {
+    delete[] tokens->data;
+    tokens->data = nullptr;
+    tokens->size = 0;
+}
+
+// Structure to hold the range of texts to be tokenized by a thread
+// half-open interval
+typedef struct {
+    const clip_ctx * ctx;
+    const char ** texts;
+    clip_vocab_id * tokens;
+    int32_t * lengths;
+    size_t start;
+    size_t end;
+} TextRange;
+
+// Function to tokenize a range of texts into rows of the padded token matrix in a thread
+static void * tokenize_texts(void * arg) {
+    const TextRange * range = static_cast<TextRange *>(arg);
+    const int num_positions = range->ctx->text_model.hparams.num_positions;
+
+    std::vector<clip_vocab::id> v_tokens; // reused for all texts of this thread
+    for (size_t i = range->start; i < range->end; i++) {
+        tokenize_text(range->ctx, range->texts[i], v_tokens);
+
+        // truncate to num_positions, keeping endoftext as the last token as the text encoder pools on it
+        if (v_tokens.size() > num_positions) {
+            v_tokens.resize(num_positions);
+            v_tokens.back() = 49407;
+        }
+
+        clip_vocab_id * row = range->tokens + i * num_positions;
+        std::copy(v_tokens.begin(), v_tokens.end(), row);
+        std::fill(row + v_tokens.size(), row + num_positions, 0);
+        range->lengths[i] = v_tokens.size();
+    }
+
+    return NULL;
+}
+
+bool clip_tokenize_batch(const clip_ctx * ctx, const int n_threads, const char ** texts, const size_t n_texts,
+                         clip_vocab_id * tokens, int32_t * lengths) {
+    if (!ctx->has_text_encoder) {
+        printf("This GGUF file seems to have no text encoder\n");
+        return false;
+    }
+
+    if (n_texts == 0) {
+        return true;
+    }
+
+    const int num_threads = std::max(1, std::min(n_threads, static_cast<int>(n_texts)));
+    const size_t texts_per_thread = n_texts / num_threads;
+
+    std::vector<TextRange> ranges(num_threads);
+    for (int t = 0; t < num_threads; t++) {
+        const size_t start = t * texts_per_thread;
+        const size_t end = (t == num_threads - 1) ? n_texts : start + texts_per_thread;
+        ranges[t] = {ctx, texts, tokens, lengths, start, end};
+    }
+
+    if (num_threads == 1) {
+        tokenize_texts(&ranges[0]);
+        return true;
+    }
+
+    // the calling thread takes the first range
+    std::vector<pthread_t> threads(num_threads);
+    for (int t = 1; t < num_threads; t++) {
+        pthread_create(&threads[t], NULL, tokenize_texts, static_cast<void *>(&ranges[t]));
+    }
+
+    tokenize_texts(&ranges[0]);
+
+    for (int t = 1; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    return true;
+}
+
+clip_image_u8 * clip_image_u8_make() { return new clip_image_u8(); }
+
+clip_image_f32 * clip_image_f32_make() { return new clip_image_f32(); }
+
+clip_image_f16 * clip_image_f16_make() { return new clip_image_f16(); }
+
+void clip_image_u8_clean(clip_image_u8* img) {
+    if (img->data){
+	delete[] img->data;
+	img->data = NULL;
+    }
+}
+
+void clip_image_f32_clean(clip_image_f32* res) {
+    if (res->data){
+	delete[] res->data;
+	res->data = NULL;
+    }
+}
+
+void clip_image_f16_clean(clip_image_f16 * res) {
+    if (res->data) {
+        delete[] res->data;
+        res->data = NULL;
+    }
+}
+
+void clip_image_u8_free(clip_image_u8* img) {
+    clip_image_u8_clean(img);
+    delete img;
+}
+
+void clip_image_f32_free(clip_image_f32* res) {
+    clip_image_f32_clean(res);
+    delete res;
+}
+
+void clip_image_f16_free(clip_image_f16 * res) {
+    clip_image_f16_clean(res);
+    delete res;
+}
+
+bool clip_image_load_from_file(const char * fname, clip_image_u8 * img) {
+    int nx, ny, nc;
+    auto data = stbi_load(fname, &nx, &ny, &nc, 3);
+    if (!data) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+        return false;
+    }
+
+    img->nx = nx;
+    img->ny = ny;
+    img->size = nx * ny * 3;
+    img->data = new uint8_t[img->size]();
+    memcpy(img->data, data, img->size);
+
+    stbi_image_free(data);
+
+    return true;
+}
+
+static inline double bicubic_filter(double x) {
+#define a -0.5
+    if (x < 0.0) {
+        x = -x;
+    }
+    if (x < 1.0) {
+        return ((a + 2.0) * x - (a + 3.0)) * x * x + 1;
+    }
+    if (x < 2.0) {
+        return (((x - 5) * x + 8) * x - 4) * a;
+    }
+    return 0.0;
+#undef a
+}
+
+static bool precompute_coeffs(int inSize, float in0, float in1, int outSize, double ** kkp, int ** boundsp, int * ksize) {
+    double support = 2.0; // Bicubic filter support from Resample.c
+    double filterscale = (double)(in1 - in0) / outSize;
+    if (filterscale < 1.0) {
+        filterscale = 1.0;
+    }
+    support *= filterscale;
+    int ksize_local = (int)ceil(support) * 2 + 1;
+
+    double * kk = (double *)malloc(outSize * ksize_local * sizeof(double));
+    int * bounds = (int *)malloc(outSize * 2 * sizeof(int));
+    if (!kk || !bounds) {
+        free(kk);
+        free(bounds);
+        return false;
+    }
+
+    for (int xx = 0; xx < outSize; xx++) {
+        double center = in0 + (xx + 0.5) * (in1 - in0) / outSize;
+        double ww = 0.0;
+        double ss = 1.0 / filterscale;
+        int xmin = (int)(center - support + 0.5);
+        if (xmin < 0)
+            xmin = 0;
+        int xmax = (int)(center + support + 0.5);
+        if (xmax > inSize)
+            xmax = inSize;
+        xmax -= xmin;
+
+        double * k = &kk[xx * ksize_local];
+        for (int x = 0; x < xmax; x++) {
+            double w = bicubic_filter((x + xmin - center + 0.5) * ss);
+            k[x] = w;
+            ww += w;
+        }
+        for (int x = 0; x < xmax; x++) {
+            if (ww != 0.0) {
+                k[x] /= ww;
+            }
+        }
+        for (int x = xmax; x < ksize_local; x++) {
+            k[x] = 0.0;
+        }
+        bounds[xx * 2 + 0] = xmin;
+        bounds[xx * 2 + 1] = xmax;
+    }
+
+    *kkp = kk;
+    *boundsp = bounds;
+    *ksize = ksize_local;
+    return true;
+}
+
+// resize with the bicubic filter keeping the aspect ratio, then center crop to image_size x image_size.
+// dst receives 3 * image_size * image_size values in [0, 255], RGB interleaved
+static bool clip_image_resize_crop(const clip_ctx * ctx, const clip_image_u8 * img, float * dst) {
+    const int nx = img->nx;
+    const int ny = img->ny;
+    const int nx2 = ctx->vision_model.hparams.image_size;
+    const int ny2 = ctx->vision_model.hparams.image_size;
+
+    // Calculate aspect ratio maintaining scaling
+    const float scale = std::min((float)nx, (float)ny) / (float)ctx->vision_model.hparams.image_size;
+    const int nx3 = (int)(nx / scale + 0.5f);
+    const int ny3 = (int)(ny / scale + 0.5f);
+
+    // Calculating horizontal and vertical coeffs
+    double *kk_horiz, *kk_vert;
+    int *bounds_horiz, *bounds_vert;
+    int ksize_horiz, ksize_vert;
+
+    if (!precompute_coeffs(nx, 0.0f, (float)nx, nx3, &kk_horiz, &bounds_horiz, &ksize_horiz)) {
+        printf("Failed to calculate coeffs\n");
+        return false;
+    }
+    if (!precompute_coeffs(ny, 0.0f, (float)ny, ny3, &kk_vert, &bounds_vert, &ksize_vert)) {
+        free(kk_horiz);
+        free(bounds_horiz);
+        printf("Failed to calculate coeffs\n");
+        return false;
+    }
+
+    // Intermediate image buffer (stores horizontal resampling results)
+    std::vector<float> temp(3 * nx3 * ny);
+
+    // Horizontal bicubic resampling
+    for (int y = 0; y < ny; y++) {
+        for (int xx = 0; xx < nx3; xx++) {
+            int xmin = bounds_horiz[xx * 2 + 0];
+            int xmax = bounds_horiz[xx * 2 + 1];
+            double * k = &kk_horiz[xx * ksize_horiz];
+            for (int c = 0; c < 3; c++) {
+                double ss = 0.0;
+                for (int x = 0; x < xmax; x++) {
+                    int src_idx = 3 * (y * nx + (x + xmin)) + c;
+                    ss += (double)img->data[src_idx] * k[x];
+                }
+                int dst_idx = 3 * (y * nx3 + xx) + c;
+                temp[dst_idx] = std::min(std::max((float)ss, 0.0f), 255.0f);
+            }
+        }
+    }
+
+    // Vertical bicubic resampling, only for the rows and columns that survive the center crop
+    const int x_offset = (nx3 - nx2) / 2;
+    const int y_offset = (ny3 - ny2) / 2;
+
+    for (int yy = 0; yy < ny2; yy++) {
+        const int ymin = bounds_vert[(yy + y_offset) * 2 + 0];
+        const int ymax = bounds_vert[(yy + y_offset) * 2 + 1];
+        const double * k = &kk_vert[(yy + y_offset) * ksize_vert];
+        for (int x = 0; x < nx2; x++) {
+            for (int c = 0; c < 3; c++) {
+                double ss = 0.0;
+                for (int y = 0; y < ymax; y++) {
+                    int src_idx = 3 * ((y + ymin) * nx3 + x + x_offset) + c;
+                    ss += (double)temp[src_idx] * k[y];
+                }
+                dst[3 * (yy * nx2 + x) + c] = std::min(std::max((float)ss, 0.0f), 255.0f);
+            }
+        }
+    }
+
+    free(kk_horiz);
+    free(bounds_horiz);
+    free(kk_vert);
+    free(bounds_vert);
+
+    return true;
+}
+
+// normalize: x = (x - mean) / std
+bool clip_image_preprocess(const clip_ctx * ctx, const clip_image_u8 * img, clip_image_f32 * res) {
+    if (!ctx->has_vision_encoder) {
+        printf("This gguf file seems to have no vision encoder\n");
+        return false;
+    }
+
+    const int nx2 = ctx->vision_model.hparams.image_size;
+    const int ny2 = ctx->vision_model.hparams.image_size;
+
+    // Setting the output image size and allocating memory
+    res->nx = nx2;
+    res->ny = ny2;
+    res->size = 3 * nx2 * ny2;
+    res->data = new float[res->size]();
+
+    if (!clip_image_resize_crop(ctx, img, res->data)) {
+        delete[] res->data;
+        res->data = NULL;
+        return false;
+    }
+
+    const auto & m3 = ctx->image_mean;
+    const auto & s3 = ctx->image_std;
+
+    for (size_t i = 0; i < res->size; i += 3) {
+        for (int c = 0; c < 3; c++) {
+            res->data[i + c] = ((res->data[i + c] / 255.0f) - m3[c]) / s3[c];
+        }
+    }
+
+    return true;
+}
+
+// resize and crop only; normalization is fused into clip_image_batch_encode_u8
+bool clip_image_preprocess_u8(const clip_ctx * ctx, const clip_image_u8 * img, clip_image_u8 * res) {
+    if (!ctx->has_vision_encoder) {
+        printf("This gguf file seems to have no vision encoder\n");
+        return false;
+    }
+
+    const int nx2 = ctx->vision_model.hparams.image_size;
+    const int ny2 = ctx->vision_model.hparams.image_size;
+
+    std::vector<float> resized(3 * nx2 * ny2);
+    if (!clip_image_resize_crop(ctx, img, resized.data())) {
+        return false;
+    }
+
+    res->nx = nx2;
+    res->ny = ny2;
+    res->size = resized.size();
+    res->data = new uint8_t[res->size];
+
+    for (size_t i = 0; i < res->size; i++) {
+        res->data[i] = (uint8_t)(resized[i] + 0.5f);
+    }
+
+    return true;
+}
+
+bool clip_image_preprocess_f16(const clip_ctx * ctx, const clip_image_u8 * img, clip_image_f16 * res) {
+    if (!ctx->has_vision_encoder) {
+        printf("This gguf file seems to have no vision encoder\n");
+        return false;
+    }
+
+    const int nx2 = ctx->vision_model.hparams.image_size;
+    const int ny2 = ctx->vision_model.hparams.image_size;
+
+    std::vector<float> resized(3 * nx2 * ny2);
+    if (!clip_image_resize_crop(ctx, img, resized.data())) {
+        return false;
+    }
+
+    const auto & m3 = ctx->image_mean;
+    const auto & s3 = ctx->image_std;
+
+    for (size_t i = 0; i < resized.size(); i += 3) {
+        for (int c = 0; c < 3; c++) {
+            resized[i + c] = ((resized[i + c] / 255.0f) - m3[c]) / s3[c];
+        }
+    }
+
+    res->nx = nx2;
+    res->ny = ny2;
+    res->size = resized.size();
+    res->data = new ggml_fp16_t[res->size];
+    ggml_fp32_to_fp16_row(resized.data(), res->data, (int)res->size);
+
+    return true;
+}
+
+// Preprocess function erased to a common signature, so that the thread code below serves f32, u8 and f16 outputs
+typedef bool (*preprocess_fn)(const clip_ctx * ctx, const clip_image_u8 * img, void * res);
+
+static bool preprocess_f32(const clip_ctx * ctx, const clip_image_u8 * img, void * res) {
+    return clip_image_preprocess(ctx, img, static_cast<clip_image_f32 *>(res));
+}
+
+static bool preprocess_u8(const clip_ctx * ctx, const clip_image_u8 * img, void * res) {
+    return clip_image_preprocess_u8(ctx, img, static_cast<clip_image_u8 *>(res));
+}
+
+static bool preprocess_f16(const clip_ctx * ctx, const clip_image_u8 * img, void * res) {
+    return clip_image_preprocess_f16(ctx, img, static_cast<clip_image_f16 *>(res));
+}
+
+// Structure to hold the image data as an input to function to be executed for thread
+typedef struct {
+    const clip_image_u8 * input;
+    void * resized;
+    const clip_ctx * ctx;
+    preprocess_fn preprocess;
+} ImageData;
+
+// Structure to hold the range of images to be processed by a thread
+// closed interval
+typedef struct {
+    ImageData* start;
+    ImageData* end;
+} ImageDataRange;
+
+// Function to preprocess a single image in a thread
+void * preprocess_image(void * arg) {
+    ImageDataRange * imageDataRange = static_cast<ImageDataRange *>(arg);
+
+    ImageData * imageData_start = imageDataRange->start;
+    ImageData * imageData_end = imageDataRange->end;
+
+    for (ImageData * imageData = imageData_start; imageData <= imageData_end; imageData++) {
+        // Call the original preprocess function on the image
+        imageData->preprocess(imageData->ctx, imageData->input, imageData->resized);
+    }
+    
+    pthread_exit(NULL);
+}
+
+// Function to batch-preprocess multiple images into outputs of elem_size bytes each
+static void batch_preprocess(const clip_ctx * ctx, const int n_threads, const clip_image_u8_batch * img_inputs,
+                             void * outputs, const size_t elem_size, preprocess_fn preprocess) {
+    if (img_inputs->size == 0) {
+        return;
+    }
+
+    int num_threads = std::max(1, std::min(n_threads, static_cast<int>(img_inputs->size)));
+    int i, t;
+
+    // Divide the images among the threads
+    int images_per_thread = img_inputs->size / num_threads;
+
+    uint8_t * out = static_cast<uint8_t *>(outputs);
+
+    if (num_threads == 1) {
+        // Single-threaded case
+        for (i = 0; i < img_inputs->size; i++) {
+            preprocess(ctx, &img_inputs->data[i], out + i * elem_size);
+        }
+    } else {
+        // Multi-threaded case
+
+        std::vector<pthread_t> threads(num_threads);
+        std::vector<ImageData> imageData(img_inputs->size);
+        ImageDataRange* imageDataRange = new ImageDataRange[num_threads]();
+        
+        for (t = 0; t < num_threads; t++) {
+            int start_index = t * images_per_thread;
+            int end_index = (t == num_threads - 1) ? img_inputs->size : start_index + images_per_thread;
+
+            // Create ImageData for each thread
+            for (i = start_index; i < end_index; i++) {
+                imageData[i].input = &img_inputs->data[i];
+                imageData[i].resized = out + i * elem_size;
+                imageData[i].ctx = ctx;
+                imageData[i].preprocess = preprocess;
+            }
+
+            // Create a thread for each batch of images
+            imageDataRange[t] = {&imageData[start_index], &imageData[end_index - 1]};
+            pthread_create(&threads[t], NULL, preprocess_image, static_cast<void *>(&imageDataRange[t]));
+        }
+
+        // Wait for all threads to finish
+        for (t = 0; t < num_threads; t++) {
+            pthread_join(threads[t], NULL);
+        }
+
+        delete[] imageDataRange;
+    }
+}
+
+void clip_image_batch_preprocess(const clip_ctx * ctx, const int n_threads, const clip_image_u8_batch * img_inputs,
+                                 clip_image_f32_batch * imgs_resized) {
+    imgs_resized->size = img_inputs->size;
+    batch_preprocess(ctx, n_threads, img_inputs, imgs_resized->data, sizeof(clip_image_f32), preprocess_f32);
+}
+
+void clip_image_batch_preprocess_u8(const clip_ctx * ctx, const int n_threads, const clip_image_u8_batch * img_inputs,
+                                    clip_image_u8_batch * imgs_resized) {
+    imgs_resized->size = img_inputs->size;
+    batch_preprocess(ctx, n_threads, img_inputs, imgs_resized->data, sizeof(clip_image_u8), preprocess_u8);
+}
+
+void clip_image_batch_preprocess_f16(const clip_ctx * ctx, const int n_threads, const clip_image_u8_batch * img_inputs,
+                                     clip_image_f16_batch * imgs_resized) {
+    imgs_resized->size = img_inputs->size;
+    batch_preprocess(ctx, n_threads, img_inputs, imgs_resized->data, sizeof(clip_image_f16), preprocess_f16);
+}
+
+//
+// importance matrix
+//
+
+// sums of the squares of each input column of a weight
+struct clip_imatrix_stats {
+    std::vector<double> sum_sq;
+    int64_t n_rows = 0;
+};
+
+struct clip_imatrix {
+    std::map<std::string, clip_imatrix_stats> stats; // by weight name
+};
+
+// runs inplace on the input of a matmul, so it only reads it
+static void imatrix_accumulate(struct ggml_tensor * dst, const struct ggml_tensor * a, int ith, int nth, void * userdata) {
+    (void)dst;
+    (void)nth;
+    if (ith != 0) {
+        return;
+    }
+
+    clip_imatrix_stats * stats = static_cast<clip_imatrix_stats *>(userdata);
+    const int64_t n_cols = a->ne[0];
+    if (stats->sum_sq.empty()) {
+        stats->sum_sq.assign(n_cols, 0.0);
+    }
+
+    for (int64_t i3 = 0; i3 < a->ne[3]; i3++) {
+        for (int64_t i2 = 0; i2 < a->ne[2]; i2++) {
+            for (int64_t i1 = 0; i1 < a->ne[1]; i1++) {
+                const char * row = static_cast<const char *>(a->data) + i1 * a->nb[1] + i2 * a->nb[2] + i3 * a->nb[3];
+                for (int64_t i0 = 0; i0 < n_cols; i0++) {
+                    const float x = *reinterpret_cast<const float *>(row + i0 * a->nb[0]);
+                    stats->sum_sq[i0] += x * x;
+                }
+                stats->n_rows++;
+            }
+        }
+    }
+}
+
+// ggml_mul_mat of a weight. while an importance matrix is collected, the input goes through an observer first.
+// repacked weights go through the panel kernels
+static struct ggml_tensor * weight_mul_mat(struct ggml_context * ctx0, const clip_ctx * ctx, struct ggml_tensor * w,
+                                           struct ggml_tensor * x) {
+    if (ctx->imatrix) {
+        clip_imatrix_stats * stats = &ctx->imatrix->stats[ggml_get_name(w)];
+        x = ggml_map_custom1_inplace(ctx0, x, imatrix_accumulate, 1, stats);
+    }
+    if (ctx->packed_weights.count(w)) {
+        // x is quantized once for all the threads of the multiplication. the graph runs each quantization right before
+        // its multiplication, so that one buffer, grown to the largest x, serves all of them
+        const size_t xq_size = ggml_nrows(x) * (w->ne[0] / QK_LEGACY) * sizeof(clip_block_q8);
+        if (ctx->buf_panel.size < xq_size) {
+            ctx->buf_panel.resize(xq_size);
+        }
+        x = ggml_map_custom1_inplace(ctx0, x, panel_quantize, GGML_N_TASKS_MAX, &ctx->buf_panel);
+
+        // only the shape of the result, never allocated
+        const bool no_alloc = ggml_get_no_alloc(ctx0);
+        ggml_set_no_alloc(ctx0, true);
+        struct ggml_tensor * shape = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, w->ne[1], x->ne[1], x->ne[2], x->ne[3]);
+        ggml_set_no_alloc(ctx0, no_alloc);
+        return ggml_map_custom3(ctx0, shape, x, w, panel_mul_mat, GGML_N_TASKS_MAX, &ctx->buf_panel);
+    }
+    return ggml_mul_mat(ctx0, w, x);
+}
+
+struct clip_layer_observation {
+    const clip_ctx * ctx;
+    int layer;
+};
+
+static void layer_observe(struct ggml_tensor * dst, const struct ggml_tensor * a, int ith, int nth, void * userdata) {
+    (void)dst;
+    (void)nth;
+    if (ith != 0) {
+        return;
+    }
+
+    const clip_layer_observation * obs = static_cast<const clip_layer_observation *>(userdata);
+    obs->ctx->layer_callback(obs->layer, static_cast<const float *>(a->data), a->ne[0], a->ne[1], a->ne[2],
+                             obs->ctx->layer_callback_data);
+}
+
+// passes the output of a layer to the layer callback of ctx, if any. observations must outlive the graph computation
+// and have room reserved for every layer, as the graph points into it
+static struct ggml_tensor * observe_layer(struct ggml_context * ctx0, const clip_ctx * ctx,
+                                          std::vector<clip_layer_observation> & observations, const int layer,
+                                          struct ggml_tensor * cur) {
+    if (!ctx->layer_callback) {
+        return cur;
+    }
+    observations.push_back({ctx, layer});
+    return ggml_map_custom1_inplace(ctx0, cur, layer_observe, 1, &observations.back());
+}
+
+void clip_set_layer_callback(struct clip_ctx * ctx, clip_layer_callback fn, void * user_data) {
+    ctx->layer_callback = fn;
+    ctx->layer_callback_data = user_data;
+}
+
+void clip_imatrix_begin(struct clip_ctx * ctx) {
+    if (!ctx->imatrix) {
+        ctx->imatrix = new clip_imatrix;
+    }
+}
+
+bool clip_imatrix_save(struct clip_ctx * ctx, const char * fname) {
+    clip_imatrix * imatrix = ctx->imatrix;
+    ctx->imatrix = nullptr;
+    if (!imatrix) {
+        fprintf(stderr, "%s: no importance matrix is being collected\n", __func__);
+        return false;
+    }
+
+    // one f32 tensor of mean squares per weight, named after it
+    size_t mem_size = ggml_tensor_overhead() * (imatrix->stats.size() + 1);
+    for (const auto & it : imatrix->stats) {
+        mem_size += GGML_PAD(it.second.sum_sq.size() * sizeof(float), GGML_MEM_ALIGN);
+    }
+    struct ggml_init_params params = {
+        /*.mem_size   = */ mem_size,
+        /*.mem_buffer = */ NULL,
+        /*.no_alloc   = */ false,
+    };
+    struct ggml_context * ctx_data = ggml_init(params);
+    struct gguf_context * ctx_out = gguf_init_empty();
+
+    int64_t n_rows = 0;
+    for (const auto & it : imatrix->stats) {
+        const clip_imatrix_stats & stats = it.second;
+        struct ggml_tensor * t = ggml_new_tensor_1d(ctx_data, GGML_TYPE_F32, stats.sum_sq.size());
+        ggml_set_name(t, it.first.c_str());
+        float * data = static_cast<float *>(t->data);
+        for (size_t i = 0; i < stats.sum_sq.size(); i++) {
+            data[i] = stats.n_rows > 0 ? (float)(stats.sum_sq[i] / stats.n_rows) : 0.0f;
+        }
+        gguf_add_tensor(ctx_out, t);
+        n_rows = std::max(n_rows, stats.n_rows);
+    }
+    gguf_set_val_u32(ctx_out, KEY_IMATRIX_N_ROWS, (uint32_t)std::min<int64_t>(n_rows, UINT32_MAX));
+    delete imatrix;
+
+    bool ok = false;
+    FILE * f = fopen(fname, "wb");
+    if (f) {
+        fclose(f);
+        gguf_write_to_file(ctx_out, fname, false);
+        ok = true;
+    } else {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
+    }
+
+    gguf_free(ctx_out);
+    ggml_free(ctx_data);
+    return ok;
+}
+
+void clip_free(clip_ctx * ctx) {
+    delete ctx->imatrix;
+    ggml_free(ctx->ctx);
+    gguf_free(ctx->ctx_gguf);
+#ifndef _WIN32
+    if (ctx->mapping) {
+        munmap(ctx->mapping, ctx->mapping_size);
+    }
+#endif
+    delete ctx;
+}
+
+struct clip_model_handle {
+    std::mutex mutex; // guards current, held only to swap it or take a reference to it
+    struct clip_ctx * current;
+
+    std::mutex reload_mutex; // guards the fields below
+    std::condition_variable reload_done;
+    std::thread reload_thread;
+    bool reloading = false;
+    bool reload_ok = true;
+    std::string reload_fname;
+    std::string reload_weight_type;
+    std::string reload_cache_dir;
+    clip_model_load_params reload_params;
+};
+
+struct clip_model_handle * clip_model_handle_new(struct clip_ctx * ctx) {
+    clip_model_handle * handle = new clip_model_handle;
+    ctx->n_refs = 1;
+    handle->current = ctx;
+    return handle;
+}
+
+void clip_model_handle_free(struct clip_model_handle * handle) {
+    clip_model_reload_wait(handle);
+    if (handle->reload_thread.joinable()) {
+        handle->reload_thread.join();
+    }
+    clip_model_release(handle->current);
+    delete handle;
+}
+
+struct clip_ctx * clip_model_acquire(struct clip_model_handle * handle) {
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    handle->current->n_refs++;
+    return handle->current;
+}
+
+void clip_model_release(struct clip_ctx * ctx) {
+    if (ctx->n_refs.fetch_sub(1) == 1) {
+        clip_free(ctx);
+    }
+}
+
+// makes ctx the current model and returns the one it replaces, with the reference the handle held on it
+static struct clip_ctx * model_exchange(clip_model_handle * handle, struct clip_ctx * ctx) {
+    ctx->n_refs = 1;
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    struct clip_ctx * old = handle->current;
+    handle->current = ctx;
+    return old;
+}
+
+void clip_model_swap(struct clip_model_handle * handle, struct clip_ctx * ctx) {
+    // freed here, or by the last encode still holding it
+    clip_model_release(model_exchange(handle, ctx));
+}
+
+// threads a reload loads on when none are given, rather than all cores, which the encodes still running need
+static const int CLIP_RELOAD_THREADS = 2;
+
+static void model_reload(clip_model_handle * handle) {
+    struct clip_ctx * ctx = clip_model_load_ex(handle->reload_fname.c_str(), handle->reload_params);
+    if (ctx) {
+        // the reload keeps the reference of the handle until the encodes still running on the old model release it, so
+        // that freeing it falls to this thread rather than to the last of them
+        struct clip_ctx * old = model_exchange(handle, ctx);
+        while (old->n_refs.load() > 1) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        clip_model_release(old);
+    } else {
+        fprintf(stderr, "%s: failed to load '%s', keeping the current model\n", __func__, handle->reload_fname.c_str());
+    }
+
+    std::lock_guard<std::mutex> lock(handle->reload_mutex);
+    handle->reloading = false;
+    handle->reload_ok = ctx != nullptr;
+    handle->reload_done.notify_all();
+}
+
+bool clip_model_reload_async(struct clip_model_handle * handle, const char * fname,
+                             const struct clip_model_load_params params) {
+    std::lock_guard<std::mutex> lock(handle->reload_mutex);
+    if (handle->reloading) {
+        fprintf(stderr, "%s: a reload is already running\n", __func__);
+        return false;
+    }
+    if (handle->reload_thread.joinable()) {
+        handle->reload_thread.join(); // exiting, as it is no longer reloading
+    }
+
+    // the strings of params may not outlive the call
+    handle->reload_fname = fname;
+    handle->reload_weight_type = params.weight_type ? params.weight_type : "";
+    handle->reload_cache_dir = params.cache_dir ? params.cache_dir : "";
+    handle->reload_params = params;
+    handle->reload_params.n_threads = params.n_threads > 0 ? params.n_threads : CLIP_RELOAD_THREADS;
+    handle->reload_params.weight_type = params.weight_type ? handle->reload_weight_type.c_str() : NULL;
+    handle->reload_params.cache_dir = params.cache_dir ? handle->reload_cache_dir.c_str() : NULL;
+
+    handle->reloading = true;
+    handle->reload_thread = std::thread(model_reload, handle);
+    return true;
+}
+
+bool clip_model_reload_wait(struct clip_model_handle * handle) {
+    std::unique_lock<std::mutex> lock(handle->reload_mutex);
+    handle->reload_done.wait(lock, [handle] { return !handle->reloading; });
+    return handle->reload_ok;
+}
+
+static bool clip_text_encode_impl(const clip_ctx * ctx, const int n_threads, const clip_tokens * tokens, float * vec,
+                                  const bool normalize) {
+
+    const auto & model = ctx->text_model;
+    const auto & hparams = model.hparams;
+    const size_t N = tokens->size;
+
+    const int n_vocab = hparams.n_vocab;
+    const int num_positions = hparams.num_positions;
+    const int hidden_size = hparams.hidden_size;
+    const int n_head = hparams.n_head;
+    const int d_head = hidden_size / n_head;
+    const int n_layer = hparams.n_layer;
+    const int n_intermediate = hparams.n_intermediate;
+    const int projection_dim = hparams.projection_dim;
+    const float eps = hparams.eps;
+
+    // the buffers of ctx serve one encode at a time
+    std::lock_guard<std::mutex> lock(ctx->compute_mutex);
+    auto & buf_compute = ctx->buf_compute;
+
+    struct ggml_init_params params = {
+        .mem_size = buf_compute.size,
+        .mem_buffer = buf_compute.data,
+        .no_alloc = false,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+    struct ggml_cgraph gf = {};
+
+    const size_t scr0_size = ctx->buf_scratch.size;
+    void * scr0 = ctx->buf_scratch.data;
+
+    struct ggml_tensor * input_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    memcpy(input_ids->data, tokens->data, N * ggml_element_size(input_ids));
+
+    struct ggml_tensor * positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    for (int i = 0; i < N; i++) {
+        ggml_set_i32_1d(positions, i, i);
+    }
+
+    struct ggml_tensor * embeddings = ggml_get_rows(ctx0, model.token_embeddings, input_ids);
+
+    embeddings = ggml_add(ctx0, ggml_get_rows(ctx0, model.position_embeddings, positions), embeddings);
+
+    std::vector<clip_layer_observation> observations;
+    observations.reserve(n_layer);
+
+    // loop over layers
+    for (int il = 0; il < n_layer; il++) {
+        struct ggml_tensor * cur = embeddings; // embeddings = residual, cur = hidden_states
+
+        ggml_set_scratch(ctx0, {0, scr0_size, scr0});
+
+        // layernorm1
+        {
+            cur = ggml_norm(ctx0, cur, eps);
+
+            cur = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers[il].ln_1_w, cur), cur),
+                           ggml_repeat(ctx0, model.layers[il].ln_1_b, cur));
+        }
+
+        // self-attention
+        {
+            struct ggml_tensor * Q = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].q_b, cur),
+                                              weight_mul_mat(ctx0, ctx, model.layers[il].q_w, cur));
+
+            Q = ggml_scale_inplace(ctx0, Q, ggml_new_f32(ctx0, 1.0f / sqrt((float)d_head)));
+            Q = ggml_reshape_4d(ctx0, Q, d_head, n_head, N, 1);
+            Q = ggml_cont(ctx0, ggml_permute(ctx0, Q, 0, 2, 1, 3));
+            Q = ggml_reshape_3d(ctx0, Q, d_head, N, n_head);
+
+            struct ggml_tensor * K = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].k_b, cur),
+                                              weight_mul_mat(ctx0, ctx, model.layers[il].k_w, cur));
+
+            K = ggml_reshape_4d(ctx0, K, d_head, n_head, N, 1);
+            K = ggml_cont(ctx0, ggml_permute(ctx0, K, 0, 2, 1, 3));
+            K = ggml_reshape_3d(ctx0, K, d_head, N, n_head);
+
+            struct ggml_tensor * V = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].v_b, cur),
+                                              weight_mul_mat(ctx0, ctx, model.layers[il].v_w, cur));
+            V = ggml_reshape_4d(ctx0, V, d_head, n_head, N, 1);
+            V = ggml_cont(ctx0, ggml_permute(ctx0, V, 1, 2, 0, 3));
+            V = ggml_reshape_3d(ctx0, V, N, d_head, n_head);
+
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+            KQ = ggml_diag_mask_inf_inplace(ctx0, KQ, 0); // causal masking
+            KQ = ggml_soft_max_inplace(ctx0, KQ);
+
+            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ);
+            KQV = ggml_reshape_4d(ctx0, KQV, d_head, N, n_head, 1);
+            KQV = ggml_cont(ctx0, ggml_permute(ctx0, KQV, 0, 2, 1, 3));
+
+            cur = ggml_cpy(ctx0, KQV, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, hidden_size, N));
+        }
+
+        // attention output
+        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].o_b, cur),
+                       weight_mul_mat(ctx0, ctx, model.layers[il].o_w, cur));
+
+        // re-add the layer input, e.g., residual
+        cur = ggml_add(ctx0, cur, embeddings);
+
+        embeddings = cur; // embeddings = residual, cur = hidden_states
+
+        // layernorm2
+        {
+            cur = ggml_norm(ctx0, cur, eps);
+
+            cur = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers[il].ln_2_w, cur), cur),
+                           ggml_repeat(ctx0, model.layers[il].ln_2_b, cur));
+        }
+
+        cur = weight_mul_mat(ctx0, ctx, model.layers[il].ff_i_w, cur);
+        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].ff_i_b, cur), cur);
+
+        if (ctx->use_gelu) {
+            cur = ggml_gelu_inplace(ctx0, cur);
+        } else {
+            cur = ggml_gelu_quick_inplace(ctx0, cur);
+        }
+
+        cur = weight_mul_mat(ctx0, ctx, model.layers[il].ff_o_w, cur);
+        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].ff_o_b, cur), cur);
+
+        // residual 2
+        cur = ggml_add(ctx0, embeddings, cur);
+
+        embeddings = observe_layer(ctx0, ctx, observations, il, cur);
+    }
+
+    // final -layer_norm
+    {
+        embeddings = ggml_norm(ctx0, embeddings, eps);
+
+        embeddings = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.post_ln_w, embeddings), embeddings),
+                              ggml_repeat(ctx0, model.post_ln_b, embeddings));
+    }
+
+    // get the output of eot token, e.g., last index
+    struct ggml_tensor * eot = ggml_new_i32(ctx0, N - 1);
+    embeddings = ggml_get_rows(ctx0, embeddings, eot);
+
+    ggml_set_scratch(ctx0, {0, 0, nullptr});
+
+    // text projection
+    embeddings = weight_mul_mat(ctx0, ctx, model.projection, embeddings);
+
+    // normalize output embeddings
+    if (normalize) {
+        ggml_tensor * length = ggml_sqrt(ctx0, ggml_sum(ctx0, ggml_sqr(ctx0, embeddings)));
+        embeddings = ggml_scale_inplace(ctx0, embeddings, ggml_div(ctx0, ggml_new_f32(ctx0, 1.0f), length));
+    }
+
+    ggml_set_name(embeddings, "check");
+
+    // run the computation
+
+    ggml_build_forward_expand(&gf, embeddings);
+    ggml_cplan cplan = ggml_graph_plan(&gf, n_threads);
+    if (cplan.work_size != 0) {
+        cplan.work_data = (uint8_t *)malloc(cplan.work_size);
+    }
+    ggml_graph_compute(&gf, &cplan);
+
+// print
+#ifdef CLIP_DEBUG
+    {
+        auto print_t_f32 = [&](struct ggml_tensor * t) {
+            float * data = (float *)t->data;
+            printf("dtype: f32, dims: %jd %jd %jd %jd, nb: %jd %jd %jd %jd\n", t->ne[0], t->ne[1], t->ne[2], t->ne[3], t->nb[0],
+                   t->nb[1], t->nb[2], t->nb[3]);
+            printf("data: ");
+            for (int i = 0; i < std::min((int)t->ne[0], 20); i++) {
+                printf("%f ", data[i]);
+            }
+
+            // printf("\n\n");
+            double sum = 0.0;
+            for (int i = 0; i < ggml_nelements(t); i++) {
+                sum += data[i];
+            }
+            printf("sum:  %f\n", sum);
+        };
+
+        auto print_t_f16 = [&](struct ggml_tensor * t) {
+            ggml_fp16_t * data = (ggml_fp16_t *)t->data;
+            printf("dtype: f16, dims: %jd %jd %jd %jd\n", t->ne[0], t->ne[1], t->ne[2], t->ne[3]);
+            printf("data: ");
+            for (int i = 0; i < std::min((int)t->ne[0], 10); i++) {
+                printf("%f ", ggml_fp16_to_fp32(data[i]));
+            }
+            printf("\n\n");
+            double sum = 0.0;
+            for (int i = 0; i < ggml_nelements(t); i++) {
+                sum += ggml_fp16_to_fp32(data[i]);
+            }
+            printf("sum:  %f\n", sum);
+        };
+
+        auto * t = ggml_get_tensor(ctx0, "check");
+        if (t->type == GGML_TYPE_F32) {
+            print_t_f32(t);
+        } else {
+            print_t_f16(t);
+        }
+    }
+
+    printf("used_mem = %zu\n", ggml_used_mem(ctx0));
+#endif
+    memcpy(vec, ggml_get_data_f32(embeddings), sizeof(float) * projection_dim);
+
+    if (cplan.work_size != 0) {
+        free(cplan.work_data);
+    }
+
+    ggml_free(ctx0);
+
+    return true;
+}
+
+bool clip_text_encode(const clip_ctx * ctx, const int n_threads, const clip_tokens * tokens, float * vec,
+                      const bool normalize) {
+    if (!ctx->has_text_encoder) {
+        printf("This GGUF file seems to have no text encoder\n");
+        return false;
+    }
+
+    auto & cache = ctx->text_cache;
+    if (cache.get(tokens->data, tokens->size, normalize, vec)) {
+        return true;
+    }
+
+    if (!clip_text_encode_impl(ctx, n_threads, tokens, vec, normalize)) {
+        return false;
+    }
+
+    cache.put(tokens->data, tokens->size, normalize, vec, ctx->text_model.hparams.projection_dim);
+
+    return true;
+}
+
+void clip_text_cache_enable(clip_ctx * ctx, const size_t max_bytes) {
+    auto & cache = ctx->text_cache;
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.max_bytes = max_bytes;
+    cache.evict(max_bytes);
+}
+
+void clip_text_cache_get_stats(const clip_ctx * ctx, clip_text_cache_stats * stats) {
+    auto & cache = ctx->text_cache;
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    *stats = cache.stats;
+    stats->n_entries = cache.lru.size();
+    stats->size_bytes = cache.size_bytes;
+}
+
+// file layout: magic, version, projection_dim, n_entries, then per entry (most recently used first):
+// normalize (u8), n_tokens (u32), tokens (i32 * n_tokens), embedding (f32 * projection_dim)
+static const uint32_t CLIP_TEXT_CACHE_MAGIC = 0x63747863; // "cxtc"
+static const uint32_t CLIP_TEXT_CACHE_VERSION = 2;
+
+bool clip_text_cache_save(const clip_ctx * ctx, const char * fname) {
+    auto & cache = ctx->text_cache;
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    std::ofstream fout(fname, std::ios::binary);
+    if (!fout.is_open()) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
+        return false;
+    }
+
+    // magic, version, dim, n_entries, then the fingerprint of the model the embeddings come from
+    const uint32_t dim = ctx->text_model.hparams.projection_dim;
+    const uint32_t n_entries = cache.lru.size();
+    fout.write(reinterpret_cast<const char *>(&CLIP_TEXT_CACHE_MAGIC), sizeof(uint32_t));
+    fout.write(reinterpret_cast<const char *>(&CLIP_TEXT_CACHE_VERSION), sizeof(uint32_t));
+    fout.write(reinterpret_cast<const char *>(&dim), sizeof(uint32_t));
+    fout.write(reinterpret_cast<const char *>(&n_entries), sizeof(uint32_t));
+    fout.write(reinterpret_cast<const char *>(&ctx->fingerprint), sizeof(uint64_t));
+
+    for (const auto & e : cache.lru) {
+        const uint8_t normalize = e.normalize;
+        const uint32_t n_tokens = e.tokens.size();
+        fout.write(reinterpret_cast<const char *>(&normalize), sizeof(uint8_t));
+        fout.write(reinterpret_cast<const char *>(&n_tokens), sizeof(uint32_t));
+        fout.write(reinterpret_cast<const char *>(e.tokens.data()), n_tokens * sizeof(clip_vocab_id));
+        fout.write(reinterpret_cast<const char *>(e.vec.data()), dim * sizeof(float));
+    }
+
+    if (!fout.good()) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname);
+        return false;
+    }
+
+    return true;
+}
+
+bool clip_text_cache_load(clip_ctx * ctx, const char * fname) {
+    if (ctx->text_cache.max_bytes == 0) {
+        fprintf(stderr, "%s: the text embedding cache is disabled, call clip_text_cache_enable first\n", __func__);
+        return false;
+    }
+
+    std::ifstream fin(fname, std::ios::binary | std::ios::ate);
+    if (!fin.is_open()) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+        return false;
+    }
+    const size_t file_size = fin.tellg();
+    fin.seekg(0);
+
+    uint32_t header[4];
+    uint64_t fingerprint = 0;
+    fin.read(reinterpret_cast<char *>(header), sizeof(header));
+    fin.read(reinterpret_cast<char *>(&fingerprint), sizeof(fingerprint));
+    if (!fin.good() || header[0] != CLIP_TEXT_CACHE_MAGIC || header[1] != CLIP_TEXT_CACHE_VERSION) {
+        fprintf(stderr, "%s: '%s' is not a text embedding cache file\n", __func__, fname);
+        return false;
+    }
+
+    const int dim = ctx->text_model.hparams.projection_dim;
+    if (header[2] != (uint32_t)dim) {
+        fprintf(stderr, "%s: cache was built for embeddings of size %u, but the model has %d\n", __func__, header[2], dim);
+        return false;
+    }
+    if (fingerprint != ctx->fingerprint) {
+        fprintf(stderr, "%s: '%s' was built with another model\n", __func__, fname);
+        return false;
+    }
+
+    // the counts are checked against the file before anything is allocated for them
+    const size_t min_entry_size = sizeof(uint8_t) + sizeof(uint32_t) + dim * sizeof(float);
+    const size_t max_tokens = ctx->text_model.hparams.num_positions;
+    if (header[3] > (file_size - sizeof(header) - sizeof(fingerprint)) / min_entry_size) {
+        fprintf(stderr, "%s: '%s' is truncated\n", __func__, fname);
+        return false;
+    }
+
+    std::vector<clip_text_cache::entry> entries(header[3]);
+    for (auto & e : entries) {
+        uint8_t normalize;
+        uint32_t n_tokens;
+        fin.read(reinterpret_cast<char *>(&normalize), sizeof(uint8_t));
+        fin.read(reinterpret_cast<char *>(&n_tokens), sizeof(uint32_t));
+        if (!fin.good()) {
+            break;
+        }
+        if (n_tokens > max_tokens) {
+            fprintf(stderr, "%s: '%s' is corrupt, an entry has %u tokens\n", __func__, fname, n_tokens);
+            return false;
+        }
+        e.normalize = normalize != 0;
+        e.tokens.resize(n_tokens);
+        e.vec.resize(dim);
+        fin.read(reinterpret_cast<char *>(e.tokens.data()), n_tokens * sizeof(clip_vocab_id));
+        fin.read(reinterpret_cast<char *>(e.vec.data()), dim * sizeof(float));
+    }
+
+    if (!fin.good()) {
+        fprintf(stderr, "%s: '%s' is truncated\n", __func__, fname);
+        return false;
+    }
+
+    // insert least recently used first to restore the order; entries beyond the budget get evicted as usual
+    auto & cache = ctx->text_cache;
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        cache.put(it->tokens.data(), it->tokens.size(), it->normalize, it->vec.data(), dim);
+    }
+
+    return true;
+}
+
+bool clip_image_encode(const clip_ctx * ctx, const int n_threads, clip_image_f32 * img, float * vec, const bool normalize) {
+    if (!ctx->has_vision_encoder) {
+        printf("This gguf file seems to have no vision encoder\n");
+        return false;
+    }
+
+    clip_image_f32_batch imgs{};
+    imgs.size = 1;
+    imgs.data = img;
+    return clip_image_batch_encode(ctx, n_threads, &imgs, vec, normalize);
+}
+
+// Input staging: writes image b of the batch to dst as planar f32 (CHW), normalized.
+// The compact image types are converted here, so they are expanded to f32 one image at a time.
+typedef void (*image_stage_fn)(const clip_ctx * ctx, const void * imgs, const int b, float * dst);
+
+static void stage_image_f32(const clip_ctx * ctx, const void * imgs, const int b, float * dst) {
+    const clip_image_f32 & img = static_cast<const clip_image_f32_batch *>(imgs)->data[b];
+    const int image_size = ctx->vision_model.hparams.image_size;
+    GGML_ASSERT(img.nx == image_size && img.ny == image_size);
+
+    const int n = img.nx * img.ny;
+    for (int k = 0; k < 3; k++) {
+        for (int i = 0; i < n; i++) {
+            dst[k * n + i] = img.data[3 * i + k];
+        }
+    }
+}
+
+static void stage_image_u8(const clip_ctx * ctx, const void * imgs, const int b, float * dst) {
+    const clip_image_u8 & img = static_cast<const clip_image_u8_batch *>(imgs)->data[b];
+    const int image_size = ctx->vision_model.hparams.image_size;
+    GGML_ASSERT(img.nx == image_size && img.ny == image_size);
+
+    // normalization folded into a lookup table per channel
+    float lut[3][256];
+    for (int k = 0; k < 3; k++) {
+        for (int v = 0; v < 256; v++) {
+            lut[k][v] = ((v / 255.0f) - ctx->image_mean[k]) / ctx->image_std[k];
+        }
+    }
+
+    const int n = img.nx * img.ny;
+    for (int k = 0; k < 3; k++) {
+        for (int i = 0; i < n; i++) {
+            dst[k * n + i] = lut[k][img.data[3 * i + k]];
+        }
+    }
+}
+
+static void stage_image_f16(const clip_ctx * ctx, const void * imgs, const int b, float * dst) {
+    const clip_image_f16 & img = static_cast<const clip_image_f16_batch *>(imgs)->data[b];
+    const int image_size = ctx->vision_model.hparams.image_size;
+    GGML_ASSERT(img.nx == image_size && img.ny == image_size);
+
+    const int n = img.nx * img.ny;
+    for (int k = 0; k < 3; k++) {
+        for (int i = 0; i < n; i++) {
+            dst[k * n + i] = ggml_fp16_to_fp32(img.data[3 * i + k]);
+        }
+    }
+}
+
+static bool clip_image_batch_encode_impl(const clip_ctx * ctx, const int n_threads, const void * imgs,
+                                         const int batch_size, image_stage_fn stage, float * vec, const bool normalize);
+
+bool clip_image_batch_encode(const clip_ctx * ctx, const int n_threads, const clip_image_f32_batch * imgs, float * vec,
+                             const bool normalize) {
+    return clip_image_batch_encode_impl(ctx, n_threads, imgs, imgs->size, stage_image_f32, vec, normalize);
+}
+
+bool clip_image_batch_encode_u8(const clip_ctx * ctx, const int n_threads, const clip_image_u8_batch * imgs, float * vec,
+                                const bool normalize) {
+    return clip_image_batch_encode_impl(ctx, n_threads, imgs, imgs->size, stage_image_u8, vec, normalize);
+}
+
+bool clip_image_batch_encode_f16(const clip_ctx * ctx, const int n_threads, const clip_image_f16_batch * imgs, float * vec,
+                                 const bool normalize) {
+    return clip_image_batch_encode_impl(ctx, n_threads, imgs, imgs->size, stage_image_f16, vec, normalize);
+}
+
+static bool clip_image_batch_encode_impl(const clip_ctx * ctx, const int n_threads, const void * imgs,
+                                         const int batch_size, image_stage_fn stage, float * vec, const bool normalize) {
+
+    if (!ctx->has_vision_encoder) {
+        printf("This gguf file seems to have no vision encoder\n");
+        return false;
+    }
+
+    const auto & model = ctx->vision_model;
+    const auto & hparams = model.hparams;
+
+    const int image_size = hparams.image_size;
+    const int patch_size = hparams.patch_size;
+    const int num_patches = ((image_size / patch_size) * (image_size / patch_size));
+    const int num_positions = num_patches + 1;
+    const int hidden_size = hparams.hidden_size;
+    const int n_head = hparams.n_head;
+    const int d_head = hidden_size / n_head;
+    const int n_layer = hparams.n_layer;
+    const int n_intermediate = hparams.n_intermediate;
+    const int projection_dim = hparams.projection_dim;
+    const float eps = hparams.eps;
+
+    // the buffers of ctx serve one encode at a time
+    std::lock_guard<std::mutex> lock(ctx->compute_mutex);
+    auto & buf_compute = ctx->buf_compute;
+
+    struct ggml_init_params params = {
+        .mem_size = buf_compute.size,
+        .mem_buffer = buf_compute.data,
+        .no_alloc = false,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+    struct ggml_cgraph gf = {};
+
+    const size_t scr0_size = ctx->buf_scratch.size;
+    void * scr0 = ctx->buf_scratch.data;
+
+    struct ggml_tensor * inp_raw = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, image_size, image_size, 3, batch_size);
+
+    {
+        float * data = (float *)ggml_get_data(inp_raw);
+        const int n = image_size * image_size;
+
+        for (int b = 0; b < batch_size; b++) {
+            stage(ctx, imgs, b, data + b * 3 * n);
+        }
+    }
+
+    struct ggml_tensor * inp = ggml_conv_2d(ctx0, model.patch_embeddings, inp_raw, patch_size, patch_size, 0, 0, 1, 1);
+
+    inp = ggml_reshape_3d(ctx0, inp, num_patches, hidden_size, batch_size);
+    inp = ggml_cont(ctx0, ggml_permute(ctx0, inp, 1, 0, 2, 3));
+
+    // concat class_embeddings and patch_embeddings
+    struct ggml_tensor * embeddings = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, num_positions, batch_size);
+
+    ggml_set_zero(embeddings);
+    struct ggml_tensor * temp = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, 1, batch_size);
+
+    embeddings = ggml_acc(ctx0, embeddings, ggml_repeat(ctx0, model.class_embedding, temp), embeddings->nb[1],
+                          embeddings->nb[2], embeddings->nb[3], 0);
+    embeddings =
+        ggml_acc(ctx0, embeddings, inp, embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], model.class_embedding->nb[1]);
+
+    struct ggml_tensor * positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_positions);
+    for (int i = 0; i < num_positions; i++) {
+        ggml_set_i32_1d(positions, i, i);
+    }
+
+    embeddings =
+        ggml_add(ctx0, embeddings, ggml_repeat(ctx0, ggml_get_rows(ctx0, model.position_embeddings, positions), embeddings));
+
+    // pre-layernorm
+    {
+        embeddings = ggml_norm(ctx0, embeddings, eps);
+
+        embeddings = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.pre_ln_w, embeddings), embeddings),
+                              ggml_repeat(ctx0, model.pre_ln_b, embeddings));
+    }
+
+    std::vector<clip_layer_observation> observations;
+    observations.reserve(n_layer);
+
+    // loop over layers
+    for (int il = 0; il < n_layer; il++) {
+        struct ggml_tensor * cur = embeddings; // embeddings = residual, cur = hidden_states
+
+        const size_t nb_q_w = model.layers[il].q_w->nb[0];
+
+        ggml_set_scratch(ctx0, {0, scr0_size, scr0});
+
+        // layernorm1
+        {
+            cur = ggml_norm(ctx0, cur, eps);
+
+            cur = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers[il].ln_1_w, cur), cur),
+                           ggml_repeat(ctx0, model.layers[il].ln_1_b, cur));
+        }
+
+        // self-attention
+        {
+
+            struct ggml_tensor * Q = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].q_b, cur),
+                                              weight_mul_mat(ctx0, ctx, model.layers[il].q_w, cur));
+
+            Q = ggml_scale_inplace(ctx0, Q, ggml_new_f32(ctx0, 1.0f / sqrt((float)d_head)));
+            Q = ggml_reshape_4d(ctx0, Q, d_head, n_head, num_positions, batch_size);
+            Q = ggml_cont(ctx0, ggml_permute(ctx0, Q, 0, 2, 1, 3));
+            Q = ggml_reshape_3d(ctx0, Q, d_head, num_positions, n_head * batch_size);
+
+            struct ggml_tensor * K = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].k_b, cur),
+                                              weight_mul_mat(ctx0, ctx, model.layers[il].k_w, cur));
+
+            K = ggml_reshape_4d(ctx0, K, d_head, n_head, num_positions, batch_size);
+            K = ggml_cont(ctx0, ggml_permute(ctx0, K, 0, 2, 1, 3));
+            K = ggml_reshape_3d(ctx0, K, d_head, num_positions, n_head * batch_size);
+
+            struct ggml_tensor * V = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].v_b, cur),
+                                              weight_mul_mat(ctx0, ctx, model.layers[il].v_w, cur));
+
+            V = ggml_reshape_4d(ctx0, V, d_head, n_head, num_positions, batch_size);
+            V = ggml_cont(ctx0, ggml_permute(ctx0, V, 1, 2, 0, 3));
+            V = ggml_reshape_3d(ctx0, V, num_positions, d_head, n_head * batch_size);
+
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+            KQ = ggml_soft_max_inplace(ctx0, KQ);
+            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ);
+            KQV = ggml_reshape_4d(ctx0, KQV, d_head, num_positions, n_head, batch_size);
+            KQV = ggml_cont(ctx0, ggml_permute(ctx0, KQV, 0, 2, 1, 3));
+
+            cur = ggml_cpy(ctx0, KQV, ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, num_positions, batch_size));
+        }
+
+        // attention output
+        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].o_b, cur),
+                       weight_mul_mat(ctx0, ctx, model.layers[il].o_w, cur));
+
+        // re-add the layer input, e.g., residual
+        cur = ggml_add(ctx0, cur, embeddings);
+
+        embeddings = cur; // embeddings = residual, cur = hidden_states
+
+        // layernorm2
+        {
+            cur = ggml_norm(ctx0, cur, eps);
+
+            cur = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers[il].ln_2_w, cur), cur),
+                           ggml_repeat(ctx0, model.layers[il].ln_2_b, cur));
+        }
+
+        cur = weight_mul_mat(ctx0, ctx, model.layers[il].ff_i_w, cur);
+        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].ff_i_b, cur), cur);
+
+        if (ctx->use_gelu) {
+            cur = ggml_gelu_inplace(ctx0, cur);
+        } else {
+            cur = ggml_gelu_quick_inplace(ctx0, cur);
+        }
+
+        cur = weight_mul_mat(ctx0, ctx, model.layers[il].ff_o_w, cur);
+        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].ff_o_b, cur), cur);
+
+        // residual 2
+        cur = ggml_add(ctx0, embeddings, cur);
+
+        embeddings = observe_layer(ctx0, ctx, observations, il, cur);
+    }
+
+    // get the output of cls token, e.g., 0th index
+    struct ggml_tensor * cls = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, batch_size);
+    for (int b = 0; b < batch_size; b++) {
+        ggml_set_i32_1d(cls, b, b * num_positions);
+    }
+    embeddings = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, embeddings, hidden_size, num_positions * batch_size), cls);
+
+    // post-layernorm
+    {
+        embeddings = ggml_norm(ctx0, embeddings, eps);
+
+        embeddings = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.post_ln_w, embeddings), embeddings),
+                              ggml_repeat(ctx0, model.post_ln_b, embeddings));
+    }
+
+    ggml_set_scratch(ctx0, {0, 0, nullptr});
+
+    // final visual projection
+    embeddings = weight_mul_mat(ctx0, ctx, model.projection, embeddings);
+
+    // normalize output embeddings
+    struct ggml_tensor * output = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, projection_dim, batch_size);
+
+    for (int b = 0; b < batch_size; b++) {
+        struct ggml_tensor * embedding = ggml_get_rows(ctx0, embeddings, ggml_new_i32(ctx0, b));
+        if (normalize) {
+            ggml_tensor * length = ggml_sqrt(ctx0, ggml_sum(ctx0, ggml_sqr(ctx0, embedding)));
+            embedding = ggml_scale_inplace(ctx0, embedding, ggml_div(ctx0, ggml_new_f32(ctx0, 1.0f), length));
+        }
+        output = ggml_acc(ctx0, output, embedding, output->nb[1], output->nb[2], output->nb[3], b * ggml_nbytes(embedding));
+    }
+    ggml_set_name(output, "check");
+
+    // run the computation
+    ggml_build_forward_expand(&gf, output);
+    ggml_cplan cplan = ggml_graph_plan(&gf, n_threads);
+    cplan.work_size *= batch_size;
+    if (cplan.work_size != 0) {
+        cplan.work_data = (uint8_t *)malloc(cplan.work_size);
+    }
+    ggml_graph_compute(&gf, &cplan);
+
+// print
+#ifdef CLIP_DEBUG
+    {
+        auto print_t_f32 = [&](struct ggml_tensor * t) {
+            float * data = (float *)t->data;
+            printf("dtype: f32, dims: %jd %jd %jd %jd, nb: %jd %jd %jd %jd\n", t->ne[0], t->ne[1], t->ne[2], t->ne[3], t->nb[0],
+                   t->nb[1], t->nb[2], t->nb[3]);
+            printf("data: ");
+            for (int i = 0; i < std::min((int)t->ne[0], 20); i++) {
+                printf("%f ", data[i]);
+            }
+
+            // printf("\n\n");
+            double sum = 0.0;
+            for (int i = 0; i < ggml_nelements(t); i++) {
+                sum += data[i];
+            }
+            printf("sum:  %f\n", sum);
+        };
+
+        auto print_t_f16 = [&](struct ggml_tensor * t) {
+            ggml_fp16_t * data = (ggml_fp16_t *)t->data;
+            printf("dtype: f16, dims: %jd %jd %jd %jd\n", t->ne[0], t->ne[1], t->ne[2], t->ne[3]);
+            printf("data: ");
+            for (int i = 0; i < std::min((int)t->ne[0], 10); i++) {
+                printf("%f ", ggml_fp16_to_fp32(data[i]));
+            }
+            printf("\n\n");
+            double sum = 0.0;
+            for (int i = 0; i < ggml_nelements(t); i++) {
+                sum += ggml_fp16_to_fp32(data[i]);
+            }
+            printf("sum:  %f\n", sum);
+        };
+
+        auto * t = ggml_get_tensor(ctx0, "check");
+        // auto t = inp_raw;
+        if (t->type == GGML_TYPE_F32) {
+            print_t_f32(t);
+        } else {
+            print_t_f16(t);
+        }
+    }
+
+    printf("used_mem = %zu\n", ggml_used_mem(ctx0));
+#endif
+
+    memcpy(vec, ggml_get_data_f32(output), sizeof(float) * projection_dim * batch_size);
+
+    if (cplan.work_size != 0) {
+        free(cplan.work_data);
+    }
+
+    ggml_free(ctx0);
+
+    return true;
+}
+
+//
+// similarity kernels
+//
+
+typedef struct {
+    range_fn fn;
+    void * arg;
+    size_t start;
+    size_t end;
+} RangeTask;
+
+static void * run_range_task(void * arg) {
+    const RangeTask * task = static_cast<RangeTask *>(arg);
+    task->fn(task->arg, task->start, task->end);
+    return NULL;
+}
+
+static void parallel_for(const int n_threads, const size_t n, const size_t min_per_thread, range_fn fn, void * arg) {
+    const size_t max_threads = std::max<size_t>(1, n / std::max<size_t>(1, min_per_thread));
+    const int num_threads = std::max(1, (int)std::min<size_t>(n_threads, max_threads));
+    if (num_threads == 1) {
+        fn(arg, 0, n);
+        return;
+    }
+
+    const size_t per_thread = (n + num_threads - 1) / num_threads;
+    std::vector<RangeTask> tasks(num_threads);
+    std::vector<pthread_t> threads(num_threads);
+    for (int t = 0; t < num_threads; t++) {
+        tasks[t] = {fn, arg, std::min(n, t * per_thread), std::min(n, (t + 1) * per_thread)};
+    }
+
+    for (int t = 1; t < num_threads; t++) {
+        pthread_create(&threads[t], NULL, run_range_task, &tasks[t]);
+    }
+    run_range_task(&tasks[0]);
+    for (int t = 1; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+static inline float vec_dot_f32(const float * x, const float * y, const int n) {
+    int i = 0;
+    float sum = 0.0f;
+#if defined(__AVX__)
+    __m256 acc[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+    for (; i + 32 <= n; i += 32) {
+        for (int j = 0; j < 4; j++) {
+#if defined(__FMA__)
+            acc[j] = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8 * j), _mm256_loadu_ps(y + i + 8 * j), acc[j]);
+#else
+            acc[j] = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(x + i + 8 * j), _mm256_loadu_ps(y + i + 8 * j)), acc[j]);
+#endif
+        }
+    }
+    // short vectors such as PQ subvectors
+    for (; i + 8 <= n; i += 8) {
+        acc[0] = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)), acc[0]);
+    }
+    sum = hsum_f32_8(_mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3])));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc[4] = {vdupq_n_f32(0.0f), vdupq_n_f32(0.0f), vdupq_n_f32(0.0f), vdupq_n_f32(0.0f)};
+    for (; i + 16 <= n; i += 16) {
+        for (int j = 0; j < 4; j++) {
+            acc[j] = vfmaq_f32(acc[j], vld1q_f32(x + i + 4 * j), vld1q_f32(y + i + 4 * j));
+        }
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc[0] = vfmaq_f32(acc[0], vld1q_f32(x + i), vld1q_f32(y + i));
+    }
+    sum = vaddvq_f32(vaddq_f32(vaddq_f32(acc[0], acc[1]), vaddq_f32(acc[2], acc[3])));
+#endif
+    for (; i < n; i++) {
+        sum += x[i] * y[i];
+    }
+    return sum;
+}
+
+static inline float vec_dot_f32_f16(const float * x, const ggml_fp16_t * y, const int n) {
+    int i = 0;
+    float sum = 0.0f;
+#if defined(__AVX__) && defined(__F16C__)
+    __m256 acc[2] = {_mm256_setzero_ps(), _mm256_setzero_ps()};
+    for (; i + 16 <= n; i += 16) {
+        for (int j = 0; j < 2; j++) {
+            const __m256 yv = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(y + i + 8 * j)));
+#if defined(__FMA__)
+            acc[j] = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8 * j), yv, acc[j]);
+#else
+            acc[j] = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(x + i + 8 * j), yv), acc[j]);
+#endif
+        }
+    }
+    sum = hsum_f32_8(_mm256_add_ps(acc[0], acc[1]));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc[2] = {vdupq_n_f32(0.0f), vdupq_n_f32(0.0f)};
+    for (; i + 8 <= n; i += 8) {
+        for (int j = 0; j < 2; j++) {
+            const float32x4_t yv = vcvt_f32_f16(vld1_f16((const __fp16 *)(y + i + 4 * j)));
+            acc[j] = vfmaq_f32(acc[j], vld1q_f32(x + i + 4 * j), yv);
+        }
+    }
+    sum = vaddvq_f32(vaddq_f32(acc[0], acc[1]));
+#endif
+    for (; i < n; i++) {
+        sum += x[i] * ggml_fp16_to_fp32(y[i]);
+    }
+    return sum;
+}
+
+// x and y in [-127, 127]
+static inline int32_t vec_dot_i8(const int8_t * x, const int8_t * y, const int n) {
+    int i = 0;
+    int32_t sum = 0;
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+#if defined(CLIP_DPBUSD)
+    // vpdpbusd multiplies unsigned by signed bytes, so x * y is computed as |x| * (y with the sign of x)
+    for (; i + 32 <= n; i += 32) {
+        const __m256i xv = _mm256_loadu_si256((const __m256i *)(x + i));
+        const __m256i yv = _mm256_loadu_si256((const __m256i *)(y + i));
+        acc = CLIP_DPBUSD(acc, _mm256_sign_epi8(xv, xv), _mm256_sign_epi8(yv, xv));
+    }
+#endif
+    for (; i + 32 <= n; i += 32) {
+        for (int j = 0; j < 2; j++) {
+            const __m256i xv = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(x + i + 16 * j)));
+            const __m256i yv = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(y + i + 16 * j)));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(xv, yv));
+        }
+    }
+    sum = hsum_i32_8(acc);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 16 <= n; i += 16) {
+        const int8x16_t xv = vld1q_s8(x + i);
+        const int8x16_t yv = vld1q_s8(y + i);
+        acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(xv), vget_low_s8(yv)));
+        acc = vpadalq_s16(acc, vmull_s8(vget_high_s8(xv), vget_high_s8(yv)));
+    }
+    sum = vaddvq_s32(acc);
+#endif
+    for (; i < n; i++) {
+        sum += (int32_t)x[i] * (int32_t)y[i];
+    }
+    return sum;
+}
+
+// number of differing bits of two n-byte codes
+static inline int vec_hamming(const uint8_t * x, const uint8_t * y, const int n) {
+    int i = 0;
+    int sum = 0;
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512F__)
+    __m512i acc = _mm512_setzero_si512();
+    for (; i + 64 <= n; i += 64) {
+        const __m512i d = _mm512_xor_si512(_mm512_loadu_si512(x + i), _mm512_loadu_si512(y + i));
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(d));
+    }
+    sum = _mm512_reduce_add_epi64(acc);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint16x8_t acc = vdupq_n_u16(0);
+    for (; i + 16 <= n; i += 16) {
+        acc = vpadalq_u8(acc, vcntq_u8(veorq_u8(vld1q_u8(x + i), vld1q_u8(y + i))));
+    }
+    sum = vaddlvq_u16(acc);
+#endif
+    for (; i + 8 <= n; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, x + i, sizeof(a));
+        memcpy(&b, y + i, sizeof(b));
+        sum += __builtin_popcountll(a ^ b);
+    }
+    for (; i < n; i++) {
+        sum += __builtin_popcount(x[i] ^ y[i]);
+    }
+    return sum;
+}
+
+// keys are scored in blocks that stay in cache while every query is run against them,
+// so each key is read from memory once no matter how many queries there are
+static const size_t SIMILARITY_KEY_BLOCK = 64;
+
+typedef struct {
+    const void * queries;
+    const float * query_scales;
+    size_t n_queries;
+    const void * keys;
+    const float * key_scales;
+    size_t n_keys;
+    int dim;
+    float * out;
+} SimilarityArgs;
+
+template <typename T_query, typename T_key, typename F>
+static void similarity_blocks(const SimilarityArgs * a, const size_t block_start, const size_t block_end, F dot) {
+    const T_query * queries = static_cast<const T_query *>(a->queries);
+    const T_key * keys = static_cast<const T_key *>(a->keys);
+    const size_t dim = a->dim;
+    for (size_t kb = block_start * SIMILARITY_KEY_BLOCK; kb < std::min(a->n_keys, block_end * SIMILARITY_KEY_BLOCK);
+         kb += SIMILARITY_KEY_BLOCK) {
+        const size_t kb_end = std::min(a->n_keys, kb + SIMILARITY_KEY_BLOCK);
+        for (size_t q = 0; q < a->n_queries; q++) {
+            float * out = a->out + q * a->n_keys;
+            for (size_t k = kb; k < kb_end; k++) {
+                out[k] = dot(queries + q * dim, keys + k * dim, q, k);
+            }
+        }
+    }
+}
+
+static void similarity_f32(void * arg, size_t start, size_t end) {
+    const SimilarityArgs * a = static_cast<SimilarityArgs *>(arg);
+    similarity_blocks<float, float>(a, start, end, [a](const float * q, const float * k, size_t, size_t) {
+        return vec_dot_f32(q, k, a->dim);
+    });
+}
+
+static void similarity_f16(void * arg, size_t start, size_t end) {
+    const SimilarityArgs * a = static_cast<SimilarityArgs *>(arg);
+    similarity_blocks<float, ggml_fp16_t>(a, start, end, [a](const float * q, const ggml_fp16_t * k, size_t, size_t) {
+        return vec_dot_f32_f16(q, k, a->dim);
+    });
+}
+
+static void similarity_i8(void * arg, size_t start, size_t end) {
+    const SimilarityArgs * a = static_cast<SimilarityArgs *>(arg);
+    similarity_blocks<int8_t, int8_t>(a, start, end, [a](const int8_t * q, const int8_t * k, size_t iq, size_t ik) {
+        return vec_dot_i8(q, k, a->dim) * a->query_scales[iq] * a->key_scales[ik];
+    });
+}
+
+// dim is the code size in bytes
+static void similarity_bin(void * arg, size_t start, size_t end) {
+    const SimilarityArgs * a = static_cast<SimilarityArgs *>(arg);
+    const float inv_bits = 1.0f / (8 * a->dim);
+    similarity_blocks<uint8_t, uint8_t>(a, start, end, [a, inv_bits](const uint8_t * q, const uint8_t * k, size_t, size_t) {
+        return 1.0f - 2.0f * vec_hamming(q, k, a->dim) * inv_bits;
+    });
+}
+
+static void similarity_matrix(const SimilarityArgs & args, const int n_threads, range_fn fn) {
+    const size_t n_blocks = (args.n_keys + SIMILARITY_KEY_BLOCK - 1) / SIMILARITY_KEY_BLOCK;
+    parallel_for(n_threads, n_blocks, 1, fn, const_cast<SimilarityArgs *>(&args));
+}
+
+float clip_similarity_score(const float * vec1, const float * vec2, const int vec_dim) {
+    return vec_dot_f32(vec1, vec2, vec_dim);
+}
+
+void clip_similarity_matrix(const float * queries, const size_t n_queries, const float * keys, const size_t n_keys,
+                            const int vec_dim, const int n_threads, float * out) {
+    const SimilarityArgs args = {queries, nullptr, n_queries, keys, nullptr, n_keys, vec_dim, out};
+    similarity_matrix(args, n_threads, similarity_f32);
+}
+
+void clip_similarity_matrix_f16(const float * queries, const size_t n_queries, const ggml_fp16_t * keys,
+                                const size_t n_keys, const int vec_dim, const int n_threads, float * out) {
+    const SimilarityArgs args = {queries, nullptr, n_queries, keys, nullptr, n_keys, vec_dim, out};
+    similarity_matrix(args, n_threads, similarity_f16);
+}
+
+void clip_similarity_matrix_i8(const int8_t * queries, const float * query_scales, const size_t n_queries,
+                               const int8_t * keys, const float * key_scales, const size_t n_keys, const int vec_dim,
+                               const int n_threads, float * out) {
+    const SimilarityArgs args = {queries, query_scales, n_queries, keys, key_scales, n_keys, vec_dim, out};
+    similarity_matrix(args, n_threads, similarity_i8);
+}
+
+void clip_similarity_matrix_bin(const uint8_t * queries, const size_t n_queries, const uint8_t * keys,
+                                const size_t n_keys, const int vec_dim, const int n_threads, float * out) {
+    const SimilarityArgs args = {queries, nullptr, n_queries, keys, nullptr, n_keys, (vec_dim + 7) / 8, out};
+    similarity_matrix(args, n_threads, similarity_bin);
+}
+
+void clip_vecs_quantize_i8(const float * vecs, const size_t n_vecs, const int vec_dim, int8_t * out, float * scales) {
+    for (size_t i = 0; i < n_vecs; i++) {
+        const float * vec = vecs + i * vec_dim;
+        float amax = 0.0f;
+        for (int d = 0; d < vec_dim; d++) {
+            amax = std::max(amax, fabsf(vec[d]));
+        }
+
+        const float scale = amax / 127.0f;
+        const float inv_scale = scale > 0.0f ? 1.0f / scale : 0.0f;
+        for (int d = 0; d < vec_dim; d++) {
+            out[i * vec_dim + d] = (int8_t)roundf(vec[d] * inv_scale);
+        }
+        scales[i] = scale;
+    }
+}
+
+void clip_vecs_binarize(const float * vecs, const size_t n_vecs, const int vec_dim, uint8_t * out) {
+    const int n_bytes = (vec_dim + 7) / 8;
+    for (size_t i = 0; i < n_vecs; i++) {
+        const float * vec = vecs + i * vec_dim;
+        uint8_t * code = out + i * n_bytes;
+        memset(code, 0, n_bytes);
+        for (int d = 0; d < vec_dim; d++) {
+            code[d / 8] |= (uint8_t)(vec[d] > 0.0f) << (d % 8);
+        }
+    }
+}
+
+bool clip_compare_text_and_image(const clip_ctx * ctx, const int n_threads, const char * text, const clip_image_u8 * image,
+                                 float * score) {
+    if (!(ctx->has_text_encoder && ctx->has_vision_encoder)) {
+        printf("clip_compare_text_and_image function can only be used with two-tower models\n");
+        return false;
+    }
+
+    // prepare image and text vectors
+    const int projection_dim = ctx->vision_model.hparams.projection_dim;
+    float img_vec[projection_dim];
+    float txt_vec[projection_dim];
+
+    // tokenize and encode text
+    clip_tokens tokens;
+    if (!clip_tokenize(ctx, text, &tokens)) {
+        return false;
+    }
+
+    const bool encoded = clip_text_encode(ctx, n_threads, &tokens, txt_vec, true);
+    clip_tokens_free(&tokens);
+    if (!encoded) {
+        return false;
+    }
+
+    // preprocess and encode image
+    clip_image_f32 img_res;
+
+    if (!clip_image_preprocess(ctx, image, &img_res)) {
+        return false;
+    }
+
+    if (!clip_image_encode(ctx, n_threads, &img_res, img_vec, true)) {
+        return false;
+    }
+
+    // compute similarity
+    *score = clip_similarity_score(img_vec, txt_vec, projection_dim);
+
+    return true;
+}
+
+// ranks higher scores first, ties by lower index
+template <typename T>
+static inline bool score_index_greater(const std::pair<float, T> & a, const std::pair<float, T> & b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+// keeps the k best entries seen so far in a min-heap, the worst of them at the front
+template <typename T>
+static inline void top_k_push(std::vector<std::pair<float, T>> & heap, const int k, const std::pair<float, T> & cur) {
+    if ((int)heap.size() < k) {
+        heap.push_back(cur);
+        std::push_heap(heap.begin(), heap.end(), score_index_greater<T>);
+    } else if (score_index_greater(cur, heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), score_index_greater<T>);
+        heap.back() = cur;
+        std::push_heap(heap.begin(), heap.end(), score_index_greater<T>);
+    }
+}
+
+// top-k of the logits with a bounded min-heap, then the softmax probability of those k only.
+// softmax is monotonic, so selecting on the logits gives the same order. heap is scratch space of k pairs
+static void softmax_top_k(const float * logits, const int n, const int k, std::vector<std::pair<float, int>> & heap,
+                          float * top_scores, int * top_indices) {
+    heap.clear();
+    float max_logit = -INFINITY;
+    for (int i = 0; i < n; i++) {
+        max_logit = std::max(max_logit, logits[i]);
+        top_k_push(heap, k, std::pair<float, int>(logits[i], i));
+    }
+
+    // shifted by the max logit so that exp never overflows
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += expf(logits[i] - max_logit);
+    }
+
+    std::sort_heap(heap.begin(), heap.end(), score_index_greater<int>);
+    for (int i = 0; i < (int)heap.size(); i++) {
+        top_scores[i] = expf(heap[i].first - max_logit) / sum;
+        top_indices[i] = heap[i].second;
+    }
+}
+
+bool clip_softmax_top_k(const float * logits, const int n, const int k, float * top_scores, int * top_indices) {
+    if (n <= 0 || k <= 0 || k > n) {
+        return false;
+    }
+
+    std::vector<std::pair<float, int>> heap;
+    heap.reserve(k);
+    softmax_top_k(logits, n, k, heap, top_scores, top_indices);
+
+    return true;
+}
+
+bool clip_softmax_top_k_batch(const float * logits, const size_t n_rows, const int n, const int k, float * top_scores,
+                              int * top_indices) {
+    if (n <= 0 || k <= 0 || k > n) {
+        return false;
+    }
+
+    std::vector<std::pair<float, int>> heap;
+    heap.reserve(k);
+    for (size_t r = 0; r < n_rows; r++) {
+        softmax_top_k(logits + r * n, n, k, heap, top_scores + r * k, top_indices + r * k);
+    }
+
+    return true;
+}
+
+bool softmax_with_sorting(float * arr, const int length, float * sorted_scores, int * indices) {
+    if (!clip_softmax_top_k(arr, length, length, sorted_scores, indices)) {
+        return false;
+    }
+
+    // callers also expect the probabilities in place
+    for (int i = 0; i < length; i++) {
+        arr[indices[i]] = sorted_scores[i];
+    }
+
+    return true;
+}
+
+// zero-shot classifier: a contiguous matrix of normalized class embeddings, built once and reused for every image
+struct clip_zsl {
+    const clip_ctx * ctx;
+    int n_labels;
+    int vec_dim;
+    std::vector<float> label_vecs; // [n_labels, vec_dim]
+};
+
+// CLIP's learned temperature, exp(logit_scale), which is fixed at its maximum of 100 in the released models
+static const float CLIP_LOGIT_SCALE = 100.0f;
+
+clip_zsl * clip_zsl_make(const clip_ctx * ctx, const int n_threads, const char ** labels, const size_t n_labels,
+                         const char ** templates, const size_t n_templates) {
+    if (!(ctx->has_text_encoder && ctx->has_vision_encoder)) {
+        printf("clip_zsl_make function can only be used with two-tower models\n");
+        return nullptr;
+    }
+
+    const int vec_dim = ctx->text_model.hparams.projection_dim;
+    const int num_positions = ctx->text_model.hparams.num_positions;
+
+    // expand the templates for every label
+    const size_t n_prompts_per_label = n_templates > 0 ? n_templates : 1;
+    std::vector<std::string> prompts;
+    prompts.reserve(n_labels * n_prompts_per_label);
+    for (size_t i = 0; i < n_labels; i++) {
+        if (n_templates == 0) {
+            prompts.push_back(labels[i]);
+            continue;
+        }
+        for (size_t j = 0; j < n_templates; j++) {
+            std::string prompt = templates[j];
+            const size_t pos = prompt.find("{c}");
+            if (pos != std::string::npos) {
+                prompt.replace(pos, 3, labels[i]);
+            }
+            prompts.push_back(prompt);
+        }
+    }
+
+    std::vector<const char *> prompt_ptrs(prompts.size());
+    for (size_t i = 0; i < prompts.size(); i++) {
+        prompt_ptrs[i] = prompts[i].c_str();
+    }
+
+    std::vector<clip_vocab_id> tokens(prompts.size() * num_positions);
+    std::vector<int32_t> lengths(prompts.size());
+    if (!clip_tokenize_batch(ctx, n_threads, prompt_ptrs.data(), prompts.size(), tokens.data(), lengths.data())) {
+        return nullptr;
+    }
+
+    clip_zsl * zsl = new clip_zsl;
+    zsl->ctx = ctx;
+    zsl->n_labels = n_labels;
+    zsl->vec_dim = vec_dim;
+    zsl->label_vecs.assign(n_labels * vec_dim, 0.0f);
+
+    // class embedding = normalized mean of the normalized prompt embeddings
+    std::vector<float> prompt_vec(vec_dim);
+    for (size_t i = 0; i < n_labels; i++) {
+        float * label_vec = zsl->label_vecs.data() + i * vec_dim;
+        for (size_t j = 0; j < n_prompts_per_label; j++) {
+            const size_t p = i * n_prompts_per_label + j;
+            clip_tokens prompt_tokens = {tokens.data() + p * num_positions, (size_t)lengths[p]};
+            if (!clip_text_encode(ctx, n_threads, &prompt_tokens, prompt_vec.data(), true)) {
+                fprintf(stderr, "%s: failed to encode '%s'\n", __func__, prompts[p].c_str());
+                delete zsl;
+                return nullptr;
+            }
+            for (int d = 0; d < vec_dim; d++) {
+                label_vec[d] += prompt_vec[d];
+            }
+        }
+
+        const float norm = sqrtf(clip_similarity_score(label_vec, label_vec, vec_dim));
+        for (int d = 0; d < vec_dim; d++) {
+            label_vec[d] /= norm;
+        }
+    }
+
+    return zsl;
+}
+
+void clip_zsl_free(clip_zsl * zsl) { delete zsl; }
+
+size_t clip_zsl_n_labels(const clip_zsl * zsl) { return zsl->n_labels; }
+
+bool clip_zsl_classify_vecs(const clip_zsl * zsl, const int n_threads, const float * img_vecs, const size_t n_images,
+                            const int k, float * scores, int * indices) {
+    const int n_labels = zsl->n_labels;
+
+    std::vector<float> logits(n_images * n_labels);
+    clip_similarity_matrix(img_vecs, n_images, zsl->label_vecs.data(), n_labels, zsl->vec_dim, n_threads, logits.data());
+    for (auto & logit : logits) {
+        logit *= CLIP_LOGIT_SCALE;
+    }
+
+    return clip_softmax_top_k_batch(logits.data(), n_images, n_labels, k, scores, indices);
+}
+
+bool clip_zsl_classify(const clip_zsl * zsl, const int n_threads, const clip_image_u8 * img, const int k, float * scores,
+                       int * indices) {
+    clip_image_f32 img_res;
+    if (!clip_image_preprocess(zsl->ctx, img, &img_res)) {
+        return false;
+    }
+
+    std::vector<float> img_vec(zsl->vec_dim);
+    const bool encoded = clip_image_encode(zsl->ctx, n_threads, &img_res, img_vec.data(), true);
+    clip_image_f32_clean(&img_res);
+    if (!encoded) {
+        return false;
+    }
+
+    return clip_zsl_classify_vecs(zsl, n_threads, img_vec.data(), 1, k, scores, indices);
+}
+
+bool clip_zsl_classify_batch(const clip_zsl * zsl, const int n_threads, const clip_image_u8_batch * imgs, const int k,
+                             float * scores, int * indices) {
+    std::vector<clip_image_f32> imgs_resized(imgs->size);
+    clip_image_f32_batch imgs_resized_batch = {imgs_resized.data(), imgs_resized.size()};
+    clip_image_batch_preprocess(zsl->ctx, n_threads, imgs, &imgs_resized_batch);
+
+    std::vector<float> img_vecs(imgs->size * zsl->vec_dim);
+    const bool encoded = clip_image_batch_encode(zsl->ctx, n_threads, &imgs_resized_batch, img_vecs.data(), true);
+    for (auto & img : imgs_resized) {
+        clip_image_f32_clean(&img);
+    }
+    if (!encoded) {
+        return false;
+    }
+
+    return clip_zsl_classify_vecs(zsl, n_threads, img_vecs.data(), imgs->size, k, scores, indices);
+}
+
+bool clip_zero_shot_label_image(struct clip_ctx * ctx, const int n_threads, const struct clip_image_u8 * input_img,
+                                const char ** labels, const size_t n_labels, float * scores, int * indices) {
+    if (!(ctx->has_text_encoder && ctx->has_vision_encoder)) {
+        printf("clip_zero_shot_label_image function can only be used with two-tower models\n");
+        return false;
+    }
+
+    clip_zsl * zsl = clip_zsl_make(ctx, n_threads, labels, n_labels, nullptr, 0);
+    if (!zsl) {
+        return false;
+    }
+
+    const bool ok = clip_zsl_classify(zsl, n_threads, input_img, n_labels, scores, indices);
+    clip_zsl_free(zsl);
+
+    return ok;
+}
+
+//
+// embedding index
+//
+
+// file layout, all sections aligned to CLIP_INDEX_ALIGNMENT so that a mapping of the file can be used in place:
+// header | ids (i64 * n_vecs) | scales (f32 * n_vecs, int8 only) | vectors (row_size * n_vecs)
+struct clip_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t type;
+    uint32_t vec_dim;
+    uint64_t n_vecs;
+};
+
+static const uint32_t CLIP_INDEX_MAGIC = 0x78696c63; // "clix"
+static const uint32_t CLIP_INDEX_VERSION = 1;
+static const size_t CLIP_INDEX_ALIGNMENT = 64;
+
+static size_t align_up(const size_t n, const size_t alignment) { return (n + alignment - 1) / alignment * alignment; }
+
+struct clip_index {
+    clip_index_type type;
+    int vec_dim;
+    size_t n_vecs = 0;
+
+    // storage owned by the index
+    std::vector<int64_t> ids_buf;
+    std::vector<float> scales_buf;
+    std::vector<uint8_t> vecs_buf;
+
+    // read-only mapping of an index file, used in place of the buffers above until the index is modified
+    void * mapping = nullptr;
+    size_t mapping_size = 0;
+
+    const int64_t * ids = nullptr;
+    const float * scales = nullptr;
+    const uint8_t * vecs = nullptr;
+
+    size_t row_size() const {
+        switch (type) {
+        case CLIP_INDEX_F16:
+            return vec_dim * sizeof(ggml_fp16_t);
+        case CLIP_INDEX_I8:
+            return vec_dim * sizeof(int8_t);
+        case CLIP_INDEX_BIN:
+            return (vec_dim + 7) / 8;
+        default:
+            return vec_dim * sizeof(float);
+        }
+    }
+
+    void use_buffers() {
+        ids = ids_buf.data();
+        scales = scales_buf.data();
+        vecs = vecs_buf.data();
+    }
+
+    void unmap() {
+#ifndef _WIN32
+        if (mapping) {
+            munmap(mapping, mapping_size);
+        }
+#endif
+        mapping = nullptr;
+        mapping_size = 0;
+    }
+
+    // copies a mapped index into owned buffers so that it can be modified
+    void materialize() {
+        if (!mapping) {
+            return;
+        }
+        ids_buf.assign(ids, ids + n_vecs);
+        if (type == CLIP_INDEX_I8) {
+            scales_buf.assign(scales, scales + n_vecs);
+        }
+        vecs_buf.assign(vecs, vecs + n_vecs * row_size());
+        unmap();
+        use_buffers();
+    }
+
+    ~clip_index() { unmap(); }
+};
+
+clip_index * clip_index_make(const int vec_dim, const enum clip_index_type type) {
+    if (vec_dim <= 0 || type < CLIP_INDEX_F32 || type > CLIP_INDEX_BIN) {
+        fprintf(stderr, "%s: invalid index parameters\n", __func__);
+        return nullptr;
+    }
+
+    clip_index * index = new clip_index;
+    index->type = type;
+    index->vec_dim = vec_dim;
+    index->use_buffers();
+    return index;
+}
+
+void clip_index_free(clip_index * index) { delete index; }
+
+size_t clip_index_size(const clip_index * index) { return index->n_vecs; }
+
+int clip_index_dim(const clip_index * index) { return index->vec_dim; }
+
+void clip_index_reserve(clip_index * index, const size_t n_vecs) {
+    index->materialize();
+    index->ids_buf.reserve(n_vecs);
+    if (index->type == CLIP_INDEX_I8) {
+        index->scales_buf.reserve(n_vecs);
+    }
+    index->vecs_buf.reserve(n_vecs * index->row_size());
+    index->use_buffers();
+}
+
+bool clip_index_add(clip_index * index, const float * vecs, const int64_t * ids, const size_t n_vecs) {
+    index->materialize();
+
+    const size_t row_size = index->row_size();
+    const size_t n_before = index->n_vecs;
+    index->ids_buf.insert(index->ids_buf.end(), ids, ids + n_vecs);
+    index->vecs_buf.resize((n_before + n_vecs) * row_size);
+
+    uint8_t * dst = index->vecs_buf.data() + n_before * row_size;
+    switch (index->type) {
+    case CLIP_INDEX_F32:
+        memcpy(dst, vecs, n_vecs * row_size);
+        break;
+    case CLIP_INDEX_F16:
+        ggml_fp32_to_fp16_row(vecs, reinterpret_cast<ggml_fp16_t *>(dst), n_vecs * index->vec_dim);
+        break;
+    case CLIP_INDEX_I8:
+        index->scales_buf.resize(n_before + n_vecs);
+        clip_vecs_quantize_i8(vecs, n_vecs, index->vec_dim, reinterpret_cast<int8_t *>(dst),
+                              index->scales_buf.data() + n_before);
+        break;
+    case CLIP_INDEX_BIN:
+        clip_vecs_binarize(vecs, n_vecs, index->vec_dim, dst);
+        break;
+    }
+
+    index->n_vecs += n_vecs;
+    index->use_buffers();
+    return true;
+}
 
-        std::regex re(pat);
-        std::smatch m;
+const int64_t * clip_index_ids(const clip_index * index) { return index->ids; }
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
-        }
-    }
+size_t clip_index_remove(clip_index * index, const int64_t * ids, const size_t n_ids) {
+    index->materialize();
 
-    std::vector<clip_vocab::id> v_tokens;
-    v_tokens.push_back(49406); // startoftext
+    std::vector<int64_t> removed(ids, ids + n_ids);
+    std::sort(removed.begin(), removed.end());
 
-    for (const auto & word : words) {
-        // feel lucky? let's try if it's a full word
-        std::string full_word = "";
-        if (word.find(" ") == 0) // starts_with for C++11
-        {
-            full_word += word.substr(1);
-        } else {
-            full_word += word;
-        }
-        full_word += "</w>";
-        auto wit = ctx->vocab.token_to_id.find(full_word);
-        if (wit != ctx->vocab.token_to_id.end()) {
-            v_tokens.push_back(wit->second);
+    // compact the rows that are kept, in order
+    const size_t row_size = index->row_size();
+    size_t n_kept = 0;
+    for (size_t r = 0; r < index->n_vecs; r++) {
+        if (std::binary_search(removed.begin(), removed.end(), index->ids_buf[r])) {
             continue;
         }
-
-        for (int i = 0; i < word.size();) {
-            for (int j = word.size() - 1; j >= i; j--) {
-                auto cand = word.substr(i, j - i + 1);
-                auto it = ctx->vocab.token_to_id.find(cand);
-                if (it != ctx->vocab.token_to_id.end()) { // word.substr(i, j-i+1) in vocab
-                    v_tokens.push_back(it->second);
-                    i = j + 1;
-                    break;
-                } else if (j == i) { // word.substr(i, 1) has no matching
-                    fprintf(stderr, "%s: unknown token '%s'\n", __func__, word.substr(i, 1).data());
-                    i++;
-                }
+        if (n_kept != r) {
+            index->ids_buf[n_kept] = index->ids_buf[r];
+            if (index->type == CLIP_INDEX_I8) {
+                index->scales_buf[n_kept] = index->scales_buf[r];
             }
+            memcpy(index->vecs_buf.data() + n_kept * row_size, index->vecs_buf.data() + r * row_size, row_size);
         }
+        n_kept++;
     }
 
-    v_tokens.push_back(49407); // endoftext
-
-    tokens->size = v_tokens.size();
-
-    tokens->data = new int[v_tokens.size()];
-    std::copy(v_tokens.begin(), v_tokens.end(), tokens->data);
+    const size_t n_removed = index->n_vecs - n_kept;
+    index->ids_buf.resize(n_kept);
+    if (index->type == CLIP_INDEX_I8) {
+        index->scales_buf.resize(n_kept);
+    }
+    index->vecs_buf.resize(n_kept * row_size);
+    index->n_vecs = n_kept;
+    index->use_buffers();
 
-    return true;
+    return n_removed;
 }
 
-clip_image_u8 * clip_image_u8_make() { return new clip_image_u8(); }
-
-clip_image_f32 * clip_image_f32_make() { return new clip_image_f32(); }
+typedef struct {
+    const clip_index * index;
+    SimilarityArgs sim;  // queries and their scales, keys are set per chunk
+    range_fn similarity; // kernel matching the storage type
+    size_t chunk_size;   // keys scored at once, a multiple of SIMILARITY_KEY_BLOCK
+    int k;
+    std::mutex * mutex;
+    std::vector<std::pair<float, int>> * heaps; // merged results, one heap per query
+} IndexSearchArgs;
+
+// scores the key chunks [start, end) against all queries and merges the per-query top-k into the shared heaps
+static void index_search_chunks(void * arg, size_t start, size_t end) {
+    const IndexSearchArgs * a = static_cast<IndexSearchArgs *>(arg);
+    const clip_index * index = a->index;
+    const size_t n_queries = a->sim.n_queries;
+
+    std::vector<std::vector<std::pair<float, int>>> heaps(n_queries);
+    std::vector<float> scores(n_queries * a->chunk_size);
+
+    for (size_t c = start; c < end; c++) {
+        const size_t key_start = c * a->chunk_size;
+        const size_t n_keys = std::min(a->chunk_size, index->n_vecs - key_start);
+
+        SimilarityArgs sim = a->sim;
+        sim.keys = index->vecs + key_start * index->row_size();
+        sim.key_scales = index->scales + (index->type == CLIP_INDEX_I8 ? key_start : 0);
+        sim.n_keys = n_keys;
+        sim.out = scores.data();
+        a->similarity(&sim, 0, (n_keys + SIMILARITY_KEY_BLOCK - 1) / SIMILARITY_KEY_BLOCK);
+
+        for (size_t q = 0; q < n_queries; q++) {
+            for (size_t i = 0; i < n_keys; i++) {
+                top_k_push(heaps[q], a->k, std::pair<float, int>(scores[q * n_keys + i], key_start + i));
+            }
+        }
+    }
 
-void clip_image_u8_clean(clip_image_u8* img) {
-    if (img->data){
-	delete[] img->data;
-	img->data = NULL;
+    std::lock_guard<std::mutex> lock(*a->mutex);
+    for (size_t q = 0; q < n_queries; q++) {
+        for (const auto & cur : heaps[q]) {
+            top_k_push(a->heaps[q], a->k, cur);
+        }
     }
 }
 
-void clip_image_f32_clean(clip_image_f32* res) {
-    if (res->data){
-	delete[] res->data;
-	res->data = NULL;
+// the k best rows of each query, each heap sorted in descending order of score
+static void index_search_rows(const clip_index * index, const float * queries, const size_t n_queries, const int k,
+                              const int n_threads, std::vector<std::vector<std::pair<float, int>>> & heaps) {
+    const int vec_dim = index->vec_dim;
+
+    // int8 and binary indices score queries of the same type
+    std::vector<int8_t> queries_i8;
+    std::vector<float> query_scales;
+    std::vector<uint8_t> queries_bin;
+    if (index->type == CLIP_INDEX_I8) {
+        queries_i8.resize(n_queries * vec_dim);
+        query_scales.resize(n_queries);
+        clip_vecs_quantize_i8(queries, n_queries, vec_dim, queries_i8.data(), query_scales.data());
+    } else if (index->type == CLIP_INDEX_BIN) {
+        queries_bin.resize(n_queries * index->row_size());
+        clip_vecs_binarize(queries, n_queries, vec_dim, queries_bin.data());
     }
-}
 
-void clip_image_u8_free(clip_image_u8* img) {
-    clip_image_u8_clean(img);
-    delete img;
-}
+    std::mutex mutex;
+    heaps.assign(n_queries, {});
 
-void clip_image_f32_free(clip_image_f32* res) {
-    clip_image_f32_clean(res);
-    delete res;
+    IndexSearchArgs args;
+    args.index = index;
+    args.sim = {queries, nullptr, n_queries, nullptr, nullptr, 0, vec_dim, nullptr};
+    switch (index->type) {
+    case CLIP_INDEX_F32:
+        args.similarity = similarity_f32;
+        break;
+    case CLIP_INDEX_F16:
+        args.similarity = similarity_f16;
+        break;
+    case CLIP_INDEX_I8:
+        args.similarity = similarity_i8;
+        args.sim.queries = queries_i8.data();
+        args.sim.query_scales = query_scales.data();
+        break;
+    case CLIP_INDEX_BIN:
+        args.similarity = similarity_bin;
+        args.sim.queries = queries_bin.data();
+        args.sim.dim = index->row_size();
+        break;
+    }
+    args.k = k;
+    args.mutex = &mutex;
+
+    // the score buffer of each thread holds 256K scores, ~1 MB: up to 4096 queries are run at once against chunks of
+    // at least SIMILARITY_KEY_BLOCK keys, more queries go in blocks of 4096, each reading the index once
+    const size_t max_scores = 256 * 1024;
+    const size_t query_block = max_scores / SIMILARITY_KEY_BLOCK;
+    const size_t query_size = index->type == CLIP_INDEX_I8    ? vec_dim * sizeof(int8_t)
+                              : index->type == CLIP_INDEX_BIN ? index->row_size()
+                                                              : vec_dim * sizeof(float);
+    const uint8_t * all_queries = static_cast<const uint8_t *>(args.sim.queries);
+    for (size_t q0 = 0; q0 < n_queries; q0 += query_block) {
+        const size_t n_block = std::min(query_block, n_queries - q0);
+        args.sim.queries = all_queries + q0 * query_size;
+        args.sim.query_scales = index->type == CLIP_INDEX_I8 ? query_scales.data() + q0 : nullptr;
+        args.sim.n_queries = n_block;
+        args.heaps = heaps.data() + q0;
+        args.chunk_size = align_up(std::max<size_t>(1, max_scores / n_block), SIMILARITY_KEY_BLOCK);
+
+        const size_t n_chunks = (index->n_vecs + args.chunk_size - 1) / args.chunk_size;
+        parallel_for(n_threads, n_chunks, 1, index_search_chunks, &args);
+    }
+
+    for (auto & heap : heaps) {
+        std::sort_heap(heap.begin(), heap.end(), score_index_greater<int>);
+    }
 }
 
-bool clip_image_load_from_file(const char * fname, clip_image_u8 * img) {
-    int nx, ny, nc;
-    auto data = stbi_load(fname, &nx, &ny, &nc, 3);
-    if (!data) {
-        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+bool clip_index_search(const clip_index * index, const float * queries, const size_t n_queries, const int k,
+                       const int n_threads, float * scores, int64_t * ids) {
+    if (k <= 0) {
         return false;
     }
 
-    img->nx = nx;
-    img->ny = ny;
-    img->size = nx * ny * 3;
-    img->data = new uint8_t[img->size]();
-    memcpy(img->data, data, img->size);
+    std::vector<std::vector<std::pair<float, int>>> heaps;
+    index_search_rows(index, queries, n_queries, k, n_threads, heaps);
 
-    stbi_image_free(data);
+    for (size_t q = 0; q < n_queries; q++) {
+        const auto & heap = heaps[q];
+        for (int i = 0; i < k; i++) {
+            const bool found = i < (int)heap.size();
+            scores[q * k + i] = found ? heap[i].first : -INFINITY;
+            ids[q * k + i] = found ? index->ids[heap[i].second] : -1;
+        }
+    }
 
     return true;
 }
 
-static inline double bicubic_filter(double x) {
-#define a -0.5
-    if (x < 0.0) {
-        x = -x;
-    }
-    if (x < 1.0) {
-        return ((a + 2.0) * x - (a + 3.0)) * x * x + 1;
-    }
-    if (x < 2.0) {
-        return (((x - 5) * x + 8) * x - 4) * a;
+// exact score of a row of an f32, f16 or int8 index. q_i8 and q_scale are the quantized query, for int8 indices only
+static float index_row_similarity(const clip_index * index, const float * q, const int8_t * q_i8, const float q_scale,
+                                  const size_t row) {
+    const uint8_t * v = index->vecs + row * index->row_size();
+    switch (index->type) {
+    case CLIP_INDEX_F16:
+        return vec_dot_f32_f16(q, reinterpret_cast<const ggml_fp16_t *>(v), index->vec_dim);
+    case CLIP_INDEX_I8:
+        return vec_dot_i8(q_i8, reinterpret_cast<const int8_t *>(v), index->vec_dim) * q_scale * index->scales[row];
+    default:
+        return vec_dot_f32(q, reinterpret_cast<const float *>(v), index->vec_dim);
     }
-    return 0.0;
-#undef a
 }
 
-static bool precompute_coeffs(int inSize, float in0, float in1, int outSize, double ** kkp, int ** boundsp, int * ksize) {
-    double support = 2.0; // Bicubic filter support from Resample.c
-    double filterscale = (double)(in1 - in0) / outSize;
-    if (filterscale < 1.0) {
-        filterscale = 1.0;
+typedef struct {
+    const clip_index * coarse;
+    const clip_index * fine;
+    const float * queries;
+    const std::vector<std::vector<std::pair<float, int>>> * candidates;
+    int k;
+    float * scores;
+    int64_t * ids;
+    std::atomic<bool> * misaligned; // set when a candidate row holds another id in the fine index
+} IndexRerankArgs;
+
+static void index_rerank_queries(void * arg, size_t start, size_t end) {
+    const IndexRerankArgs * a = static_cast<IndexRerankArgs *>(arg);
+    const clip_index * fine = a->fine;
+
+    std::vector<int8_t> q_i8(fine->type == CLIP_INDEX_I8 ? fine->vec_dim : 0);
+    float q_scale = 0.0f;
+    std::vector<std::pair<float, int>> heap;
+    for (size_t qi = start; qi < end; qi++) {
+        const float * q = a->queries + qi * fine->vec_dim;
+        if (fine->type == CLIP_INDEX_I8) {
+            clip_vecs_quantize_i8(q, 1, fine->vec_dim, q_i8.data(), &q_scale);
+        }
+
+        heap.clear();
+        for (const auto & cand : (*a->candidates)[qi]) {
+            if (fine->ids[cand.second] != a->coarse->ids[cand.second]) {
+                *a->misaligned = true;
+                return;
+            }
+            const float score = index_row_similarity(fine, q, q_i8.data(), q_scale, cand.second);
+            top_k_push(heap, a->k, std::pair<float, int>(score, cand.second));
+        }
+        std::sort_heap(heap.begin(), heap.end(), score_index_greater<int>);
+
+        for (int i = 0; i < a->k; i++) {
+            const bool found = i < (int)heap.size();
+            a->scores[qi * a->k + i] = found ? heap[i].first : -INFINITY;
+            a->ids[qi * a->k + i] = found ? a->coarse->ids[heap[i].second] : -1;
+        }
     }
-    support *= filterscale;
-    int ksize_local = (int)ceil(support) * 2 + 1;
+}
 
-    double * kk = (double *)malloc(outSize * ksize_local * sizeof(double));
-    int * bounds = (int *)malloc(outSize * 2 * sizeof(int));
-    if (!kk || !bounds) {
-        free(kk);
-        free(bounds);
+bool clip_index_search_rerank(const clip_index * coarse, const clip_index * fine, const float * queries,
+                              const size_t n_queries, const int k, const int n_candidates, const int n_threads,
+                              float * scores, int64_t * ids) {
+    if (k <= 0) {
+        return false;
+    }
+    if (fine->type == CLIP_INDEX_BIN || fine->vec_dim != coarse->vec_dim || fine->n_vecs < coarse->n_vecs) {
+        fprintf(stderr, "%s: the fine index must hold f32, f16 or int8 vectors for every row of the coarse index\n",
+                __func__);
         return false;
     }
 
-    for (int xx = 0; xx < outSize; xx++) {
-        double center = in0 + (xx + 0.5) * (in1 - in0) / outSize;
-        double ww = 0.0;
-        double ss = 1.0 / filterscale;
-        int xmin = (int)(center - support + 0.5);
-        if (xmin < 0)
-            xmin = 0;
-        int xmax = (int)(center + support + 0.5);
-        if (xmax > inSize)
-            xmax = inSize;
-        xmax -= xmin;
+    std::vector<std::vector<std::pair<float, int>>> candidates;
+    index_search_rows(coarse, queries, n_queries, std::max(k, n_candidates), n_threads, candidates);
 
-        double * k = &kk[xx * ksize_local];
-        for (int x = 0; x < xmax; x++) {
-            double w = bicubic_filter((x + xmin - center + 0.5) * ss);
-            k[x] = w;
-            ww += w;
-        }
-        for (int x = 0; x < xmax; x++) {
-            if (ww != 0.0) {
-                k[x] /= ww;
-            }
-        }
-        for (int x = xmax; x < ksize_local; x++) {
-            k[x] = 0.0;
-        }
-        bounds[xx * 2 + 0] = xmin;
-        bounds[xx * 2 + 1] = xmax;
+    std::atomic<bool> misaligned{false};
+    IndexRerankArgs args = {coarse, fine, queries, &candidates, k, scores, ids, &misaligned};
+    parallel_for(n_threads, n_queries, 1, index_rerank_queries, &args);
+    if (misaligned) {
+        fprintf(stderr, "%s: the rows of the coarse and fine indexes hold different ids\n", __func__);
+        return false;
     }
 
-    *kkp = kk;
-    *boundsp = bounds;
-    *ksize = ksize_local;
     return true;
 }
 
-// normalize: x = (x - mean) / std
-bool clip_image_preprocess(const clip_ctx * ctx, const clip_image_u8 * img, clip_image_f32 * res) {
-    if (!ctx->has_vision_encoder) {
-        printf("This gguf file seems to have no vision encoder\n");
+static void index_section_offsets(const clip_index_header & hdr, const size_t row_size, size_t * ids_offset,
+                                  size_t * scales_offset, size_t * vecs_offset, size_t * file_size) {
+    *ids_offset = align_up(sizeof(clip_index_header), CLIP_INDEX_ALIGNMENT);
+    *scales_offset = align_up(*ids_offset + hdr.n_vecs * sizeof(int64_t), CLIP_INDEX_ALIGNMENT);
+    const size_t scales_size = hdr.type == CLIP_INDEX_I8 ? hdr.n_vecs * sizeof(float) : 0;
+    *vecs_offset = align_up(*scales_offset + scales_size, CLIP_INDEX_ALIGNMENT);
+    *file_size = *vecs_offset + hdr.n_vecs * row_size;
+}
+
+bool clip_index_save(const clip_index * index, const char * fname) {
+    std::ofstream fout(fname, std::ios::binary);
+    if (!fout.is_open()) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
         return false;
     }
 
-    const int nx = img->nx;
-    const int ny = img->ny;
-    const int nx2 = ctx->vision_model.hparams.image_size;
-    const int ny2 = ctx->vision_model.hparams.image_size;
+    const clip_index_header hdr = {CLIP_INDEX_MAGIC, CLIP_INDEX_VERSION, (uint32_t)index->type, (uint32_t)index->vec_dim,
+                                   index->n_vecs};
+    size_t ids_offset, scales_offset, vecs_offset, file_size;
+    index_section_offsets(hdr, index->row_size(), &ids_offset, &scales_offset, &vecs_offset, &file_size);
 
-    // Setting the output image size and allocating memory
-    res->nx = nx2;
-    res->ny = ny2;
-    res->size = 3 * nx2 * ny2;
-    res->data = new float[res->size]();
-    if (!res->data) {
-        printf("clip_image_f32 Memory allocation failed\n");
+    auto write_at = [&fout](const size_t offset, const void * data, const size_t size) {
+        static const char zeros[CLIP_INDEX_ALIGNMENT] = {};
+        fout.write(zeros, offset - (size_t)fout.tellp());
+        fout.write(reinterpret_cast<const char *>(data), size);
+    };
+
+    write_at(0, &hdr, sizeof(hdr));
+    write_at(ids_offset, index->ids, index->n_vecs * sizeof(int64_t));
+    if (index->type == CLIP_INDEX_I8) {
+        write_at(scales_offset, index->scales, index->n_vecs * sizeof(float));
+    }
+    write_at(vecs_offset, index->vecs, index->n_vecs * index->row_size());
+
+    if (!fout.good()) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname);
         return false;
     }
 
-    // Calculate aspect ratio maintaining scaling
-    const float scale = std::min((float)nx, (float)ny) / (float)ctx->vision_model.hparams.image_size;
-    const int nx3 = (int)(nx / scale + 0.5f);
-    const int ny3 = (int)(ny / scale + 0.5f);
+    return true;
+}
 
-    const auto & m3 = ctx->image_mean;
-    const auto & s3 = ctx->image_std;
+clip_index * clip_index_load(const char * fname, const bool use_mmap) {
+    std::ifstream fin(fname, std::ios::binary);
+    if (!fin.is_open()) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+        return nullptr;
+    }
 
-    // Calculating horizontal and vertical coeffs
-    double *kk_horiz, *kk_vert;
-    int *bounds_horiz, *bounds_vert;
-    int ksize_horiz, ksize_vert;
+    clip_index_header hdr;
+    fin.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+    if (!fin.good() || hdr.magic != CLIP_INDEX_MAGIC || hdr.version != CLIP_INDEX_VERSION || hdr.type > CLIP_INDEX_BIN) {
+        fprintf(stderr, "%s: '%s' is not an index file\n", __func__, fname);
+        return nullptr;
+    }
 
-    if (!precompute_coeffs(nx, 0.0f, (float)nx, nx3, &kk_horiz, &bounds_horiz, &ksize_horiz) ||
-        !precompute_coeffs(ny, 0.0f, (float)ny, ny3, &kk_vert, &bounds_vert, &ksize_vert)) {
-        delete[] res->data;
-        free(kk_horiz);
-        free(bounds_horiz);
-        free(kk_vert);
-        free(bounds_vert);
-        printf("Failed to calculate coeffs\n");
-        return false;
+    clip_index * index = clip_index_make(hdr.vec_dim, (clip_index_type)hdr.type);
+    if (!index) {
+        return nullptr;
     }
+    index->n_vecs = hdr.n_vecs;
 
-    // Intermediate image buffer (stores horizontal resampling results)
-    float * temp = new float[3 * nx3 * ny]();
-    if (!temp) {
-        delete[] res->data;
-        free(kk_horiz);
-        free(bounds_horiz);
-        free(kk_vert);
-        free(bounds_vert);
-        printf("Failed to allocate intermediate buffer memory\n");
-        return false;
+    size_t ids_offset, scales_offset, vecs_offset, file_size;
+    index_section_offsets(hdr, index->row_size(), &ids_offset, &scales_offset, &vecs_offset, &file_size);
+
+    fin.seekg(0, std::ios::end);
+    if ((size_t)fin.tellg() < file_size) {
+        fprintf(stderr, "%s: '%s' is truncated\n", __func__, fname);
+        delete index;
+        return nullptr;
     }
 
-    // Horizontal bicubic resampling
-    for (int y = 0; y < ny; y++) {
-        for (int xx = 0; xx < nx3; xx++) {
-            int xmin = bounds_horiz[xx * 2 + 0];
-            int xmax = bounds_horiz[xx * 2 + 1];
-            double * k = &kk_horiz[xx * ksize_horiz];
-            for (int c = 0; c < 3; c++) {
-                double ss = 0.0;
-                for (int x = 0; x < xmax; x++) {
-                    int src_idx = 3 * (y * nx + (x + xmin)) + c;
-                    ss += (double)img->data[src_idx] * k[x];
-                }
-                int dst_idx = 3 * (y * nx3 + xx) + c;
-                temp[dst_idx] = std::min(std::max((float)ss, 0.0f), 255.0f);
-            }
+#ifndef _WIN32
+    if (use_mmap) {
+        const int fd = open(fname, O_RDONLY);
+        void * addr = fd >= 0 ? mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (addr != MAP_FAILED) {
+            index->mapping = addr;
+            index->mapping_size = file_size;
+            const uint8_t * base = static_cast<const uint8_t *>(addr);
+            index->ids = reinterpret_cast<const int64_t *>(base + ids_offset);
+            index->scales = reinterpret_cast<const float *>(base + scales_offset);
+            index->vecs = base + vecs_offset;
+            return index;
         }
+        fprintf(stderr, "%s: failed to mmap '%s', reading it instead\n", __func__, fname);
     }
+#endif
 
-    // Vertical bicubic resampling
-    float * resampled = new float[3 * nx3 * ny3]();
-    if (!resampled) {
-        delete[] temp;
-        delete[] res->data;
-        free(kk_horiz);
-        free(bounds_horiz);
-        free(kk_vert);
-        free(bounds_vert);
-        printf("Failed to allocate resampling buffer memory\n");
-        return false;
+    index->ids_buf.resize(hdr.n_vecs);
+    fin.seekg(ids_offset);
+    fin.read(reinterpret_cast<char *>(index->ids_buf.data()), hdr.n_vecs * sizeof(int64_t));
+    if (hdr.type == CLIP_INDEX_I8) {
+        index->scales_buf.resize(hdr.n_vecs);
+        fin.seekg(scales_offset);
+        fin.read(reinterpret_cast<char *>(index->scales_buf.data()), hdr.n_vecs * sizeof(float));
+    }
+    index->vecs_buf.resize(hdr.n_vecs * index->row_size());
+    fin.seekg(vecs_offset);
+    fin.read(reinterpret_cast<char *>(index->vecs_buf.data()), index->vecs_buf.size());
+    index->use_buffers();
+
+    if (!fin.good()) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname);
+        delete index;
+        return nullptr;
     }
 
-    for (int yy = 0; yy < ny3; yy++) {
-        int ymin = bounds_vert[yy * 2 + 0];
-        int ymax = bounds_vert[yy * 2 + 1];
-        double * k = &kk_vert[yy * ksize_vert];
-        for (int x = 0; x < nx3; x++) {
-            for (int c = 0; c < 3; c++) {
-                double ss = 0.0;
-                for (int y = 0; y < ymax; y++) {
-                    int src_idx = 3 * ((y + ymin) * nx3 + x) + c;
-                    ss += (double)temp[src_idx] * k[y];
-                }
-                int dst_idx = 3 * (yy * nx3 + x) + c;
-                resampled[dst_idx] = std::min(std::max((float)ss, 0.0f), 255.0f);
-            }
+    return index;
+}
+
+//
+// HNSW index
+//
+
+// file layout, sections aligned to CLIP_INDEX_ALIGNMENT like the flat index:
+// header | ids (i64 * n_vecs) | levels (u8 * n_vecs) | offsets of the upper links of each node (u64 * n_vecs) |
+// level 0 links (u32 * n_vecs * (1 + 2M)) | upper links (u32 * n_upper_links) | vectors (row_size * n_vecs)
+// every link list is a count followed by the fixed capacity of the level
+struct clip_hnsw_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t type;
+    uint32_t vec_dim;
+    uint32_t M;
+    uint32_t ef_construction;
+    uint32_t ef_search;
+    int32_t max_level;
+    uint32_t entry_point;
+    uint32_t padding;
+    uint64_t n_vecs;
+    uint64_t n_upper_links;
+};
+
+static const uint32_t CLIP_HNSW_MAGIC = 0x6e686c63; // "clhn"
+static const uint32_t CLIP_HNSW_VERSION = 1;
+
+// marks visited nodes with a tag that changes on every search, so the array is cleared only on wrap around
+struct hnsw_visited {
+    std::vector<uint32_t> marks;
+    uint32_t tag = 0;
+
+    void reset(const size_t n) {
+        if (marks.size() < n) {
+            marks.resize(n, 0);
+        }
+        if (++tag == 0) {
+            std::fill(marks.begin(), marks.end(), 0);
+            tag = 1;
+        }
+    }
+
+    // true the first time a node is seen
+    bool visit(const uint32_t i) {
+        if (marks[i] == tag) {
+            return false;
         }
+        marks[i] = tag;
+        return true;
     }
+};
 
-    // Center crop and normalize
-    int x_offset = (nx3 - nx2) / 2;
-    int y_offset = (ny3 - ny2) / 2;
+typedef std::pair<float, uint32_t> hnsw_candidate; // similarity, node
+
+struct clip_hnsw {
+    clip_hnsw_params params;
+    int vec_dim;
+    int M0; // link capacity of level 0
+    size_t n_vecs = 0;
+    int max_level = -1;
+    uint32_t entry_point = 0;
+
+    // storage owned by the index
+    std::vector<uint8_t> vecs_buf;
+    std::vector<int64_t> ids_buf;
+    std::vector<uint8_t> levels_buf;
+    std::vector<uint32_t> links0_buf;             // n_vecs * (1 + M0)
+    std::vector<std::vector<uint32_t>> upper_buf; // per node, levels 1..level * (1 + M)
+
+    // read-only mapping of an index file, used until the index is modified
+    void * mapping = nullptr;
+    size_t mapping_size = 0;
+    const uint64_t * upper_offsets = nullptr;
+    const uint32_t * upper_links = nullptr;
+
+    const uint8_t * vecs = nullptr;
+    const int64_t * ids = nullptr;
+    const uint8_t * levels = nullptr;
+    const uint32_t * links0 = nullptr;
+
+    // insertion locks, one per node plus one for the entry point
+    std::unique_ptr<std::mutex[]> node_locks;
+    size_t n_node_locks = 0;
+    std::mutex entry_lock;
+
+    std::mt19937_64 rng;
+
+    size_t row_size() const {
+        return vec_dim * (params.type == CLIP_INDEX_F16 ? sizeof(ggml_fp16_t) : sizeof(float));
+    }
 
-    for (int yy = 0; yy < ny2; yy++) {
-        for (int x = 0; x < nx2; x++) {
-            int src_y = yy + y_offset;
-            int src_x = x + x_offset;
-            int src_idx = 3 * (src_y * nx3 + src_x);
-            int dst_idx = 3 * (yy * nx2 + x);
-            for (int c = 0; c < 3; c++) {
-                float v = resampled[src_idx + c];
-                res->data[dst_idx + c] = ((v / 255.0f) - m3[c]) / s3[c];
-            }
+    const uint32_t * links(const uint32_t i, const int level) const {
+        if (level == 0) {
+            return links0 + (size_t)i * (1 + M0);
         }
+        const size_t offset = (size_t)(level - 1) * (1 + params.M);
+        return mapping ? upper_links + upper_offsets[i] + offset : upper_buf[i].data() + offset;
     }
 
-    delete[] resampled;
-    delete[] temp;
-    free(kk_horiz);
-    free(bounds_horiz);
-    free(kk_vert);
-    free(bounds_vert);
+    // only valid for owned storage
+    uint32_t * links_mut(const uint32_t i, const int level) {
+        if (level == 0) {
+            return links0_buf.data() + (size_t)i * (1 + M0);
+        }
+        return upper_buf[i].data() + (size_t)(level - 1) * (1 + params.M);
+    }
 
-    return true;
-}
+    float similarity(const float * q, const uint32_t i) const {
+        const uint8_t * v = vecs + i * row_size();
+        if (params.type == CLIP_INDEX_F16) {
+            return vec_dot_f32_f16(q, reinterpret_cast<const ggml_fp16_t *>(v), vec_dim);
+        }
+        return vec_dot_f32(q, reinterpret_cast<const float *>(v), vec_dim);
+    }
 
-// Structure to hold the image data as an input to function to be executed for thread
-typedef struct {
-    const clip_image_u8 * input;
-    clip_image_f32 * resized;
-    const clip_ctx * ctx;
-} ImageData;
+    // vector of node i in f32, converted into scratch for f16 storage
+    const float * vec_f32(const uint32_t i, std::vector<float> & scratch) const {
+        const uint8_t * v = vecs + i * row_size();
+        if (params.type == CLIP_INDEX_F16) {
+            scratch.resize(vec_dim);
+            ggml_fp16_to_fp32_row(reinterpret_cast<const ggml_fp16_t *>(v), scratch.data(), vec_dim);
+            return scratch.data();
+        }
+        return reinterpret_cast<const float *>(v);
+    }
 
-// Structure to hold the range of images to be processed by a thread
-// closed interval
-typedef struct {
-    ImageData* start;
-    ImageData* end;
-} ImageDataRange;
+    void use_buffers() {
+        vecs = vecs_buf.data();
+        ids = ids_buf.data();
+        levels = levels_buf.data();
+        links0 = links0_buf.data();
+    }
 
-// Function to preprocess a single image in a thread
-void * preprocess_image(void * arg) {
-    ImageDataRange * imageDataRange = static_cast<ImageDataRange *>(arg);
+    void unmap() {
+#ifndef _WIN32
+        if (mapping) {
+            munmap(mapping, mapping_size);
+        }
+#endif
+        mapping = nullptr;
+        mapping_size = 0;
+    }
 
-    ImageData * imageData_start = imageDataRange->start;
-    ImageData * imageData_end = imageDataRange->end;
+    // copies a mapped index into owned buffers so that it can be modified
+    void materialize() {
+        if (!mapping) {
+            return;
+        }
+        vecs_buf.assign(vecs, vecs + n_vecs * row_size());
+        ids_buf.assign(ids, ids + n_vecs);
+        levels_buf.assign(levels, levels + n_vecs);
+        links0_buf.assign(links0, links0 + n_vecs * (1 + M0));
+        upper_buf.resize(n_vecs);
+        for (size_t i = 0; i < n_vecs; i++) {
+            const uint32_t * first = upper_links + upper_offsets[i];
+            upper_buf[i].assign(first, first + (size_t)levels[i] * (1 + params.M));
+        }
+        unmap();
+        use_buffers();
+    }
 
-    for (ImageData * imageData = imageData_start; imageData <= imageData_end; imageData++) {
-        const clip_image_u8 * input = imageData->input;
-        clip_image_f32 * resized = imageData->resized; 
-        const clip_ctx * ctx = imageData->ctx;
+    ~clip_hnsw() { unmap(); }
+};
 
-        // Call the original preprocess function on the image
-        clip_image_preprocess(ctx, input, resized); 
+// greedy walk towards q on one level, used above the levels that are searched with a candidate list
+template <bool LOCK>
+static uint32_t hnsw_greedy(clip_hnsw * h, const float * q, uint32_t ep, const int level, std::vector<uint32_t> & nbs) {
+    float best = h->similarity(q, ep);
+    for (bool changed = true; changed;) {
+        changed = false;
+        if (LOCK) {
+            std::lock_guard<std::mutex> lock(h->node_locks[ep]);
+            const uint32_t * l = h->links(ep, level);
+            nbs.assign(l + 1, l + 1 + l[0]);
+        } else {
+            const uint32_t * l = h->links(ep, level);
+            nbs.assign(l + 1, l + 1 + l[0]);
+        }
+        for (const uint32_t nb : nbs) {
+            const float sim = h->similarity(q, nb);
+            if (sim > best) {
+                best = sim;
+                ep = nb;
+                changed = true;
+            }
+        }
     }
-    
-    pthread_exit(NULL);
+    return ep;
 }
 
-// Function to batch-preprocess multiple images i
-void clip_image_batch_preprocess(const clip_ctx * ctx, const int n_threads, const clip_image_u8_batch * img_inputs,
-                                 clip_image_f32_batch * imgs_resized) {
-    imgs_resized->size = img_inputs->size;
+// beam search on one level. results get the ef most similar nodes that pass the filter, in descending order
+template <bool LOCK>
+static void hnsw_search_level(clip_hnsw * h, const float * q, const uint32_t ep, const int ef, const int level,
+                              hnsw_visited & visited, clip_id_filter filter, void * user_data,
+                              std::vector<uint32_t> & nbs, std::vector<hnsw_candidate> & results) {
+    std::priority_queue<hnsw_candidate> candidates; // most similar on top
+    std::priority_queue<hnsw_candidate, std::vector<hnsw_candidate>, std::greater<hnsw_candidate>> top; // least on top
+
+    auto allowed = [&](const uint32_t i) { return !filter || filter(h->ids[i], user_data); };
+
+    visited.reset(h->n_vecs);
+    visited.visit(ep);
+    const float sim_ep = h->similarity(q, ep);
+    candidates.push({sim_ep, ep});
+    if (allowed(ep)) {
+        top.push({sim_ep, ep});
+    }
 
-    int num_threads = std::min(n_threads, static_cast<int>(img_inputs->size));
-    int i, t;
+    while (!candidates.empty()) {
+        const hnsw_candidate cur = candidates.top();
+        if ((int)top.size() >= ef && cur.first < top.top().first) {
+            break;
+        }
+        candidates.pop();
 
-    // Divide the images among the threads
-    int images_per_thread = img_inputs->size / num_threads;
+        if (LOCK) {
+            std::lock_guard<std::mutex> lock(h->node_locks[cur.second]);
+            const uint32_t * l = h->links(cur.second, level);
+            nbs.assign(l + 1, l + 1 + l[0]);
+        } else {
+            const uint32_t * l = h->links(cur.second, level);
+            nbs.assign(l + 1, l + 1 + l[0]);
+        }
 
-    if (num_threads == 1) {
-        // Single-threaded case
-        for (i = 0; i < img_inputs->size; i++) {
-            clip_image_preprocess(ctx, &img_inputs->data[i], &imgs_resized->data[i]);
+        for (const uint32_t nb : nbs) {
+            if (!visited.visit(nb)) {
+                continue;
+            }
+            const float sim = h->similarity(q, nb);
+            if ((int)top.size() < ef || sim > top.top().first) {
+                candidates.push({sim, nb});
+                if (allowed(nb)) {
+                    top.push({sim, nb});
+                    if ((int)top.size() > ef) {
+                        top.pop();
+                    }
+                }
+            }
         }
-    } else {
-        // Multi-threaded case
+    }
 
-        std::vector<pthread_t> threads(num_threads);
-        std::vector<ImageData> imageData(img_inputs->size);
-        ImageDataRange* imageDataRange = new ImageDataRange[num_threads]();
-        
-        for (t = 0; t < num_threads; t++) {
-            int start_index = t * images_per_thread;
-            int end_index = (t == num_threads - 1) ? img_inputs->size : start_index + images_per_thread;
+    results.resize(top.size());
+    for (size_t i = results.size(); i-- > 0;) {
+        results[i] = top.top();
+        top.pop();
+    }
+}
 
-            // Create ImageData for each thread
-            for (i = start_index; i < end_index; i++) {
-                imageData[i].input = &img_inputs->data[i];
-                imageData[i].resized = &imgs_resized->data[i];
-                imageData[i].ctx = ctx;
+// keeps a candidate only if it is more similar to the base than to every neighbor selected so far,
+// which spreads the links in different directions. candidates must be sorted in descending order
+static void hnsw_select_neighbors(const clip_hnsw * h, std::vector<hnsw_candidate> & candidates, const int M,
+                                  std::vector<float> & scratch) {
+    std::vector<hnsw_candidate> selected;
+    selected.reserve(M);
+    for (const auto & cand : candidates) {
+        if ((int)selected.size() >= M) {
+            break;
+        }
+        const float * v = h->vec_f32(cand.second, scratch);
+        bool keep = true;
+        for (const auto & sel : selected) {
+            if (h->similarity(v, sel.second) > cand.first) {
+                keep = false;
+                break;
             }
-
-            // Create a thread for each batch of images
-            imageDataRange[t] = {&imageData[start_index], &imageData[end_index - 1]};
-            pthread_create(&threads[t], NULL, preprocess_image, static_cast<void *>(&imageDataRange[t]));
         }
-
-        // Wait for all threads to finish
-        for (t = 0; t < num_threads; t++) {
-            pthread_join(threads[t], NULL);
+        if (keep) {
+            selected.push_back(cand);
         }
-
-        delete[] imageDataRange;
     }
+    candidates.swap(selected);
 }
 
-void clip_free(clip_ctx * ctx) {
-    ggml_free(ctx->ctx);
-    gguf_free(ctx->ctx_gguf);
-    delete ctx;
-}
+struct hnsw_insert_state {
+    hnsw_visited visited;
+    std::vector<uint32_t> nbs;
+    std::vector<hnsw_candidate> results;
+    std::vector<hnsw_candidate> pruned;
+    std::vector<float> scratch;
+};
 
-bool clip_text_encode(const clip_ctx * ctx, const int n_threads, const clip_tokens * tokens, float * vec,
-                      const bool normalize) {
-    if (!ctx->has_text_encoder) {
-        printf("This GGUF file seems to have no text encoder\n");
-        return false;
+static void hnsw_insert(clip_hnsw * h, const uint32_t i, const float * q, hnsw_insert_state & st) {
+    const int level = h->levels[i];
+
+    // nodes that raise the max level hold the entry lock for the whole insertion, as they become the entry point
+    std::unique_lock<std::mutex> entry_lock(h->entry_lock);
+    const int max_level = h->max_level;
+    uint32_t ep = h->entry_point;
+    if (max_level < 0) {
+        h->max_level = level;
+        h->entry_point = i;
+        return;
+    }
+    if (level <= max_level) {
+        entry_lock.unlock();
     }
 
-    const auto & model = ctx->text_model;
-    const auto & hparams = model.hparams;
-    const size_t N = tokens->size;
-
-    const int n_vocab = hparams.n_vocab;
-    const int num_positions = hparams.num_positions;
-    const int hidden_size = hparams.hidden_size;
-    const int n_head = hparams.n_head;
-    const int d_head = hidden_size / n_head;
-    const int n_layer = hparams.n_layer;
-    const int n_intermediate = hparams.n_intermediate;
-    const int projection_dim = hparams.projection_dim;
-    const float eps = hparams.eps;
+    for (int lev = max_level; lev > level; lev--) {
+        ep = hnsw_greedy<true>(h, q, ep, lev, st.nbs);
+    }
 
-    auto & buf_compute = ctx->buf_compute;
+    for (int lev = std::min(level, max_level); lev >= 0; lev--) {
+        const int max_links = lev == 0 ? h->M0 : h->params.M;
 
-    struct ggml_init_params params = {
-        .mem_size = buf_compute.size,
-        .mem_buffer = buf_compute.data,
-        .no_alloc = false,
-    };
+        hnsw_search_level<true>(h, q, ep, h->params.ef_construction, lev, st.visited, nullptr, nullptr, st.nbs,
+                                st.results);
+        ep = st.results[0].second;
+        hnsw_select_neighbors(h, st.results, h->params.M, st.scratch);
 
-    struct ggml_context * ctx0 = ggml_init(params);
-    struct ggml_cgraph gf = {};
+        {
+            std::lock_guard<std::mutex> lock(h->node_locks[i]);
+            uint32_t * l = h->links_mut(i, lev);
+            l[0] = st.results.size();
+            for (size_t j = 0; j < st.results.size(); j++) {
+                l[1 + j] = st.results[j].second;
+            }
+        }
 
-    static size_t scr0_size = get_scr_buf_req_by_size((struct clip_ctx *)ctx);
-    static void * scr0 = malloc(scr0_size);
+        // link back, pruning the neighbor's list when it is full
+        for (const auto & res : st.results) {
+            const uint32_t nb = res.second;
+            std::lock_guard<std::mutex> lock(h->node_locks[nb]);
+            uint32_t * l = h->links_mut(nb, lev);
+            if ((int)l[0] < max_links) {
+                l[1 + l[0]] = i;
+                l[0]++;
+                continue;
+            }
 
-    struct ggml_tensor * input_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(input_ids->data, tokens->data, N * ggml_element_size(input_ids));
+            std::vector<float> nb_vec;
+            const float * v = h->vec_f32(nb, nb_vec);
+            st.pruned.clear();
+            st.pruned.push_back({res.first, i});
+            for (uint32_t j = 0; j < l[0]; j++) {
+                st.pruned.push_back({h->similarity(v, l[1 + j]), l[1 + j]});
+            }
+            std::sort(st.pruned.begin(), st.pruned.end(), std::greater<hnsw_candidate>());
+            hnsw_select_neighbors(h, st.pruned, max_links, st.scratch);
+            l[0] = st.pruned.size();
+            for (size_t j = 0; j < st.pruned.size(); j++) {
+                l[1 + j] = st.pruned[j].second;
+            }
+        }
+    }
 
-    struct ggml_tensor * positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    for (int i = 0; i < N; i++) {
-        ggml_set_i32_1d(positions, i, i);
+    if (level > max_level) {
+        h->max_level = level;
+        h->entry_point = i;
     }
+}
 
-    struct ggml_tensor * embeddings = ggml_get_rows(ctx0, model.token_embeddings, input_ids);
+clip_hnsw_params clip_hnsw_default_params() {
+    clip_hnsw_params params;
+    params.M = 16;
+    params.ef_construction = 200;
+    params.ef_search = 64;
+    params.type = CLIP_INDEX_F32;
+    params.seed = 42;
+    return params;
+}
 
-    embeddings = ggml_add(ctx0, ggml_get_rows(ctx0, model.position_embeddings, positions), embeddings);
+clip_hnsw * clip_hnsw_make(const int vec_dim, const clip_hnsw_params params) {
+    if (vec_dim <= 0 || params.M < 2 || params.ef_construction < 1 || params.ef_search < 1 ||
+        (params.type != CLIP_INDEX_F32 && params.type != CLIP_INDEX_F16)) {
+        fprintf(stderr, "%s: invalid index parameters, HNSW supports f32 and f16 storage with M >= 2\n", __func__);
+        return nullptr;
+    }
 
-    // loop over layers
-    for (int il = 0; il < n_layer; il++) {
-        struct ggml_tensor * cur = embeddings; // embeddings = residual, cur = hidden_states
+    clip_hnsw * h = new clip_hnsw;
+    h->params = params;
+    h->vec_dim = vec_dim;
+    h->M0 = 2 * params.M;
+    h->rng.seed(params.seed);
+    h->use_buffers();
+    return h;
+}
 
-        ggml_set_scratch(ctx0, {0, scr0_size, scr0});
+void clip_hnsw_free(clip_hnsw * h) { delete h; }
 
-        // layernorm1
-        {
-            cur = ggml_norm(ctx0, cur, eps);
+size_t clip_hnsw_size(const clip_hnsw * h) { return h->n_vecs; }
 
-            cur = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers[il].ln_1_w, cur), cur),
-                           ggml_repeat(ctx0, model.layers[il].ln_1_b, cur));
-        }
+void clip_hnsw_set_ef_search(clip_hnsw * h, const int ef_search) { h->params.ef_search = std::max(1, ef_search); }
 
-        // self-attention
-        {
-            struct ggml_tensor * Q =
-                ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].q_b, cur), ggml_mul_mat(ctx0, model.layers[il].q_w, cur));
+typedef struct {
+    clip_hnsw * h;
+    const float * vecs; // the new vectors in f32
+    size_t first;       // node of vecs[0]
+    size_t n;
+    std::atomic<size_t> * next;
+} HnswInsertArgs;
+
+static void hnsw_insert_nodes(void * arg, size_t, size_t) {
+    HnswInsertArgs * a = static_cast<HnswInsertArgs *>(arg);
+    hnsw_insert_state st;
+    // nodes are taken in order from a shared counter instead of the given range, so that early nodes, which the
+    // rest of the graph is built upon, are inserted first
+    for (size_t j = (*a->next)++; j < a->n; j = (*a->next)++) {
+        hnsw_insert(a->h, a->first + j, a->vecs + j * a->h->vec_dim, st);
+    }
+}
 
-            Q = ggml_scale_inplace(ctx0, Q, ggml_new_f32(ctx0, 1.0f / sqrt((float)d_head)));
-            Q = ggml_reshape_4d(ctx0, Q, d_head, n_head, N, 1);
-            Q = ggml_cont(ctx0, ggml_permute(ctx0, Q, 0, 2, 1, 3));
-            Q = ggml_reshape_3d(ctx0, Q, d_head, N, n_head);
+bool clip_hnsw_add(clip_hnsw * h, const float * vecs, const int64_t * ids, const size_t n_vecs, const int n_threads) {
+    if (h->n_vecs + n_vecs > UINT32_MAX) {
+        fprintf(stderr, "%s: too many vectors\n", __func__);
+        return false;
+    }
 
-            struct ggml_tensor * K =
-                ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].k_b, cur), ggml_mul_mat(ctx0, model.layers[il].k_w, cur));
+    h->materialize();
 
-            K = ggml_reshape_4d(ctx0, K, d_head, n_head, N, 1);
-            K = ggml_cont(ctx0, ggml_permute(ctx0, K, 0, 2, 1, 3));
-            K = ggml_reshape_3d(ctx0, K, d_head, N, n_head);
+    // grow the storage up front so that the insertion threads never reallocate
+    const size_t first = h->n_vecs;
+    const size_t n_total = first + n_vecs;
+    const double level_mult = 1.0 / log((double)h->params.M);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
 
-            struct ggml_tensor * V =
-                ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].v_b, cur), ggml_mul_mat(ctx0, model.layers[il].v_w, cur));
-            V = ggml_reshape_4d(ctx0, V, d_head, n_head, N, 1);
-            V = ggml_cont(ctx0, ggml_permute(ctx0, V, 1, 2, 0, 3));
-            V = ggml_reshape_3d(ctx0, V, N, d_head, n_head);
+    h->ids_buf.insert(h->ids_buf.end(), ids, ids + n_vecs);
+    h->vecs_buf.resize(n_total * h->row_size());
+    if (h->params.type == CLIP_INDEX_F16) {
+        ggml_fp32_to_fp16_row(vecs, reinterpret_cast<ggml_fp16_t *>(h->vecs_buf.data() + first * h->row_size()),
+                              n_vecs * h->vec_dim);
+    } else {
+        memcpy(h->vecs_buf.data() + first * h->row_size(), vecs, n_vecs * h->row_size());
+    }
+    h->links0_buf.resize(n_total * (1 + h->M0), 0);
+    h->levels_buf.resize(n_total);
+    h->upper_buf.resize(n_total);
+    for (size_t i = first; i < n_total; i++) {
+        const int level = std::min(255, (int)(-log(std::max(uniform(h->rng), 1e-12)) * level_mult));
+        h->levels_buf[i] = level;
+        h->upper_buf[i].assign((size_t)level * (1 + h->params.M), 0);
+    }
+    if (h->n_node_locks < n_total) {
+        h->n_node_locks = std::max(n_total, 2 * h->n_node_locks);
+        h->node_locks.reset(new std::mutex[h->n_node_locks]);
+    }
+    h->n_vecs = n_total;
+    h->use_buffers();
 
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-            KQ = ggml_diag_mask_inf_inplace(ctx0, KQ, 0); // causal masking
-            KQ = ggml_soft_max_inplace(ctx0, KQ);
+    std::atomic<size_t> next(0);
+    HnswInsertArgs args = {h, vecs, first, n_vecs, &next};
+    parallel_for(n_threads, n_vecs, 256, hnsw_insert_nodes, &args);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ);
-            KQV = ggml_reshape_4d(ctx0, KQV, d_head, N, n_head, 1);
-            KQV = ggml_cont(ctx0, ggml_permute(ctx0, KQV, 0, 2, 1, 3));
+    return true;
+}
 
-            cur = ggml_cpy(ctx0, KQV, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, hidden_size, N));
+typedef struct {
+    const clip_hnsw * h;
+    const float * queries;
+    int k;
+    clip_id_filter filter;
+    void * user_data;
+    float * scores;
+    int64_t * ids;
+} HnswSearchArgs;
+
+static void hnsw_search_queries(void * arg, size_t start, size_t end) {
+    const HnswSearchArgs * a = static_cast<HnswSearchArgs *>(arg);
+    // search never modifies the index, the non-const pointer is only needed by the shared insertion helpers
+    clip_hnsw * h = const_cast<clip_hnsw *>(a->h);
+    const int ef = std::max(h->params.ef_search, a->k);
+
+    hnsw_visited visited;
+    std::vector<uint32_t> nbs;
+    std::vector<hnsw_candidate> results;
+    for (size_t qi = start; qi < end; qi++) {
+        const float * q = a->queries + qi * h->vec_dim;
+        results.clear();
+        if (h->n_vecs > 0) {
+            uint32_t ep = h->entry_point;
+            for (int lev = h->max_level; lev > 0; lev--) {
+                ep = hnsw_greedy<false>(h, q, ep, lev, nbs);
+            }
+            hnsw_search_level<false>(h, q, ep, ef, 0, visited, a->filter, a->user_data, nbs, results);
         }
 
-        // attention output
-        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].o_b, cur), ggml_mul_mat(ctx0, model.layers[il].o_w, cur));
-
-        // re-add the layer input, e.g., residual
-        cur = ggml_add(ctx0, cur, embeddings);
-
-        embeddings = cur; // embeddings = residual, cur = hidden_states
-
-        // layernorm2
-        {
-            cur = ggml_norm(ctx0, cur, eps);
-
-            cur = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers[il].ln_2_w, cur), cur),
-                           ggml_repeat(ctx0, model.layers[il].ln_2_b, cur));
+        for (int i = 0; i < a->k; i++) {
+            const bool found = i < (int)results.size();
+            a->scores[qi * a->k + i] = found ? results[i].first : -INFINITY;
+            a->ids[qi * a->k + i] = found ? h->ids[results[i].second] : -1;
         }
+    }
+}
 
-        cur = ggml_mul_mat(ctx0, model.layers[il].ff_i_w, cur);
-        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].ff_i_b, cur), cur);
+bool clip_hnsw_search(const clip_hnsw * h, const float * queries, const size_t n_queries, const int k,
+                      const int n_threads, clip_id_filter filter, void * user_data, float * scores, int64_t * ids) {
+    if (k <= 0) {
+        return false;
+    }
 
-        if (ctx->use_gelu) {
-            cur = ggml_gelu_inplace(ctx0, cur);
-        } else {
-            cur = ggml_gelu_quick_inplace(ctx0, cur);
-        }
+    HnswSearchArgs args = {h, queries, k, filter, user_data, scores, ids};
+    parallel_for(n_threads, n_queries, 1, hnsw_search_queries, &args);
 
-        cur = ggml_mul_mat(ctx0, model.layers[il].ff_o_w, cur);
-        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].ff_o_b, cur), cur);
+    return true;
+}
 
-        // residual 2
-        cur = ggml_add(ctx0, embeddings, cur);
+static void hnsw_section_offsets(const clip_hnsw_header & hdr, const size_t row_size, size_t offsets[6],
+                                 size_t * file_size) {
+    const size_t n = hdr.n_vecs;
+    offsets[0] = align_up(sizeof(clip_hnsw_header), CLIP_INDEX_ALIGNMENT);                       // ids
+    offsets[1] = align_up(offsets[0] + n * sizeof(int64_t), CLIP_INDEX_ALIGNMENT);                // levels
+    offsets[2] = align_up(offsets[1] + n * sizeof(uint8_t), CLIP_INDEX_ALIGNMENT);                // upper offsets
+    offsets[3] = align_up(offsets[2] + n * sizeof(uint64_t), CLIP_INDEX_ALIGNMENT);               // level 0 links
+    offsets[4] = align_up(offsets[3] + n * (1 + 2 * hdr.M) * sizeof(uint32_t), CLIP_INDEX_ALIGNMENT); // upper links
+    offsets[5] = align_up(offsets[4] + hdr.n_upper_links * sizeof(uint32_t), CLIP_INDEX_ALIGNMENT);   // vectors
+    *file_size = offsets[5] + n * row_size;
+}
 
-        embeddings = cur;
+bool clip_hnsw_save(const clip_hnsw * h, const char * fname) {
+    std::ofstream fout(fname, std::ios::binary);
+    if (!fout.is_open()) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
+        return false;
     }
 
-    // final -layer_norm
-    {
-        embeddings = ggml_norm(ctx0, embeddings, eps);
-
-        embeddings = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.post_ln_w, embeddings), embeddings),
-                              ggml_repeat(ctx0, model.post_ln_b, embeddings));
+    const size_t n = h->n_vecs;
+    std::vector<uint64_t> upper_offsets(n);
+    uint64_t n_upper_links = 0;
+    for (size_t i = 0; i < n; i++) {
+        upper_offsets[i] = n_upper_links;
+        n_upper_links += (uint64_t)h->levels[i] * (1 + h->params.M);
     }
 
-    // get the output of eot token, e.g., last index
-    struct ggml_tensor * eot = ggml_new_i32(ctx0, N - 1);
-    embeddings = ggml_get_rows(ctx0, embeddings, eot);
-
-    ggml_set_scratch(ctx0, {0, 0, nullptr});
-
-    // text projection
-    embeddings = ggml_mul_mat(ctx0, model.projection, embeddings);
+    const clip_hnsw_header hdr = {CLIP_HNSW_MAGIC,
+                                  CLIP_HNSW_VERSION,
+                                  (uint32_t)h->params.type,
+                                  (uint32_t)h->vec_dim,
+                                  (uint32_t)h->params.M,
+                                  (uint32_t)h->params.ef_construction,
+                                  (uint32_t)h->params.ef_search,
+                                  h->max_level,
+                                  h->entry_point,
+                                  0,
+                                  n,
+                                  n_upper_links};
+    size_t offsets[6];
+    size_t file_size;
+    hnsw_section_offsets(hdr, h->row_size(), offsets, &file_size);
+
+    auto pad_to = [&fout](const size_t offset) {
+        static const char zeros[CLIP_INDEX_ALIGNMENT] = {};
+        fout.write(zeros, offset - (size_t)fout.tellp());
+    };
 
-    // normalize output embeddings
-    if (normalize) {
-        ggml_tensor * length = ggml_sqrt(ctx0, ggml_sum(ctx0, ggml_sqr(ctx0, embeddings)));
-        embeddings = ggml_scale_inplace(ctx0, embeddings, ggml_div(ctx0, ggml_new_f32(ctx0, 1.0f), length));
+    fout.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+    pad_to(offsets[0]);
+    fout.write(reinterpret_cast<const char *>(h->ids), n * sizeof(int64_t));
+    pad_to(offsets[1]);
+    fout.write(reinterpret_cast<const char *>(h->levels), n * sizeof(uint8_t));
+    pad_to(offsets[2]);
+    fout.write(reinterpret_cast<const char *>(upper_offsets.data()), n * sizeof(uint64_t));
+    pad_to(offsets[3]);
+    fout.write(reinterpret_cast<const char *>(h->links0), n * (1 + h->M0) * sizeof(uint32_t));
+    pad_to(offsets[4]);
+    for (size_t i = 0; i < n; i++) {
+        if (h->levels[i] > 0) {
+            fout.write(reinterpret_cast<const char *>(h->links(i, 1)),
+                       (size_t)h->levels[i] * (1 + h->params.M) * sizeof(uint32_t));
+        }
     }
+    pad_to(offsets[5]);
+    fout.write(reinterpret_cast<const char *>(h->vecs), n * h->row_size());
 
-    ggml_set_name(embeddings, "check");
+    if (!fout.good()) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname);
+        return false;
+    }
 
-    // run the computation
+    return true;
+}
 
-    ggml_build_forward_expand(&gf, embeddings);
-    ggml_cplan cplan = ggml_graph_plan(&gf, n_threads);
-    if (cplan.work_size != 0) {
-        cplan.work_data = (uint8_t *)malloc(cplan.work_size);
+// checks what the graph of a loaded index refers to, so that a corrupt file fails to load instead of being walked out
+// of bounds. levels and links0 of h are set, the upper links are given by their offsets
+static bool hnsw_check_graph(const clip_hnsw * h, const uint64_t * upper_offsets, const uint32_t * upper_links,
+                             const uint64_t n_upper_links) {
+    const size_t n = h->n_vecs;
+    if (n == 0) {
+        return h->max_level == -1;
+    }
+    if (h->entry_point >= n || h->max_level < 0 || h->levels[h->entry_point] != h->max_level) {
+        return false;
     }
-    ggml_graph_compute(&gf, &cplan);
-
-// print
-#ifdef CLIP_DEBUG
-    {
-        auto print_t_f32 = [&](struct ggml_tensor * t) {
-            float * data = (float *)t->data;
-            printf("dtype: f32, dims: %jd %jd %jd %jd, nb: %jd %jd %jd %jd\n", t->ne[0], t->ne[1], t->ne[2], t->ne[3], t->nb[0],
-                   t->nb[1], t->nb[2], t->nb[3]);
-            printf("data: ");
-            for (int i = 0; i < std::min((int)t->ne[0], 20); i++) {
-                printf("%f ", data[i]);
-            }
 
-            // printf("\n\n");
-            double sum = 0.0;
-            for (int i = 0; i < ggml_nelements(t); i++) {
-                sum += data[i];
+    const size_t M = h->params.M;
+    for (size_t i = 0; i < n; i++) {
+        const uint32_t * l = h->links0 + i * (1 + h->M0);
+        if (l[0] > (uint32_t)h->M0 || h->levels[i] > h->max_level) {
+            return false;
+        }
+        for (uint32_t j = 1; j <= l[0]; j++) {
+            if (l[j] >= n) {
+                return false;
             }
-            printf("sum:  %f\n", sum);
-        };
+        }
 
-        auto print_t_f16 = [&](struct ggml_tensor * t) {
-            ggml_fp16_t * data = (ggml_fp16_t *)t->data;
-            printf("dtype: f16, dims: %jd %jd %jd %jd\n", t->ne[0], t->ne[1], t->ne[2], t->ne[3]);
-            printf("data: ");
-            for (int i = 0; i < std::min((int)t->ne[0], 10); i++) {
-                printf("%f ", ggml_fp16_to_fp32(data[i]));
+        const uint64_t n_links = (uint64_t)h->levels[i] * (1 + M);
+        if (upper_offsets[i] > n_upper_links || n_links > n_upper_links - upper_offsets[i]) {
+            return false;
+        }
+        for (int level = 1; level <= h->levels[i]; level++) {
+            const uint32_t * u = upper_links + upper_offsets[i] + (level - 1) * (1 + M);
+            if (u[0] > M) {
+                return false;
             }
-            printf("\n\n");
-            double sum = 0.0;
-            for (int i = 0; i < ggml_nelements(t); i++) {
-                sum += ggml_fp16_to_fp32(data[i]);
+            for (uint32_t j = 1; j <= u[0]; j++) {
+                if (u[j] >= n) {
+                    return false;
+                }
             }
-            printf("sum:  %f\n", sum);
-        };
+        }
+    }
+    return true;
+}
+
+clip_hnsw * clip_hnsw_load(const char * fname, const bool use_mmap) {
+    std::ifstream fin(fname, std::ios::binary);
+    if (!fin.is_open()) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+        return nullptr;
+    }
+
+    clip_hnsw_header hdr;
+    fin.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+    if (!fin.good() || hdr.magic != CLIP_HNSW_MAGIC || hdr.version != CLIP_HNSW_VERSION) {
+        fprintf(stderr, "%s: '%s' is not an HNSW index file\n", __func__, fname);
+        return nullptr;
+    }
 
-        auto * t = ggml_get_tensor(ctx0, "check");
-        if (t->type == GGML_TYPE_F32) {
-            print_t_f32(t);
-        } else {
-            print_t_f16(t);
-        }
+    // the counts are bounded by the file before any size is computed from them
+    fin.seekg(0, std::ios::end);
+    const size_t file_bytes = fin.tellg();
+    if (hdr.n_vecs > file_bytes / sizeof(int64_t) || hdr.n_upper_links > file_bytes / sizeof(uint32_t) ||
+        hdr.M > 0xffff || hdr.max_level > 255) {
+        fprintf(stderr, "%s: '%s' is corrupt\n", __func__, fname);
+        return nullptr;
     }
 
-    printf("used_mem = %zu\n", ggml_used_mem(ctx0));
-#endif
-    memcpy(vec, ggml_get_data_f32(embeddings), sizeof(float) * projection_dim);
+    clip_hnsw_params params = clip_hnsw_default_params();
+    params.M = hdr.M;
+    params.ef_construction = hdr.ef_construction;
+    params.ef_search = hdr.ef_search;
+    params.type = (clip_index_type)hdr.type;
+    clip_hnsw * h = clip_hnsw_make(hdr.vec_dim, params);
+    if (!h) {
+        return nullptr;
+    }
+    h->n_vecs = hdr.n_vecs;
+    h->max_level = hdr.max_level;
+    h->entry_point = hdr.entry_point;
+
+    size_t offsets[6];
+    size_t file_size;
+    hnsw_section_offsets(hdr, h->row_size(), offsets, &file_size);
+
+    if (file_bytes < file_size) {
+        fprintf(stderr, "%s: '%s' is truncated\n", __func__, fname);
+        delete h;
+        return nullptr;
+    }
 
-    if (cplan.work_size != 0) {
-        free(cplan.work_data);
+    const size_t n = hdr.n_vecs;
+    std::vector<uint64_t> upper_offsets;
+    std::vector<uint32_t> upper_links;
+
+#ifndef _WIN32
+    if (use_mmap) {
+        const int fd = open(fname, O_RDONLY);
+        void * addr = fd >= 0 ? mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (addr != MAP_FAILED) {
+            const uint8_t * base = static_cast<const uint8_t *>(addr);
+            h->mapping = addr;
+            h->mapping_size = file_size;
+            h->ids = reinterpret_cast<const int64_t *>(base + offsets[0]);
+            h->levels = base + offsets[1];
+            h->upper_offsets = reinterpret_cast<const uint64_t *>(base + offsets[2]);
+            h->links0 = reinterpret_cast<const uint32_t *>(base + offsets[3]);
+            h->upper_links = reinterpret_cast<const uint32_t *>(base + offsets[4]);
+            h->vecs = base + offsets[5];
+            if (!hnsw_check_graph(h, h->upper_offsets, h->upper_links, hdr.n_upper_links)) {
+                fprintf(stderr, "%s: '%s' is corrupt\n", __func__, fname);
+                delete h;
+                return nullptr;
+            }
+            return h;
+        }
+        fprintf(stderr, "%s: failed to mmap '%s', reading it instead\n", __func__, fname);
     }
+#endif
 
-    ggml_free(ctx0);
+    auto read_at = [&fin](const size_t offset, void * data, const size_t size) {
+        fin.seekg(offset);
+        fin.read(static_cast<char *>(data), size);
+    };
 
-    return true;
-}
+    h->ids_buf.resize(n);
+    read_at(offsets[0], h->ids_buf.data(), n * sizeof(int64_t));
+    h->levels_buf.resize(n);
+    read_at(offsets[1], h->levels_buf.data(), n * sizeof(uint8_t));
+    upper_offsets.resize(n);
+    read_at(offsets[2], upper_offsets.data(), n * sizeof(uint64_t));
+    h->links0_buf.resize(n * (1 + h->M0));
+    read_at(offsets[3], h->links0_buf.data(), h->links0_buf.size() * sizeof(uint32_t));
+    upper_links.resize(hdr.n_upper_links);
+    read_at(offsets[4], upper_links.data(), upper_links.size() * sizeof(uint32_t));
+    h->vecs_buf.resize(n * h->row_size());
+    read_at(offsets[5], h->vecs_buf.data(), h->vecs_buf.size());
+
+    if (!fin.good()) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname);
+        delete h;
+        return nullptr;
+    }
 
-bool clip_image_encode(const clip_ctx * ctx, const int n_threads, clip_image_f32 * img, float * vec, const bool normalize) {
-    if (!ctx->has_vision_encoder) {
-        printf("This gguf file seems to have no vision encoder\n");
-        return false;
+    h->use_buffers();
+    if (!hnsw_check_graph(h, upper_offsets.data(), upper_links.data(), hdr.n_upper_links)) {
+        fprintf(stderr, "%s: '%s' is corrupt\n", __func__, fname);
+        delete h;
+        return nullptr;
     }
 
-    clip_image_f32_batch imgs{};
-    imgs.size = 1;
-    imgs.data = img;
-    return clip_image_batch_encode(ctx, n_threads, &imgs, vec, normalize);
+    h->upper_buf.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        const uint32_t * first = upper_links.data() + upper_offsets[i];
+        h->upper_buf[i].assign(first, first + (size_t)h->levels_buf[i] * (1 + params.M));
+    }
+
+    return h;
 }
 
-bool clip_image_batch_encode(const clip_ctx * ctx, const int n_threads, const clip_image_f32_batch * imgs, float * vec,
-                             const bool normalize) {
+//
+// IVF-PQ index
+//
 
-    if (!ctx->has_vision_encoder) {
-        printf("This gguf file seems to have no vision encoder\n");
-        return false;
-    }
+// file layout, sections aligned to CLIP_INDEX_ALIGNMENT like the flat index:
+// header | centroids (f32 * n_lists * vec_dim) | codebooks (f32 * pq_m * 256 * vec_dim / pq_m) | ids by row
+// (i64 * n_vecs) | start of each list in the sections below (u64 * (n_lists + 1)) | rows grouped by list
+// (u64 * n_vecs) | codes grouped by list (u8 * n_vecs * pq_m)
+struct clip_ivfpq_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vec_dim;
+    uint32_t n_lists;
+    uint32_t pq_m;
+    uint32_t n_probe;
+    uint32_t n_iter;
+    uint32_t padding;
+    uint64_t max_train;
+    uint64_t seed;
+    uint64_t n_vecs;
+};
 
-    const auto & model = ctx->vision_model;
-    const auto & hparams = model.hparams;
+static const uint32_t CLIP_IVFPQ_MAGIC = 0x71766963; // "civq"
+static const uint32_t CLIP_IVFPQ_VERSION = 1;
+static const int PQ_N_CODES = 256;
 
-    const int image_size = hparams.image_size;
-    const int patch_size = hparams.patch_size;
-    const int num_patches = ((image_size / patch_size) * (image_size / patch_size));
-    const int num_positions = num_patches + 1;
-    const int hidden_size = hparams.hidden_size;
-    const int n_head = hparams.n_head;
-    const int d_head = hidden_size / n_head;
-    const int n_layer = hparams.n_layer;
-    const int n_intermediate = hparams.n_intermediate;
-    const int projection_dim = hparams.projection_dim;
-    const float eps = hparams.eps;
-    int batch_size = imgs->size;
+struct clip_ivfpq {
+    clip_ivfpq_params params;
+    int vec_dim;
+    int dsub; // dimensions per subvector
+    bool trained = false;
+    size_t n_vecs = 0;
 
-    auto & buf_compute = ctx->buf_compute;
+    std::vector<float> centroids; // [n_lists, vec_dim]
+    std::vector<float> codebooks; // [pq_m, PQ_N_CODES, dsub]
 
-    struct ggml_init_params params = {
-        .mem_size = buf_compute.size,
-        .mem_buffer = buf_compute.data,
-        .no_alloc = false,
-    };
+    // storage owned by the index
+    std::vector<int64_t> ids_buf;
+    std::vector<std::vector<uint64_t>> rows_buf;
+    std::vector<std::vector<uint8_t>> codes_buf;
 
-    struct ggml_context * ctx0 = ggml_init(params);
-    struct ggml_cgraph gf = {};
+    // read-only mapping of an index file, used until the index is modified
+    void * mapping = nullptr;
+    size_t mapping_size = 0;
+    const uint64_t * list_offsets = nullptr;
+    const uint64_t * rows_map = nullptr;
+    const uint8_t * codes_map = nullptr;
 
-    static size_t scr0_size = get_scr_buf_req_by_size((struct clip_ctx *)ctx);
-    static void * scr0 = malloc(scr0_size);
+    const int64_t * ids = nullptr;
 
-    struct ggml_tensor * inp_raw = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, image_size, image_size, 3, batch_size);
+    size_t list_size(const int l) const {
+        return mapping ? list_offsets[l + 1] - list_offsets[l] : rows_buf[l].size();
+    }
 
-    {
-        float * data = (float *)ggml_get_data(inp_raw);
+    const uint64_t * list_rows(const int l) const { return mapping ? rows_map + list_offsets[l] : rows_buf[l].data(); }
+
+    const uint8_t * list_codes(const int l) const {
+        return mapping ? codes_map + list_offsets[l] * params.pq_m : codes_buf[l].data();
+    }
+
+    void unmap() {
+#ifndef _WIN32
+        if (mapping) {
+            munmap(mapping, mapping_size);
+        }
+#endif
+        mapping = nullptr;
+        mapping_size = 0;
+    }
 
-        for (int b = 0; b < imgs->size; b++) {
-            const int nx = imgs->data[b].nx;
-            const int ny = imgs->data[b].ny;
-            GGML_ASSERT(nx == image_size && ny == image_size);
+    // copies a mapped index into owned buffers so that it can be modified
+    void materialize() {
+        if (!mapping) {
+            return;
+        }
+        ids_buf.assign(ids, ids + n_vecs);
+        for (int l = 0; l < params.n_lists; l++) {
+            rows_buf[l].assign(list_rows(l), list_rows(l) + list_size(l));
+            codes_buf[l].assign(list_codes(l), list_codes(l) + list_size(l) * params.pq_m);
+        }
+        unmap();
+        ids = ids_buf.data();
+    }
 
-            const int n = nx * ny;
+    ~clip_ivfpq() { unmap(); }
+};
 
-            for (int b = 0; b < batch_size; b++) {
-                for (int k = 0; k < 3; k++) {
-                    for (int y = 0; y < ny; y++) {
-                        for (int x = 0; x < nx; x++) {
-                            data[(b * 3 * n) + k * n + y * nx + x] = imgs->data[b].data[3 * (y * nx + x) + k];
-                        }
-                    }
+typedef struct {
+    const float * vecs;
+    int dim;
+    const float * centroids;
+    const float * half_norms; // |c|^2 / 2 of each centroid
+    int k;
+    int32_t * assign;
+} KmeansAssignArgs;
+
+// nearest centroid by L2 distance, which is the largest x . c - |c|^2 / 2
+static void kmeans_assign_range(void * arg, size_t start, size_t end) {
+    const KmeansAssignArgs * a = static_cast<KmeansAssignArgs *>(arg);
+    const size_t chunk = std::max<size_t>(1, (64 * 1024) / a->k);
+    std::vector<float> scores(chunk * a->k);
+
+    for (size_t c = start; c < end; c += chunk) {
+        const size_t n = std::min(chunk, end - c);
+        SimilarityArgs sim = {a->vecs + c * a->dim, nullptr, n, a->centroids, nullptr, (size_t)a->k, a->dim,
+                              scores.data()};
+        similarity_f32(&sim, 0, (a->k + SIMILARITY_KEY_BLOCK - 1) / SIMILARITY_KEY_BLOCK);
+
+        for (size_t i = 0; i < n; i++) {
+            const float * row = scores.data() + i * a->k;
+            int best = 0;
+            float best_score = -INFINITY;
+            for (int j = 0; j < a->k; j++) {
+                const float score = row[j] - a->half_norms[j];
+                if (score > best_score) {
+                    best_score = score;
+                    best = j;
                 }
             }
+            a->assign[c + i] = best;
         }
     }
+}
 
-    struct ggml_tensor * inp = ggml_conv_2d(ctx0, model.patch_embeddings, inp_raw, patch_size, patch_size, 0, 0, 1, 1);
+static void kmeans_assign(const float * vecs, const size_t n, const int dim, const float * centroids, const int k,
+                          const int n_threads, int32_t * assign) {
+    std::vector<float> half_norms(k);
+    for (int j = 0; j < k; j++) {
+        half_norms[j] = 0.5f * vec_dot_f32(centroids + (size_t)j * dim, centroids + (size_t)j * dim, dim);
+    }
 
-    inp = ggml_reshape_3d(ctx0, inp, num_patches, hidden_size, batch_size);
-    inp = ggml_cont(ctx0, ggml_permute(ctx0, inp, 1, 0, 2, 3));
+    KmeansAssignArgs args = {vecs, dim, centroids, half_norms.data(), k, assign};
+    parallel_for(n_threads, n, 256, kmeans_assign_range, &args);
+}
 
-    // concat class_embeddings and patch_embeddings
-    struct ggml_tensor * embeddings = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, num_positions, batch_size);
+// Lloyd's algorithm from k distinct random vectors. empty clusters are split off the largest one
+static void kmeans(const float * vecs, const size_t n, const int dim, const int k, const int n_iter, const int n_threads,
+                   std::mt19937_64 & rng, float * centroids) {
+    std::vector<size_t> perm(n);
+    for (size_t i = 0; i < n; i++) {
+        perm[i] = i;
+    }
+    for (int j = 0; j < k; j++) {
+        std::swap(perm[j], perm[j + rng() % (n - j)]);
+        memcpy(centroids + (size_t)j * dim, vecs + perm[j] * dim, dim * sizeof(float));
+    }
 
-    ggml_set_zero(embeddings);
-    struct ggml_tensor * temp = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, 1, batch_size);
+    std::vector<int32_t> assign(n);
+    std::vector<double> sums((size_t)k * dim);
+    std::vector<size_t> counts(k);
+    for (int it = 0; it < n_iter; it++) {
+        kmeans_assign(vecs, n, dim, centroids, k, n_threads, assign.data());
+
+        std::fill(sums.begin(), sums.end(), 0.0);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < n; i++) {
+            double * sum = sums.data() + (size_t)assign[i] * dim;
+            for (int d = 0; d < dim; d++) {
+                sum[d] += vecs[i * dim + d];
+            }
+            counts[assign[i]]++;
+        }
+        for (int j = 0; j < k; j++) {
+            for (int d = 0; d < dim && counts[j] > 0; d++) {
+                centroids[(size_t)j * dim + d] = sums[(size_t)j * dim + d] / counts[j];
+            }
+        }
 
-    embeddings = ggml_acc(ctx0, embeddings, ggml_repeat(ctx0, model.class_embedding, temp), embeddings->nb[1],
-                          embeddings->nb[2], embeddings->nb[3], 0);
-    embeddings =
-        ggml_acc(ctx0, embeddings, inp, embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], model.class_embedding->nb[1]);
+        for (int j = 0; j < k; j++) {
+            if (counts[j] > 0) {
+                continue;
+            }
+            const int largest = std::max_element(counts.begin(), counts.end()) - counts.begin();
+            float * c = centroids + (size_t)j * dim;
+            float * c_largest = centroids + (size_t)largest * dim;
+            for (int d = 0; d < dim; d++) {
+                const float eps = (d % 2 ? 1e-4f : -1e-4f) * (fabsf(c_largest[d]) + 1e-6f);
+                c[d] = c_largest[d] + eps;
+                c_largest[d] -= eps;
+            }
+            counts[j] = counts[largest] / 2;
+            counts[largest] -= counts[j];
+        }
+    }
+}
 
-    struct ggml_tensor * positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_positions);
-    for (int i = 0; i < num_positions; i++) {
-        ggml_set_i32_1d(positions, i, i);
+clip_ivfpq_params clip_ivfpq_default_params() {
+    clip_ivfpq_params params;
+    params.n_lists = 1024;
+    params.pq_m = 64;
+    params.n_probe = 16;
+    params.n_iter = 20;
+    params.max_train = 65536;
+    params.seed = 42;
+    return params;
+}
+
+clip_ivfpq * clip_ivfpq_make(const int vec_dim, const clip_ivfpq_params params) {
+    if (vec_dim <= 0 || params.n_lists < 1 || params.pq_m < 1 || vec_dim % params.pq_m != 0 || params.n_probe < 1 ||
+        params.n_iter < 1) {
+        fprintf(stderr, "%s: invalid index parameters, pq_m must divide the vector dimension\n", __func__);
+        return nullptr;
     }
 
-    embeddings =
-        ggml_add(ctx0, embeddings, ggml_repeat(ctx0, ggml_get_rows(ctx0, model.position_embeddings, positions), embeddings));
+    clip_ivfpq * ivf = new clip_ivfpq;
+    ivf->params = params;
+    ivf->vec_dim = vec_dim;
+    ivf->dsub = vec_dim / params.pq_m;
+    ivf->rows_buf.resize(params.n_lists);
+    ivf->codes_buf.resize(params.n_lists);
+    ivf->ids = ivf->ids_buf.data();
+    return ivf;
+}
 
-    // pre-layernorm
-    {
-        embeddings = ggml_norm(ctx0, embeddings, eps);
+void clip_ivfpq_free(clip_ivfpq * ivf) { delete ivf; }
 
-        embeddings = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.pre_ln_w, embeddings), embeddings),
-                              ggml_repeat(ctx0, model.pre_ln_b, embeddings));
-    }
+size_t clip_ivfpq_size(const clip_ivfpq * ivf) { return ivf->n_vecs; }
 
-    // loop over layers
-    for (int il = 0; il < n_layer; il++) {
-        struct ggml_tensor * cur = embeddings; // embeddings = residual, cur = hidden_states
+void clip_ivfpq_set_n_probe(clip_ivfpq * ivf, const int n_probe) {
+    ivf->params.n_probe = std::max(1, std::min(n_probe, ivf->params.n_lists));
+}
 
-        const size_t nb_q_w = model.layers[il].q_w->nb[0];
+// residuals of vecs from their assigned centroids, split into [pq_m, n, dsub] so that each subspace is contiguous
+static void ivfpq_residual_subvectors(const clip_ivfpq * ivf, const float * vecs, const size_t n,
+                                      const int32_t * lists, std::vector<float> & out) {
+    const int m = ivf->params.pq_m;
+    const int dsub = ivf->dsub;
+    out.resize(n * ivf->vec_dim);
+    for (size_t i = 0; i < n; i++) {
+        const float * c = ivf->centroids.data() + (size_t)lists[i] * ivf->vec_dim;
+        for (int j = 0; j < m; j++) {
+            float * dst = out.data() + ((size_t)j * n + i) * dsub;
+            for (int d = 0; d < dsub; d++) {
+                dst[d] = vecs[i * ivf->vec_dim + j * dsub + d] - c[j * dsub + d];
+            }
+        }
+    }
+}
 
-        ggml_set_scratch(ctx0, {0, scr0_size, scr0});
+bool clip_ivfpq_train(clip_ivfpq * ivf, const float * vecs, const size_t n_vecs, const int n_threads) {
+    const clip_ivfpq_params & params = ivf->params;
+    if (ivf->trained) {
+        fprintf(stderr, "%s: the index is already trained\n", __func__);
+        return false;
+    }
+    if (n_vecs < (size_t)std::max(params.n_lists, PQ_N_CODES)) {
+        fprintf(stderr, "%s: at least %d training vectors are needed, got %zu\n", __func__,
+                std::max(params.n_lists, PQ_N_CODES), n_vecs);
+        return false;
+    }
 
-        // layernorm1
-        {
-            cur = ggml_norm(ctx0, cur, eps);
+    const int vec_dim = ivf->vec_dim;
+    std::mt19937_64 rng(params.seed);
 
-            cur = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers[il].ln_1_w, cur), cur),
-                           ggml_repeat(ctx0, model.layers[il].ln_1_b, cur));
+    // random subsample without replacement
+    const size_t n_train = std::min<size_t>(n_vecs, std::max<size_t>(params.max_train, std::max(params.n_lists, PQ_N_CODES)));
+    std::vector<float> sample;
+    if (n_train < n_vecs) {
+        std::vector<size_t> perm(n_vecs);
+        for (size_t i = 0; i < n_vecs; i++) {
+            perm[i] = i;
+        }
+        sample.resize(n_train * vec_dim);
+        for (size_t i = 0; i < n_train; i++) {
+            std::swap(perm[i], perm[i + rng() % (n_vecs - i)]);
+            memcpy(sample.data() + i * vec_dim, vecs + perm[i] * vec_dim, vec_dim * sizeof(float));
         }
+        vecs = sample.data();
+    }
 
-        // self-attention
-        {
+    ivf->centroids.resize((size_t)params.n_lists * vec_dim);
+    kmeans(vecs, n_train, vec_dim, params.n_lists, params.n_iter, n_threads, rng, ivf->centroids.data());
 
-            struct ggml_tensor * Q =
-                ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].q_b, cur), ggml_mul_mat(ctx0, model.layers[il].q_w, cur));
+    std::vector<int32_t> lists(n_train);
+    kmeans_assign(vecs, n_train, vec_dim, ivf->centroids.data(), params.n_lists, n_threads, lists.data());
+    std::vector<float> residuals;
+    ivfpq_residual_subvectors(ivf, vecs, n_train, lists.data(), residuals);
 
-            Q = ggml_scale_inplace(ctx0, Q, ggml_new_f32(ctx0, 1.0f / sqrt((float)d_head)));
-            Q = ggml_reshape_4d(ctx0, Q, d_head, n_head, num_positions, batch_size);
-            Q = ggml_cont(ctx0, ggml_permute(ctx0, Q, 0, 2, 1, 3));
-            Q = ggml_reshape_3d(ctx0, Q, d_head, num_positions, n_head * batch_size);
+    const size_t codebook_size = (size_t)PQ_N_CODES * ivf->dsub;
+    ivf->codebooks.resize(params.pq_m * codebook_size);
+    for (int j = 0; j < params.pq_m; j++) {
+        kmeans(residuals.data() + j * n_train * ivf->dsub, n_train, ivf->dsub, PQ_N_CODES, params.n_iter, n_threads,
+               rng, ivf->codebooks.data() + j * codebook_size);
+    }
 
-            struct ggml_tensor * K =
-                ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].k_b, cur), ggml_mul_mat(ctx0, model.layers[il].k_w, cur));
+    ivf->trained = true;
+    return true;
+}
 
-            K = ggml_reshape_4d(ctx0, K, d_head, n_head, num_positions, batch_size);
-            K = ggml_cont(ctx0, ggml_permute(ctx0, K, 0, 2, 1, 3));
-            K = ggml_reshape_3d(ctx0, K, d_head, num_positions, n_head * batch_size);
+bool clip_ivfpq_add(clip_ivfpq * ivf, const float * vecs, const int64_t * ids, const size_t n_vecs,
+                    const int n_threads) {
+    if (!ivf->trained) {
+        fprintf(stderr, "%s: the index must be trained first\n", __func__);
+        return false;
+    }
 
-            struct ggml_tensor * V =
-                ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].v_b, cur), ggml_mul_mat(ctx0, model.layers[il].v_w, cur));
+    ivf->materialize();
 
-            V = ggml_reshape_4d(ctx0, V, d_head, n_head, num_positions, batch_size);
-            V = ggml_cont(ctx0, ggml_permute(ctx0, V, 1, 2, 0, 3));
-            V = ggml_reshape_3d(ctx0, V, num_positions, d_head, n_head * batch_size);
+    const int m = ivf->params.pq_m;
+    std::vector<int32_t> lists(n_vecs);
+    kmeans_assign(vecs, n_vecs, ivf->vec_dim, ivf->centroids.data(), ivf->params.n_lists, n_threads, lists.data());
 
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-            KQ = ggml_soft_max_inplace(ctx0, KQ);
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ);
-            KQV = ggml_reshape_4d(ctx0, KQV, d_head, num_positions, n_head, batch_size);
-            KQV = ggml_cont(ctx0, ggml_permute(ctx0, KQV, 0, 2, 1, 3));
+    std::vector<float> residuals;
+    ivfpq_residual_subvectors(ivf, vecs, n_vecs, lists.data(), residuals);
 
-            cur = ggml_cpy(ctx0, KQV, ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, num_positions, batch_size));
-        }
+    // codes[j * n_vecs + i] is the code of subvector j of vector i
+    std::vector<int32_t> codes(m * n_vecs);
+    const size_t codebook_size = (size_t)PQ_N_CODES * ivf->dsub;
+    for (int j = 0; j < m; j++) {
+        kmeans_assign(residuals.data() + j * n_vecs * ivf->dsub, n_vecs, ivf->dsub,
+                      ivf->codebooks.data() + j * codebook_size, PQ_N_CODES, n_threads, codes.data() + j * n_vecs);
+    }
 
-        // attention output
-        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].o_b, cur), ggml_mul_mat(ctx0, model.layers[il].o_w, cur));
+    for (size_t i = 0; i < n_vecs; i++) {
+        auto & list_codes = ivf->codes_buf[lists[i]];
+        ivf->rows_buf[lists[i]].push_back(ivf->n_vecs + i);
+        for (int j = 0; j < m; j++) {
+            list_codes.push_back((uint8_t)codes[j * n_vecs + i]);
+        }
+    }
+    ivf->ids_buf.insert(ivf->ids_buf.end(), ids, ids + n_vecs);
+    ivf->ids = ivf->ids_buf.data();
+    ivf->n_vecs += n_vecs;
 
-        // re-add the layer input, e.g., residual
-        cur = ggml_add(ctx0, cur, embeddings);
+    return true;
+}
 
-        embeddings = cur; // embeddings = residual, cur = hidden_states
+// approximate q . r of a PQ code: the sum of the precomputed q_j . codebook_j[code_j] of each subspace j
+static inline float pq_score(const float * lut, const uint8_t * code, const int m) {
+    int j = 0;
+    float sum = 0.0f;
+#if defined(__AVX2__)
+    const __m256i offsets = _mm256_setr_epi32(0, 1 * PQ_N_CODES, 2 * PQ_N_CODES, 3 * PQ_N_CODES, 4 * PQ_N_CODES,
+                                              5 * PQ_N_CODES, 6 * PQ_N_CODES, 7 * PQ_N_CODES);
+    __m256 acc = _mm256_setzero_ps();
+    for (; j + 8 <= m; j += 8) {
+        const __m256i idx = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(code + j))), offsets);
+        acc = _mm256_add_ps(acc, _mm256_i32gather_ps(lut + j * PQ_N_CODES, idx, 4));
+    }
+    sum = hsum_f32_8(acc);
+#endif
+    for (; j < m; j++) {
+        sum += lut[j * PQ_N_CODES + code[j]];
+    }
+    return sum;
+}
 
-        // layernorm2
-        {
-            cur = ggml_norm(ctx0, cur, eps);
+typedef struct {
+    const clip_ivfpq * ivf;
+    const float * queries;
+    int k;
+    const clip_index * rerank;
+    int n_rerank;
+    float * scores;
+    int64_t * ids;
+} IvfpqSearchArgs;
+
+static void ivfpq_search_queries(void * arg, size_t start, size_t end) {
+    const IvfpqSearchArgs * a = static_cast<IvfpqSearchArgs *>(arg);
+    const clip_ivfpq * ivf = a->ivf;
+    const int m = ivf->params.pq_m;
+    const int dsub = ivf->dsub;
+    const int n_probe = std::min(ivf->params.n_probe, ivf->params.n_lists);
+    const int n_candidates = a->rerank ? std::max(a->k, a->n_rerank) : a->k;
+
+    std::vector<float> coarse(ivf->params.n_lists);
+    std::vector<float> lut((size_t)m * PQ_N_CODES);
+    std::vector<std::pair<float, int>> probes;
+    std::vector<std::pair<float, uint64_t>> candidates;
+    std::vector<std::pair<float, uint64_t>> results;
+    std::vector<int8_t> q_i8(a->rerank && a->rerank->type == CLIP_INDEX_I8 ? ivf->vec_dim : 0);
+    float q_scale = 0.0f;
+
+    for (size_t qi = start; qi < end; qi++) {
+        const float * q = a->queries + qi * ivf->vec_dim;
+
+        // q . x ~= q . c + q . r, the lookup table of q . r is shared by all lists
+        probes.clear();
+        for (int l = 0; l < ivf->params.n_lists; l++) {
+            coarse[l] = vec_dot_f32(q, ivf->centroids.data() + (size_t)l * ivf->vec_dim, ivf->vec_dim);
+            top_k_push(probes, n_probe, std::pair<float, int>(coarse[l], l));
+        }
+        for (int j = 0; j < m; j++) {
+            const float * codebook = ivf->codebooks.data() + (size_t)j * PQ_N_CODES * dsub;
+            for (int c = 0; c < PQ_N_CODES; c++) {
+                lut[j * PQ_N_CODES + c] = vec_dot_f32(q + j * dsub, codebook + c * dsub, dsub);
+            }
+        }
 
-            cur = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers[il].ln_2_w, cur), cur),
-                           ggml_repeat(ctx0, model.layers[il].ln_2_b, cur));
+        candidates.clear();
+        for (const auto & probe : probes) {
+            const int l = probe.second;
+            const size_t n = ivf->list_size(l);
+            const uint64_t * rows = ivf->list_rows(l);
+            const uint8_t * codes = ivf->list_codes(l);
+            for (size_t i = 0; i < n; i++) {
+                const float score = coarse[l] + pq_score(lut.data(), codes + i * m, m);
+                top_k_push(candidates, n_candidates, std::pair<float, uint64_t>(score, rows[i]));
+            }
         }
 
-        cur = ggml_mul_mat(ctx0, model.layers[il].ff_i_w, cur);
-        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].ff_i_b, cur), cur);
+        if (a->rerank) {
+            if (!q_i8.empty()) {
+                clip_vecs_quantize_i8(q, 1, ivf->vec_dim, q_i8.data(), &q_scale);
+            }
+            results.clear();
+            for (const auto & cand : candidates) {
+                const float score = index_row_similarity(a->rerank, q, q_i8.data(), q_scale, cand.second);
+                top_k_push(results, a->k, std::pair<float, uint64_t>(score, cand.second));
+            }
+            candidates.swap(results);
+        }
 
-        if (ctx->use_gelu) {
-            cur = ggml_gelu_inplace(ctx0, cur);
-        } else {
-            cur = ggml_gelu_quick_inplace(ctx0, cur);
+        std::sort_heap(candidates.begin(), candidates.end(), score_index_greater<uint64_t>);
+        for (int i = 0; i < a->k; i++) {
+            const bool found = i < (int)candidates.size();
+            a->scores[qi * a->k + i] = found ? candidates[i].first : -INFINITY;
+            a->ids[qi * a->k + i] = found ? ivf->ids[candidates[i].second] : -1;
         }
+    }
+}
 
-        cur = ggml_mul_mat(ctx0, model.layers[il].ff_o_w, cur);
-        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].ff_o_b, cur), cur);
+bool clip_ivfpq_search(const clip_ivfpq * ivf, const float * queries, const size_t n_queries, const int k,
+                       const int n_threads, const clip_index * rerank, const int n_rerank, float * scores,
+                       int64_t * ids) {
+    if (k <= 0 || !ivf->trained) {
+        return false;
+    }
+    if (rerank && (rerank->type == CLIP_INDEX_BIN || rerank->vec_dim != ivf->vec_dim || rerank->n_vecs < ivf->n_vecs)) {
+        fprintf(stderr, "%s: the rerank index does not match the vectors of the IVF-PQ index\n", __func__);
+        return false;
+    }
 
-        // residual 2
-        cur = ggml_add(ctx0, embeddings, cur);
+    IvfpqSearchArgs args = {ivf, queries, k, rerank, n_rerank, scores, ids};
+    parallel_for(n_threads, n_queries, 1, ivfpq_search_queries, &args);
+
+    return true;
+}
 
-        embeddings = cur;
+static void ivfpq_section_offsets(const clip_ivfpq_header & hdr, size_t offsets[6], size_t * file_size) {
+    const size_t n = hdr.n_vecs;
+    offsets[0] = align_up(sizeof(clip_ivfpq_header), CLIP_INDEX_ALIGNMENT);                                 // centroids
+    offsets[1] = align_up(offsets[0] + (size_t)hdr.n_lists * hdr.vec_dim * sizeof(float), CLIP_INDEX_ALIGNMENT); // codebooks
+    offsets[2] = align_up(offsets[1] + (size_t)PQ_N_CODES * hdr.vec_dim * sizeof(float), CLIP_INDEX_ALIGNMENT);  // ids
+    offsets[3] = align_up(offsets[2] + n * sizeof(int64_t), CLIP_INDEX_ALIGNMENT);                    // list offsets
+    offsets[4] = align_up(offsets[3] + (hdr.n_lists + 1) * sizeof(uint64_t), CLIP_INDEX_ALIGNMENT);   // rows
+    offsets[5] = align_up(offsets[4] + n * sizeof(uint64_t), CLIP_INDEX_ALIGNMENT);                   // codes
+    *file_size = offsets[5] + n * hdr.pq_m;
+}
+
+bool clip_ivfpq_save(const clip_ivfpq * ivf, const char * fname) {
+    if (!ivf->trained) {
+        fprintf(stderr, "%s: the index must be trained first\n", __func__);
+        return false;
     }
 
-    // get the output of cls token, e.g., 0th index
-    struct ggml_tensor * cls = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, batch_size);
-    for (int b = 0; b < batch_size; b++) {
-        ggml_set_i32_1d(cls, b, b * num_positions);
+    std::ofstream fout(fname, std::ios::binary);
+    if (!fout.is_open()) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
+        return false;
     }
-    embeddings = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, embeddings, hidden_size, num_positions * batch_size), cls);
 
-    // post-layernorm
-    {
-        embeddings = ggml_norm(ctx0, embeddings, eps);
+    const clip_ivfpq_params & params = ivf->params;
+    const clip_ivfpq_header hdr = {CLIP_IVFPQ_MAGIC,
+                                   CLIP_IVFPQ_VERSION,
+                                   (uint32_t)ivf->vec_dim,
+                                   (uint32_t)params.n_lists,
+                                   (uint32_t)params.pq_m,
+                                   (uint32_t)params.n_probe,
+                                   (uint32_t)params.n_iter,
+                                   0,
+                                   params.max_train,
+                                   params.seed,
+                                   ivf->n_vecs};
+    size_t offsets[6];
+    size_t file_size;
+    ivfpq_section_offsets(hdr, offsets, &file_size);
+
+    std::vector<uint64_t> list_offsets(params.n_lists + 1, 0);
+    for (int l = 0; l < params.n_lists; l++) {
+        list_offsets[l + 1] = list_offsets[l] + ivf->list_size(l);
+    }
 
-        embeddings = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.post_ln_w, embeddings), embeddings),
-                              ggml_repeat(ctx0, model.post_ln_b, embeddings));
+    auto pad_to = [&fout](const size_t offset) {
+        static const char zeros[CLIP_INDEX_ALIGNMENT] = {};
+        fout.write(zeros, offset - (size_t)fout.tellp());
+    };
+
+    fout.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+    pad_to(offsets[0]);
+    fout.write(reinterpret_cast<const char *>(ivf->centroids.data()), ivf->centroids.size() * sizeof(float));
+    pad_to(offsets[1]);
+    fout.write(reinterpret_cast<const char *>(ivf->codebooks.data()), ivf->codebooks.size() * sizeof(float));
+    pad_to(offsets[2]);
+    fout.write(reinterpret_cast<const char *>(ivf->ids), ivf->n_vecs * sizeof(int64_t));
+    pad_to(offsets[3]);
+    fout.write(reinterpret_cast<const char *>(list_offsets.data()), list_offsets.size() * sizeof(uint64_t));
+    pad_to(offsets[4]);
+    for (int l = 0; l < params.n_lists; l++) {
+        fout.write(reinterpret_cast<const char *>(ivf->list_rows(l)), ivf->list_size(l) * sizeof(uint64_t));
+    }
+    pad_to(offsets[5]);
+    for (int l = 0; l < params.n_lists; l++) {
+        fout.write(reinterpret_cast<const char *>(ivf->list_codes(l)), ivf->list_size(l) * params.pq_m);
     }
 
-    ggml_set_scratch(ctx0, {0, 0, nullptr});
+    if (!fout.good()) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname);
+        return false;
+    }
 
-    // final visual projection
-    embeddings = ggml_mul_mat(ctx0, model.projection, embeddings);
+    return true;
+}
 
-    // normalize output embeddings
-    struct ggml_tensor * output = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, projection_dim, batch_size);
+clip_ivfpq * clip_ivfpq_load(const char * fname, const bool use_mmap) {
+    std::ifstream fin(fname, std::ios::binary);
+    if (!fin.is_open()) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+        return nullptr;
+    }
 
-    for (int b = 0; b < batch_size; b++) {
-        struct ggml_tensor * embedding = ggml_get_rows(ctx0, embeddings, ggml_new_i32(ctx0, b));
-        if (normalize) {
-            ggml_tensor * length = ggml_sqrt(ctx0, ggml_sum(ctx0, ggml_sqr(ctx0, embedding)));
-            embedding = ggml_scale_inplace(ctx0, embedding, ggml_div(ctx0, ggml_new_f32(ctx0, 1.0f), length));
-        }
-        output = ggml_acc(ctx0, output, embedding, output->nb[1], output->nb[2], output->nb[3], b * ggml_nbytes(embedding));
+    clip_ivfpq_header hdr;
+    fin.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+    if (!fin.good() || hdr.magic != CLIP_IVFPQ_MAGIC || hdr.version != CLIP_IVFPQ_VERSION) {
+        fprintf(stderr, "%s: '%s' is not an IVF-PQ index file\n", __func__, fname);
+        return nullptr;
     }
-    ggml_set_name(output, "check");
 
-    // run the computation
-    ggml_build_forward_expand(&gf, output);
-    ggml_cplan cplan = ggml_graph_plan(&gf, n_threads);
-    cplan.work_size *= batch_size;
-    if (cplan.work_size != 0) {
-        cplan.work_data = (uint8_t *)malloc(cplan.work_size);
+    // the counts are bounded by the file before any size is computed from them
+    fin.seekg(0, std::ios::end);
+    const size_t file_bytes = fin.tellg();
+    if (hdr.n_vecs > file_bytes / sizeof(int64_t) || hdr.n_lists > file_bytes / sizeof(uint64_t)) {
+        fprintf(stderr, "%s: '%s' is corrupt\n", __func__, fname);
+        return nullptr;
     }
-    ggml_graph_compute(&gf, &cplan);
 
-// print
-#ifdef CLIP_DEBUG
-    {
-        auto print_t_f32 = [&](struct ggml_tensor * t) {
-            float * data = (float *)t->data;
-            printf("dtype: f32, dims: %jd %jd %jd %jd, nb: %jd %jd %jd %jd\n", t->ne[0], t->ne[1], t->ne[2], t->ne[3], t->nb[0],
-                   t->nb[1], t->nb[2], t->nb[3]);
-            printf("data: ");
-            for (int i = 0; i < std::min((int)t->ne[0], 20); i++) {
-                printf("%f ", data[i]);
-            }
+    clip_ivfpq_params params;
+    params.n_lists = hdr.n_lists;
+    params.pq_m = hdr.pq_m;
+    params.n_probe = hdr.n_probe;
+    params.n_iter = hdr.n_iter;
+    params.max_train = hdr.max_train;
+    params.seed = hdr.seed;
+    clip_ivfpq * ivf = clip_ivfpq_make(hdr.vec_dim, params);
+    if (!ivf) {
+        return nullptr;
+    }
+    ivf->n_vecs = hdr.n_vecs;
+    ivf->trained = true;
+
+    size_t offsets[6];
+    size_t file_size;
+    ivfpq_section_offsets(hdr, offsets, &file_size);
+
+    if (file_bytes < file_size) {
+        fprintf(stderr, "%s: '%s' is truncated\n", __func__, fname);
+        delete ivf;
+        return nullptr;
+    }
+
+    auto read_at = [&fin](const size_t offset, void * data, const size_t size) {
+        fin.seekg(offset);
+        fin.read(static_cast<char *>(data), size);
+    };
+
+    // the quantizers are small and always read
+    const size_t n = hdr.n_vecs;
+    ivf->centroids.resize((size_t)hdr.n_lists * hdr.vec_dim);
+    read_at(offsets[0], ivf->centroids.data(), ivf->centroids.size() * sizeof(float));
+    ivf->codebooks.resize((size_t)PQ_N_CODES * hdr.vec_dim);
+    read_at(offsets[1], ivf->codebooks.data(), ivf->codebooks.size() * sizeof(float));
+    std::vector<uint64_t> list_offsets(hdr.n_lists + 1);
+    read_at(offsets[3], list_offsets.data(), list_offsets.size() * sizeof(uint64_t));
+
+    if (!fin.good()) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname);
+        delete ivf;
+        return nullptr;
+    }
 
-            // printf("\n\n");
-            double sum = 0.0;
-            for (int i = 0; i < ggml_nelements(t); i++) {
-                sum += data[i];
+    // the lists cover the rows in order, and each row is one of the index
+    bool valid = list_offsets[0] == 0 && list_offsets[hdr.n_lists] == n;
+    for (uint32_t l = 0; valid && l < hdr.n_lists; l++) {
+        valid = list_offsets[l] <= list_offsets[l + 1];
+    }
+    auto rows_valid = [n](const uint64_t * rows, const size_t n_rows) {
+        for (size_t i = 0; i < n_rows; i++) {
+            if (rows[i] >= n) {
+                return false;
             }
-            printf("sum:  %f\n", sum);
-        };
+        }
+        return true;
+    };
+    if (!valid) {
+        fprintf(stderr, "%s: '%s' is corrupt\n", __func__, fname);
+        delete ivf;
+        return nullptr;
+    }
 
-        auto print_t_f16 = [&](struct ggml_tensor * t) {
-            ggml_fp16_t * data = (ggml_fp16_t *)t->data;
-            printf("dtype: f16, dims: %jd %jd %jd %jd\n", t->ne[0], t->ne[1], t->ne[2], t->ne[3]);
-            printf("data: ");
-            for (int i = 0; i < std::min((int)t->ne[0], 10); i++) {
-                printf("%f ", ggml_fp16_to_fp32(data[i]));
-            }
-            printf("\n\n");
-            double sum = 0.0;
-            for (int i = 0; i < ggml_nelements(t); i++) {
-                sum += ggml_fp16_to_fp32(data[i]);
+#ifndef _WIN32
+    if (use_mmap) {
+        const int fd = open(fname, O_RDONLY);
+        void * addr = fd >= 0 ? mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (addr != MAP_FAILED) {
+            const uint8_t * base = static_cast<const uint8_t *>(addr);
+            ivf->mapping = addr;
+            ivf->mapping_size = file_size;
+            ivf->ids = reinterpret_cast<const int64_t *>(base + offsets[2]);
+            ivf->list_offsets = reinterpret_cast<const uint64_t *>(base + offsets[3]);
+            ivf->rows_map = reinterpret_cast<const uint64_t *>(base + offsets[4]);
+            ivf->codes_map = base + offsets[5];
+            if (!rows_valid(ivf->rows_map, n)) {
+                fprintf(stderr, "%s: '%s' is corrupt\n", __func__, fname);
+                delete ivf;
+                return nullptr;
             }
-            printf("sum:  %f\n", sum);
-        };
-
-        auto * t = ggml_get_tensor(ctx0, "check");
-        // auto t = inp_raw;
-        if (t->type == GGML_TYPE_F32) {
-            print_t_f32(t);
-        } else {
-            print_t_f16(t);
+            return ivf;
         }
+        fprintf(stderr, "%s: failed to mmap '%s', reading it instead\n", __func__, fname);
     }
-
-    printf("used_mem = %zu\n", ggml_used_mem(ctx0));
 #endif
 
-    memcpy(vec, ggml_get_data_f32(output), sizeof(float) * projection_dim * batch_size);
+    ivf->ids_buf.resize(n);
+    read_at(offsets[2], ivf->ids_buf.data(), n * sizeof(int64_t));
+    for (int l = 0; l < params.n_lists; l++) {
+        const size_t size = list_offsets[l + 1] - list_offsets[l];
+        ivf->rows_buf[l].resize(size);
+        read_at(offsets[4] + list_offsets[l] * sizeof(uint64_t), ivf->rows_buf[l].data(), size * sizeof(uint64_t));
+        ivf->codes_buf[l].resize(size * params.pq_m);
+        read_at(offsets[5] + list_offsets[l] * params.pq_m, ivf->codes_buf[l].data(), size * params.pq_m);
+        valid = valid && rows_valid(ivf->rows_buf[l].data(), size);
+    }
+    ivf->ids = ivf->ids_buf.data();
 
-    if (cplan.work_size != 0) {
-        free(cplan.work_data);
+    if (!fin.good()) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname);
+        delete ivf;
+        return nullptr;
+    }
+    if (!valid) {
+        fprintf(stderr, "%s: '%s' is corrupt\n", __func__, fname);
+        delete ivf;
+        return nullptr;
     }
 
-    ggml_free(ctx0);
+    return ivf;
+}
 
-    return true;
+// file types a tensor can be converted to, by their general.file_type number. k-quants work on blocks of 256, rows
+// that don't split into them fall back to the legacy type of the nearest size
+static const struct {
+    const char * name;
+    int ftype;
+    ggml_type type;
+    ggml_type fallback;
+} quantize_types[] = {
+    {"f32", 0, GGML_TYPE_F32, GGML_TYPE_F32},     {"f16", 1, GGML_TYPE_F16, GGML_TYPE_F16},
+    {"q4_0", 2, GGML_TYPE_Q4_0, GGML_TYPE_Q4_0},  {"q4_1", 3, GGML_TYPE_Q4_1, GGML_TYPE_Q4_1},
+    {"q5_0", 6, GGML_TYPE_Q5_0, GGML_TYPE_Q5_0},  {"q5_1", 7, GGML_TYPE_Q5_1, GGML_TYPE_Q5_1},
+    {"q8_0", 8, GGML_TYPE_Q8_0, GGML_TYPE_Q8_0},  {"q2_k", 10, GGML_TYPE_Q2_K, GGML_TYPE_Q4_0},
+    {"q3_k", 11, GGML_TYPE_Q3_K, GGML_TYPE_Q4_0}, {"q4_k", 12, GGML_TYPE_Q4_K, GGML_TYPE_Q5_0},
+    {"q5_k", 13, GGML_TYPE_Q5_K, GGML_TYPE_Q5_1}, {"q6_k", 14, GGML_TYPE_Q6_K, GGML_TYPE_Q8_0},
+};
+
+// the tower, block and role of a tensor: token_embd, position_embd, attn_q, attn_k, attn_v, attn_out, ffn_up,
+// ffn_down or proj
+struct quantize_tensor_class {
+    std::string tower;
+    int layer = -1;
+    std::string role;
+};
+
+static bool glob_match(const char * pattern, const char * str) {
+    if (*pattern == '\0') {
+        return *str == '\0';
+    }
+    if (*pattern == '*') {
+        return glob_match(pattern + 1, str) || (*str != '\0' && glob_match(pattern, str + 1));
+    }
+    return *pattern == *str && glob_match(pattern + 1, str + 1);
 }
 
-float clip_similarity_score(const float * vec1, const float * vec2, const int vec_dim) {
-    float dot_product = 0.0;
-    for (int i = 0; i < vec_dim; i++) {
-        dot_product += vec1[i] * vec2[i];
+static quantize_tensor_class classify_tensor(const std::string & name) {
+    quantize_tensor_class c;
+    if (name == TN_TEXT_PROJ || name == TN_VIS_PROJ) {
+        c.tower = name == TN_TEXT_PROJ ? "t" : "v";
+        c.role = "proj";
+        return c;
     }
 
-    return dot_product;
+    // <tower>.[blk.<layer>.]<role>.<weight|bias>
+    std::vector<std::string> parts;
+    size_t pos = 0;
+    for (size_t dot; (dot = name.find('.', pos)) != std::string::npos; pos = dot + 1) {
+        parts.push_back(name.substr(pos, dot - pos));
+    }
+    parts.push_back(name.substr(pos));
+
+    if (parts.size() >= 4 && parts[1] == "blk") {
+        c.tower = parts[0];
+        c.layer = atoi(parts[2].c_str());
+        c.role = parts[3];
+    } else if (parts.size() >= 2) {
+        c.tower = parts[0];
+        c.role = parts[1];
+    }
+    return c;
 }
 
-bool clip_compare_text_and_image(const clip_ctx * ctx, const int n_threads, const char * text, const clip_image_u8 * image,
-                                 float * score) {
-    if (!(ctx->has_text_encoder && ctx->has_vision_encoder)) {
-        printf("clip_compare_text_and_image function can only be used with two-tower models\n");
+static bool quantize_rule_matches(const quantize_rule & rule, const quantize_tensor_class & c) {
+    if (!rule.tower.empty() && rule.tower != c.tower) {
         return false;
     }
-
-    // prepare image and text vectors
-    const int projection_dim = ctx->vision_model.hparams.projection_dim;
-    float img_vec[projection_dim];
-    float txt_vec[projection_dim];
-
-    // tokenize and encode text
-    clip_tokens tokens;
-    if (!clip_tokenize(ctx, text, &tokens)) {
+    if (rule.layer_min >= 0 && (c.layer < rule.layer_min || (rule.layer_max >= 0 && c.layer > rule.layer_max))) {
         return false;
     }
+    return glob_match(rule.role.c_str(), c.role.c_str());
+}
 
-    if (!clip_text_encode(ctx, n_threads, &tokens, txt_vec, true)) {
-        return false;
+static bool parse_quantize_recipe(const std::string & recipe, std::vector<quantize_rule> & rules) {
+    std::string text = recipe;
+    for (const auto & preset : quantize_presets) {
+        if (text == preset.name) {
+            text = preset.recipe;
+            break;
+        }
     }
 
-    // preprocess and encode image
-    clip_image_f32 img_res;
+    // a bare type converts every weight
+    if (text.find('=') == std::string::npos && text.find(',') == std::string::npos) {
+        text = "*=" + text;
+    }
 
-    if (!clip_image_preprocess(ctx, image, &img_res)) {
-        return false;
+    rules.clear();
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) {
+            continue;
+        }
+
+        const size_t eq = item.find('=');
+        if (eq == std::string::npos) {
+            fprintf(stderr, "%s: expected [tower.]role[@first-last]=type, got '%s'\n", __func__, item.c_str());
+            return false;
+        }
+
+        quantize_rule rule;
+        std::string pattern = item.substr(0, eq);
+        const std::string type = item.substr(eq + 1);
+
+        const size_t at = pattern.find('@');
+        if (at != std::string::npos) {
+            const std::string range = pattern.substr(at + 1);
+            pattern = pattern.substr(0, at);
+            const size_t dash = range.find('-');
+            rule.layer_min = atoi(range.c_str());
+            rule.layer_max = dash == std::string::npos ? rule.layer_min
+                             : dash + 1 < range.size() ? atoi(range.c_str() + dash + 1)
+                                                       : -1;
+        }
+
+        const size_t dot = pattern.find('.');
+        if (dot != std::string::npos) {
+            rule.tower = pattern.substr(0, dot);
+            pattern = pattern.substr(dot + 1);
+            if (rule.tower == "text") {
+                rule.tower = "t";
+            } else if (rule.tower == "vision") {
+                rule.tower = "v";
+            } else if (rule.tower == "*") {
+                rule.tower.clear();
+            } else if (rule.tower != "t" && rule.tower != "v") {
+                fprintf(stderr, "%s: unknown tower '%s' in '%s'\n", __func__, rule.tower.c_str(), item.c_str());
+                return false;
+            }
+        }
+        rule.role = pattern;
+
+        bool found = type == "keep";
+        rule.keep = found;
+        for (const auto & t : quantize_types) {
+            if (type == t.name || (type.size() == 4 && type[3] == 'K' && type.substr(0, 3) + "k" == t.name)) {
+                rule.ftype = t.ftype;
+                rule.type = t.type;
+                rule.fallback = t.fallback;
+                found = true;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "%s: unknown type '%s' in '%s'\n", __func__, type.c_str(), item.c_str());
+            return false;
+        }
+
+        rules.push_back(rule);
     }
 
-    if (!clip_image_encode(ctx, n_threads, &img_res, img_vec, true)) {
+    if (rules.empty()) {
+        fprintf(stderr, "%s: empty recipe '%s'\n", __func__, recipe.c_str());
         return false;
     }
-
-    // compute similarity
-    *score = clip_similarity_score(img_vec, txt_vec, projection_dim);
-
     return true;
 }
 
-typedef struct {
-    float score;
-    int index;
-} ScoreIndexPair;
+// importance weighted quantization of the legacy types. ggml picks the scale of a block from its largest value,
+// here a few scales around it are tried and the one with the lowest error weighted by the mean square activation of
+// each column is kept, then the scale (and min) are refit by weighted least squares. the block layouts are ggml's
+
+// symmetric: x ~ d * l with l in [-nmax, nmax - 1]. returns d
+static float quantize_block_sym_weighted(const float * x, const float * w, const int nmax, int8_t * l) {
+    float amax = 0.0f;
+    float max = 0.0f;
+    for (int i = 0; i < QK_LEGACY; i++) {
+        if (fabsf(x[i]) > amax) {
+            amax = fabsf(x[i]);
+            max = x[i];
+        }
+    }
+    if (amax == 0.0f) {
+        memset(l, 0, QK_LEGACY);
+        return 0.0f;
+    }
 
-int compare_scores(const void * a, const void * b) {
-    const ScoreIndexPair * pair1 = (const ScoreIndexPair *)a;
-    const ScoreIndexPair * pair2 = (const ScoreIndexPair *)b;
+    // ggml's scale first, so that blocks without any importance end up as ggml would quantize them
+    float best_d = max / -nmax;
+    float best_err = 0.0f;
+    for (int i = 0; i < QK_LEGACY; i++) {
+        l[i] = (int8_t)std::max(-nmax, std::min(nmax - 1, (int)roundf(x[i] / best_d)));
+        const float diff = x[i] - best_d * l[i];
+        best_err += w[i] * diff * diff;
+    }
 
-    if (pair1->score < pair2->score) {
-        return 1;
-    } else if (pair1->score > pair2->score) {
-        return -1;
-    } else {
-        return 0;
+    int8_t cand[QK_LEGACY];
+    for (int is = -9; is <= 9; is++) {
+        const float id = (-nmax + 0.1f * is) / max;
+        float sum_xl = 0.0f;
+        float sum_ll = 0.0f;
+        for (int i = 0; i < QK_LEGACY; i++) {
+            const int q = std::max(-nmax, std::min(nmax - 1, (int)roundf(id * x[i])));
+            cand[i] = (int8_t)q;
+            sum_xl += w[i] * x[i] * q;
+            sum_ll += w[i] * q * q;
+        }
+        if (sum_ll <= 0.0f) {
+            continue;
+        }
+        const float d = sum_xl / sum_ll;
+        float err = 0.0f;
+        for (int i = 0; i < QK_LEGACY; i++) {
+            const float diff = x[i] - d * cand[i];
+            err += w[i] * diff * diff;
+        }
+        if (err < best_err) {
+            best_err = err;
+            best_d = d;
+            memcpy(l, cand, QK_LEGACY);
+        }
     }
+    return best_d;
 }
 
-bool softmax_with_sorting(float * arr, const int length, float * sorted_scores, int * indices) {
-    ScoreIndexPair * score_index_pairs = (ScoreIndexPair *)malloc(length * sizeof(ScoreIndexPair));
-    if (!score_index_pairs) {
-        return false;
+// asymmetric: x ~ d * l + m with l in [0, nmax]
+static void quantize_block_asym_weighted(const float * x, const float * w, const int nmax, uint8_t * l, float * d,
+                                         float * m) {
+    float min = x[0];
+    float max = x[0];
+    for (int i = 1; i < QK_LEGACY; i++) {
+        min = std::min(min, x[i]);
+        max = std::max(max, x[i]);
+    }
+    *d = 0.0f;
+    *m = min;
+    memset(l, 0, QK_LEGACY);
+    if (max == min) {
+        return;
     }
 
-    // Calculate softmax probabilities
+    *d = (max - min) / nmax;
+    float best_err = 0.0f;
+    for (int i = 0; i < QK_LEGACY; i++) {
+        l[i] = (uint8_t)std::max(0, std::min(nmax, (int)roundf((x[i] - min) / *d)));
+        const float diff = x[i] - *d * l[i] - min;
+        best_err += w[i] * diff * diff;
+    }
 
-    double sum = 0.0;
-    for (int i = 0; i < length; i++) {
-        arr[i] = exp(arr[i]) + 1e-9;
-        sum += arr[i];
+    uint8_t cand[QK_LEGACY];
+    for (int is = 0; is <= 20; is++) {
+        const float iscale = (nmax - 1.0f + 0.1f * is) / (max - min);
+        float sw = 0.0f, sl = 0.0f, sll = 0.0f, sx = 0.0f, sxl = 0.0f;
+        for (int i = 0; i < QK_LEGACY; i++) {
+            const int q = std::max(0, std::min(nmax, (int)roundf(iscale * (x[i] - min))));
+            cand[i] = (uint8_t)q;
+            sw += w[i];
+            sl += w[i] * q;
+            sll += w[i] * q * q;
+            sx += w[i] * x[i];
+            sxl += w[i] * x[i] * q;
+        }
+        const float det = sw * sll - sl * sl;
+        if (det <= 0.0f) {
+            continue;
+        }
+        const float cd = (sw * sxl - sx * sl) / det;
+        const float cm = (sll * sx - sl * sxl) / det;
+        float err = 0.0f;
+        for (int i = 0; i < QK_LEGACY; i++) {
+            const float diff = x[i] - cd * cand[i] - cm;
+            err += w[i] * diff * diff;
+        }
+        if (err < best_err) {
+            best_err = err;
+            *d = cd;
+            *m = cm;
+            memcpy(l, cand, QK_LEGACY);
+        }
     }
+}
 
-    for (int i = 0; i < length; i++) {
-        arr[i] /= sum;
-        score_index_pairs[i].score = arr[i];
-        score_index_pairs[i].index = i;
+// nibbles of values j and j + 16 share a byte, the fifth bits go to a 32-bit mask
+static void pack_block_bits(const uint8_t * q, uint8_t * qs, uint8_t * qh) {
+    uint32_t h = 0;
+    for (int j = 0; j < QK_LEGACY / 2; j++) {
+        qs[j] = (q[j] & 0x0F) | ((q[j + QK_LEGACY / 2] & 0x0F) << 4);
+        h |= (uint32_t)((q[j] & 0x10) >> 4) << j;
+        h |= (uint32_t)((q[j + QK_LEGACY / 2] & 0x10) >> 4) << (j + QK_LEGACY / 2);
+    }
+    if (qh) {
+        memcpy(qh, &h, sizeof(h));
     }
+}
 
-    // Sort scores in descending order
-    qsort(score_index_pairs, length, sizeof(ScoreIndexPair), compare_scores);
+static bool quantize_type_has_imatrix(const ggml_type type) {
+    return type == GGML_TYPE_Q4_0 || type == GGML_TYPE_Q4_1 || type == GGML_TYPE_Q5_0 || type == GGML_TYPE_Q5_1;
+}
 
-    // Copy sorted scores and indices to the respective arrays
-    for (int i = 0; i < length; i++) {
-        sorted_scores[i] = score_index_pairs[i].score;
-        indices[i] = score_index_pairs[i].index;
-    }
+// quantizes n_per_row values, n_per_row a multiple of 32, with the importance w of each column
+static void quantize_row_weighted(const ggml_type type, const float * x, const float * w, const int64_t n_per_row,
+                                  uint8_t * dst, int64_t * hist) {
+    const bool has_min = type == GGML_TYPE_Q4_1 || type == GGML_TYPE_Q5_1;
+    const bool has_qh = type == GGML_TYPE_Q5_0 || type == GGML_TYPE_Q5_1;
+    const int bits = has_qh ? 5 : 4;
+
+    uint8_t q[QK_LEGACY];
+    for (int64_t ib = 0; ib < n_per_row / QK_LEGACY; ib++) {
+        const float * xb = x + ib * QK_LEGACY;
+        const float * wb = w + ib * QK_LEGACY;
+
+        float d;
+        float m = 0.0f;
+        if (has_min) {
+            quantize_block_asym_weighted(xb, wb, (1 << bits) - 1, q, &d, &m);
+        } else {
+            int8_t l[QK_LEGACY];
+            d = quantize_block_sym_weighted(xb, wb, 1 << (bits - 1), l);
+            for (int i = 0; i < QK_LEGACY; i++) {
+                q[i] = (uint8_t)(l[i] + (1 << (bits - 1)));
+            }
+        }
+        for (int i = 0; i < QK_LEGACY; i++) {
+            hist[q[i] >> (bits - 4)]++;
+        }
 
-    free(score_index_pairs);
-    return true;
+        // d, [m], [qh], qs
+        ggml_fp16_t * head = reinterpret_cast<ggml_fp16_t *>(dst);
+        head[0] = ggml_fp32_to_fp16(d);
+        uint8_t * p = dst + sizeof(ggml_fp16_t);
+        if (has_min) {
+            head[1] = ggml_fp32_to_fp16(m);
+            p += sizeof(ggml_fp16_t);
+        }
+        uint8_t * qh = has_qh ? p : nullptr;
+        p += has_qh ? sizeof(uint32_t) : 0;
+        pack_block_bits(q, p, qh);
+        dst = p + QK_LEGACY / 2;
+    }
 }
 
-bool clip_zero_shot_label_image(struct clip_ctx * ctx, const int n_threads, const struct clip_image_u8 * input_img,
-                                const char ** labels, const size_t n_labels, float * scores, int * indices) {
-    if (!(ctx->has_text_encoder && ctx->has_vision_encoder)) {
-        printf("clip_zero_shot_label_image function can only be used with two-tower models\n");
-        return false;
+struct QuantizeArgs {
+    ggml_type type;
+    ggml_type src_type;
+    const uint8_t * src;
+    uint8_t * dst;
+    int64_t n_per_row;
+    size_t dst_row_size;
+    const float * imatrix; // importance of each column, or NULL
+    std::mutex * hist_mutex;
+    int64_t * hist;
+};
+
+// converts and quantizes rows [start, end) of a tensor. f16 rows are converted to f32 a few at a time, so the scratch
+// of a call stays small whatever the size of the tensor
+static void quantize_rows(void * arg, size_t start, size_t end) {
+    const QuantizeArgs * args = static_cast<const QuantizeArgs *>(arg);
+    const int64_t n_per_row = args->n_per_row;
+
+    if (args->src_type == GGML_TYPE_F16 && args->type == GGML_TYPE_F32) {
+        ggml_fp16_to_fp32_row(reinterpret_cast<const ggml_fp16_t *>(args->src) + start * n_per_row,
+                              reinterpret_cast<float *>(args->dst + start * args->dst_row_size),
+                              (end - start) * n_per_row);
+        return;
     }
 
-    // load the image
-    clip_image_f32 img_res;
+    const bool convert = args->src_type == GGML_TYPE_F16;
+    const size_t chunk_rows = convert ? std::max<int64_t>(1, 16384 / n_per_row) : end - start;
+    std::vector<float> f32_buf(convert ? std::min(chunk_rows, end - start) * n_per_row : 0);
+
+    int64_t hist[1 << 4] = {0};
+    for (size_t r0 = start; r0 < end; r0 += chunk_rows) {
+        const size_t r1 = std::min(end, r0 + chunk_rows);
+        const int64_t n = (r1 - r0) * n_per_row;
+        uint8_t * dst = args->dst + r0 * args->dst_row_size;
+
+        const float * f32 = reinterpret_cast<const float *>(args->src) + r0 * n_per_row;
+        if (convert) {
+            ggml_fp16_to_fp32_row(reinterpret_cast<const ggml_fp16_t *>(args->src) + r0 * n_per_row, f32_buf.data(),
+                                  n);
+            f32 = f32_buf.data();
+        }
 
-    const int vec_dim = clip_get_vision_hparams(ctx)->projection_dim;
+        if (args->type == GGML_TYPE_F16) {
+            ggml_fp32_to_fp16_row(f32, reinterpret_cast<ggml_fp16_t *>(dst), n);
+        } else if (args->type == GGML_TYPE_F32) {
+            memcpy(dst, f32, n * sizeof(float));
+        } else if (args->imatrix && quantize_type_has_imatrix(args->type)) {
+            for (size_t r = r0; r < r1; r++) {
+                quantize_row_weighted(args->type, f32 + (r - r0) * n_per_row, args->imatrix, n_per_row,
+                                      dst + (r - r0) * args->dst_row_size, hist);
+            }
+        } else {
+            // ggml_quantize_chunk offsets src and dst by its start, which is relative to the rows handled here
+            ggml_quantize_chunk(args->type, f32, dst, 0, n, hist);
+        }
+    }
 
-    clip_image_preprocess(ctx, input_img, &img_res);
+    if (args->type == GGML_TYPE_F16 || args->type == GGML_TYPE_F32) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(*args->hist_mutex);
+    for (int j = 0; j < (1 << 4); j++) {
+        args->hist[j] += hist[j];
+    }
+}
 
-    float img_vec[vec_dim];
-    if (!clip_image_encode(ctx, n_threads, &img_res, img_vec, false)) {
-        return false;
+// the recipe expanded, as recorded under clip.quantize.recipe
+static std::string quantize_recipe_text(const std::vector<quantize_rule> & rules) {
+    std::string text;
+    for (const auto & rule : rules) {
+        char range[32] = "";
+        if (rule.layer_min >= 0) {
+            snprintf(range, sizeof(range), rule.layer_max < 0 ? "@%d-" : "@%d-%d", rule.layer_min, rule.layer_max);
+        }
+        text += (text.empty() ? "" : ",") + (rule.tower.empty() ? "" : rule.tower + ".") + rule.role + range + "=" +
+                (rule.keep ? "keep" : get_ftype(rule.ftype));
     }
+    return text;
+}
 
-    // encode texts and compute similarities
-    float txt_vec[vec_dim];
-    float similarities[n_labels];
+// the type the first matching rule converts a tensor to. only 2D weights are converted, and only if their rows split
+// into whole blocks of the type or of its fallback, anything else keeps its type
+static ggml_type quantize_tensor_type(const std::vector<quantize_rule> & rules, const std::string & name,
+                                      const struct ggml_tensor * t) {
+    if (!ends_with(name, "weight") || t->n_dims != 2) {
+        return t->type;
+    }
 
-    for (int i = 0; i < n_labels; i++) {
-        const auto & text = labels[i];
-        clip_tokens tokens;
-        clip_tokenize(ctx, text, &tokens);
-        clip_text_encode(ctx, n_threads, &tokens, txt_vec, false);
-        similarities[i] = clip_similarity_score(img_vec, txt_vec, vec_dim);
+    const quantize_tensor_class c = classify_tensor(name);
+    for (const auto & rule : rules) {
+        if (!quantize_rule_matches(rule, c)) {
+            continue;
+        }
+        if (rule.keep) {
+            return t->type;
+        }
+        const ggml_type target = t->ne[0] % ggml_blck_size(rule.type) == 0 ? rule.type : rule.fallback;
+        return t->ne[0] % ggml_blck_size(target) == 0 ? target : t->type;
     }
+    return t->type;
+}
 
-    // apply softmax and sort scores
-    softmax_with_sorting(similarities, n_labels, scores, indices);
+// the general.file_type of the type of most weights of a model, or -1 if it has none
+static int dominant_ftype(const std::map<ggml_type, int64_t> & n_elements_by_type) {
+    int ftype = -1;
+    int64_t n_max = -1;
+    for (const auto & it : n_elements_by_type) {
+        for (const auto & t : quantize_types) {
+            if (t.type == it.first && it.second > n_max) {
+                ftype = t.ftype;
+                n_max = it.second;
+            }
+        }
+    }
+    return ftype;
+}
 
-    return true;
+// converts a tensor read from the file to the type it has in the model, across n_threads threads
+static void convert_tensor(const int n_threads, const struct ggml_tensor * src, const void * src_data,
+                           struct ggml_tensor * dst) {
+    const int64_t n_per_row = src->ne[0];
+    const int64_t n_rows = ggml_nelements(src) / n_per_row;
+
+    std::mutex hist_mutex;
+    int64_t hist[1 << 4] = {0};
+    QuantizeArgs args = {dst->type,
+                         src->type,
+                         static_cast<const uint8_t *>(src_data),
+                         static_cast<uint8_t *>(dst->data),
+                         n_per_row,
+                         ggml_nbytes(dst) / n_rows,
+                         NULL,
+                         &hist_mutex,
+                         hist};
+    parallel_for(n_threads, n_rows, std::max<int64_t>(1, 16384 / n_per_row), quantize_rows, &args);
 }
 
-bool clip_model_quantize(const char * fname_inp, const char * fname_out, const int itype) {
+// a tensor of the source model, read ahead while the previous one is quantized and written
+struct quantize_src_tensor {
+    int idx;
+    struct ggml_tensor * meta;
+    std::vector<uint8_t> data;
+};
 
-    ggml_type type = GGML_TYPE_Q4_1;
+static bool quantize_read_tensor(std::ifstream & fin, const gguf_context * ctx, const size_t data_offset,
+                                 quantize_src_tensor & t) {
+    t.data.resize(ggml_nbytes(t.meta));
+    fin.seekg(data_offset + gguf_get_tensor_offset(ctx, t.idx), std::ios::beg);
+    fin.read(reinterpret_cast<char *>(t.data.data()), t.data.size());
+    return fin.good();
+}
 
-    switch (itype) {
-    case 2:
-        type = GGML_TYPE_Q4_0;
-        break;
-    case 3:
-        type = GGML_TYPE_Q4_1;
-        break;
-    case 6:
-        type = GGML_TYPE_Q5_0;
-        break;
-    case 7:
-        type = GGML_TYPE_Q5_1;
-        break;
-    case 8:
-        type = GGML_TYPE_Q8_0;
-        break;
-    default:
+static bool ends_with(const std::string & str, const std::string & suffix) {
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+const char * clip_model_quantize_preset(const int i, const char ** name) {
+    const int n_presets = sizeof(quantize_presets) / sizeof(quantize_presets[0]);
+    if (i < 0 || i >= n_presets) {
+        return NULL;
+    }
+    *name = quantize_presets[i].name;
+    return quantize_presets[i].recipe;
+}
+
+bool clip_model_quantize(const char * fname_inp, const char * fname_out, const int itype) {
+    if (itype < 2 || itype == 4 || itype == 5 || itype == 9 || itype > 14) {
         fprintf(stderr, "%s: invalid quantization type %d\n", __func__, itype);
         return false;
+    }
+
+    return clip_model_quantize_recipe(fname_inp, fname_out, ("*=" + get_ftype(itype)).c_str(), NULL);
+}
+
+bool clip_model_quantize_recipe(const char * fname_inp, const char * fname_out, const char * recipe,
+                                const char * fname_imatrix) {
+    std::vector<quantize_rule> rules;
+    if (!parse_quantize_recipe(recipe, rules)) {
+        return false;
+    }
+
+    struct ggml_context * ctx_imatrix = NULL;
+    struct gguf_context * gguf_imatrix = NULL;
+    if (fname_imatrix) {
+        struct gguf_init_params imatrix_params = {
+            /*.no_alloc = */ false,
+            /*.ctx      = */ &ctx_imatrix,
+        };
+        gguf_imatrix = gguf_init_from_file(fname_imatrix, imatrix_params);
+        if (!gguf_imatrix) {
+            fprintf(stderr, "%s: failed to load the importance matrix '%s'\n", __func__, fname_imatrix);
+            return false;
+        }
+        const int idx_rows = gguf_find_key(gguf_imatrix, KEY_IMATRIX_N_ROWS);
+        printf("%s: importance matrix of %d weights over %u rows\n", __func__, gguf_get_n_tensors(gguf_imatrix),
+               idx_rows != -1 ? gguf_get_val_u32(gguf_imatrix, idx_rows) : 0);
+    }
+
+    // only the metadata is loaded, tensors are streamed through one at a time
+    struct ggml_context * ctx_data = NULL;
+    struct gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &ctx_data,
     };
+    struct gguf_context * ctx_src = gguf_init_from_file(fname_inp, params);
+    if (!ctx_src) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname_inp);
+        if (gguf_imatrix) {
+            ggml_free(ctx_imatrix);
+            gguf_free(gguf_imatrix);
+        }
+        return false;
+    }
 
-    auto ctx_clip = clip_model_load(fname_inp, 2);
-    const auto & ctx_src = ctx_clip->ctx_gguf;
-    const auto & ctx_data = ctx_clip->ctx;
+    std::ifstream fin(fname_inp, std::ios::binary);
+    if (!fin.is_open()) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname_inp);
+        ggml_free(ctx_data);
+        gguf_free(ctx_src);
+        if (gguf_imatrix) {
+            ggml_free(ctx_imatrix);
+            gguf_free(gguf_imatrix);
+        }
+        return false;
+    }
+
+    // the recipe is recorded expanded, the type of every tensor is in its tensor info
+    const std::string recipe_text = quantize_recipe_text(rules);
 
     auto ctx_out = gguf_init_empty();
     gguf_set_kv(ctx_out, ctx_src);
     gguf_set_val_u32(ctx_out, "general.quantization_version", GGML_QNT_VERSION);
-    gguf_set_val_u32(ctx_out, "general.file_type", itype);
-
-    auto fout = std::ofstream(fname_out, std::ios::binary);
+    gguf_set_val_str(ctx_out, KEY_QUANT_RECIPE, recipe_text.c_str());
+
+    std::vector<char> write_buf(4 * 1024 * 1024);
+    std::ofstream fout;
+    fout.rdbuf()->pubsetbuf(write_buf.data(), write_buf.size());
+    // write next to the output and rename on success, so that a failure never leaves a truncated model behind
+    char tmp_suffix[32];
+    snprintf(tmp_suffix, sizeof(tmp_suffix), ".tmp.%08x", (unsigned)std::random_device{}());
+    const std::string tmp_out = std::string(fname_out) + tmp_suffix;
+    fout.open(tmp_out, std::ios::binary | std::ios::trunc);
+    if (!fout.is_open()) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, tmp_out.c_str());
+    }
 
     const int n_tensors = gguf_get_n_tensors(ctx_src);
+    const size_t data_offset = gguf_get_data_offset(ctx_src);
+    const int n_threads = std::max(1, (int)std::thread::hardware_concurrency());
 
     for (int i = 0; i < n_tensors; ++i) {
         const char * name = gguf_get_tensor_name(ctx_src, i);
@@ -1702,129 +7104,156 @@ bool clip_model_quantize(const char * fname_inp, const char * fname_out, const i
         gguf_add_tensor(ctx_out, cur);
     }
 
+    const size_t alignment = gguf_get_alignment(ctx_out);
     const size_t meta_size = gguf_get_meta_size(ctx_out);
-    for (size_t i = 0; i < meta_size; ++i) {
-        fout.put(0);
-    }
-
-    // regexes of tensor names to be quantized
-    const std::vector<std::string> k_names = {
-        ".*weight",
-    };
+    const std::vector<char> zeros(std::max(meta_size, alignment), 0);
+    fout.write(zeros.data(), meta_size);
 
-    std::vector<uint8_t> read_data(512);
-    std::vector<uint8_t> work(512);
-    std::vector<float> conv_buf(512);
+    std::vector<uint8_t> work;
+    std::mutex hist_mutex;
     std::vector<int64_t> hist_all(1 << 4, 0);
+    std::map<ggml_type, int64_t> n_elements_by_type;
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
-    for (int i = 0; i < n_tensors; ++i) {
+    bool ok = fout.good();
+    quantize_src_tensor cur_tensor;
+    quantize_src_tensor next_tensor;
+    if (n_tensors > 0) {
+        cur_tensor = {0, ggml_get_tensor(ctx_data, gguf_get_tensor_name(ctx_src, 0)), {}};
+        if (ok && !quantize_read_tensor(fin, ctx_src, data_offset, cur_tensor)) {
+            fprintf(stderr, "%s: failed to read tensor '%s'\n", __func__, ggml_get_name(cur_tensor.meta));
+            ok = false;
+        }
+    }
+
+    for (int i = 0; ok && i < n_tensors; ++i) {
         const std::string name = gguf_get_tensor_name(ctx_src, i);
-        struct ggml_tensor * cur = ggml_get_tensor(ctx_data, name.c_str());
+        struct ggml_tensor * cur = cur_tensor.meta;
+
+        // read the next tensor while this one is quantized and written
+        bool next_ok = true;
+        std::thread reader;
+        if (i + 1 < n_tensors) {
+            next_tensor.idx = i + 1;
+            next_tensor.meta = ggml_get_tensor(ctx_data, gguf_get_tensor_name(ctx_src, i + 1));
+            reader = std::thread([&]() { next_ok = quantize_read_tensor(fin, ctx_src, data_offset, next_tensor); });
+        }
 
-        enum ggml_type new_type;
-        void * new_data;
-        size_t new_size;
+        const bool is_weight = ends_with(name, "weight") && cur->n_dims == 2;
+        const ggml_type target = quantize_tensor_type(rules, name, cur);
+        const bool quantize = target != cur->type;
 
-        bool quantize = false;
-        for (const auto & s : k_names) {
-            if (std::regex_match(name, std::regex(s))) {
-                quantize = true;
-                break;
+        // the importance of the columns of this weight, if collected
+        const float * imatrix = nullptr;
+        if (quantize && ctx_imatrix && quantize_type_has_imatrix(target)) {
+            struct ggml_tensor * t = ggml_get_tensor(ctx_imatrix, name.c_str());
+            if (t && t->type == GGML_TYPE_F32 && t->ne[0] == cur->ne[0]) {
+                imatrix = static_cast<const float *>(t->data);
             }
         }
 
-        // quantize only 2D tensors
-        quantize &= (cur->n_dims == 2);
+        enum ggml_type new_type;
+        const void * new_data;
+        size_t new_size;
 
         if (quantize) {
-            new_type = type;
-            const size_t n_elms = ggml_nelements(cur);
-            float * f32_data;
+            new_type = target;
+            const int64_t n_per_row = cur->ne[0];
+            const int64_t n_rows = ggml_nelements(cur) / n_per_row;
 
-            switch (cur->type) {
-            case GGML_TYPE_F32:
-                f32_data = (float *)cur->data;
-                break;
-            case GGML_TYPE_F16:
-                if (conv_buf.size() < n_elms) {
-                    conv_buf.resize(n_elms);
-                }
-                for (int j = 0; j < n_elms; ++j) {
-                    conv_buf[j] = ggml_fp16_to_fp32(((ggml_fp16_t *)cur->data)[j]);
-                }
-                f32_data = (float *)conv_buf.data();
-                break;
-            default:
+            if (cur->type != GGML_TYPE_F32 && cur->type != GGML_TYPE_F16) {
                 printf("Please use an input file in f32 or f16\n");
-                return false;
-            }
-
-            if (work.size() < n_elms * 4) {
-                work.resize(n_elms * 4);
-            }
-            new_data = work.data();
-
-            std::vector<int64_t> hist_cur(1 << 4, 0);
-
-            switch (new_type) {
-            case GGML_TYPE_Q4_0: {
-                new_size = ggml_quantize_q4_0(f32_data, new_data, n_elms, cur->ne[0], hist_cur.data());
-            } break;
-            case GGML_TYPE_Q4_1: {
-                new_size = ggml_quantize_q4_1(f32_data, new_data, n_elms, cur->ne[0], hist_cur.data());
-            } break;
-            case GGML_TYPE_Q5_0: {
-                new_size = ggml_quantize_q5_0(f32_data, new_data, n_elms, cur->ne[0], hist_cur.data());
-            } break;
-            case GGML_TYPE_Q5_1: {
-                new_size = ggml_quantize_q5_1(f32_data, new_data, n_elms, cur->ne[0], hist_cur.data());
-            } break;
-            case GGML_TYPE_Q8_0: {
-                new_size = ggml_quantize_q8_0(f32_data, new_data, n_elms, cur->ne[0], hist_cur.data());
-            } break;
-            default: {
-                fprintf(stderr, "%s: unsupported quantization type %d\n", __func__, new_type);
-                return false;
-            }
-            }
-
-            for (int j = 0; j < hist_cur.size(); ++j) {
-                hist_all[j] += hist_cur[j];
+                ok = false;
+            } else {
+                const size_t dst_row_size = ggml_type_size(new_type) * n_per_row / ggml_blck_size(new_type);
+                new_size = dst_row_size * n_rows;
+                work.resize(new_size);
+
+                QuantizeArgs args = {new_type,  cur->type,    cur_tensor.data.data(), work.data(),
+                                     n_per_row, dst_row_size, imatrix,                &hist_mutex, hist_all.data()};
+                parallel_for(n_threads, n_rows, std::max<int64_t>(1, 16384 / n_per_row), quantize_rows, &args);
+                new_data = work.data();
             }
         } else {
             new_type = cur->type;
-            new_data = cur->data;
+            new_data = cur_tensor.data.data();
             new_size = ggml_nbytes(cur);
         }
-        const size_t orig_size = ggml_nbytes(cur);
-        total_size_org += orig_size;
-        total_size_new += new_size;
-        gguf_set_tensor_type(ctx_out, name.c_str(), new_type);
-        gguf_set_tensor_data(ctx_out, name.c_str(), new_data, new_size);
-        fout.write((const char *)new_data, new_size);
-        size_t pad = GGML_PAD(new_size, gguf_get_alignment(ctx_out)) - new_size;
-        for (int j = 0; j < pad; ++j) {
-            fout.put(0);
+
+        if (ok) {
+            if (is_weight) {
+                n_elements_by_type[new_type] += ggml_nelements(cur);
+            }
+
+            const size_t orig_size = ggml_nbytes(cur);
+            total_size_org += orig_size;
+            total_size_new += new_size;
+            gguf_set_tensor_type(ctx_out, name.c_str(), new_type);
+            gguf_set_tensor_data(ctx_out, name.c_str(), new_data, new_size);
+            fout.write((const char *)new_data, new_size);
+            fout.write(zeros.data(), GGML_PAD(new_size, alignment) - new_size);
+            ok = fout.good();
+            if (!ok) {
+                fprintf(stderr, "%s: failed to write '%s'\n", __func__, tmp_out.c_str());
+            }
+
+            printf("%s: n_dims = %d | type = %s -> %s%s | size = %f MB -> %f MB\n", name.c_str(), cur->n_dims,
+                   ggml_type_name(cur->type), ggml_type_name(new_type), imatrix ? " (imatrix)" : "",
+                   orig_size / 1024.0 / 1024.0, new_size / 1024.0 / 1024.0);
         }
 
-        printf("%s: n_dims = %d | quantize=%d | size = %f MB -> %f MB\n", name.c_str(), cur->n_dims, quantize,
-               orig_size / 1024.0 / 1024.0, new_size / 1024.0 / 1024.0);
+        if (reader.joinable()) {
+            reader.join();
+            if (!next_ok) {
+                fprintf(stderr, "%s: failed to read tensor '%s'\n", __func__, ggml_get_name(next_tensor.meta));
+                ok = false;
+            }
+            std::swap(cur_tensor, next_tensor);
+        }
     }
 
-    // go back to beginning of file and write the updated metadata
-    fout.seekp(0, std::ios::beg);
-    std::vector<uint8_t> meta(meta_size);
-    gguf_get_meta_data(ctx_out, meta.data());
-    fout.write((const char *)meta.data(), meta_size);
+    if (ok) {
+        // the file type is the type of most weights. the key exists already, so the metadata keeps its size
+        const int ftype = dominant_ftype(n_elements_by_type);
+        gguf_set_val_u32(ctx_out, KEY_FTYPE,
+                         ftype >= 0 ? ftype : gguf_get_val_u32(ctx_src, get_key_idx(ctx_src, KEY_FTYPE)));
+
+        // go back to beginning of file and write the updated metadata
+        fout.seekp(0, std::ios::beg);
+        std::vector<uint8_t> meta(meta_size);
+        gguf_get_meta_data(ctx_out, meta.data());
+        fout.write((const char *)meta.data(), meta_size);
+        fout.flush();
+        ok = fout.good();
+        if (!ok) {
+            fprintf(stderr, "%s: failed to write '%s'\n", __func__, tmp_out.c_str());
+        }
+    }
 
     fout.close();
+    if (ok && rename(tmp_out.c_str(), fname_out) != 0) {
+        fprintf(stderr, "%s: failed to rename '%s' to '%s'\n", __func__, tmp_out.c_str(), fname_out);
+        ok = false;
+    }
+    if (!ok) {
+        remove(tmp_out.c_str());
+    }
 
-    clip_free(ctx_clip);
+    ggml_free(ctx_data);
+    gguf_free(ctx_src);
     gguf_free(ctx_out);
+    if (gguf_imatrix) {
+        ggml_free(ctx_imatrix);
+        gguf_free(gguf_imatrix);
+    }
+
+    if (!ok) {
+        return false;
+    }
 
     {
+        printf("%s: recipe: %s\n", __func__, recipe_text.c_str());
         printf("%s: original size  = %8.2f MB\n", __func__, total_size_org / 1024.0 / 1024.0);
         printf("%s: quantized size  = %8.2f MB\n", __func__, total_size_new / 1024.0 / 1024.0);
 
@@ -1833,15 +7262,18 @@ bool clip_model_quantize(const char * fname_inp, const char * fname_out, const i
             sum_all += hist_all[i];
         }
 
-        printf("%s: hist: ", __func__);
-        for (size_t i = 0; i < hist_all.size(); ++i) {
-            printf("%5.3f ", hist_all[i] / (float)sum_all);
+        if (sum_all > 0) {
+            printf("%s: hist: ", __func__);
+            for (size_t i = 0; i < hist_all.size(); ++i) {
+                printf("%5.3f ", hist_all[i] / (float)sum_all);
+            }
+            printf("\n");
         }
-        printf("\n");
     }
 
     return true;
 }
 
 struct clip_text_hparams * clip_get_text_hparams(struct clip_ctx * ctx) { return &ctx->text_model.hparams; }
+uint64_t clip_model_fingerprint(const struct clip_ctx * ctx) { return ctx->fingerprint; }
 struct clip_vision_hparams * clip_get_vision_hparams(struct clip_ctx * ctx) { return &ctx->vision_model.hparams; }
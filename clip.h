@@ -41,10 +41,62 @@ struct clip_tokens {
 
 struct clip_ctx * clip_model_load(const char * fname, const int verbosity);
 
+// tensors of towers that are not loaded are neither read nor allocated, and the encode functions of such a tower fail
+// as they do for a file without it
+struct clip_model_load_params {
+    int verbosity;
+    bool text_tower;          // load the text tower if the file has it
+    bool vision_tower;        // load the vision tower if the file has it
+    bool use_mmap;            // map the file and use the weights that are not converted in place
+    int n_threads;            // threads reading and converting weights, 0 for all cores
+    const char * weight_type; // NULL to keep the types of the file, else a type, preset or recipe as taken by
+                              // clip_model_quantize_recipe, applied to f32 and f16 weights while they are loaded
+    const char * cache_dir;   // with a weight_type, the converted model is written to this directory and loaded from
+                              // it while the source file and the recipe don't change. NULL for none
+    size_t memory_budget;     // bytes the loaded weights may take, mapped or not, 0 for no limit. without a weight_type,
+                              // the types of the file and then the presets quality, balanced and small are tried in turn
+    bool repack_weights;      // repack the q4_0 and q8_0 weights of the layers and projections into panels for the matmul
+                              // kernels of the CPU, if it has any. mapped weights and those of a buffer are copied
+};
+
+struct clip_model_load_params clip_model_load_default_params(void);
+struct clip_ctx * clip_model_load_ex(const char * fname, const struct clip_model_load_params params);
+// loads a model from a GGUF file held in memory. tensors that keep their type and are aligned to 16 bytes in the buffer
+// are used in place, so the buffer must outlive the returned context; the others are copied. use_mmap and cache_dir
+// are ignored
+struct clip_ctx * clip_model_load_from_buffer(const void * data, const size_t size,
+                                              const struct clip_model_load_params params);
+
 void clip_free(struct clip_ctx * ctx);
 
+// a model that can be replaced while it is in use. each encode takes a reference to the current model and releases it
+// when done; a replacement is swapped in once fully loaded, and the model it replaces is freed when its last reference
+// is released, so in-flight encodes finish on it. encodes on one context run one at a time
+struct clip_model_handle;
+
+// takes ownership of ctx
+struct clip_model_handle * clip_model_handle_new(struct clip_ctx * ctx);
+// waits for a reload in progress. models still acquired are freed when released
+void clip_model_handle_free(struct clip_model_handle * handle);
+// the current model, valid until released
+struct clip_ctx * clip_model_acquire(struct clip_model_handle * handle);
+void clip_model_release(struct clip_ctx * ctx);
+// makes ctx, which the handle takes ownership of, the current model
+void clip_model_swap(struct clip_model_handle * handle, struct clip_ctx * ctx);
+// loads a model with clip_model_load_ex on a background thread and swaps it in once loaded, or keeps the current one
+// if it fails. n_threads 0 loads on 2 threads rather than all cores, leaving the rest to the encodes. the replaced
+// model is freed on the same thread once the encodes still holding it release it, and the reload runs until then.
+// fails if a reload is already running
+bool clip_model_reload_async(struct clip_model_handle * handle, const char * fname,
+                             const struct clip_model_load_params params);
+// waits for the reload in progress, if any. returns whether the last reload succeeded
+bool clip_model_reload_wait(struct clip_model_handle * handle);
+
 struct clip_text_hparams * clip_get_text_hparams(struct clip_ctx * ctx);
 struct clip_vision_hparams * clip_get_vision_hparams(struct clip_ctx * ctx);
+// identifies the weights of a model: its metadata, the weight_type it was converted with and a sample of its data. the
+// same file loaded with the same weight_type gives the same value, whatever its path or the towers loaded
+uint64_t clip_model_fingerprint(const struct clip_ctx * ctx);
 
 // RGB uint8 image
 struct clip_image_u8 {
@@ -63,6 +115,15 @@ struct clip_image_f32 {
     size_t size;
 };
 
+// RGB float16 image (NHWC), normalized like clip_image_f32
+// Memory layout: RGBRGBRGB...
+struct clip_image_f16 {
+    int nx;
+    int ny;
+    ggml_fp16_t * data;
+    size_t size;
+};
+
 struct clip_image_u8_batch {
     struct clip_image_u8 * data;
     size_t size;
@@ -73,22 +134,64 @@ struct clip_image_f32_batch {
     size_t size;
 };
 
+struct clip_image_f16_batch {
+    struct clip_image_f16 * data;
+    size_t size;
+};
+
 bool clip_tokenize(const struct clip_ctx * ctx, const char * text, struct clip_tokens * tokens);
+// frees the tokens allocated by clip_tokenize
+void clip_tokens_free(struct clip_tokens * tokens);
+
+// tokenizes n_texts strings across n_threads threads into tokens, a caller-provided [n_texts, num_positions] matrix.
+// each row is zero-padded and lengths[i] receives its number of tokens. texts that do not fit num_positions are
+// truncated, keeping endoftext as the last token. {tokens + i * num_positions, lengths[i]} can be passed as is to
+// clip_text_encode.
+bool clip_tokenize_batch(const struct clip_ctx * ctx, const int n_threads, const char ** texts, const size_t n_texts,
+                         clip_vocab_id * tokens, int32_t * lengths);
 
 struct clip_image_u8 * clip_image_u8_make();
 struct clip_image_f32 * clip_image_f32_make();
+struct clip_image_f16 * clip_image_f16_make();
 
 void clip_image_u8_clean(struct clip_image_u8 * img);
 void clip_image_f32_clean(struct clip_image_f32 * res);
+void clip_image_f16_clean(struct clip_image_f16 * res);
 
 void clip_image_u8_free(struct clip_image_u8 * img);
 void clip_image_f32_free(struct clip_image_f32 * res);
+void clip_image_f16_free(struct clip_image_f16 * res);
 
 bool clip_image_load_from_file(const char * fname, struct clip_image_u8 * img);
 bool clip_image_preprocess(const struct clip_ctx * ctx, const struct clip_image_u8 * img, struct clip_image_f32 * res);
 
+// compact variants of clip_image_preprocess to keep queues of ready images small:
+// the u8 variant only resizes and center-crops (no normalization, 1 byte per value),
+// the f16 variant stores normalized values in half precision (2 bytes per value).
+// normalization / conversion to f32 happens while staging the input in the matching batch_encode function.
+bool clip_image_preprocess_u8(const struct clip_ctx * ctx, const struct clip_image_u8 * img, struct clip_image_u8 * res);
+bool clip_image_preprocess_f16(const struct clip_ctx * ctx, const struct clip_image_u8 * img, struct clip_image_f16 * res);
+
 bool clip_text_encode(const struct clip_ctx * ctx, const int n_threads, const struct clip_tokens * tokens, float * vec,
                       const bool normalize);
+
+// text embedding cache, disabled by default. when enabled, clip_text_encode looks up the token sequence first and
+// only runs the text encoder on a miss. the least recently used entries are evicted to stay within max_bytes.
+struct clip_text_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t n_entries;
+    size_t size_bytes;
+};
+
+// max_bytes = 0 disables the cache and drops all entries
+void clip_text_cache_enable(struct clip_ctx * ctx, const size_t max_bytes);
+void clip_text_cache_get_stats(const struct clip_ctx * ctx, struct clip_text_cache_stats * stats);
+// persist the cache so that it survives restarts. loading requires the cache to be enabled, and fails for a file saved
+// with another model, as told by clip_model_fingerprint
+bool clip_text_cache_save(const struct clip_ctx * ctx, const char * fname);
+bool clip_text_cache_load(struct clip_ctx * ctx, const char * fname);
 bool clip_image_encode(const struct clip_ctx * ctx, const int n_threads, struct clip_image_f32 * img, float * vec,
                        const bool normalize);
 
@@ -97,16 +200,191 @@ void clip_image_batch_preprocess(const struct clip_ctx * ctx, const int n_thread
 bool clip_image_batch_encode(const struct clip_ctx * ctx, const int n_threads, const struct clip_image_f32_batch * imgs,
                              float * vec, const bool normalize);
 
+void clip_image_batch_preprocess_u8(const struct clip_ctx * ctx, const int n_threads,
+                                    const struct clip_image_u8_batch * img_inputs, struct clip_image_u8_batch * imgs_resized);
+void clip_image_batch_preprocess_f16(const struct clip_ctx * ctx, const int n_threads,
+                                     const struct clip_image_u8_batch * img_inputs, struct clip_image_f16_batch * imgs_resized);
+bool clip_image_batch_encode_u8(const struct clip_ctx * ctx, const int n_threads, const struct clip_image_u8_batch * imgs,
+                                float * vec, const bool normalize);
+bool clip_image_batch_encode_f16(const struct clip_ctx * ctx, const int n_threads, const struct clip_image_f16_batch * imgs,
+                                 float * vec, const bool normalize);
+
 // bool image_normalize(const clip_image_u8 *img, clip_image_f32 *res);
 
 bool clip_compare_text_and_image(const struct clip_ctx * ctx, const int n_threads, const char * text,
                                  const struct clip_image_u8 * image, float * score);
 float clip_similarity_score(const float * vec1, const float * vec2, const int vec_dim);
+
+// many-to-many dot products: out[i * n_keys + j] = queries[i] . keys[j], with queries [n_queries, vec_dim] and keys
+// [n_keys, vec_dim]. with normalized embeddings these are cosine similarities
+void clip_similarity_matrix(const float * queries, const size_t n_queries, const float * keys, const size_t n_keys,
+                            const int vec_dim, const int n_threads, float * out);
+// same with half precision keys
+void clip_similarity_matrix_f16(const float * queries, const size_t n_queries, const ggml_fp16_t * keys,
+                                const size_t n_keys, const int vec_dim, const int n_threads, float * out);
+// same with int8 queries and keys, as produced by clip_vecs_quantize_i8
+void clip_similarity_matrix_i8(const int8_t * queries, const float * query_scales, const size_t n_queries,
+                               const int8_t * keys, const float * key_scales, const size_t n_keys, const int vec_dim,
+                               const int n_threads, float * out);
+// symmetric per-vector quantization to [-127, 127]: vecs[i] ~= scales[i] * out[i]
+void clip_vecs_quantize_i8(const float * vecs, const size_t n_vecs, const int vec_dim, int8_t * out, float * scales);
+// sign bits packed into (vec_dim + 7) / 8 bytes per vector, bit d % 8 of byte d / 8 set when vecs[i][d] > 0
+void clip_vecs_binarize(const float * vecs, const size_t n_vecs, const int vec_dim, uint8_t * out);
+// same as clip_similarity_matrix with binary codes, scored by 1 - 2 * hamming distance / (8 * code bytes)
+void clip_similarity_matrix_bin(const uint8_t * queries, const size_t n_queries, const uint8_t * keys,
+                                const size_t n_keys, const int vec_dim, const int n_threads, float * out);
 bool softmax_with_sorting(float * arr, const int length, float * sorted_scores, int * indices);
+// the k largest softmax probabilities of logits[n] in descending order, without sorting all n.
+// the batch variant takes [n_rows, n] logits and writes [n_rows, k] scores and indices
+bool clip_softmax_top_k(const float * logits, const int n, const int k, float * top_scores, int * top_indices);
+bool clip_softmax_top_k_batch(const float * logits, const size_t n_rows, const int n, const int k, float * top_scores,
+                              int * top_indices);
 bool clip_zero_shot_label_image(struct clip_ctx * ctx, const int n_threads, const struct clip_image_u8 * input_img,
                                 const char ** labels, const size_t n_labels, float * scores, int * indices);
 
+// reusable zero-shot classifier. the labels are encoded once into a normalized [n_labels, dim] matrix, so classifying
+// an image costs one image encode and one matrix-vector product.
+// templates are optional prompts such as "a photo of a {c}.", where {c} is replaced by the label. the class embedding
+// is the normalized mean of its prompt embeddings. without templates the labels are used as is.
+struct clip_zsl;
+
+struct clip_zsl * clip_zsl_make(const struct clip_ctx * ctx, const int n_threads, const char ** labels,
+                                const size_t n_labels, const char ** templates, const size_t n_templates);
+void clip_zsl_free(struct clip_zsl * zsl);
+size_t clip_zsl_n_labels(const struct clip_zsl * zsl);
+
+// the k most probable labels per image, in descending order of their softmax probability.
+// scores and indices are [n_images, k], with k <= n_labels
+bool clip_zsl_classify(const struct clip_zsl * zsl, const int n_threads, const struct clip_image_u8 * img, const int k,
+                       float * scores, int * indices);
+bool clip_zsl_classify_batch(const struct clip_zsl * zsl, const int n_threads, const struct clip_image_u8_batch * imgs,
+                             const int k, float * scores, int * indices);
+// same as above with already computed, normalized image embeddings
+bool clip_zsl_classify_vecs(const struct clip_zsl * zsl, const int n_threads, const float * img_vecs,
+                            const size_t n_images, const int k, float * scores, int * indices);
+
+// exact (brute-force) index of embeddings, scored by inner product: cosine similarity for normalized embeddings.
+// vectors are stored in a contiguous matrix in f32, f16, int8 (with a scale per vector) or sign bits, along with
+// caller ids. binary indices are 32x smaller than f32 but only coarse, see clip_index_search_rerank
+enum clip_index_type {
+    CLIP_INDEX_F32 = 0,
+    CLIP_INDEX_F16 = 1,
+    CLIP_INDEX_I8 = 2,
+    CLIP_INDEX_BIN = 3,
+};
+
+struct clip_index;
+
+struct clip_index * clip_index_make(const int vec_dim, const enum clip_index_type type);
+void clip_index_free(struct clip_index * index);
+size_t clip_index_size(const struct clip_index * index);
+int clip_index_dim(const struct clip_index * index);
+void clip_index_reserve(struct clip_index * index, const size_t n_vecs);
+bool clip_index_add(struct clip_index * index, const float * vecs, const int64_t * ids, const size_t n_vecs);
+// ids of the rows, in the order they were added
+const int64_t * clip_index_ids(const struct clip_index * index);
+// removes the rows of the given ids, keeping the order of the others. returns the number of removed rows
+size_t clip_index_remove(struct clip_index * index, const int64_t * ids, const size_t n_ids);
+// the k best matches of each query in descending order of score. scores and ids are [n_queries, k],
+// slots beyond the size of the index get id -1
+bool clip_index_search(const struct clip_index * index, const float * queries, const size_t n_queries, const int k,
+                       const int n_threads, float * scores, int64_t * ids);
+bool clip_index_save(const struct clip_index * index, const char * fname);
+// with use_mmap the file is mapped and searched in place; adding to such an index copies it into memory first
+struct clip_index * clip_index_load(const char * fname, const bool use_mmap);
+// two-stage search: the n_candidates best matches in the coarse index (e.g. binary) are rescored with the vectors of
+// the same rows in the fine index (f32, f16 or int8, built from the same vectors in the same order). fails if a
+// candidate row holds a different id in each index, e.g. after removing ids from one of them only
+bool clip_index_search_rerank(const struct clip_index * coarse, const struct clip_index * fine, const float * queries,
+                              const size_t n_queries, const int k, const int n_candidates, const int n_threads,
+                              float * scores, int64_t * ids);
+
+// predicate on the caller ids of an index, returning true for the entries that may be returned by a search
+typedef bool (*clip_id_filter)(int64_t id, void * user_data);
+
+// approximate nearest neighbor index (HNSW graph), scored by inner product like clip_index
+struct clip_hnsw_params {
+    int M;                     // links per node and level, 2 * M on the base level
+    int ef_construction;       // candidate list size while inserting. larger is slower to build but more accurate
+    int ef_search;             // candidate list size while searching, raised to k if smaller
+    enum clip_index_type type; // CLIP_INDEX_F32 or CLIP_INDEX_F16
+    uint64_t seed;             // for the level assignment
+};
+
+struct clip_hnsw;
+
+struct clip_hnsw_params clip_hnsw_default_params(void);
+struct clip_hnsw * clip_hnsw_make(const int vec_dim, const struct clip_hnsw_params params);
+void clip_hnsw_free(struct clip_hnsw * hnsw);
+size_t clip_hnsw_size(const struct clip_hnsw * hnsw);
+void clip_hnsw_set_ef_search(struct clip_hnsw * hnsw, const int ef_search);
+// inserts the vectors across n_threads threads; can be called repeatedly to grow the index
+bool clip_hnsw_add(struct clip_hnsw * hnsw, const float * vecs, const int64_t * ids, const size_t n_vecs,
+                   const int n_threads);
+// same output as clip_index_search. with a filter, only ids accepted by it are returned
+bool clip_hnsw_search(const struct clip_hnsw * hnsw, const float * queries, const size_t n_queries, const int k,
+                      const int n_threads, clip_id_filter filter, void * user_data, float * scores, int64_t * ids);
+bool clip_hnsw_save(const struct clip_hnsw * hnsw, const char * fname);
+struct clip_hnsw * clip_hnsw_load(const char * fname, const bool use_mmap);
+
+// compressed approximate index (IVF-PQ), scored by inner product like clip_index. vectors are assigned to the nearest
+// of n_lists k-means centroids and the residual is product quantized: split into pq_m subvectors of
+// vec_dim / pq_m dimensions, each replaced by the byte index of its nearest entry in a 256-entry codebook.
+// a vector costs pq_m bytes plus its id and row
+struct clip_ivfpq_params {
+    int n_lists;      // coarse clusters (inverted lists)
+    int pq_m;         // bytes per vector, must divide vec_dim
+    int n_probe;      // lists scanned per query
+    int n_iter;       // k-means iterations while training
+    size_t max_train; // training vectors beyond this are subsampled
+    uint64_t seed;
+};
+
+struct clip_ivfpq;
+
+struct clip_ivfpq_params clip_ivfpq_default_params(void);
+struct clip_ivfpq * clip_ivfpq_make(const int vec_dim, const struct clip_ivfpq_params params);
+void clip_ivfpq_free(struct clip_ivfpq * ivf);
+size_t clip_ivfpq_size(const struct clip_ivfpq * ivf);
+void clip_ivfpq_set_n_probe(struct clip_ivfpq * ivf, const int n_probe);
+// learns the centroids and codebooks from a sample of at least max(n_lists, 256) vectors. must be called once,
+// before the first add
+bool clip_ivfpq_train(struct clip_ivfpq * ivf, const float * vecs, const size_t n_vecs, const int n_threads);
+// vectors are numbered by rows in the order they are added, starting at 0
+bool clip_ivfpq_add(struct clip_ivfpq * ivf, const float * vecs, const int64_t * ids, const size_t n_vecs,
+                    const int n_threads);
+// same output as clip_index_search. with an f32, f16 or int8 rerank index holding the vectors in the same row order
+// (e.g. a clip_index built alongside and loaded with use_mmap), the n_rerank best candidates by approximate score are
+// rescored exactly before the top k are returned. pass NULL / 0 to return the approximate scores
+bool clip_ivfpq_search(const struct clip_ivfpq * ivf, const float * queries, const size_t n_queries, const int k,
+                       const int n_threads, const struct clip_index * rerank, const int n_rerank, float * scores,
+                       int64_t * ids);
+bool clip_ivfpq_save(const struct clip_ivfpq * ivf, const char * fname);
+struct clip_ivfpq * clip_ivfpq_load(const char * fname, const bool use_mmap);
+
 bool clip_model_quantize(const char * fname_inp, const char * fname_out, const int itype);
+// quantizes each 2D weight by the first matching rule of a recipe, a comma separated list of
+// [tower.]role[@first-last]=type. tower is t or v, role a glob over token_embd, position_embd, attn_q, attn_k, attn_v,
+// attn_out, ffn_up, ffn_down and proj, and type one of f32, f16, q4_0, q4_1, q5_0, q5_1, q8_0, q2_k, q3_k, q4_k, q5_k,
+// q6_k or keep. weights no rule matches are kept. the presets small, balanced and quality can be passed instead of a
+// recipe, and a bare type converts every weight. the expanded recipe is stored under clip.quantize.recipe.
+// with an importance matrix from clip_imatrix_save, q4_0, q4_1, q5_0 and q5_1 weights minimize the quantization error
+// weighted by the activations of each column. pass NULL for none
+bool clip_model_quantize_recipe(const char * fname_inp, const char * fname_out, const char * recipe,
+                                const char * fname_imatrix);
+// the recipe of the i-th preset, with its name in *name, or NULL past the last one
+const char * clip_model_quantize_preset(const int i, const char ** name);
+
+// importance matrix: the mean square of each input column of every weight over calibration inputs. after
+// clip_imatrix_begin, every encode with ctx accumulates the inputs of its matmuls until clip_imatrix_save writes them
+// out. the text cache should stay disabled meanwhile, cached texts are not encoded
+void clip_imatrix_begin(struct clip_ctx * ctx);
+bool clip_imatrix_save(struct clip_ctx * ctx, const char * fname);
+
+// called during every encode with ctx with the output of each encoder layer, n_embd values per token, n_tokens tokens
+// per input and n_batch inputs. pass NULL to remove it. for debugging and evaluating quantized models
+typedef void (*clip_layer_callback)(int layer, const float * data, int n_embd, int n_tokens, int n_batch, void * user_data);
+void clip_set_layer_callback(struct clip_ctx * ctx, clip_layer_callback fn, void * user_data);
 
 #ifdef __cplusplus
 }
@@ -2,16 +2,21 @@
 
 #include <cassert>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <set>
 #include <vector>
 
 #ifdef _WIN32
+#include <sys/stat.h>
 #include <tchar.h>
 #include <windows.h>
 #else
@@ -21,9 +26,32 @@
 
 // common utility functions mainly intended for examples and debugging
 
-std::map<std::string, std::vector<std::string>> get_dir_keyed_files(const std::string & path, uint32_t max_files_per_dir = 0) {
-    std::map<std::string, std::vector<std::string>> result;
+#ifndef _WIN32
+// type of a directory entry from d_type, with a stat only for symlinks and file systems that don't fill d_type.
+// returns false for anything that is neither a directory nor a regular file
+static bool get_entry_type(const std::string & full_path, const struct dirent * entry, bool * is_dir) {
+#ifdef DT_DIR
+    if (entry->d_type == DT_DIR || entry->d_type == DT_REG) {
+        *is_dir = entry->d_type == DT_DIR;
+        return true;
+    }
+    if (entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) {
+        return false;
+    }
+#endif
+    struct stat fileStat;
+    if (stat(full_path.c_str(), &fileStat) < 0) {
+        std::cerr << "Failed to get file stat: " << full_path << std::endl;
+        return false;
+    }
+    *is_dir = S_ISDIR(fileStat.st_mode);
+    return *is_dir || S_ISREG(fileStat.st_mode);
+}
+#endif
 
+// fills result in place, so that the files of nested directories are not copied up through every level
+static void collect_dir_keyed_files(const std::string & path, uint32_t max_files_per_dir,
+                                    std::map<std::string, std::vector<std::string>> & result) {
 #ifdef _WIN32
     std::string wildcard = path + "\\*";
     WIN32_FIND_DATAA fileData;
@@ -31,7 +59,7 @@ std::map<std::string, std::vector<std::string>> get_dir_keyed_files(const std::s
 
     if (hFind == INVALID_HANDLE_VALUE) {
         std::cerr << "Failed to open directory: " << path << std::endl;
-        return result;
+        return;
     }
 
     uint32_t fileCount = 0;
@@ -45,8 +73,7 @@ std::map<std::string, std::vector<std::string>> get_dir_keyed_files(const std::s
             if (name == "." || name == "..")
                 continue;
 
-            std::map<std::string, std::vector<std::string>> subResult = get_dir_keyed_files(fullPath, max_files_per_dir);
-            result.insert(subResult.begin(), subResult.end());
+            collect_dir_keyed_files(fullPath, max_files_per_dir, result);
         } else {
             size_t pos = path.find_last_of("\\/");
             std::string parentDir = (pos != std::string::npos) ? path.substr(pos + 1) : path;
@@ -62,37 +89,35 @@ std::map<std::string, std::vector<std::string>> get_dir_keyed_files(const std::s
 #else
     DIR * dir;
     struct dirent * entry;
-    struct stat fileStat;
 
     if ((dir = opendir(path.c_str())) == NULL) {
         std::cerr << "Failed to open directory: " << path << std::endl;
-        return result;
+        return;
     }
 
     uint32_t fileCount = 0;
+    size_t pos = path.find_last_of("/");
+    std::string parentDir = (pos != std::string::npos) ? path.substr(pos + 1) : path;
 
     while ((entry = readdir(dir)) != NULL) {
         std::string name = entry->d_name;
-        std::string fullPath = path + "/" + name;
+        // Skip . and ..
+        if (name == "." || name == "..")
+            continue;
 
-        if (stat(fullPath.c_str(), &fileStat) < 0) {
-            std::cerr << "Failed to get file stat: " << fullPath << std::endl;
+        std::string fullPath = path + "/" + name;
+        bool is_dir;
+        if (!get_entry_type(fullPath, entry, &is_dir)) {
             continue;
         }
 
-        if (S_ISDIR(fileStat.st_mode)) {
-            // Skip . and ..
-            if (name == "." || name == "..")
-                continue;
-
-            std::map<std::string, std::vector<std::string>> subResult = get_dir_keyed_files(fullPath, max_files_per_dir);
-            result.insert(subResult.begin(), subResult.end());
+        if (is_dir) {
+            collect_dir_keyed_files(fullPath, max_files_per_dir, result);
         } else {
             if (!is_image_file_extension(fullPath)) {
                 continue;
             }
-            size_t pos = path.find_last_of("/");
-            std::string parentDir = (pos != std::string::npos) ? path.substr(pos + 1) : path;
+            // directories of the same name share a key
             result[parentDir].push_back(fullPath);
 
             ++fileCount;
@@ -103,10 +128,184 @@ std::map<std::string, std::vector<std::string>> get_dir_keyed_files(const std::s
 
     closedir(dir);
 #endif
+}
 
+std::map<std::string, std::vector<std::string>> get_dir_keyed_files(const std::string & path, uint32_t max_files_per_dir = 0) {
+    std::map<std::string, std::vector<std::string>> result;
+    collect_dir_keyed_files(path, max_files_per_dir, result);
     return result;
 }
 
+struct dir_crawler {
+    std::mutex mutex;
+    std::condition_variable work_ready; // a directory to walk, or the crawl is over
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+
+    std::vector<std::string> dirs; // walked depth first, which keeps this list short
+    int n_walking = 0;
+    bool done = false;
+    bool stopped = false;
+
+    std::deque<std::string> paths;
+    size_t capacity;
+
+    std::set<std::pair<uint64_t, uint64_t>> walked_dirs; // device and inode
+    std::vector<std::thread> workers;
+};
+
+// blocks while the queue is full. returns false if the crawl was stopped
+static bool dir_crawler_push(dir_crawler * crawler, std::string path) {
+    std::unique_lock<std::mutex> lock(crawler->mutex);
+    crawler->not_full.wait(lock, [crawler] { return crawler->stopped || crawler->paths.size() < crawler->capacity; });
+    if (crawler->stopped) {
+        return false;
+    }
+    crawler->paths.push_back(std::move(path));
+    crawler->not_empty.notify_one();
+    return true;
+}
+
+static void dir_crawler_add_dir(dir_crawler * crawler, std::string path) {
+    std::lock_guard<std::mutex> lock(crawler->mutex);
+    crawler->dirs.push_back(std::move(path));
+    crawler->work_ready.notify_one();
+}
+
+// returns false if the crawl was stopped
+static bool dir_crawler_walk(dir_crawler * crawler, const std::string & path) {
+#ifdef _WIN32
+    std::string wildcard = path + "\\*";
+    WIN32_FIND_DATAA fileData;
+    HANDLE hFind = FindFirstFileA(wildcard.c_str(), &fileData);
+
+    if (hFind == INVALID_HANDLE_VALUE) {
+        std::cerr << "Failed to open directory: " << path << std::endl;
+        return true;
+    }
+
+    bool running = true;
+    do {
+        std::string name = fileData.cFileName;
+        if (name == "." || name == "..")
+            continue;
+
+        std::string fullPath = path + "\\" + name;
+        if (fileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            dir_crawler_add_dir(crawler, fullPath);
+        } else if (is_image_file_extension(fullPath)) {
+            running = dir_crawler_push(crawler, fullPath);
+        }
+    } while (running && FindNextFileA(hFind, &fileData));
+
+    FindClose(hFind);
+    return running;
+#else
+    DIR * dir = opendir(path.c_str());
+    if (dir == NULL) {
+        std::cerr << "Failed to open directory: " << path << std::endl;
+        return true;
+    }
+
+    // symlinks may lead to a directory walked already, or back to an ancestor
+    struct stat dirStat;
+    if (fstat(dirfd(dir), &dirStat) == 0) {
+        std::lock_guard<std::mutex> lock(crawler->mutex);
+        if (!crawler->walked_dirs.insert({(uint64_t)dirStat.st_dev, (uint64_t)dirStat.st_ino}).second) {
+            closedir(dir);
+            return true;
+        }
+    }
+
+    bool running = true;
+    struct dirent * entry;
+    while (running && (entry = readdir(dir)) != NULL) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..")
+            continue;
+
+        std::string fullPath = path + "/" + name;
+        bool is_dir;
+        if (!get_entry_type(fullPath, entry, &is_dir)) {
+            continue;
+        }
+
+        if (is_dir) {
+            dir_crawler_add_dir(crawler, fullPath);
+        } else if (is_image_file_extension(fullPath)) {
+            running = dir_crawler_push(crawler, fullPath);
+        }
+    }
+
+    closedir(dir);
+    return running;
+#endif
+}
+
+static void dir_crawler_worker(dir_crawler * crawler) {
+    for (;;) {
+        std::string path;
+        {
+            std::unique_lock<std::mutex> lock(crawler->mutex);
+            crawler->work_ready.wait(lock, [crawler] {
+                return crawler->stopped || !crawler->dirs.empty() || crawler->n_walking == 0;
+            });
+            if (crawler->stopped || crawler->dirs.empty()) {
+                return;
+            }
+            path = std::move(crawler->dirs.back());
+            crawler->dirs.pop_back();
+            crawler->n_walking++;
+        }
+
+        const bool running = dir_crawler_walk(crawler, path);
+
+        std::lock_guard<std::mutex> lock(crawler->mutex);
+        crawler->n_walking--;
+        if (!running || (crawler->n_walking == 0 && crawler->dirs.empty())) {
+            crawler->done = true;
+            crawler->work_ready.notify_all();
+            crawler->not_empty.notify_all();
+        }
+    }
+}
+
+dir_crawler * dir_crawler_start(const std::vector<std::string> & roots, const int n_threads, const size_t queue_capacity) {
+    dir_crawler * crawler = new dir_crawler;
+    crawler->capacity = std::max<size_t>(1, queue_capacity);
+    crawler->dirs.assign(roots.rbegin(), roots.rend());
+    crawler->done = roots.empty();
+    for (int i = 0; i < std::max(1, n_threads); i++) {
+        crawler->workers.emplace_back(dir_crawler_worker, crawler);
+    }
+    return crawler;
+}
+
+bool dir_crawler_next(dir_crawler * crawler, std::string & path) {
+    std::unique_lock<std::mutex> lock(crawler->mutex);
+    crawler->not_empty.wait(lock, [crawler] { return !crawler->paths.empty() || crawler->done; });
+    if (crawler->paths.empty()) {
+        return false;
+    }
+    path = std::move(crawler->paths.front());
+    crawler->paths.pop_front();
+    crawler->not_full.notify_one();
+    return true;
+}
+
+void dir_crawler_free(dir_crawler * crawler) {
+    {
+        std::lock_guard<std::mutex> lock(crawler->mutex);
+        crawler->stopped = true;
+        crawler->work_ready.notify_all();
+        crawler->not_full.notify_all();
+    }
+    for (auto & worker : crawler->workers) {
+        worker.join();
+    }
+    delete crawler;
+}
+
 bool is_image_file_extension(const std::string & path) {
     size_t pos = path.find_last_of(".");
     if (pos == std::string::npos) {
@@ -140,6 +339,43 @@ bool is_image_file_extension(const std::string & path) {
     return false;
 }
 
+bool get_file_info(const std::string & path, uint64_t * size, int64_t * mtime) {
+#ifdef _WIN32
+    struct _stat64 fileStat;
+    if (_stat64(path.c_str(), &fileStat) != 0) {
+        return false;
+    }
+#else
+    struct stat fileStat;
+    if (stat(path.c_str(), &fileStat) != 0) {
+        return false;
+    }
+#endif
+    *size = fileStat.st_size;
+    *mtime = fileStat.st_mtime;
+    return true;
+}
+
+bool hash_file(const std::string & path, uint64_t * hash) {
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin.is_open()) {
+        return false;
+    }
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    std::vector<char> buf(1 << 16);
+    while (fin) {
+        fin.read(buf.data(), buf.size());
+        const std::streamsize n = fin.gcount();
+        for (std::streamsize i = 0; i < n; i++) {
+            h = (h ^ (uint8_t)buf[i]) * 0x100000001b3ULL;
+        }
+    }
+
+    *hash = h;
+    return fin.eof();
+}
+
 bool app_params_parse(int argc, char ** argv, app_params & params, const int min_text_arg, const int min_image_arg) {
     for (int i = 0; i < argc; i++) {
         std::string arg = std::string(argv[i]);
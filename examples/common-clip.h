@@ -15,6 +15,24 @@ std::map<std::string, std::vector<std::string>> get_dir_keyed_files(const std::s
 
 bool is_image_file_extension(const std::string & path);
 
+// walks directory trees with n_threads threads and streams the paths of the image files found into a queue of at
+// most queue_capacity paths, so that they can be processed while the walk goes on. the order of the paths is
+// unspecified
+struct dir_crawler;
+
+struct dir_crawler * dir_crawler_start(const std::vector<std::string> & roots, const int n_threads,
+                                       const size_t queue_capacity);
+// blocks until a path is available. returns false once every directory was walked and every path consumed
+bool dir_crawler_next(struct dir_crawler * crawler, std::string & path);
+// stops the walk if it is still running and frees the crawler
+void dir_crawler_free(struct dir_crawler * crawler);
+
+// size in bytes and modification time (seconds since the epoch) of a file. returns false if it can't be stat'ed
+bool get_file_info(const std::string & path, uint64_t * size, int64_t * mtime);
+
+// 64-bit FNV-1a hash of the contents of a file
+bool hash_file(const std::string & path, uint64_t * hash);
+
 #include <algorithm>
 #include <string>
 #include <vector>
@@ -71,7 +71,9 @@ int main(int argc, char ** argv) {
         int shape[2] = {1, vec_dim};
         float vec[vec_dim];
 
-        if (!clip_text_encode(ctx, params.n_threads, &tokens, vec, false)) {
+        const bool encoded = clip_text_encode(ctx, params.n_threads, &tokens, vec, false);
+        clip_tokens_free(&tokens);
+        if (!encoded) {
             printf("Unable to encode text\n");
             continue;
         }
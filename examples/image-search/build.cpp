@@ -1,13 +1,20 @@
 #include "clip.h"
 #include "common-clip.h"
-#include "usearch/index.hpp"
+#include "manifest.h"
 
-#include <fstream>
+#include <algorithm>
+#include <cstdio>
+#include <unordered_map>
+#include <unordered_set>
 
 struct my_app_params {
     int32_t n_threads{4};
+    int32_t n_crawl_threads{4};
     std::string model{"../models/ggml-model-f16.bin"};
     int32_t verbose{1};
+    clip_index_type index_type{CLIP_INDEX_F32};
+    bool rebuild{false};
+    int32_t checkpoint{1000};
     std::vector<std::string> image_directories;
 };
 
@@ -17,8 +24,12 @@ void my_print_help(int argc, char ** argv, my_app_params & params) {
     printf("  -h, --help: Show this message and exit\n");
     printf("  -m <path>, --model <path>: path to model. Default: %s\n", params.model.c_str());
     printf("  -t N, --threads N: Number of threads to use for inference. Default: %d\n", params.n_threads);
+    printf("  --crawl-threads N: Number of threads walking the directories. Default: %d\n", params.n_crawl_threads);
     printf("  -v <level>, --verbose <level>: Control the level of verbosity. 0 = minimum, 2 = maximum. Default: %d\n",
            params.verbose);
+    printf("  --index-type <type>: Storage of the embeddings in a new index, one of f32, f16, i8. Default: f32\n");
+    printf("  --rebuild: Ignore the existing index and encode every image again\n");
+    printf("  --checkpoint N: Save the index every N newly encoded images. Default: %d\n", params.checkpoint);
 }
 
 // returns success
@@ -40,12 +51,42 @@ bool my_app_params_parse(int argc, char ** argv, my_app_params & params) {
                 break;
             }
             params.n_threads = std::stoi(argv[i]);
+        } else if (arg == "--crawl-threads") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_crawl_threads = std::stoi(argv[i]);
         } else if (arg == "-v" || arg == "--verbose") {
             if (++i >= argc) {
                 invalid_param = true;
                 break;
             }
             params.verbose = std::stoi(argv[i]);
+        } else if (arg == "--index-type") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            const std::string type = argv[i];
+            if (type == "f32") {
+                params.index_type = CLIP_INDEX_F32;
+            } else if (type == "f16") {
+                params.index_type = CLIP_INDEX_F16;
+            } else if (type == "i8") {
+                params.index_type = CLIP_INDEX_I8;
+            } else {
+                printf("%s: unknown index type: %s\n", __func__, type.c_str());
+                return false;
+            }
+        } else if (arg == "--rebuild") {
+            params.rebuild = true;
+        } else if (arg == "--checkpoint") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.checkpoint = std::stoi(argv[i]);
         } else if (arg == "-h" || arg == "--help") {
             my_print_help(argc, argv, params);
             exit(0);
@@ -63,6 +104,34 @@ bool my_app_params_parse(int argc, char ** argv, my_app_params & params) {
     return !(invalid_param || params.image_directories.empty());
 }
 
+static const char * INDEX_FILE = "images.index";
+static const char * MANIFEST_FILE = "images.manifest";
+
+// the index is written first: if the process dies between the two renames, the next run drops the rows that the
+// older manifest does not know about
+static bool save_state(const clip_index * index, const image_manifest & manifest) {
+    const std::string tmp = std::string(INDEX_FILE) + ".tmp";
+    if (!clip_index_save(index, tmp.c_str())) {
+        return false;
+    }
+#ifdef _WIN32
+    std::remove(INDEX_FILE);
+#endif
+    if (std::rename(tmp.c_str(), INDEX_FILE) != 0) {
+        fprintf(stderr, "%s: failed to replace '%s'\n", __func__, INDEX_FILE);
+        return false;
+    }
+    return image_manifest_save(MANIFEST_FILE, manifest);
+}
+
+// a file to encode, new or changed since it was indexed
+struct pending_image {
+    std::string path;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+};
+
 int main(int argc, char ** argv) {
     my_app_params params;
     if (!my_app_params_parse(argc, argv, params)) {
@@ -70,133 +139,263 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
-    auto clip_ctx = clip_model_load(params.model.c_str(), params.verbose);
+    // resume from the previous run unless asked not to
+    image_manifest manifest;
+    clip_index * embd_index = nullptr;
+    const bool resume = !params.rebuild && image_manifest_load(MANIFEST_FILE, manifest);
+
+    // only images are encoded, the text tower is not loaded
+    struct clip_model_load_params load_params = clip_model_load_default_params();
+    load_params.verbosity = params.verbose;
+    load_params.text_tower = false;
+    load_params.use_mmap = true;
+    auto clip_ctx = clip_model_load_ex(params.model.c_str(), load_params);
     if (!clip_ctx) {
         printf("%s: Unable  to load model from %s\n", __func__, params.model.c_str());
         return 1;
     }
 
-    std::vector<std::string> image_file_index;
-    unum::usearch::index_gt<unum::usearch::cos_gt<float>> embd_index;
+    // the model is told by its fingerprint, not its path: a checkpoint copied over the same path is another model.
+    // manifests from before fingerprints were recorded have none and are taken as they are
+    const uint64_t fingerprint = clip_model_fingerprint(clip_ctx);
+    if (resume) {
+        if (manifest.fingerprint != 0 && manifest.fingerprint != fingerprint) {
+            printf("%s: the index was built with another model than '%s', pass --rebuild to index with it\n", __func__,
+                   params.model.c_str());
+            clip_free(clip_ctx);
+            return 1;
+        }
+        embd_index = clip_index_load(INDEX_FILE, false);
+    }
 
     const size_t vec_dim = clip_get_vision_hparams(clip_ctx)->projection_dim;
-    const size_t batch_size = 4;
-
-    size_t label = 0;
-
-    std::vector<float> vec(vec_dim * batch_size);
-    std::vector<clip_image_u8> img_inputs(batch_size);
-    std::vector<clip_image_f32> imgs_resized(batch_size);
-
-    // search for images in path and write embedding to database
-    for (const auto & base_dir : params.image_directories) {
-        printf("%s: starting base dir scan of '%s'\n", __func__, base_dir.c_str());
-        auto results = get_dir_keyed_files(base_dir, 0);
-
-        for (auto & entry : results) {
-            printf("\n%s: processing %zu files in '%s'\n", __func__, entry.second.size(), entry.first.c_str());
-
-            size_t n_batched = (entry.second.size() / batch_size) * batch_size;
-            img_inputs.resize(batch_size);
-            imgs_resized.resize(batch_size);
-
-            if (embd_index.capacity() == embd_index.size() || embd_index.capacity() < entry.second.size()) {
-                embd_index.reserve(embd_index.size() + entry.second.size());
+    if (embd_index && clip_index_dim(embd_index) != (int)vec_dim) {
+        printf("%s: '%s' does not match the model, pass --rebuild\n", __func__, INDEX_FILE);
+        clip_free(clip_ctx);
+        return 1;
+    }
+    if (!embd_index) {
+        // without an index every entry has to be encoded again, the ids stay reserved
+        embd_index = clip_index_make(vec_dim, params.index_type);
+    }
+    manifest.model = params.model;
+    manifest.fingerprint = fingerprint;
+
+    // reconcile the index with the manifest after an interrupted save: rows of unknown ids are dropped and entries
+    // without a row are encoded again
+    const int64_t * index_ids = clip_index_ids(embd_index);
+    std::unordered_set<int64_t> indexed(index_ids, index_ids + clip_index_size(embd_index));
+    std::unordered_map<std::string, size_t> live; // path -> entry
+    std::vector<int64_t> removed_ids;
+    for (size_t i = 0; i < manifest.entries.size(); i++) {
+        image_manifest_entry & entry = manifest.entries[i];
+        if (entry.deleted) {
+            continue;
+        }
+        if (indexed.count(entry.id) == 0) {
+            entry.deleted = true;
+            continue;
+        }
+        live[entry.path] = i;
+    }
+    {
+        std::unordered_set<int64_t> live_ids;
+        for (const auto & it : live) {
+            live_ids.insert(manifest.entries[it.second].id);
+        }
+        for (const int64_t id : indexed) {
+            if (live_ids.count(id) == 0) {
+                removed_ids.push_back(id);
             }
+            // rows written after the manifest hold ids it has not handed out yet, they are never reused
+            manifest.next_id = std::max(manifest.next_id, id + 1);
+        }
+        clip_index_remove(embd_index, removed_ids.data(), removed_ids.size());
+        removed_ids.clear();
+    }
 
-            for (size_t i = 0; i < n_batched; i += batch_size) {
-                for (size_t ib = i; ib < i + batch_size; ib++) {
-                    const std::string & img_path = entry.second[ib];
-                    if (params.verbose >= 2) {
-                        printf("%s: found image file '%s'\n", __func__, img_path.c_str());
-                    }
+    size_t n_unchanged = 0;
+    size_t n_touched = 0;
+    size_t n_moved = 0;
+    size_t n_changed = 0;
+    size_t n_deleted = 0;
+
+    // entries whose file is gone. they may have been moved, which is detected by content hash below. duplicate files
+    // share a hash, each moved file takes one of their entries
+    std::unordered_map<uint64_t, std::vector<size_t>> missing; // hash -> entries
+    for (const auto & it : live) {
+        uint64_t size;
+        int64_t mtime;
+        if (!get_file_info(it.first, &size, &mtime)) {
+            missing[manifest.entries[it.second].hash].push_back(it.second);
+        }
+    }
 
-                    if (!clip_image_load_from_file(img_path.c_str(), &img_inputs[ib % batch_size])) {
-                        fprintf(stderr, "%s: failed to load image from '%s'\n", __func__, img_path.c_str());
-                        continue;
-                    }
+    const size_t batch_size = 4;
 
-                    image_file_index.push_back(img_path);
-                }
+    std::vector<float> vec(vec_dim * batch_size);
+    std::vector<int64_t> labels(batch_size);
+    std::vector<clip_image_u8> img_inputs;
+    std::vector<clip_image_f32> imgs_resized;
+    std::vector<pending_image> batch;
+
+    size_t n_new = 0;
+    size_t n_encoded = 0;
+    size_t n_since_checkpoint = 0;
+    bool save_failed = false;
+
+    // encodes the images of the batch that loaded and adds them to the index
+    auto encode_batch = [&]() {
+        if (params.verbose == 1) {
+            printf(".");
+            fflush(stdout);
+        }
 
-                if (params.verbose == 1) {
-                    printf(".");
-                    fflush(stdout);
-                }
+        imgs_resized.assign(batch.size(), clip_image_f32{});
+        auto img_inputs_batch = clip_image_u8_batch_make(img_inputs);
+        auto imgs_resized_batch = clip_image_f32_batch_make(imgs_resized);
 
-                auto img_inputs_batch = clip_image_u8_batch{};
-                img_inputs_batch.data = img_inputs.data();
-                img_inputs_batch.size = img_inputs.size();
+        clip_image_batch_preprocess(clip_ctx, params.n_threads, &img_inputs_batch, &imgs_resized_batch);
+        const bool encoded = clip_image_batch_encode(clip_ctx, params.n_threads, &imgs_resized_batch, vec.data(), true);
 
-                auto imgs_resized_batch = clip_image_f32_batch{};
-                imgs_resized_batch.data = imgs_resized.data();
-                imgs_resized_batch.size = imgs_resized.size();
+        for (size_t b = 0; b < batch.size(); b++) {
+            clip_image_u8_clean(&img_inputs[b]);
+            clip_image_f32_clean(&imgs_resized[b]);
+        }
+        const size_t n_batch = batch.size();
+        img_inputs.clear();
+        if (!encoded) {
+            fprintf(stderr, "%s: failed to encode a batch of images\n", __func__);
+            batch.clear();
+            return;
+        }
 
-                clip_image_batch_preprocess(clip_ctx, params.n_threads, &img_inputs_batch, &imgs_resized_batch);
+        // add image vectors to the database
+        for (size_t b = 0; b < n_batch; b++) {
+            const pending_image & img = batch[b];
+            labels[b] = manifest.next_id++;
+            manifest.entries.push_back({labels[b], false, img.size, img.mtime, img.hash, img.path});
+        }
+        batch.clear();
+        clip_index_add(embd_index, vec.data(), labels.data(), n_batch);
+        n_encoded += n_batch;
+        n_since_checkpoint += n_batch;
+
+        if (params.checkpoint > 0 && n_since_checkpoint >= (size_t)params.checkpoint) {
+            // rows of changed images go now, the entries of the missing ones stay live until the crawl is over
+            clip_index_remove(embd_index, removed_ids.data(), removed_ids.size());
+            removed_ids.clear();
+            save_failed = !save_state(embd_index, manifest);
+            n_since_checkpoint = 0;
+        }
+    };
+
+    // images are encoded while the crawl goes on, the queue holds the crawlers back if encoding falls behind
+    printf("%s: crawling %zu directories with %d threads\n", __func__, params.image_directories.size(),
+           params.n_crawl_threads);
+    dir_crawler * crawler = dir_crawler_start(params.image_directories, params.n_crawl_threads, 4096);
+
+    std::unordered_set<std::string> seen; // roots may overlap
+    std::string img_path;
+    while (!save_failed && dir_crawler_next(crawler, img_path)) {
+        if (!seen.insert(img_path).second) {
+            continue;
+        }
 
-                clip_image_batch_encode(clip_ctx, params.n_threads, &imgs_resized_batch, vec.data(), true);
+        pending_image img = {img_path, 0, 0, 0};
+        if (!get_file_info(img_path, &img.size, &img.mtime)) {
+            continue;
+        }
 
-                // add image vectors to the database
-                for (size_t b = 0; b < batch_size; b++) {
-                    embd_index.add(label++, {vec.data() + b * vec_dim, vec_dim});
-                }
+        auto it = live.find(img_path);
+        if (it != live.end()) {
+            image_manifest_entry & entry = manifest.entries[it->second];
+            if (entry.size == img.size && entry.mtime == img.mtime) {
+                n_unchanged++;
+                continue;
+            }
+            if (!hash_file(img_path, &img.hash)) {
+                continue;
+            }
+            if (entry.hash == img.hash) {
+                // touched but not modified
+                entry.size = img.size;
+                entry.mtime = img.mtime;
+                n_touched++;
+                continue;
             }
 
-            // process leftover if needed
-
-            const size_t leftover = entry.second.size() - n_batched;
-            if (leftover > 0) {
-
-                img_inputs.resize(leftover);
-                imgs_resized.resize(leftover);
-
-                for (size_t il = n_batched; il < entry.second.size(); il++) {
-                    const std::string & img_path = entry.second[il];
-                    if (params.verbose >= 2) {
-                        printf("%s: found image file '%s'\n", __func__, img_path.c_str());
-                    }
-
-                    if (!clip_image_load_from_file(img_path.c_str(), &img_inputs[il - n_batched])) {
-                        fprintf(stderr, "%s: failed to load image from '%s'\n", __func__, img_path.c_str());
-                        continue;
-                    }
-
-                    image_file_index.push_back(img_path);
-                }
-
-                if (params.verbose == 1) {
-                    printf(".");
-                    fflush(stdout);
+            entry.deleted = true;
+            removed_ids.push_back(entry.id);
+            live.erase(it);
+            n_changed++;
+        } else {
+            if (!hash_file(img_path, &img.hash)) {
+                continue;
+            }
+            auto moved = missing.find(img.hash);
+            if (moved != missing.end()) {
+                const size_t i = moved->second.back();
+                moved->second.pop_back();
+                if (moved->second.empty()) {
+                    missing.erase(moved);
                 }
+                image_manifest_entry & entry = manifest.entries[i];
+                live.erase(entry.path);
+                entry.path = img_path;
+                entry.size = img.size;
+                entry.mtime = img.mtime;
+                live[img_path] = i;
+                n_moved++;
+                continue;
+            }
+            n_new++;
+        }
 
-                auto img_inputs_batch = clip_image_u8_batch_make(img_inputs);
-                auto imgs_resized_batch = clip_image_f32_batch_make(imgs_resized);
-
-                clip_image_batch_preprocess(clip_ctx, params.n_threads, &img_inputs_batch, &imgs_resized_batch);
-                clip_image_batch_encode(clip_ctx, params.n_threads, &imgs_resized_batch, vec.data(), true);
+        if (params.verbose >= 2) {
+            printf("%s: found image file '%s'\n", __func__, img_path.c_str());
+        }
 
-                // add image vectors to the database
-                for (size_t l = 0; l < leftover; l++) {
-                    embd_index.add(label++, {vec.data() + l * vec_dim, vec_dim});
-                }
+        clip_image_u8 img_input = {};
+        if (!clip_image_load_from_file(img_path.c_str(), &img_input)) {
+            fprintf(stderr, "%s: failed to load image from '%s'\n", __func__, img_path.c_str());
+            continue;
+        }
+        img_inputs.push_back(img_input);
+        batch.push_back(std::move(img));
+        if (batch.size() == batch_size) {
+            encode_batch();
+        }
+    }
+    if (!save_failed && !batch.empty()) {
+        encode_batch();
+    }
+    dir_crawler_free(crawler);
+
+    // whatever is still missing was deleted. after a failed save the crawl is incomplete and nothing is deleted
+    if (!save_failed) {
+        for (const auto & it : missing) {
+            for (const size_t i : it.second) {
+                image_manifest_entry & entry = manifest.entries[i];
+                entry.deleted = true;
+                removed_ids.push_back(entry.id);
+                live.erase(entry.path);
+                n_deleted++;
             }
         }
     }
+    clip_index_remove(embd_index, removed_ids.data(), removed_ids.size());
+
+    printf("\n%s: %zu unchanged, %zu touched, %zu moved, %zu deleted, %zu changed and %zu new images\n", __func__,
+           n_unchanged, n_touched, n_moved, n_deleted, n_changed, n_new);
 
     clip_free(clip_ctx);
 
     // save to disk
+    const bool saved = save_state(embd_index, manifest) && !save_failed;
 
-    embd_index.save("images.usearch");
-
-    std::ofstream image_file_index_file("images.paths", std::ios::binary | std::ios::trunc);
-    // first line is model
-    image_file_index_file << params.model << "\n";
-    for (const auto & i_path : image_file_index) {
-        image_file_index_file << i_path << "\n";
-    }
-
-    printf("%s: %zu images processed and indexed\n", __func__, image_file_index.size());
+    printf("%s: %zu images encoded, %zu images indexed\n", __func__, n_encoded, clip_index_size(embd_index));
+    clip_index_free(embd_index);
 
-    return 0;
+    return saved ? 0 : 1;
 }
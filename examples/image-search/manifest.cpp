@@ -0,0 +1,101 @@
+#include "manifest.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+// text format, one entry per line after the header:
+//   clip-image-manifest 2
+//   model <path>
+//   fingerprint <hex>
+//   next_id <id>
+//   <id> <L|D> <size> <mtime> <hash, hex> <path>
+static const char * MANIFEST_MAGIC = "clip-image-manifest";
+static const int MANIFEST_VERSION = 2; // 1 has no fingerprint
+
+bool image_manifest_load(const std::string & fname, image_manifest & manifest) {
+    std::ifstream fin(fname);
+    if (!fin.is_open()) {
+        return false;
+    }
+
+    std::string magic, key;
+    int version = 0;
+    fin >> magic >> version;
+    if (magic != MANIFEST_MAGIC || version < 1 || version > MANIFEST_VERSION) {
+        fprintf(stderr, "%s: '%s' is not an image manifest\n", __func__, fname.c_str());
+        return false;
+    }
+
+    fin >> key;
+    fin.get();
+    std::getline(fin, manifest.model);
+    manifest.fingerprint = 0;
+    if (version >= 2) {
+        fin >> key >> std::hex >> manifest.fingerprint >> std::dec;
+    }
+    fin >> key >> manifest.next_id;
+    fin.get();
+
+    manifest.entries.clear();
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (line.empty()) {
+            continue;
+        }
+
+        std::istringstream iss(line);
+        image_manifest_entry entry;
+        char state;
+        iss >> entry.id >> state >> entry.size >> entry.mtime >> std::hex >> entry.hash;
+        if (!iss || iss.get() != ' ') {
+            fprintf(stderr, "%s: invalid entry in '%s': %s\n", __func__, fname.c_str(), line.c_str());
+            return false;
+        }
+        entry.deleted = state == 'D';
+        std::getline(iss, entry.path);
+        manifest.entries.push_back(entry);
+    }
+
+    return true;
+}
+
+bool image_manifest_save(const std::string & fname, const image_manifest & manifest) {
+    const std::string tmp = fname + ".tmp";
+    {
+        std::ofstream fout(tmp, std::ios::trunc);
+        if (!fout.is_open()) {
+            fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, tmp.c_str());
+            return false;
+        }
+
+        fout << MANIFEST_MAGIC << " " << MANIFEST_VERSION << "\n";
+        char fingerprint[17];
+        snprintf(fingerprint, sizeof(fingerprint), "%016" PRIx64, manifest.fingerprint);
+        fout << "model " << manifest.model << "\n";
+        fout << "fingerprint " << fingerprint << "\n";
+        fout << "next_id " << manifest.next_id << "\n";
+        for (const auto & entry : manifest.entries) {
+            char hash[17];
+            snprintf(hash, sizeof(hash), "%016" PRIx64, entry.hash);
+            fout << entry.id << " " << (entry.deleted ? 'D' : 'L') << " " << entry.size << " " << entry.mtime << " "
+                 << hash << " " << entry.path << "\n";
+        }
+
+        if (!fout.good()) {
+            fprintf(stderr, "%s: failed to write '%s'\n", __func__, tmp.c_str());
+            return false;
+        }
+    }
+
+#ifdef _WIN32
+    std::remove(fname.c_str());
+#endif
+    if (std::rename(tmp.c_str(), fname.c_str()) != 0) {
+        fprintf(stderr, "%s: failed to replace '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,31 @@
+#ifndef IMAGE_SEARCH_MANIFEST_H
+#define IMAGE_SEARCH_MANIFEST_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// one indexed image. the id is the id of its embedding in images.index and is never reused.
+// deleted entries are kept as tombstones, their embedding is removed from the index
+struct image_manifest_entry {
+    int64_t id;
+    bool deleted;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash; // of the file contents, see hash_file
+    std::string path;
+};
+
+struct image_manifest {
+    std::string model;
+    uint64_t fingerprint = 0; // clip_model_fingerprint of the model, 0 if unknown
+    int64_t next_id = 0;
+    std::vector<image_manifest_entry> entries;
+};
+
+bool image_manifest_load(const std::string & fname, image_manifest & manifest);
+
+// writes to a temporary file first and renames it over fname, so that a crash never leaves a partial manifest
+bool image_manifest_save(const std::string & fname, const image_manifest & manifest);
+
+#endif // IMAGE_SEARCH_MANIFEST_H
@@ -1,8 +1,9 @@
 #include "clip.h"
 #include "common-clip.h"
-#include "usearch/index.hpp"
+#include "manifest.h"
 
 #include <fstream>
+#include <unordered_map>
 
 struct my_app_params {
     int32_t n_threads{4};
@@ -14,18 +15,21 @@ struct my_app_params {
     std::string img_path;
 
     int32_t n_results{5};
+
+    std::string text_cache; // file to persist text embeddings across runs, empty = no cache
 };
 
 void my_print_help(int argc, char ** argv, my_app_params & params) {
     printf("Usage: %s [options] <search string or /path/to/query/image>\n", argv[0]);
     printf("\nOptions:\n");
     printf("  -h, --help: Show this message and exit\n");
-    printf("  -m <path>, --model <path>: overwrite path to model. Read from images.paths by default.\n");
+    printf("  -m <path>, --model <path>: overwrite path to model. Read from images.manifest by default.\n");
     printf("  -t N, --threads N: Number of threads to use for inference. Default: %d\n", params.n_threads);
     printf("  -v <level>, --verbose <level>: Control the level of verbosity. 0 = minimum, 2 = maximum. Default: %d\n",
            params.verbose);
 
     printf("  -n N, --results N: Number of results to display. Default: %d\n", params.n_results);
+    printf("  --text-cache <path>: Reuse text embeddings of previous queries stored in this file. Default: disabled\n");
 }
 
 // returns success
@@ -52,6 +56,12 @@ bool my_app_params_parse(int argc, char ** argv, my_app_params & params) {
                 break;
             }
             params.n_results = std::stoi(argv[i]);
+        } else if (arg == "--text-cache") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.text_cache = argv[i];
         } else if (arg == "-v" || arg == "--verbose") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -91,50 +101,65 @@ int main(int argc, char ** argv) {
     }
 
     // load model path
-    std::ifstream image_file_index_file("images.paths", std::ios::binary);
-    std::string line;
-    std::getline(image_file_index_file, line);
+    image_manifest manifest;
+    if (!image_manifest_load("images.manifest", manifest)) {
+        printf("%s: Unable to load images.manifest, run image-search-build first\n", __func__);
+        return 1;
+    }
     if (params.model.empty()) {
-        params.model = line;
+        params.model = manifest.model;
     } else {
         printf("%s: using alternative model from %s. Make sure you use the same model you used for indexing, or the "
                "embeddings wont work.\n",
                __func__, params.model.c_str());
     }
 
-    // load model
-    auto clip_ctx = clip_model_load(params.model.c_str(), params.verbose);
+    // load model, only the tower the query needs
+    struct clip_model_load_params load_params = clip_model_load_default_params();
+    load_params.verbosity = params.verbose;
+    load_params.text_tower = params.img_path.empty();
+    load_params.vision_tower = !params.img_path.empty();
+    load_params.use_mmap = true;
+    auto clip_ctx = clip_model_load_ex(params.model.c_str(), load_params);
     if (!clip_ctx) {
         printf("%s: Unable to load model from %s\n", __func__, params.model.c_str());
         return 1;
     }
+    if (manifest.fingerprint != 0 && manifest.fingerprint != clip_model_fingerprint(clip_ctx)) {
+        printf("%s: the index was built with another model than '%s'\n", __func__, params.model.c_str());
+        clip_free(clip_ctx);
+        return 1;
+    }
 
     // load paths and embeddings database
-    std::vector<std::string> image_file_index;
-    unum::usearch::index_gt<unum::usearch::cos_gt<float>> embd_index;
-
-    embd_index.view("images.usearch");
+    std::unordered_map<int64_t, std::string> image_file_index;
+    clip_index * embd_index = clip_index_load("images.index", true);
+    if (!embd_index) {
+        printf("%s: Unable to load the index, run image-search-build first\n", __func__);
+        clip_free(clip_ctx);
+        return 1;
+    }
 
-    // load image paths
-    do {
-        std::getline(image_file_index_file, line);
-        if (line.empty()) {
-            break;
+    // image paths by id
+    for (const auto & entry : manifest.entries) {
+        if (!entry.deleted) {
+            image_file_index[entry.id] = entry.path;
         }
-        image_file_index.push_back(line);
-    } while (image_file_index_file.good());
+    }
 
-    if (image_file_index.size() != embd_index.size()) {
+    if (image_file_index.size() != clip_index_size(embd_index)) {
         printf("%s: index files size missmatch\n", __func__);
     }
 
-    const int vec_dim = clip_get_vision_hparams(clip_ctx)->projection_dim;
+    const int vec_dim = params.img_path.empty() ? clip_get_text_hparams(clip_ctx)->projection_dim
+                                                : clip_get_vision_hparams(clip_ctx)->projection_dim;
     std::vector<float> vec(vec_dim);
 
     if (!params.img_path.empty()) {
         clip_image_u8 img0;
         if (!clip_image_load_from_file(params.img_path.c_str(), &img0)) {
             fprintf(stderr, "%s: failed to load image from '%s'\n", __func__, params.img_path.c_str());
+            clip_index_free(embd_index);
             clip_free(clip_ctx);
             return 1;
         }
@@ -144,27 +169,50 @@ int main(int argc, char ** argv) {
 
         if (!clip_image_encode(clip_ctx, params.n_threads, &img_res, vec.data(), true)) {
             fprintf(stderr, "%s: failed to encode image from '%s'\n", __func__, params.img_path.c_str());
+            clip_index_free(embd_index);
             clip_free(clip_ctx);
             return 1;
         }
     } else {
 
+        if (!params.text_cache.empty()) {
+            clip_text_cache_enable(clip_ctx, 16 * 1024 * 1024);
+            if (std::ifstream(params.text_cache).good()) {
+                clip_text_cache_load(clip_ctx, params.text_cache.c_str());
+            }
+        }
+
         clip_tokens tokens;
         clip_tokenize(clip_ctx, params.search_text.c_str(), &tokens);
 
         clip_text_encode(clip_ctx, params.n_threads, &tokens, vec.data(), true);
+        clip_tokens_free(&tokens);
+
+        if (!params.text_cache.empty()) {
+            clip_text_cache_stats stats;
+            clip_text_cache_get_stats(clip_ctx, &stats);
+            if (params.verbose >= 2) {
+                printf("%s: text cache: %zu entries, %zu bytes, %s\n", __func__, stats.n_entries, stats.size_bytes,
+                       stats.hits > 0 ? "hit" : "miss");
+            }
+            clip_text_cache_save(clip_ctx, params.text_cache.c_str());
+        }
     }
 
-    auto results = embd_index.search({vec.data(), vec.size()}, params.n_results);
+    std::vector<float> scores(params.n_results);
+    std::vector<int64_t> labels(params.n_results);
+    clip_index_search(embd_index, vec.data(), 1, params.n_results, params.n_threads, scores.data(), labels.data());
 
     if (params.verbose > 0) {
         printf("search results:\n");
-        printf("distance path\n");
+        printf("similarity path\n");
     }
-    for (std::size_t i = 0; i != results.size(); ++i) {
-        printf("  %f %s\n", results[i].distance, image_file_index.at(results[i].member.label).c_str());
+    for (int i = 0; i < params.n_results && labels[i] >= 0; ++i) {
+        auto it = image_file_index.find(labels[i]);
+        printf("  %f %s\n", scores[i], it != image_file_index.end() ? it->second.c_str() : "(unknown)");
     }
 
+    clip_index_free(embd_index);
     clip_free(clip_ctx);
 
     return 0;
@@ -0,0 +1,202 @@
+// collect an importance matrix for quantization by encoding calibration images and texts
+
+#include "clip.h"
+#include "common-clip.h"
+
+#include <cstdio>
+#include <fstream>
+
+struct imatrix_params {
+    int32_t n_threads{4};
+    std::string model{"models/ggml-model-f32.gguf"};
+    std::string output{"imatrix.gguf"};
+    std::string texts_file;
+    int32_t max_images{0};
+    int32_t verbose{1};
+    std::vector<std::string> image_directories;
+};
+
+void imatrix_print_help(int argc, char ** argv, imatrix_params & params) {
+    printf("Usage: %s [options] [dir/with/pictures ...]\n", argv[0]);
+    printf("\nOptions:\n");
+    printf("  -h, --help: Show this message and exit\n");
+    printf("  -m <path>, --model <path>: path to the f32 or f16 model to quantize later. Default: %s\n",
+           params.model.c_str());
+    printf("  -o <path>, --output <path>: path to write the importance matrix to. Default: %s\n", params.output.c_str());
+    printf("  -t N, --threads N: Number of threads to use for inference. Default: %d\n", params.n_threads);
+    printf("  --texts <path>: file with one calibration text per line\n");
+    printf("  --max-images N: Stop after N images, 0 for all. Default: %d\n", params.max_images);
+    printf("  -v <level>, --verbose <level>: Control the level of verbosity. 0 = minimum, 2 = maximum. Default: %d\n",
+           params.verbose);
+}
+
+// returns success
+bool imatrix_params_parse(int argc, char ** argv, imatrix_params & params) {
+    bool invalid_param = false;
+    for (int i = 1; i < argc; i++) {
+
+        std::string arg = argv[i];
+
+        if (arg == "-m" || arg == "--model") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.model = argv[i];
+        } else if (arg == "-o" || arg == "--output") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.output = argv[i];
+        } else if (arg == "-t" || arg == "--threads") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_threads = std::stoi(argv[i]);
+        } else if (arg == "--texts") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.texts_file = argv[i];
+        } else if (arg == "--max-images") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.max_images = std::stoi(argv[i]);
+        } else if (arg == "-v" || arg == "--verbose") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.verbose = std::stoi(argv[i]);
+        } else if (arg == "-h" || arg == "--help") {
+            imatrix_print_help(argc, argv, params);
+            exit(0);
+        } else if (arg.find('-') == 0) {
+            printf("%s: unrecognized argument: %s\n", __func__, arg.c_str());
+            return false;
+        } else {
+            params.image_directories.push_back(argv[i]);
+        }
+    }
+
+    return !(invalid_param || (params.image_directories.empty() && params.texts_file.empty()));
+}
+
+int main(int argc, char ** argv) {
+    imatrix_params params;
+    if (!imatrix_params_parse(argc, argv, params)) {
+        imatrix_print_help(argc, argv, params);
+        return 1;
+    }
+
+    auto ctx = clip_model_load(params.model.c_str(), params.verbose);
+    if (!ctx) {
+        printf("%s: Unable to load model from %s\n", __func__, params.model.c_str());
+        return 1;
+    }
+
+    clip_imatrix_begin(ctx);
+
+    // images, in batches
+    size_t n_images = 0;
+    if (!params.image_directories.empty()) {
+        const size_t batch_size = 8;
+        const int vec_dim = clip_get_vision_hparams(ctx)->projection_dim;
+        std::vector<float> vec(vec_dim * batch_size);
+        std::vector<clip_image_u8> img_inputs;
+        std::vector<clip_image_f32> imgs_resized;
+
+        auto encode_batch = [&]() {
+            imgs_resized.assign(img_inputs.size(), clip_image_f32{});
+            auto img_inputs_batch = clip_image_u8_batch_make(img_inputs);
+            auto imgs_resized_batch = clip_image_f32_batch_make(imgs_resized);
+
+            clip_image_batch_preprocess(ctx, params.n_threads, &img_inputs_batch, &imgs_resized_batch);
+            if (clip_image_batch_encode(ctx, params.n_threads, &imgs_resized_batch, vec.data(), false)) {
+                n_images += img_inputs.size();
+            } else {
+                fprintf(stderr, "%s: failed to encode a batch of images\n", __func__);
+            }
+
+            for (size_t b = 0; b < img_inputs.size(); b++) {
+                clip_image_u8_clean(&img_inputs[b]);
+                clip_image_f32_clean(&imgs_resized[b]);
+            }
+            img_inputs.clear();
+
+            if (params.verbose >= 1) {
+                printf("\r%s: %zu images", __func__, n_images);
+                fflush(stdout);
+            }
+        };
+
+        dir_crawler * crawler = dir_crawler_start(params.image_directories, 2, 256);
+        std::string img_path;
+        size_t n_loaded = 0;
+        while ((params.max_images <= 0 || n_loaded < (size_t)params.max_images) &&
+               dir_crawler_next(crawler, img_path)) {
+            clip_image_u8 img_input = {};
+            if (!clip_image_load_from_file(img_path.c_str(), &img_input)) {
+                fprintf(stderr, "%s: failed to load image from '%s'\n", __func__, img_path.c_str());
+                continue;
+            }
+            img_inputs.push_back(img_input);
+            n_loaded++;
+            if (img_inputs.size() == batch_size) {
+                encode_batch();
+            }
+        }
+        if (!img_inputs.empty()) {
+            encode_batch();
+        }
+        dir_crawler_free(crawler);
+        printf("\n");
+    }
+
+    // texts, one per line
+    size_t n_texts = 0;
+    if (!params.texts_file.empty()) {
+        std::ifstream fin(params.texts_file);
+        if (!fin.is_open()) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.texts_file.c_str());
+            clip_free(ctx);
+            return 1;
+        }
+
+        std::vector<float> vec(clip_get_text_hparams(ctx)->projection_dim);
+        std::string line;
+        while (std::getline(fin, line)) {
+            if (line.empty()) {
+                continue;
+            }
+
+            clip_tokens tokens;
+            if (!clip_tokenize(ctx, line.c_str(), &tokens)) {
+                fprintf(stderr, "%s: failed to tokenize '%s'\n", __func__, line.c_str());
+                continue;
+            }
+            if (clip_text_encode(ctx, params.n_threads, &tokens, vec.data(), false)) {
+                n_texts++;
+            } else {
+                fprintf(stderr, "%s: failed to encode '%s'\n", __func__, line.c_str());
+            }
+            clip_tokens_free(&tokens);
+        }
+        printf("%s: %zu texts\n", __func__, n_texts);
+    }
+
+    const bool saved = clip_imatrix_save(ctx, params.output.c_str());
+    if (saved) {
+        printf("%s: importance matrix of %zu images and %zu texts written to '%s'\n", __func__, n_images, n_texts,
+               params.output.c_str());
+    }
+
+    clip_free(ctx);
+
+    return saved ? 0 : 1;
+}
@@ -119,6 +119,10 @@ clip_tokenize = clip_lib.clip_tokenize
 clip_tokenize.argtypes = [ctypes.POINTER(ClipContext), ctypes.c_char_p, ctypes.POINTER(ClipTokens)]
 clip_tokenize.restype = ctypes.c_bool
 
+clip_tokens_free = clip_lib.clip_tokens_free
+clip_tokens_free.argtypes = [ctypes.POINTER(ClipTokens)]
+clip_tokens_free.restype = None
+
 clip_image_load_from_file = clip_lib.clip_image_load_from_file
 clip_image_load_from_file.argtypes = [ctypes.c_char_p, ctypes.POINTER(ClipImageU8)]
 clip_image_load_from_file.restype = ctypes.c_bool
@@ -319,7 +323,9 @@ class Clip:
     def tokenize(self, text: str) -> List[int]:
         tokens = ClipTokens()
         if clip_tokenize(self.ctx, text.encode("utf8"), ctypes.pointer(tokens)):
-            return [tokens.data[i] for i in range(tokens.size)]
+            result = [tokens.data[i] for i in range(tokens.size)]
+            clip_tokens_free(ctypes.pointer(tokens))
+            return result
         else:
             raise RuntimeError("unable to tokenize text")
 
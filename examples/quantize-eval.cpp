@@ -0,0 +1,438 @@
+// compare a quantized model against its reference: embedding fidelity, retrieval overlap, per-layer activation
+// error, encode latency and memory
+
+#include "clip.h"
+#include "common-clip.h"
+#include "ggml/ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <set>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+struct eval_params {
+    int32_t n_threads{4};
+    std::string ref_model;
+    std::string quant_model;
+    std::string texts_file;
+    std::vector<std::string> image_directories;
+    int32_t max_images{200};
+    int32_t top_k{10};
+    int32_t layer_samples{16};
+    int32_t verbose{1};
+};
+
+void eval_print_help(int argc, char ** argv, eval_params & params) {
+    printf("Usage: %s [options] --ref ref.gguf --quant quantized.gguf [dir/with/pictures ...]\n", argv[0]);
+    printf("\nOptions:\n");
+    printf("  -h, --help: Show this message and exit\n");
+    printf("  --ref <path>: path to the reference model, e.g. f32 or f16\n");
+    printf("  --quant <path>: path to the quantized model\n");
+    printf("  --texts <path>: file with one text per line\n");
+    printf("  -t N, --threads N: Number of threads to use for inference. Default: %d\n", params.n_threads);
+    printf("  --max-images N: Use at most N images. Default: %d\n", params.max_images);
+    printf("  -k N: Number of results compared for retrieval overlap. Default: %d\n", params.top_k);
+    printf("  --layer-samples N: Number of images and of texts the per-layer error is measured on. Default: %d\n",
+           params.layer_samples);
+    printf("  -v <level>, --verbose <level>: 2 prints the cosine similarity of every sample. Default: %d\n",
+           params.verbose);
+}
+
+// returns success
+bool eval_params_parse(int argc, char ** argv, eval_params & params) {
+    bool invalid_param = false;
+    for (int i = 1; i < argc; i++) {
+
+        std::string arg = argv[i];
+
+        if (arg == "--ref") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.ref_model = argv[i];
+        } else if (arg == "--quant") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.quant_model = argv[i];
+        } else if (arg == "--texts") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.texts_file = argv[i];
+        } else if (arg == "-t" || arg == "--threads") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_threads = std::stoi(argv[i]);
+        } else if (arg == "--max-images") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.max_images = std::stoi(argv[i]);
+        } else if (arg == "-k") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.top_k = std::stoi(argv[i]);
+        } else if (arg == "--layer-samples") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.layer_samples = std::stoi(argv[i]);
+        } else if (arg == "-v" || arg == "--verbose") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.verbose = std::stoi(argv[i]);
+        } else if (arg == "-h" || arg == "--help") {
+            eval_print_help(argc, argv, params);
+            exit(0);
+        } else if (arg.find('-') == 0) {
+            printf("%s: unrecognized argument: %s\n", __func__, arg.c_str());
+            return false;
+        } else {
+            params.image_directories.push_back(argv[i]);
+        }
+    }
+
+    return !(invalid_param || params.ref_model.empty() || params.quant_model.empty() ||
+             (params.image_directories.empty() && params.texts_file.empty()));
+}
+
+// resident set size in bytes, 0 where unknown
+static size_t get_rss() {
+#ifdef __linux__
+    std::ifstream fin("/proc/self/statm");
+    size_t size = 0;
+    size_t resident = 0;
+    if (fin >> size >> resident) {
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+#endif
+    return 0;
+}
+
+struct eval_model {
+    const char * label;
+    clip_ctx * ctx = nullptr;
+    size_t file_size = 0;
+    size_t rss = 0;
+    int64_t t_load_us = 0;
+    int64_t t_image_us = 0;
+    int64_t t_text_us = 0;
+    std::vector<float> image_vecs; // normalized, one row per image
+    std::vector<float> text_vecs;  // normalized, one row per text
+};
+
+static bool load_model(eval_model & model, const std::string & path) {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    get_file_info(path, &size, &mtime);
+    model.file_size = size;
+
+    const size_t rss_before = get_rss();
+    const int64_t t_start_us = ggml_time_us();
+    model.ctx = clip_model_load(path.c_str(), 0);
+    model.t_load_us = ggml_time_us() - t_start_us;
+    const size_t rss_after = get_rss();
+    model.rss = rss_after > rss_before ? rss_after - rss_before : 0;
+    if (!model.ctx) {
+        printf("%s: Unable to load model from %s\n", __func__, path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// encodes every image and text, timing the encodes only
+static void encode_all(eval_model & model, const std::vector<clip_image_u8> & images,
+                       const std::vector<std::string> & texts, const int n_threads) {
+    if (!images.empty()) {
+        const int vec_dim = clip_get_vision_hparams(model.ctx)->projection_dim;
+        model.image_vecs.assign(images.size() * vec_dim, 0.0f);
+        for (size_t i = 0; i < images.size(); i++) {
+            clip_image_f32 img_res;
+            clip_image_preprocess(model.ctx, &images[i], &img_res);
+            const int64_t t_start_us = ggml_time_us();
+            clip_image_encode(model.ctx, n_threads, &img_res, model.image_vecs.data() + i * vec_dim, true);
+            model.t_image_us += ggml_time_us() - t_start_us;
+            clip_image_f32_clean(&img_res);
+        }
+    }
+
+    if (!texts.empty()) {
+        const int vec_dim = clip_get_text_hparams(model.ctx)->projection_dim;
+        model.text_vecs.assign(texts.size() * vec_dim, 0.0f);
+        for (size_t i = 0; i < texts.size(); i++) {
+            clip_tokens tokens;
+            clip_tokenize(model.ctx, texts[i].c_str(), &tokens);
+            const int64_t t_start_us = ggml_time_us();
+            clip_text_encode(model.ctx, n_threads, &tokens, model.text_vecs.data() + i * vec_dim, true);
+            model.t_text_us += ggml_time_us() - t_start_us;
+            clip_tokens_free(&tokens);
+        }
+    }
+}
+
+static float dot(const float * a, const float * b, const int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// cosine similarity of every sample to its reference embedding
+static void report_cosine(const char * what, const std::vector<float> & ref, const std::vector<float> & quant,
+                          const std::vector<std::string> & names, const int vec_dim, const int verbose) {
+    const size_t n = names.size();
+    if (n == 0) {
+        return;
+    }
+
+    std::vector<float> sims(n);
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        sims[i] = dot(ref.data() + i * vec_dim, quant.data() + i * vec_dim, vec_dim);
+        sum += sims[i];
+        if (verbose >= 2) {
+            printf("  %.6f  %s\n", sims[i], names[i].c_str());
+        }
+    }
+
+    std::vector<float> sorted = sims;
+    std::sort(sorted.begin(), sorted.end());
+    printf("%-7s cosine to reference: mean %.6f | p5 %.6f | min %.6f (%s)\n", what, sum / n, sorted[n * 5 / 100],
+           sorted[0], names[std::min_element(sims.begin(), sims.end()) - sims.begin()].c_str());
+}
+
+// mean overlap of the top k keys of every query between the reference and the quantized embeddings
+static float retrieval_overlap(const std::vector<float> & ref_q, const std::vector<float> & ref_k,
+                               const std::vector<float> & quant_q, const std::vector<float> & quant_k, const int vec_dim,
+                               const int k, const bool skip_self) {
+    const size_t n_q = ref_q.size() / vec_dim;
+    const size_t n_k = ref_k.size() / vec_dim;
+
+    auto top_k = [&](const std::vector<float> & q, const std::vector<float> & keys, size_t qi) {
+        std::vector<std::pair<float, size_t>> scores;
+        for (size_t j = 0; j < n_k; j++) {
+            if (skip_self && j == qi) {
+                continue;
+            }
+            scores.push_back({dot(q.data() + qi * vec_dim, keys.data() + j * vec_dim, vec_dim), j});
+        }
+        const size_t n = std::min<size_t>(k, scores.size());
+        std::partial_sort(scores.begin(), scores.begin() + n, scores.end(),
+                          [](const std::pair<float, size_t> & a, const std::pair<float, size_t> & b) {
+                              return a.first > b.first;
+                          });
+        std::set<size_t> ids;
+        for (size_t j = 0; j < n; j++) {
+            ids.insert(scores[j].second);
+        }
+        return ids;
+    };
+
+    double sum = 0.0;
+    for (size_t qi = 0; qi < n_q; qi++) {
+        const std::set<size_t> a = top_k(ref_q, ref_k, qi);
+        const std::set<size_t> b = top_k(quant_q, quant_k, qi);
+        size_t common = 0;
+        for (const size_t id : a) {
+            common += b.count(id);
+        }
+        sum += a.empty() ? 1.0 : (double)common / a.size();
+    }
+    return n_q > 0 ? sum / n_q : 0.0f;
+}
+
+// per-layer activation error: the reference pass records the layer outputs, the quantized pass accumulates the
+// squared error against them
+struct layer_capture {
+    bool record = true;
+    std::vector<std::vector<float>> outputs; // by layer
+    std::vector<double> err;                 // squared error by layer
+    std::vector<double> norm;                // squared reference norm by layer
+};
+
+static void capture_layer(int layer, const float * data, int n_embd, int n_tokens, int n_batch, void * user_data) {
+    layer_capture * cap = static_cast<layer_capture *>(user_data);
+    const size_t n = (size_t)n_embd * n_tokens * n_batch;
+    if (cap->outputs.size() <= (size_t)layer) {
+        cap->outputs.resize(layer + 1);
+        cap->err.resize(layer + 1, 0.0);
+        cap->norm.resize(layer + 1, 0.0);
+    }
+
+    std::vector<float> & ref = cap->outputs[layer];
+    if (cap->record) {
+        ref.assign(data, data + n);
+        return;
+    }
+    if (ref.size() != n) {
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        const double diff = data[i] - ref[i];
+        cap->err[layer] += diff * diff;
+        cap->norm[layer] += (double)ref[i] * ref[i];
+    }
+}
+
+static void report_layer_error(const char * what, const layer_capture & cap) {
+    if (cap.err.empty()) {
+        return;
+    }
+    printf("%s layer error (relative L2):", what);
+    for (size_t l = 0; l < cap.err.size(); l++) {
+        printf("%s%zu: %.5f", l % 8 == 0 ? "\n  " : "  ", l, cap.norm[l] > 0 ? sqrt(cap.err[l] / cap.norm[l]) : 0.0);
+    }
+    printf("\n");
+}
+
+int main(int argc, char ** argv) {
+    eval_params params;
+    if (!eval_params_parse(argc, argv, params)) {
+        eval_print_help(argc, argv, params);
+        return 1;
+    }
+
+    ggml_time_init();
+
+    eval_model ref;
+    eval_model quant;
+    ref.label = "reference";
+    quant.label = "quantized";
+    if (!load_model(ref, params.ref_model) || !load_model(quant, params.quant_model)) {
+        return 1;
+    }
+
+    // samples
+    std::vector<std::string> image_paths;
+    std::vector<clip_image_u8> images;
+    if (!params.image_directories.empty()) {
+        dir_crawler * crawler = dir_crawler_start(params.image_directories, 2, 256);
+        std::string path;
+        while ((int)images.size() < params.max_images && dir_crawler_next(crawler, path)) {
+            clip_image_u8 img = {};
+            if (!clip_image_load_from_file(path.c_str(), &img)) {
+                fprintf(stderr, "%s: failed to load image from '%s'\n", __func__, path.c_str());
+                continue;
+            }
+            images.push_back(img);
+            image_paths.push_back(path);
+        }
+        dir_crawler_free(crawler);
+    }
+
+    std::vector<std::string> texts;
+    if (!params.texts_file.empty()) {
+        std::ifstream fin(params.texts_file);
+        if (!fin.is_open()) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.texts_file.c_str());
+            return 1;
+        }
+        std::string line;
+        while (std::getline(fin, line)) {
+            if (!line.empty()) {
+                texts.push_back(line);
+            }
+        }
+    }
+    printf("%s: %zu images, %zu texts\n\n", __func__, images.size(), texts.size());
+
+    encode_all(ref, images, texts, params.n_threads);
+    encode_all(quant, images, texts, params.n_threads);
+
+    // speed and memory
+    printf("%-22s %12s %12s\n", "", ref.label, quant.label);
+    printf("%-22s %12.2f %12.2f\n", "file size (MB)", ref.file_size / 1024.0 / 1024.0, quant.file_size / 1024.0 / 1024.0);
+    printf("%-22s %12.2f %12.2f\n", "resident on load (MB)", ref.rss / 1024.0 / 1024.0, quant.rss / 1024.0 / 1024.0);
+    printf("%-22s %12.2f %12.2f\n", "load (ms)", ref.t_load_us / 1000.0, quant.t_load_us / 1000.0);
+    if (!images.empty()) {
+        printf("%-22s %12.2f %12.2f\n", "image encode (ms)", ref.t_image_us / 1000.0 / images.size(),
+               quant.t_image_us / 1000.0 / images.size());
+    }
+    if (!texts.empty()) {
+        printf("%-22s %12.2f %12.2f\n", "text encode (ms)", ref.t_text_us / 1000.0 / texts.size(),
+               quant.t_text_us / 1000.0 / texts.size());
+    }
+    printf("\n");
+
+    // embedding fidelity
+    if (!images.empty()) {
+        const int vec_dim = clip_get_vision_hparams(ref.ctx)->projection_dim;
+        report_cosine("images", ref.image_vecs, quant.image_vecs, image_paths, vec_dim, params.verbose);
+    }
+    if (!texts.empty()) {
+        const int vec_dim = clip_get_text_hparams(ref.ctx)->projection_dim;
+        report_cosine("texts", ref.text_vecs, quant.text_vecs, texts, vec_dim, params.verbose);
+    }
+
+    // retrieval: texts against images when both are given, else each sample against the others
+    const int k = params.top_k;
+    if (!images.empty() && !texts.empty()) {
+        const int vec_dim = clip_get_vision_hparams(ref.ctx)->projection_dim;
+        printf("text -> image top-%d overlap: %.4f\n", k,
+               retrieval_overlap(ref.text_vecs, ref.image_vecs, quant.text_vecs, quant.image_vecs, vec_dim, k, false));
+    } else if (images.size() > 1) {
+        const int vec_dim = clip_get_vision_hparams(ref.ctx)->projection_dim;
+        printf("image -> image top-%d overlap: %.4f\n", k,
+               retrieval_overlap(ref.image_vecs, ref.image_vecs, quant.image_vecs, quant.image_vecs, vec_dim, k, true));
+    } else if (texts.size() > 1) {
+        const int vec_dim = clip_get_text_hparams(ref.ctx)->projection_dim;
+        printf("text -> text top-%d overlap: %.4f\n", k,
+               retrieval_overlap(ref.text_vecs, ref.text_vecs, quant.text_vecs, quant.text_vecs, vec_dim, k, true));
+    }
+    printf("\n");
+
+    // per-layer activation error on the first samples
+    layer_capture vision_cap;
+    layer_capture text_cap;
+    clip_set_layer_callback(ref.ctx, capture_layer, &vision_cap);
+    clip_set_layer_callback(quant.ctx, capture_layer, &vision_cap);
+    std::vector<float> vec(std::max(clip_get_vision_hparams(ref.ctx)->projection_dim,
+                                    clip_get_text_hparams(ref.ctx)->projection_dim));
+    for (size_t i = 0; i < images.size() && (int)i < params.layer_samples; i++) {
+        for (eval_model * model : {&ref, &quant}) {
+            vision_cap.record = model == &ref;
+            clip_image_f32 img_res;
+            clip_image_preprocess(model->ctx, &images[i], &img_res);
+            clip_image_encode(model->ctx, params.n_threads, &img_res, vec.data(), true);
+            clip_image_f32_clean(&img_res);
+        }
+    }
+    clip_set_layer_callback(ref.ctx, capture_layer, &text_cap);
+    clip_set_layer_callback(quant.ctx, capture_layer, &text_cap);
+    for (size_t i = 0; i < texts.size() && (int)i < params.layer_samples; i++) {
+        for (eval_model * model : {&ref, &quant}) {
+            text_cap.record = model == &ref;
+            clip_tokens tokens;
+            clip_tokenize(model->ctx, texts[i].c_str(), &tokens);
+            clip_text_encode(model->ctx, params.n_threads, &tokens, vec.data(), true);
+            clip_tokens_free(&tokens);
+        }
+    }
+    report_layer_error("vision", vision_cap);
+    report_layer_error("text", text_cap);
+
+    for (auto & img : images) {
+        clip_image_u8_clean(&img);
+    }
+    clip_free(ref.ctx);
+    clip_free(quant.ctx);
+
+    return 0;
+}
@@ -26,27 +26,41 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
-    // load the image
-    const auto & img_path = params.image_paths[0].c_str();
-    clip_image_u8 input_img;
-    if (!clip_image_load_from_file(img_path, &input_img)) {
-        fprintf(stderr, "%s: failed to load image from '%s'\n", __func__, img_path);
-        return 1;
-    }
-
-    float sorted_scores[n_labels];
-    int sorted_indices[n_labels];
-    if (!clip_zero_shot_label_image(ctx, params.n_threads, &input_img, labels, n_labels, sorted_scores, sorted_indices)) {
+    // encode the labels once for all images
+    clip_zsl * zsl = clip_zsl_make(ctx, params.n_threads, labels, n_labels, NULL, 0);
+    if (!zsl) {
         fprintf(stderr, "Unable to apply ZSL\n");
         return 1;
     }
 
-    for (int i = 0; i < n_labels; i++) {
-        auto label = labels[sorted_indices[i]];
-        float score = sorted_scores[i];
-        printf("%s = %1.4f\n", label, score);
+    for (const auto & image_path : params.image_paths) {
+        const char * img_path = image_path.c_str();
+        clip_image_u8 input_img;
+        if (!clip_image_load_from_file(img_path, &input_img)) {
+            fprintf(stderr, "%s: failed to load image from '%s'\n", __func__, img_path);
+            return 1;
+        }
+
+        float sorted_scores[n_labels];
+        int sorted_indices[n_labels];
+        if (!clip_zsl_classify(zsl, params.n_threads, &input_img, n_labels, sorted_scores, sorted_indices)) {
+            fprintf(stderr, "Unable to apply ZSL\n");
+            return 1;
+        }
+        clip_image_u8_clean(&input_img);
+
+        if (params.image_paths.size() > 1) {
+            printf("%s:\n", img_path);
+        }
+
+        for (int i = 0; i < n_labels; i++) {
+            auto label = labels[sorted_indices[i]];
+            float score = sorted_scores[i];
+            printf("%s = %1.4f\n", label, score);
+        }
     }
 
+    clip_zsl_free(zsl);
     clip_free(ctx);
 
     return 0;
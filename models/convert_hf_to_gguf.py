@@ -85,6 +85,14 @@ dir_model = args.model_dir
 with open(dir_model + "/vocab.json", "r", encoding="utf-8") as f:
     vocab = json.load(f)
     tokens = [key for key in vocab]
+
+# BPE merges in rank order, skipping the "#version" header
+merges = []
+if os.path.isfile(dir_model + "/merges.txt"):
+    with open(dir_model + "/merges.txt", "r", encoding="utf-8") as f:
+        merges = [line.rstrip("\n") for line in f if line.strip() and not line.startswith("#version")]
+else:
+    print("WARNING: merges.txt not found. The model will fall back to approximate greedy tokenization.")
     
 with open(dir_model + "/config.json", "r", encoding="utf-8") as f:
     config = json.load(f)
@@ -147,6 +155,8 @@ if has_text_encoder:
     fout.add_float32(k(KEY_ATTENTION_LAYERNORM_EPS, TEXT), t_hparams["layer_norm_eps"])
     fout.add_uint32(k(KEY_BLOCK_COUNT, TEXT), t_hparams["num_hidden_layers"])
     fout.add_token_list(tokens)
+    if merges:
+        fout.add_token_merges(merges)
 
 if has_vision_encoder:
     # vision_model hparams
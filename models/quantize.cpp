@@ -2,29 +2,56 @@
 #include "ggml/ggml.h"
 #include <string>
 
+static const struct {
+    int itype;
+    const char * name;
+} types[] = {
+    {2, "q4_0"}, {3, "q4_1"}, {6, "q5_0"}, {7, "q5_1"}, {8, "q8_0"},
+    {10, "q2_k"}, {11, "q3_k"}, {12, "q4_k"}, {13, "q5_k"}, {14, "q6_k"},
+};
+
 void print_usage(int argc, char ** argv) {
 
-    fprintf(stderr, "usage: %s /path/to/ggml-model-f32.gguf /path/to/ggml-model-quantized.gguf type\n", argv[0]);
-    fprintf(stderr, "  type = 2 - q4_0\n");
-    fprintf(stderr, "  type = 3 - q4_1\n");
-    fprintf(stderr, "  type = 6 - q5_0\n");
-    fprintf(stderr, "  type = 7 - q5_1\n");
-    fprintf(stderr, "  type = 8 - q8_0\n");
+    fprintf(stderr,
+            "usage: %s /path/to/ggml-model-f32.gguf /path/to/ggml-model-quantized.gguf type|preset|recipe [imatrix.gguf]\n",
+            argv[0]);
+    for (const auto & t : types) {
+        fprintf(stderr, "  type = %d - %s\n", t.itype, t.name);
+    }
+    const char * name;
+    const char * recipe;
+    for (int i = 0; (recipe = clip_model_quantize_preset(i, &name)) != NULL; i++) {
+        fprintf(stderr, "  preset = %-8s - %s\n", name, recipe);
+    }
+    fprintf(stderr, "  recipe = comma separated [tower.]role[@first-last]=type rules, the first match wins, e.g.\n");
+    fprintf(stderr, "           v.attn_*@0-3=q8_0,ffn_*=q4_0,*=q5_1\n");
+    fprintf(stderr, "  imatrix.gguf = importance matrix collected with ./bin/imatrix, used by q4_0, q4_1, q5_0 and q5_1\n");
 }
 
 int main(int argc, char ** argv) {
-    if (argc != 4) {
+    if (argc != 4 && argc != 5) {
         print_usage(argc, argv);
         return 1;
     }
 
     const std::string fname_inp = argv[1];
     const std::string fname_out = argv[2];
+    const char * fname_imatrix = argc == 5 ? argv[4] : NULL;
 
-    const int itype = atoi(argv[3]);
-    if (itype != 2 && itype != 3 && itype != 6 && itype != 7 && itype != 8) {
-        print_usage(argc, argv);
-        return 1;
+    // a number is a type, quantizing every weight with it, anything else a preset or a recipe
+    std::string recipe = argv[3];
+    if (recipe.find_first_not_of("0123456789") == std::string::npos) {
+        const int itype = atoi(argv[3]);
+        recipe.clear();
+        for (const auto & t : types) {
+            if (t.itype == itype) {
+                recipe = std::string("*=") + t.name;
+            }
+        }
+        if (recipe.empty()) {
+            print_usage(argc, argv);
+            return 1;
+        }
     }
 
     const int64_t t_main_start_us = ggml_time_us();
@@ -35,7 +62,7 @@ int main(int argc, char ** argv) {
     {
         const int64_t t_start_us = ggml_time_us();
 
-        if (!clip_model_quantize(fname_inp.c_str(), fname_out.c_str(), itype)) {
+        if (!clip_model_quantize_recipe(fname_inp.c_str(), fname_out.c_str(), recipe.c_str(), fname_imatrix)) {
             fprintf(stderr, "%s: failed to quantize model from '%s'\n", __func__, fname_inp.c_str());
             return 1;
         }
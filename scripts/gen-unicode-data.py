@@ -0,0 +1,98 @@
+# Generates clip-unicode.h with the Unicode tables used by the tokenizer in clip.cpp:
+#   - letter (L*) and number (N*) code point ranges for the pre-tokenizer
+#   - simple lowercase mappings, compressed into runs of equal offset
+#
+# usage: python3 scripts/gen-unicode-data.py > clip-unicode.h
+
+import unicodedata
+
+MAX_CODEPOINT = 0x110000
+
+
+def category_ranges(prefix):
+    ranges = []
+    start = None
+    for cp in range(MAX_CODEPOINT):
+        ok = unicodedata.category(chr(cp)).startswith(prefix)
+        if ok and start is None:
+            start = cp
+        elif not ok and start is not None:
+            ranges.append((start, cp - 1))
+            start = None
+    if start is not None:
+        ranges.append((start, MAX_CODEPOINT - 1))
+    return ranges
+
+
+def lowercase_runs():
+    # 1:1 mappings only. U+0130 lowercases to "i" + U+0307 in Python, we keep the "i"
+    mappings = []
+    for cp in range(MAX_CODEPOINT):
+        lower = chr(cp).lower()
+        if lower != chr(cp):
+            mappings.append((cp, ord(lower[0])))
+
+    runs = []
+    i = 0
+    while i < len(mappings):
+        first, lower = mappings[i]
+        delta = lower - first
+        stride = None
+        j = i
+        while j + 1 < len(mappings):
+            cp_next, lower_next = mappings[j + 1]
+            step = cp_next - mappings[j][0]
+            if lower_next - cp_next != delta:
+                break
+            if stride is None:
+                if step not in (1, 2):
+                    break
+                stride = step
+            elif step != stride:
+                break
+            j += 1
+        runs.append((first, mappings[j][0], stride or 1, delta))
+        i = j + 1
+    return runs
+
+
+def print_table(decl, rows, fmt, per_line):
+    print(decl + " = {")
+    for i in range(0, len(rows), per_line):
+        print("    " + " ".join(fmt(r) + "," for r in rows[i : i + per_line]))
+    print("};")
+    print()
+
+
+print("// generated by scripts/gen-unicode-data.py from Unicode %s, do not edit" % unicodedata.unidata_version)
+print()
+print("#ifndef CLIP_UNICODE_H")
+print("#define CLIP_UNICODE_H")
+print()
+print("#include <stdint.h>")
+print()
+print("struct clip_unicode_range {")
+print("    uint32_t first;")
+print("    uint32_t last;")
+print("};")
+print()
+print("// code points first, first + stride, ..., last map to code point + delta")
+print("struct clip_unicode_lower_run {")
+print("    uint32_t first;")
+print("    uint32_t last;")
+print("    uint32_t stride;")
+print("    int32_t delta;")
+print("};")
+print()
+
+rng = lambda r: "{0x%05X, 0x%05X}" % r
+print_table("static const clip_unicode_range clip_unicode_letters[]", category_ranges("L"), rng, 5)
+print_table("static const clip_unicode_range clip_unicode_numbers[]", category_ranges("N"), rng, 5)
+print_table(
+    "static const clip_unicode_lower_run clip_unicode_lower_runs[]",
+    lowercase_runs(),
+    lambda r: "{0x%05X, 0x%05X, %d, %d}" % r,
+    3,
+)
+
+print("#endif // CLIP_UNICODE_H")
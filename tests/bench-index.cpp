@@ -0,0 +1,287 @@
+// recall@k and QPS of the approximate indices against the exact flat search, on synthetic clustered embeddings
+
+#include "clip.h"
+#include "ggml/ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+struct bench_params {
+    size_t n_vecs = 100000;
+    int vec_dim = 512;
+    size_t n_queries = 1000;
+    int k = 10;
+    int n_threads = 4;
+    int M = 16;
+    int ef_construction = 200;
+    std::vector<int> ef_search = {16, 32, 64, 128, 256};
+    int n_lists = 1024;
+    int pq_m = 0; // vec_dim / 8
+    std::vector<int> n_probe = {1, 4, 16, 64};
+    int n_rerank = 100;
+};
+
+static std::vector<int> parse_list(const std::string & value) {
+    std::vector<int> out;
+    for (size_t pos = 0; pos < value.size();) {
+        size_t end = value.find(',', pos);
+        end = end == std::string::npos ? value.size() : end;
+        out.push_back(std::stoi(value.substr(pos, end - pos)));
+        pos = end + 1;
+    }
+    return out;
+}
+
+static void print_usage(char ** argv, const bench_params & params) {
+    printf("usage: %s [options]\n\n", argv[0]);
+    printf("options:\n");
+    printf("  -n N               number of indexed vectors. default: %zu\n", params.n_vecs);
+    printf("  -d N               vector dimension. default: %d\n", params.vec_dim);
+    printf("  -q N               number of queries. default: %zu\n", params.n_queries);
+    printf("  -k N               number of results per query. default: %d\n", params.k);
+    printf("  -t N               number of threads. default: %d\n", params.n_threads);
+    printf("  -M N               HNSW links per node. default: %d\n", params.M);
+    printf("  --ef-construction N  HNSW candidate list size while building. default: %d\n", params.ef_construction);
+    printf("  --ef N[,N...]      HNSW candidate list sizes to benchmark. default: 16,32,64,128,256\n");
+    printf("  --lists N          IVF-PQ inverted lists. default: %d\n", params.n_lists);
+    printf("  --pq-m N           IVF-PQ bytes per vector. default: dimension / 8\n");
+    printf("  --probe N[,N...]   IVF-PQ lists scanned per query to benchmark. default: 1,4,16,64\n");
+    printf("  --rerank N         IVF-PQ and binary candidates rescored with the full vectors. default: %d\n",
+           params.n_rerank);
+}
+
+static bool parse_params(int argc, char ** argv, bench_params & params) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const std::string value = argv[++i];
+        if (arg == "-n") {
+            params.n_vecs = std::stoul(value);
+        } else if (arg == "-d") {
+            params.vec_dim = std::stoi(value);
+        } else if (arg == "-q") {
+            params.n_queries = std::stoul(value);
+        } else if (arg == "-k") {
+            params.k = std::stoi(value);
+        } else if (arg == "-t") {
+            params.n_threads = std::stoi(value);
+        } else if (arg == "-M") {
+            params.M = std::stoi(value);
+        } else if (arg == "--ef-construction") {
+            params.ef_construction = std::stoi(value);
+        } else if (arg == "--ef") {
+            params.ef_search = parse_list(value);
+        } else if (arg == "--lists") {
+            params.n_lists = std::stoi(value);
+        } else if (arg == "--pq-m") {
+            params.pq_m = std::stoi(value);
+        } else if (arg == "--probe") {
+            params.n_probe = parse_list(value);
+        } else if (arg == "--rerank") {
+            params.n_rerank = std::stoi(value);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// normalized vectors around random cluster centers, which is closer to real embeddings than uniform noise
+static void make_vecs(std::mt19937 & rng, const std::vector<float> & centers, const int vec_dim, const size_t n,
+                      std::vector<float> & vecs) {
+    std::normal_distribution<float> noise(0.0f, 0.5f);
+    const size_t n_centers = centers.size() / vec_dim;
+    vecs.resize(n * vec_dim);
+    for (size_t i = 0; i < n; i++) {
+        const float * center = centers.data() + (rng() % n_centers) * vec_dim;
+        float * vec = vecs.data() + i * vec_dim;
+        float norm = 0.0f;
+        for (int d = 0; d < vec_dim; d++) {
+            vec[d] = center[d] + noise(rng) / sqrtf((float)vec_dim);
+            norm += vec[d] * vec[d];
+        }
+        norm = sqrtf(norm);
+        for (int d = 0; d < vec_dim; d++) {
+            vec[d] /= norm;
+        }
+    }
+}
+
+static float recall_at_k(const std::vector<int64_t> & truth, const std::vector<int64_t> & found, const size_t n_queries,
+                         const int k) {
+    size_t hits = 0;
+    for (size_t q = 0; q < n_queries; q++) {
+        for (int i = 0; i < k; i++) {
+            for (int j = 0; j < k; j++) {
+                if (found[q * k + j] == truth[q * k + i]) {
+                    hits++;
+                    break;
+                }
+            }
+        }
+    }
+    return (float)hits / (n_queries * k);
+}
+
+static bool even_ids(int64_t id, void * /*user_data*/) { return id % 2 == 0; }
+
+int main(int argc, char ** argv) {
+    bench_params params;
+    if (!parse_params(argc, argv, params)) {
+        print_usage(argv, params);
+        return 1;
+    }
+
+    ggml_time_init();
+
+    const int vec_dim = params.vec_dim;
+    const int k = params.k;
+    const size_t n_queries = params.n_queries;
+
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::vector<float> centers(256 * vec_dim);
+    for (auto & c : centers) {
+        c = normal(rng) / sqrtf((float)vec_dim);
+    }
+
+    std::vector<float> vecs;
+    std::vector<float> queries;
+    make_vecs(rng, centers, vec_dim, params.n_vecs, vecs);
+    make_vecs(rng, centers, vec_dim, n_queries, queries);
+
+    std::vector<int64_t> ids(params.n_vecs);
+    for (size_t i = 0; i < params.n_vecs; i++) {
+        ids[i] = i;
+    }
+
+    printf("%zu vectors of dimension %d, %zu queries, k = %d, %d threads\n\n", params.n_vecs, vec_dim, n_queries, k,
+           params.n_threads);
+
+    std::vector<float> scores(n_queries * k);
+    std::vector<int64_t> truth(n_queries * k);
+    std::vector<int64_t> truth_even(n_queries * k);
+    std::vector<int64_t> found(n_queries * k);
+
+    // exact search, which is also the ground truth
+    clip_index * flat = clip_index_make(vec_dim, CLIP_INDEX_F32);
+    clip_index_add(flat, vecs.data(), ids.data(), params.n_vecs);
+
+    int64_t t_start = ggml_time_us();
+    clip_index_search(flat, queries.data(), n_queries, k, params.n_threads, scores.data(), truth.data());
+    const double flat_qps = n_queries / ((ggml_time_us() - t_start) / 1e6);
+
+    // ground truth of the filtered search: an exact index of the even ids only
+    {
+        std::vector<float> even_vecs;
+        std::vector<int64_t> even_ids_list;
+        for (size_t i = 0; i < params.n_vecs; i += 2) {
+            even_vecs.insert(even_vecs.end(), vecs.begin() + i * vec_dim, vecs.begin() + (i + 1) * vec_dim);
+            even_ids_list.push_back(i);
+        }
+        clip_index * even = clip_index_make(vec_dim, CLIP_INDEX_F32);
+        clip_index_add(even, even_vecs.data(), even_ids_list.data(), even_ids_list.size());
+        clip_index_search(even, queries.data(), n_queries, k, params.n_threads, scores.data(), truth_even.data());
+        clip_index_free(even);
+    }
+
+    printf("| index         | recall@%-3d | QPS        |\n", k);
+    printf("| ------------- | ---------- | ---------- |\n");
+    printf("| flat f32      | %10.4f | %10.1f |\n", 1.0f, flat_qps);
+
+    clip_index * flat_i8 = NULL;
+    clip_index * flat_bin = NULL;
+    for (clip_index_type type : {CLIP_INDEX_F16, CLIP_INDEX_I8, CLIP_INDEX_BIN}) {
+        clip_index * index = clip_index_make(vec_dim, type);
+        clip_index_add(index, vecs.data(), ids.data(), params.n_vecs);
+        t_start = ggml_time_us();
+        clip_index_search(index, queries.data(), n_queries, k, params.n_threads, scores.data(), found.data());
+        const double qps = n_queries / ((ggml_time_us() - t_start) / 1e6);
+        const char * names[] = {"f32", "f16", "i8", "bin"};
+        printf("| flat %-8s | %10.4f | %10.1f |\n", names[type], recall_at_k(truth, found, n_queries, k), qps);
+        if (type == CLIP_INDEX_I8) {
+            flat_i8 = index;
+        } else if (type == CLIP_INDEX_BIN) {
+            flat_bin = index;
+        } else {
+            clip_index_free(index);
+        }
+    }
+
+    // binary prefilter, then exact scores of the best candidates
+    for (const clip_index * fine : {(const clip_index *)flat_i8, (const clip_index *)flat}) {
+        t_start = ggml_time_us();
+        clip_index_search_rerank(flat_bin, fine, queries.data(), n_queries, k, params.n_rerank, params.n_threads,
+                                 scores.data(), found.data());
+        const double qps = n_queries / ((ggml_time_us() - t_start) / 1e6);
+        printf("| bin > %-7s | %10.4f | %10.1f |\n", fine == flat ? "f32" : "i8", recall_at_k(truth, found, n_queries, k),
+               qps);
+    }
+    clip_index_free(flat_i8);
+    clip_index_free(flat_bin);
+
+    clip_hnsw_params hnsw_params = clip_hnsw_default_params();
+    hnsw_params.M = params.M;
+    hnsw_params.ef_construction = params.ef_construction;
+    clip_hnsw * hnsw = clip_hnsw_make(vec_dim, hnsw_params);
+
+    t_start = ggml_time_us();
+    clip_hnsw_add(hnsw, vecs.data(), ids.data(), params.n_vecs, params.n_threads);
+    const double build_s = (ggml_time_us() - t_start) / 1e6;
+
+    for (const int ef : params.ef_search) {
+        clip_hnsw_set_ef_search(hnsw, ef);
+        t_start = ggml_time_us();
+        clip_hnsw_search(hnsw, queries.data(), n_queries, k, params.n_threads, NULL, NULL, scores.data(), found.data());
+        const double qps = n_queries / ((ggml_time_us() - t_start) / 1e6);
+        printf("| hnsw ef=%-5d | %10.4f | %10.1f |\n", ef, recall_at_k(truth, found, n_queries, k), qps);
+    }
+
+    clip_hnsw_set_ef_search(hnsw, params.ef_search.back());
+    t_start = ggml_time_us();
+    clip_hnsw_search(hnsw, queries.data(), n_queries, k, params.n_threads, even_ids, NULL, scores.data(), found.data());
+    const double filtered_qps = n_queries / ((ggml_time_us() - t_start) / 1e6);
+    printf("| hnsw even ids | %10.4f | %10.1f |\n", recall_at_k(truth_even, found, n_queries, k), filtered_qps);
+
+    clip_ivfpq_params ivf_params = clip_ivfpq_default_params();
+    ivf_params.n_lists = params.n_lists;
+    ivf_params.pq_m = params.pq_m > 0 ? params.pq_m : vec_dim / 8;
+    clip_ivfpq * ivf = clip_ivfpq_make(vec_dim, ivf_params);
+    if (!ivf) {
+        return 1;
+    }
+
+    t_start = ggml_time_us();
+    if (!clip_ivfpq_train(ivf, vecs.data(), params.n_vecs, params.n_threads)) {
+        return 1;
+    }
+    const double train_s = (ggml_time_us() - t_start) / 1e6;
+    clip_ivfpq_add(ivf, vecs.data(), ids.data(), params.n_vecs, params.n_threads);
+
+    for (const int n_probe : params.n_probe) {
+        clip_ivfpq_set_n_probe(ivf, n_probe);
+        for (const clip_index * rerank : {(const clip_index *)NULL, (const clip_index *)flat}) {
+            t_start = ggml_time_us();
+            clip_ivfpq_search(ivf, queries.data(), n_queries, k, params.n_threads, rerank, params.n_rerank,
+                              scores.data(), found.data());
+            const double qps = n_queries / ((ggml_time_us() - t_start) / 1e6);
+            printf("| ivfpq p=%-4d%s | %10.4f | %10.1f |\n", n_probe, rerank ? "r" : " ",
+                   recall_at_k(truth, found, n_queries, k), qps);
+        }
+    }
+
+    printf("\nHNSW built in %.2f s (M = %d, ef_construction = %d)\n", build_s, params.M, params.ef_construction);
+    printf("IVF-PQ trained in %.2f s (%d lists, %d bytes per vector instead of %zu), r: %d candidates reranked\n",
+           train_s, ivf_params.n_lists, ivf_params.pq_m, vec_dim * sizeof(float), params.n_rerank);
+
+    clip_ivfpq_free(ivf);
+    clip_hnsw_free(hnsw);
+    clip_index_free(flat);
+
+    return 0;
+}
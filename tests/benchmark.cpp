@@ -52,38 +52,34 @@ int main(int argc, char ** argv) {
 
     const int vec_dim = clip_get_text_hparams(ctx)->projection_dim;
 
-    float txt_vecs[n_labels * vec_dim];
-
     ggml_time_init();
 
-    // walk through directory names and encode them as texts
-
-    int label_idx = 0;
+    // walk through directory names and encode them as labels of a zero-shot classifier
 
     const int64_t t_start_encode_texts = ggml_time_us();
 
+    std::vector<const char *> labels;
     for (const auto & entry : result) {
-        clip_tokens tokens;
-        clip_tokenize(ctx, entry.first.c_str(), &tokens);
-        if (!clip_text_encode(ctx, n_threads, &tokens, txt_vecs + label_idx * vec_dim, true)) {
-            printf("%s: Could not encode the label at index %d: %s\n", __func__, label_idx, entry.first.c_str());
-            return 1;
-        }
+        labels.push_back(entry.first.c_str());
+    }
 
-        label_idx += 1;
+    clip_zsl * zsl = clip_zsl_make(ctx, n_threads, labels.data(), n_labels, NULL, 0);
+    if (!zsl) {
+        printf("%s: Could not encode the labels\n", __func__);
+        return 1;
     }
 
     const int64_t t_end_encode_texts = ggml_time_us();
 
-    label_idx = 0;                 // reset label index
+    int label_idx = 0;
     int n_total_items = 0;         // total number of images processed
     float total_acc1_score = 0.0f; // total accuracy at 1 for the intire dataset
     float total_acc5_score = 0.0f; // total accuracy at 5 in intitre dataset
     float img_vecs[vec_dim * batch_size];
 
-    float similarities[n_labels];
-    float sorted_scores[n_labels];
-    int indices[n_labels];
+    const int top_k = std::min<int>(5, n_labels);
+    float sorted_scores[batch_size * top_k];
+    int indices[batch_size * top_k];
     std::vector<clip_image_u8> img_inputs(batch_size);
     std::vector<clip_image_f32> imgs_resized(batch_size);
 
@@ -117,18 +113,15 @@ int main(int argc, char ** argv) {
 
             clip_image_batch_encode(ctx, n_threads, &imgs_resized_batch, img_vecs, true);
 
-            for (size_t b = 0; b < batch_size; b++) {
-                for (size_t j = 0; j < n_labels; j++) {
-                    similarities[j] = clip_similarity_score(img_vecs + b * vec_dim, txt_vecs + j * vec_dim, vec_dim);
-                }
-                softmax_with_sorting(similarities, n_labels, sorted_scores, indices);
+            clip_zsl_classify_vecs(zsl, n_threads, img_vecs, batch_size, top_k, sorted_scores, indices);
 
-                for (int k = 0; k < 5; k++) {
-                    if (k == 0 && indices[k] == label_idx) {
+            for (size_t b = 0; b < batch_size; b++) {
+                for (int k = 0; k < top_k; k++) {
+                    if (k == 0 && indices[b * top_k + k] == label_idx) {
                         n_acc1 += 1;
                         n_acc5 += 1;
                         break;
-                    } else if (indices[k] == label_idx) {
+                    } else if (indices[b * top_k + k] == label_idx) {
                         n_acc5 += 1;
                         break;
                     }
@@ -166,6 +159,7 @@ int main(int argc, char ** argv) {
         fclose(fout);
     }
 
+    clip_zsl_free(zsl);
     clip_free(ctx);
 
     return 0;
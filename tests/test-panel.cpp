@@ -0,0 +1,101 @@
+// panel_mul_mat of repacked q4_0 and q8_0 weights against ggml_mul_mat of the same weights, on random data. the
+// panel kernels are internal to clip.cpp, so it is compiled into the test
+
+#include "clip.cpp"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static bool test_panel_mul_mat(const ggml_type type, const int64_t n_in, const int64_t n_out, const int64_t n_tokens,
+                               const int nth, std::mt19937 & rng) {
+    struct ggml_init_params params = {
+        /*.mem_size   = */ 4 * (n_in * n_out + n_in * n_tokens + 2 * n_out * n_tokens) * sizeof(float) +
+            8 * ggml_tensor_overhead() + 1024 * 1024,
+        /*.mem_buffer = */ NULL,
+        /*.no_alloc   = */ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    std::normal_distribution<float> dist;
+    std::vector<float> w_f32(n_in * n_out);
+    for (auto & v : w_f32) {
+        v = dist(rng);
+    }
+    struct ggml_tensor * w = ggml_new_tensor_2d(ctx, type, n_in, n_out);
+    int64_t hist[1 << 4] = {0};
+    ggml_quantize_chunk(type, w_f32.data(), w->data, 0, w_f32.size(), hist);
+
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_in, n_tokens);
+    float * x_data = static_cast<float *>(x->data);
+    for (int64_t i = 0; i < n_in * n_tokens; i++) {
+        x_data[i] = dist(rng);
+    }
+
+    struct ggml_tensor * ref = ggml_mul_mat(ctx, w, x);
+    struct ggml_cgraph gf = {};
+    ggml_build_forward_expand(&gf, ref);
+    ggml_cplan cplan = ggml_graph_plan(&gf, 1);
+    std::vector<uint8_t> work(cplan.work_size);
+    cplan.work_data = work.data();
+    ggml_graph_compute(&gf, &cplan);
+
+    struct ggml_tensor * packed = ggml_dup_tensor(ctx, w);
+    RepackArgs args = {ggml_type_size(type), n_in / QK_LEGACY, static_cast<const uint8_t *>(w->data),
+                       static_cast<uint8_t *>(packed->data)};
+    repack_panels(&args, 0, n_out / CLIP_PANEL_ROWS);
+
+    // as in a graph, the quantization runs on all threads before the multiplication
+    clip_buffer xq;
+    xq.resize(n_tokens * (n_in / QK_LEGACY) * sizeof(clip_block_q8));
+    struct ggml_tensor * out = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_out, n_tokens);
+    for (int ith = 0; ith < nth; ith++) {
+        panel_quantize(x, x, ith, nth, &xq);
+    }
+    for (int ith = 0; ith < nth; ith++) {
+        panel_mul_mat(out, out, x, packed, ith, nth, &xq);
+    }
+
+    // both quantize the activations to 8 bits, ggml with an f16 scale and the panels with an f32 one, so the results
+    // differ by a few percent of their magnitude at most. a wrong layout or tile is off by as much as the results
+    const float * ref_data = static_cast<const float *>(ref->data);
+    const float * out_data = static_cast<const float *>(out->data);
+    double sum_sq = 0.0;
+    float max_err = 0.0f;
+    for (int64_t i = 0; i < n_out * n_tokens; i++) {
+        sum_sq += (double)ref_data[i] * ref_data[i];
+        max_err = std::max(max_err, std::fabs(ref_data[i] - out_data[i]));
+    }
+    const float tolerance = 5e-2f * (float)std::sqrt(sum_sq / (n_out * n_tokens));
+    ggml_free(ctx);
+
+    const bool ok = max_err <= tolerance;
+    printf("%s: %s %4lld x %4lld, %3lld tokens, %d threads: max error %.5f (tolerance %.5f)%s\n", __func__,
+           ggml_type_name(type), (long long)n_out, (long long)n_in, (long long)n_tokens, nth, max_err, tolerance,
+           ok ? "" : " FAILED");
+    return ok;
+}
+
+int main() {
+    std::mt19937 rng(42);
+    int n_failed = 0;
+    for (const ggml_type type : {GGML_TYPE_Q4_0, GGML_TYPE_Q8_0}) {
+        for (const int64_t n_in : {96, 512}) {
+            for (const int64_t n_out : {4, 36}) {
+                for (const int64_t n_tokens : {1, 2, 3, 7, 64, 65, 131}) {
+                    for (const int nth : {1, 3}) {
+                        n_failed += test_panel_mul_mat(type, n_in, n_out, n_tokens, nth, rng) ? 0 : 1;
+                    }
+                }
+            }
+        }
+    }
+
+    if (n_failed > 0) {
+        printf("%d tests failed\n", n_failed);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,183 @@
+// the tokenizer against the ids of the HF CLIPTokenizer of openai/clip-vit-base-patch32, and the rows of
+// clip_tokenize_batch against clip_tokenize. the vocab is that of a model converted with its merges.txt:
+//
+//   test-tokenizer <model.gguf>
+//
+// the ids of single characters follow from the layout of the vocab: the 256 byte symbols in bytes_to_unicode order,
+// then the same with "</w>", so a word of one printable ASCII character c is 256 + c - '!'. the cases without known
+// ids check the splitting into words instead, by comparing a text with the words it must be split into
+
+#include "clip.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static const clip_vocab_id SOT = 49406;
+static const clip_vocab_id EOT = 49407;
+
+static std::vector<clip_vocab_id> tokenize(clip_ctx * ctx, const char * text) {
+    clip_tokens tokens;
+    if (!clip_tokenize(ctx, text, &tokens)) {
+        return {};
+    }
+    std::vector<clip_vocab_id> out(tokens.data, tokens.data + tokens.size);
+    clip_tokens_free(&tokens);
+    return out;
+}
+
+// the tokens of text without startoftext and endoftext
+static std::vector<clip_vocab_id> words(clip_ctx * ctx, const char * text) {
+    std::vector<clip_vocab_id> out = tokenize(ctx, text);
+    return out.size() < 2 ? out : std::vector<clip_vocab_id>(out.begin() + 1, out.end() - 1);
+}
+
+static std::vector<clip_vocab_id> concat(std::initializer_list<std::vector<clip_vocab_id>> parts) {
+    std::vector<clip_vocab_id> out;
+    for (const auto & part : parts) {
+        out.insert(out.end(), part.begin(), part.end());
+    }
+    return out;
+}
+
+static std::string to_string(const std::vector<clip_vocab_id> & tokens) {
+    std::string out;
+    for (const clip_vocab_id id : tokens) {
+        out += (out.empty() ? "" : " ") + std::to_string(id);
+    }
+    return out;
+}
+
+static bool check(const char * what, const bool ok) {
+    printf("%s: %-40s %s\n", __func__, what, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static bool check(const char * what, const std::vector<clip_vocab_id> & got, const std::vector<clip_vocab_id> & expected) {
+    const bool ok = check(what, got == expected);
+    if (!ok) {
+        printf("    got      %s\n", to_string(got).c_str());
+        printf("    expected %s\n", to_string(expected).c_str());
+    }
+    return ok;
+}
+
+static int test_ids(clip_ctx * ctx) {
+    struct test_case {
+        const char * text;
+        std::vector<clip_vocab_id> expected;
+    };
+    const test_case cases[] = {
+        {"a photo of a cat", {SOT, 320, 1125, 539, 320, 2368, EOT}},
+        {"a photo of a dog.", {SOT, 320, 1125, 539, 320, 1929, 269, EOT}},
+        {"A  Photo\tof \n a CAT", {SOT, 320, 1125, 539, 320, 2368, EOT}},
+        {"2024", {SOT, 273, 271, 273, 275, EOT}},
+        {"a1, i", {SOT, 320, 272, 267, 328, EOT}},
+        {"", {SOT, EOT}},
+        {"   ", {SOT, EOT}},
+        {"a<|endoftext|>", {SOT, 320, EOT, EOT}},
+    };
+
+    int n_failed = 0;
+    for (const auto & c : cases) {
+        std::string what = "\"";
+        for (const char * p = c.text; *p; p++) {
+            what += *p == '\t' ? "\\t" : *p == '\n' ? "\\n" : std::string(1, *p);
+        }
+        what += "\"";
+        n_failed += check(what.c_str(), tokenize(ctx, c.text), c.expected) ? 0 : 1;
+    }
+    return n_failed;
+}
+
+static int test_words(clip_ctx * ctx) {
+    int n_failed = 0;
+
+    // contractions are words of their own, and their apostrophe is not a word either: "'" alone is "'</w>", 262
+    for (const char * c : {"'s", "'t", "'re", "'ve", "'m", "'ll", "'d"}) {
+        const std::string text = std::string("it") + c;
+        n_failed += check(text.c_str(), words(ctx, text.c_str()), concat({words(ctx, "it"), words(ctx, c)})) ? 0 : 1;
+        n_failed += check(c, words(ctx, c).front() != 262) ? 0 : 1;
+    }
+    n_failed += check("don't", words(ctx, "don't"), concat({words(ctx, "don"), words(ctx, "'t")})) ? 0 : 1;
+
+    // non-ASCII letters are lowercased and belong to the word around them, so "a" is not "a</w>", 320; other
+    // symbols end it
+    n_failed += check("CAFÉ", tokenize(ctx, "CAFÉ"), tokenize(ctx, "café")) ? 0 : 1;
+    n_failed += check("ÜBER", tokenize(ctx, "ÜBER"), tokenize(ctx, "über")) ? 0 : 1;
+    n_failed += check("aéa", words(ctx, "aéa").front() != 320) ? 0 : 1;
+    n_failed += check("a€a", words(ctx, "a€a"), concat({{320}, words(ctx, "€"), {320}})) ? 0 : 1;
+    n_failed += check("naïve1", words(ctx, "naïve1"), concat({words(ctx, "naïve"), {272}})) ? 0 : 1;
+
+    // digits are words of one digit, whatever is around them
+    n_failed += check("cat42", words(ctx, "cat42"), concat({words(ctx, "cat"), {275, 273}})) ? 0 : 1;
+
+    return n_failed;
+}
+
+static int test_batch(clip_ctx * ctx, const int n_threads) {
+    const int num_positions = clip_get_text_hparams(ctx)->num_positions;
+
+    std::string long_text;
+    for (int i = 0; i < 2 * num_positions; i++) {
+        long_text += "a ";
+    }
+    const char * texts[] = {"a photo of a cat", "", long_text.c_str(), "it's 2024", "CAFÉ"};
+    const size_t n_texts = sizeof(texts) / sizeof(texts[0]);
+
+    std::vector<clip_vocab_id> tokens(n_texts * num_positions, -1);
+    std::vector<int32_t> lengths(n_texts, -1);
+    if (!clip_tokenize_batch(ctx, n_threads, texts, n_texts, tokens.data(), lengths.data())) {
+        printf("%s: clip_tokenize_batch failed\n", __func__);
+        return 1;
+    }
+
+    int n_failed = 0;
+    for (size_t i = 0; i < n_texts; i++) {
+        // texts that fit are those of clip_tokenize, zero-padded. the long one is cut to num_positions and keeps
+        // endoftext last
+        std::vector<clip_vocab_id> expected = tokenize(ctx, texts[i]);
+        if (expected.size() > (size_t)num_positions) {
+            expected.assign(num_positions, 320);
+            expected.front() = SOT;
+            expected.back() = EOT;
+        }
+        const int32_t length = expected.size();
+        expected.resize(num_positions, 0);
+
+        const std::vector<clip_vocab_id> row(tokens.begin() + i * num_positions, tokens.begin() + (i + 1) * num_positions);
+        const std::string what = "batch of " + std::to_string(n_threads) + " threads, text " + std::to_string(i);
+        n_failed += check(what.c_str(), row, expected) ? 0 : 1;
+        n_failed += check((what + " length").c_str(), {lengths[i]}, {length}) ? 0 : 1;
+    }
+    return n_failed;
+}
+
+int main(int argc, char ** argv) {
+    if (argc != 2) {
+        printf("usage: %s <model.gguf>\n", argv[0]);
+        return 1;
+    }
+
+    struct clip_model_load_params params = clip_model_load_default_params();
+    params.verbosity = 0;
+    params.vision_tower = false;
+    struct clip_ctx * ctx = clip_model_load_ex(argv[1], params);
+    if (!ctx) {
+        printf("failed to load '%s'\n", argv[1]);
+        return 1;
+    }
+
+    int n_failed = test_ids(ctx) + test_words(ctx);
+    for (const int n_threads : {1, 3}) {
+        n_failed += test_batch(ctx, n_threads);
+    }
+    clip_free(ctx);
+
+    if (n_failed > 0) {
+        printf("%d tests failed\n", n_failed);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}